@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Accounts for sniping with several eBay users from one esniper.  The
+ * username and password functions of util.c and the requests of http.c
+ * work on the current account, useAccount() switches it.
+ */
+
+#include "account.h"
+#include "esniper.h"
+#include <curl/curl.h>
+#include <stdlib.h>
+#include <string.h>
+
+static account_t mainAccount = {
+	NULL, NULL, NULL, { NULL, NULL, 0 }, NULL, 0, 0, NULL, NULL
+};
+static account_t *accounts = NULL;	/* other accounts, in config order */
+
+account_t *account = &mainAccount;
+
+/*
+ * Make ap the current account, NULL is the main account.  The username
+ * and password of the old one are put aside.
+ */
+void
+useAccount(account_t *ap)
+{
+	if (!ap)
+		ap = &mainAccount;
+	if (ap == account)
+		return;
+	account->username = options.username;
+	account->usernameEscape = options.usernameEscape;
+	savePassword(&account->password);
+	options.username = ap->username;
+	options.usernameEscape = ap->usernameEscape;
+	restorePassword(&ap->password);
+	httpUseSession(ap->http);
+	account = ap;
+}
+
+/*
+ * Account of an auction file, created when the file is first named.
+ */
+account_t *
+newAccount(const char *filename)
+{
+	account_t *ap, **app;
+
+	for (app = &accounts; (ap = *app); app = &ap->next)
+		if (!strcmp(ap->filename, filename))
+			return ap;
+	ap = (account_t *)myMalloc(sizeof(account_t));
+	ap->filename = myStrdup(filename);
+	ap->username = NULL;
+	ap->usernameEscape = NULL;
+	ap->password.password = NULL;
+	ap->password.pad = NULL;
+	ap->password.len = 0;
+	ap->http = httpNewSession();
+	ap->loginTime = 0;
+	ap->rejectedLogin = 0;
+	ap->refreshEvent = NULL;
+	ap->next = NULL;
+	*app = ap;
+	return ap;
+}
+
+/* accounts other than the main one, linked by next */
+account_t *
+getAccounts(void)
+{
+	return accounts;
+}
+
+void
+freeAccounts(void)
+{
+	useAccount(NULL);
+	while (accounts) {
+		account_t *ap = accounts;
+
+		accounts = ap->next;
+		free(ap->filename);
+		free(ap->username);
+		curl_free(ap->usernameEscape);
+		if (ap->password.password)
+			memset(ap->password.password, '\0', ap->password.len);
+		curl_free(ap->password.password);
+		free(ap->password.pad);
+		free(ap);
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ACCOUNT_H_INCLUDED
+#define ACCOUNT_H_INCLUDED
+
+#include "http.h"
+#include "util.h"
+#include <time.h>
+
+struct event;
+
+/*
+ * eBay account.  The main account is given by the usual options, more
+ * accounts by "account" lines naming an auction file with username,
+ * password and the auctions to snipe from that account.  All accounts
+ * share the event loop and connections, but each has its own cookies
+ * and login.
+ *
+ * The username and password of the current account are in options, see
+ * useAccount(), the fields here are only valid for the other accounts.
+ */
+typedef struct account {
+	char *filename;		/* auction file, NULL for the main account */
+	char *username;
+	char *usernameEscape;	/* URL escaped */
+	savedPassword_t password;
+	httpSession_t *http;	/* cookies, NULL: default session */
+	time_t loginTime;	/* Time of last login */
+	time_t rejectedLogin;	/* eBay wants a new login after this one */
+	struct event *refreshEvent;/* see scheduleRefresh() in auction.c */
+	struct account *next;
+} account_t;
+
+extern account_t *account;	/* current account */
+
+extern void useAccount(account_t *ap);
+extern account_t *newAccount(const char *filename);
+extern account_t *getAccounts(void);
+extern void freeAccounts(void);
+
+#endif /* ACCOUNT_H_INCLUDED */
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "arena.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* minimum chunk size, big enough for most of an auction's strings */
+#define ARENA_CHUNK 512
+
+struct arenaChunk {
+	arenaChunk_t *next;
+	size_t size;		/* bytes after the header */
+	size_t used;
+};
+
+/*
+ * Interned strings: one copy of each, never freed.  Open addressing,
+ * the table is at most half full.
+ */
+static const char **internTable = NULL;
+static unsigned long internSize = 0;
+static unsigned long internUsed = 0;
+
+static unsigned long hashString(const char *s);
+
+/*
+ * Copy len bytes of s into the arena, and terminate with '\0'.
+ * NULL s gives NULL.
+ */
+char *
+arenaStrndup(arena_t *ap, const char *s, size_t len)
+{
+	arenaChunk_t *cp = ap->chunks;
+	char *ret;
+
+	if (!s)
+		return NULL;
+	if (!cp || cp->size - cp->used <= len) {
+		size_t size = len < ARENA_CHUNK ? ARENA_CHUNK : len + 1;
+
+		cp = (arenaChunk_t *)myMalloc(sizeof(arenaChunk_t) + size);
+		cp->next = ap->chunks;
+		cp->size = size;
+		cp->used = 0;
+		ap->chunks = cp;
+	}
+	ret = (char *)(cp + 1) + cp->used;
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	cp->used += len + 1;
+	ap->used += len + 1;
+	return ret;
+}
+
+char *
+arenaStrdup(arena_t *ap, const char *s)
+{
+	return s ? arenaStrndup(ap, s, strlen(s)) : NULL;
+}
+
+/*
+ * Release all strings of the arena, it can be used again afterwards.
+ */
+void
+arenaFree(arena_t *ap)
+{
+	arenaChunk_t *cp, *next;
+
+	for (cp = ap->chunks; cp; cp = next) {
+		next = cp->next;
+		free(cp);
+	}
+	ap->chunks = NULL;
+	ap->used = 0;
+}
+
+/*
+ * Return the single copy of s, comparing interned strings with == is
+ * the same as strcmp().  NULL s gives NULL.
+ */
+const char *
+internString(const char *s)
+{
+	unsigned long i;
+
+	if (!s)
+		return NULL;
+	if (2 * (internUsed + 1) > internSize) {
+		const char **old = internTable;
+		unsigned long j, oldSize = internSize;
+
+		internSize = oldSize ? 2 * oldSize : 64;
+		internTable = (const char **)myMalloc(internSize * sizeof(const char *));
+		memset(internTable, 0, internSize * sizeof(const char *));
+		for (j = 0; j < oldSize; ++j) {
+			if (!old[j])
+				continue;
+			for (i = hashString(old[j]) & (internSize - 1); internTable[i]; i = (i + 1) & (internSize - 1))
+				;
+			internTable[i] = old[j];
+		}
+		free(old);
+	}
+	for (i = hashString(s) & (internSize - 1); internTable[i]; i = (i + 1) & (internSize - 1)) {
+		if (!strcmp(internTable[i], s))
+			return internTable[i];
+	}
+	++internUsed;
+	return internTable[i] = myStrdup(s);
+}
+
+/* FNV-1a */
+static unsigned long
+hashString(const char *s)
+{
+	unsigned long hash = 2166136261UL;
+
+	for (; *s; ++s)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	return hash;
+}
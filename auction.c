@@ -28,12 +28,19 @@
 #define _GNU_SOURCE
 
 #include "util.h"
+#include "account.h"
 #include "auction.h"
 #include "buffer.h"
 #include "http.h"
 #include "html.h"
 #include "history.h"
+#include "metrics.h"
+#include "polling.h"
+#include "scan.h"
+#include "session.h"
+#include "schedule.h"
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,7 +55,8 @@
 #	include <unistd.h>
 #endif
 
-#define newRemain(aip) (aip->endTime - time(NULL) - aip->latency - options.bidtime)
+/* latency is rounded up to whole seconds */
+#define newRemain(aip) (aip->endTime - time(NULL) - (time_t)((bidLatency(aip) + 999999) / 1000000) - options.bidtime)
 
 #define TOKEN_FOUND_UIID (1 << 0)
 #define TOKEN_FOUND_STOK (1 << 1)
@@ -56,67 +64,244 @@
 
 #define TOKEN_FOUND_ALL (TOKEN_FOUND_UIID | TOKEN_FOUND_STOK | TOKEN_FOUND_SRT)
 
-typedef struct _headerattr
-{
-  char* name;
-  int   occurence;
-  int   direction;
-  int   mandatory;
-  char* value;
-} headerAttr_t, headerVal_t;
-
-typedef enum searchType { st_attribute, st_value } searchType_t;
+/* bid tokens on pre-bid page, see parsePreBid() */
+enum { ps_uiid, ps_stok, ps_srt };
+
+static const scanPattern_t preBidPatterns[] = {
+	{ "name=\"uiid\"", 1 },
+	{ "name=\"stok\"", 1 },
+	{ "name=\"srt\"", 1 },
+};
+
+static scanner_t *preBidScanner = NULL;
+
+#define PS_COUNT ((int)(sizeof(preBidPatterns) / sizeof(preBidPatterns[0])))
+
+/* progress of preBidTokens() on a streamed pre-bid page */
+typedef struct {
+	size_t from[PS_COUNT];	/* go on looking for a pattern here */
+	int done;		/* bit for each pattern whose tag is complete */
+} preBidScan_t;
+
+/* fields of the sign in form, see parseSignIn() */
+enum { sf_userid, sf_password, sf_regUrl, sf_mid, sf_srt, sf_usid, sf_runId2, SF_COUNT };
+
+static const scanPattern_t signInPatterns[] = {
+	{ "<label for=\"userid\">", 0 },
+	{ "\"password\"", 0 },
+	{ "name=\"regUrl\"", 0 },
+	{ "name=\"mid\"", 0 },
+	{ "name=\"srt\"", 0 },
+	{ "name=\"usid\"", 0 },
+	{ "name=\"runId2\"", 0 },
+};
+
+typedef struct {
+	int direction;	/* value is after (1) or before (-1) the pattern */
+	int digits;	/* digits of id="...", otherwise value="..." */
+	int mandatory;
+} signInField_t;
+
+static const signInField_t signInFields[] = {
+	{ 1, 1, 1 },	/* sf_userid */
+	{ -1, 1, 1 },	/* sf_password */
+	{ 1, 0, 1 },	/* sf_regUrl */
+	{ 1, 0, 1 },	/* sf_mid */
+	{ 1, 0, 1 },	/* sf_srt */
+	{ 1, 0, 1 },	/* sf_usid */
+	{ 1, 0, 0 },	/* sf_runId2 */
+};
+
+static scanner_t *signInScanner = NULL;
 
-static time_t loginTime = 0;	/* Time of last login */
 static time_t defaultLoginInterval = 12 * 60 * 60;	/* ebay login interval */
 
+/*
+ * watch() signs in again when bidding is close and the session is older
+ * than LOGIN_CHECK seconds.  To keep that off the critical path, the
+ * session is refreshed in the background LOGIN_REFRESH seconds before,
+ * but never within LOGIN_QUIET seconds of a bid.
+ */
+static const time_t LOGIN_CHECK = 12 * 60 * 60 - 600;
+static const time_t LOGIN_REFRESH = 60 * 60;
+static const time_t LOGIN_QUIET = 300;
+
+static auctionInfo **sniping = NULL;	/* auctions still being sniped */
+static int numSniping = 0;
+static int snipingSize = 0;
+static int pendingQuantity = 0;	/* items bid on, outcome not known yet */
+static int totalWon = 0;	/* items won by sniped auctions */
+
+/*
+ * Connections to bidHost are kept open before bidding by requests every
+ * WARM_INTERVAL seconds.  No request is started in the last WARM_LEAD / 2
+ * seconds, so the connection is idle (and can be used) when we bid.
+ */
+static const long WARM_INTERVAL = 30;
+static const long WARM_LEAD = 10;
+
+/*
+ * Bid events are due on a whole second before the exact bid time.  If
+ * that is not more than MAX_APPROACH away, finalApproach() schedules the
+ * bid for the exact time, less options.tolerance, which fireBid() spins
+ * for.
+ */
+static const usec_t MAX_APPROACH = 3000000;
+
+/*
+ * Bid tokens are fetched in the background TOKEN_EARLY seconds before the
+ * bid and refreshed every half of their expected lifetime, with a last
+ * refresh TOKEN_LAST seconds before the bid.  The lifetime grows when a
+ * set comes back unchanged (see updateTokens()) and shrinks only when a
+ * bid is turned down because of its tokens (see tokensRejected()), never
+ * below TOKEN_MIN_LIFETIME, so the last set is always good enough.
+ * Failed fetches are retried after TOKEN_RETRY seconds, up to
+ * TOKEN_FAILURES times in a row.
+ */
+static const time_t TOKEN_EARLY = 600;
+static const time_t TOKEN_LAST = 180;
+static const time_t TOKEN_RETRY = 2;
+static const time_t TOKEN_MIN_LIFETIME = 240;	/* TOKEN_LAST plus a margin */
+static const time_t TOKEN_MAX_INTERVAL = 600;
+static const int TOKEN_FAILURES = 5;
+static time_t tokenLifetime = 1200;
+
+/* background request of an auction */
+typedef struct pendingRequest {
+	auctionInfo *aip;	/* NULL if the auction is gone */
+	usec_t start;		/* 0: token fetch waits for sign in */
+	struct pendingRequest *next;
+} pendingRequest_t;
+
+static pendingRequest_t *tokenRequests = NULL;	/* background token fetches */
+static pendingRequest_t *bidRequests = NULL;	/* bids waiting for the answer */
+
+/*
+ * History page fetch in the background, see getInfoAsync().
+ */
+typedef void (*infoFunc_t)(auctionInfo *aip, int ret, usec_t latency);
+
+typedef struct infoRequest {
+	auctionInfo *aip;	/* NULL if the auction is gone */
+	infoFunc_t func;	/* called with the result */
+	int tries;		/* retries (sign in, blank time) */
+	int known;		/* conditional request, see historyValidator() */
+	time_t start;		/* start of request */
+	usec_t sent;		/* same, for latency */
+	struct infoRequest *next;
+} infoRequest_t;
+
+static infoRequest_t *infoRequests = NULL;
+
+/*
+ * Sign in in the background, see ebayLoginAsync().  Callers of an
+ * account that is already signing in wait for that sign in.
+ */
+typedef void (*loginFunc_t)(auctionInfo *aip, int ret);
+
+typedef struct loginRequest {
+	account_t *ap;		/* account to sign in */
+	auctionInfo *aip;	/* NULL if the auction is gone */
+	loginFunc_t func;	/* called with the result */
+	struct loginRequest *next;
+} loginRequest_t;
+
+typedef struct signIn {
+	account_t *ap;		/* account signing in */
+	auctionInfo *status;	/* errors of the sign in */
+	usec_t start;
+	struct signIn *next;
+} signIn_t;
+
+static loginRequest_t *loginRequests = NULL;
+static signIn_t *signIns = NULL;
+
+typedef struct fetch fetch_t;
+
 static int acceptBid(const char *pagename, auctionInfo *aip);
 static int bid(auctionInfo *aip);
+static void bidAnswer(memBuf_t *mp, void *data);
+static void bidDone(auctionInfo *aip, int ret);
 static int ebayLogin(auctionInfo *aip, time_t interval);
-static int findAttr(char* src, size_t srcLen, headerAttr_t* attr);
+static int ebayLoginInternal(auctionInfo *aip);
+static void ebayLoginAsync(auctionInfo *aip, time_t interval, loginFunc_t func);
+static void signInPage(memBuf_t *mp, void *data);
+static void signInAnswer(memBuf_t *mp, void *data);
+static void signInDone(signIn_t *sp, int ret);
+static void loginFinish(account_t *ap, const auctionInfo *status);
+static char *loginUrl(const char *format);
+static char *signInForm(memBuf_t *mp, auctionInfo *aip, char **logData);
+static int signInResult(memBuf_t *mp, auctionInfo *aip);
 static int forceEbayLogin(auctionInfo *aip);
+static void scheduleRefresh(account_t *ap);
+static void refreshLogin(void *data);
+static void refreshDone(auctionInfo *aip, int ret);
+static int accountSniping(const account_t *ap);
 static char *getIdInternal(char *s, size_t len);
-static int getInfoTiming(auctionInfo *aip, time_t *timeToFirstByte);
+static void getInfoAsync(auctionInfo *aip, infoFunc_t func);
+static void infoStart(infoRequest_t *ir);
+static void infoRetry(void *data);
+static void infoDone(memBuf_t *mp, void *data);
+static void infoFinish(infoRequest_t *ir, int ret, usec_t latency);
+static int historyValidator(const auctionInfo *aip, httpValidator_t *cond);
+static int historyPage(memBuf_t *mp, auctionInfo *aip, time_t start, int known);
+static const char *historyQuery(auctionInfo *aip);
+static void savePageState(auctionInfo *aip, const memBuf_t *mp);
+static void fetchQueue(fetch_t *fp);
+static void fetchPump(void);
+static void fetchPumpEvent(void *data);
+static void fetchRetry(void *data);
+static void fetchDone(memBuf_t *mp, void *data);
+static void fetchResult(fetch_t *fp, int ret);
+static void fetchAbort(void);
 static int getQuantity(int want, int available);
-static int getVals(char* src, size_t srcLen, headerVal_t* vals);
+static int availableQuantity(void);
 static int makeBidError(const pageInfo_t *pageInfo, auctionInfo *aip);
-static int match(memBuf_t *mp, const char *str);
 static int parseBid(memBuf_t *mp, auctionInfo *aip);
+static usec_t fireTime(const auctionInfo *aip);
+static void bidFired(const auctionInfo *aip);
+static int timedParseBidHistory(memBuf_t *mp, auctionInfo *aip, time_t start);
 static int preBid(auctionInfo *aip);
+static char *preBidUrl(auctionInfo *aip);
+static int updateTokens(memBuf_t *mp, auctionInfo *aip);
+static int tokensReady(const auctionInfo *aip);
+static void tokensRejected(const auctionInfo *aip);
+static int tokenPending(const auctionInfo *aip);
+static void scheduleTokens(auctionInfo *aip);
+static void tokenRefresh(void *data);
+static void tokenFetch(auctionInfo *aip);
+static void tokenSignedIn(auctionInfo *aip, int ret);
+static void tokenDone(memBuf_t *mp, void *data);
+static void tokenDrop(pendingRequest_t *tp);
+static void tokenFinish(auctionInfo *aip, int ret);
+static int retryTokens(auctionInfo *aip);
+static int preBidTokens(const memBuf_t *mp, void *data);
+static int bidPageKnown(const memBuf_t *mp, void *data);
+static int prepareBid(auctionInfo *aip, int quantity);
+static int getBidToken(memBuf_t *mp, const scanResult_t *rp, int pattern, auctionInfo *aip, char **token);
 static int parsePreBid(memBuf_t *mp, auctionInfo *aip);
-static int printMyItemsRow(char **row, int printNewline);
-static int signinFormSearch(char* src, size_t srcLen, headerAttr_t* searchdef, searchType_t searchfor);
-static int watch(auctionInfo *aip);
-
-/*
- * attempt to match some input, neglecting case, ignoring \r and \n.
- * returns 0 on success, -1 on failure
- */
-static int
-match(memBuf_t *mp, const char *str)
-{
-	const char *cursor;
-	int c;
-
-	log(("\n\nmatch(\"%s\")\n\n", str));
-
-	cursor = str;
-	while ((c = memGetc(mp)) != EOF) {
-		if (options.debug)
-			logChar(c);
-		if (tolower(c) == (int)*cursor) {
-			if (*++cursor == '\0') {
-				if (options.debug)
-					logChar(EOF);
-				return 0;
-			}
-		} else if (c != '\n' && c != '\r')
-			cursor = str;
-	}
-	if (options.debug)
-		logChar(EOF);
-	return -1;
-}
+static int printMyItemsRow(memBuf_t *mp, const tableRow_t *row, int printNewline, int print);
+static int myItemsTables(memBuf_t *mp, int print);
+static int parseSignIn(memBuf_t *mp, auctionInfo *aip, char **fields);
+static char *signInValue(const memBuf_t *mp, const char *match, const signInField_t *fp);
+static char *signInData(char **fields, const char *password);
+static void snipeStart(void *data);
+static void watch(void *data);
+static void watchInfo(auctionInfo *aip, int ret, usec_t latency);
+static void watchSignedIn(auctionInfo *aip, int ret);
+static void watchNext(auctionInfo *aip);
+static void watchTokens(auctionInfo *aip, int ret);
+static void watchSleep(auctionInfo *aip);
+static void keepWarm(void *data);
+static void watchFailed(auctionInfo *aip);
+static void snipeBid(void *data);
+static int finalApproach(auctionInfo *aip);
+static void fireBid(void *data);
+static void postBidWait(auctionInfo *aip);
+static void postBid(void *data);
+static void postBidInfo(auctionInfo *aip, int ret, usec_t latency);
+static void snipeDone(auctionInfo *aip, int won);
+static void snipeUnregister(auctionInfo *aip);
 
 static const char PAGEID[] = "Page id: ";
 static const char PAGEID2[] = "pageId:";
@@ -265,54 +450,44 @@ getQuantity(int want, int available)
 	return available - 1;
 }
 
-static const char HISTORY_URL[] = "http://%s/ws/eBayISAPI.dll?ViewBids&item=%s";
-
 /*
- * getInfo(): Get info on auction from bid history page.
- *
- * returns:
- *	0 OK
- *	1 error (badly formatted page, etc) set auctionError
+ * Quantity we still want, not counting items of bids that are still
+ * waiting for the end of their auction.
  */
-int
-getInfo(auctionInfo *aip)
+static int
+availableQuantity(void)
 {
-	return getInfoTiming(aip, NULL);
+	return options.quantity - pendingQuantity;
 }
 
+static const char HISTORY_URL[] = "https://%s/ws/eBayISAPI.dll?ViewBids&item=%s";
+
 /*
- * getInfoTiming(): Get info on auction from bid history page.
+ * getInfo(): Get info on auction from bid history page, and wait for it.
+ * The sniping engine uses getInfoAsync() instead.
  *
  * returns:
  *	0 OK
  *	1 error (badly formatted page, etc) set auctionError
  */
-static int
-getInfoTiming(auctionInfo *aip, time_t *timeToFirstByte)
+int
+getInfo(auctionInfo *aip)
 {
 	int i, ret;
-	time_t start;
 
 	log(("\n\n*** getInfo auction %s price %s user %s\n", aip->auction, aip->bidPriceStr, options.username));
 	if (ebayLogin(aip, 0))
 		return 1;
 
 	for (i = 0; i < 3; ++i) {
-		memBuf_t *mp = NULL;
-
-		if (!aip->query) {
-			size_t urlLen = sizeof(HISTORY_URL) + strlen(options.historyHost) + strlen(aip->auction) - (2*2);
+		memBuf_t *mp;
+		httpValidator_t cond;
+		int known = historyValidator(aip, &cond);
+		time_t start = time(NULL);
 
-			aip->query = (char *)myMalloc(urlLen);
-			sprintf(aip->query, HISTORY_URL, options.historyHost, aip->auction);
-		}
-		start = time(NULL);
-		if (!(mp = httpGet(aip->query, NULL))) {
-			freeMembuf(mp);
+		if (!(mp = httpGetIfChanged(historyQuery(aip), NULL, &cond)))
 			return httpError(aip);
-		}
-		ret = parseBidHistory(mp, aip, start, timeToFirstByte, 0);
-		freeMembuf(mp);
+		ret = historyPage(mp, aip, start, known);
 		if (i == 0 && ret == 1 && aip->auctionError == ae_mustsignin) {
 			if (forceEbayLogin(aip))
 				break;
@@ -321,345 +496,1316 @@ getInfoTiming(auctionInfo *aip, time_t *timeToFirstByte)
 			sleep(2);
 		else
 			break;
+		metricCount(mc_retries, 1);
 	}
 	return ret;
 }
 
 /*
- * Note: quant=1 is just to dupe eBay into allowing the pre-bid to get
- *	 through.  Actual quantity will be sent with bid.
- */
-static const char PRE_BID_URL[] = "http://%s/ws/eBayISAPI.dll?MfcISAPICommand=MakeBid&fb=2&co_partner_id=&item=%s&maxbid=%s&quant=%s";
-
-/*
- * Get bid key
- *
- * returns 0 on success, 1 on failure.
+ * getInfoAsync(): Get info on auction from bid history page in the
+ * background, with the retries of getInfo().  func is called with the
+ * result and the latency of the request (-1 if there was no request).
  */
-static int
-preBid(auctionInfo *aip)
+static void
+getInfoAsync(auctionInfo *aip, infoFunc_t func)
 {
-	memBuf_t *mp = NULL;
-	int quantity = getQuantity(options.quantity, aip->quantity);
-	char quantityStr[12];	/* must hold an int */
-	size_t urlLen;
-	char *url;
-	int ret = 0;
-
-	if (ebayLogin(aip, 0))
-		return 1;
-	sprintf(quantityStr, "%d", quantity);
-	urlLen = sizeof(PRE_BID_URL) + strlen(options.prebidHost) + strlen(aip->auction) + strlen(aip->bidPriceStr) + strlen(quantityStr) - (4*2);
-	url = (char *)myMalloc(urlLen);
-	sprintf(url, PRE_BID_URL, options.prebidHost, aip->auction, aip->bidPriceStr, quantityStr);
-	log(("\n\n*** preBid(): url is %s\n", url));
-	mp = httpGet(url, NULL);
-	free(url);
-	if (!mp)
-		return httpError(aip);
+	infoRequest_t *ir;
 
-	ret = parsePreBid(mp, aip);
-	freeMembuf(mp);
-	return ret;
+	log(("\n\n*** getInfo auction %s price %s user %s\n", aip->auction, aip->bidPriceStr, options.username));
+	if (ebayLogin(aip, 0)) {
+		(*func)(aip, 1, -1);
+		return;
+	}
+	ir = (infoRequest_t *)myMalloc(sizeof(infoRequest_t));
+	ir->aip = aip;
+	ir->func = func;
+	ir->tries = 0;
+	ir->next = infoRequests;
+	infoRequests = ir;
+	infoStart(ir);
 }
 
-static int
-parsePreBid(memBuf_t *mp, auctionInfo *aip)
+static void
+infoStart(infoRequest_t *ir)
 {
-	int ret = 0;
-	int found = 0; //Used as binary store - 1=uiid,10=stok,100=srt
+	httpValidator_t cond;
 
-	memReset(mp);
-	while (!match(mp, "name=\"uiid\"")) {
-		char *start, *value, *end;
+	ir->known = historyValidator(ir->aip, &cond);
+	ir->start = time(NULL);
+	ir->sent = usecNow();
+	if (httpGetIfChangedAsync(historyQuery(ir->aip), NULL, &cond, infoDone, ir))
+		infoFinish(ir, httpError(ir->aip), -1);
+}
 
-		for (start = mp->readptr; start >= mp->memory && *start != '<'; --start)
-			;
-		value = strcasestr(start, "value=\"");
-		end = strchr(start, '>');
+/* retry after a pause */
+static void
+infoRetry(void *data)
+{
+	infoRequest_t *ir = (infoRequest_t *)data;
 
-		if (!value || !end || value > end)
-			continue;
-		free(aip->biduiid);
-		mp->readptr = value + 7;
-		aip->biduiid = myStrdup(getUntil(mp, '\"'));
-		log(("preBid(): biduiid is \"%s\"", aip->biduiid));
-		found |= TOKEN_FOUND_UIID;
-		break;
+	if (!ir->aip) {
+		infoFinish(ir, 1, -1);
+		return;
 	}
+	useAccount(ir->aip->account);
+	if (options.debug)
+		logOpen(ir->aip, options.logdir);
+	infoStart(ir);
+}
 
-	memReset(mp);
-	while (!match(mp, "name=\"stok\"")) {
-		char *start, *value, *end;
-
-		for (start = mp->readptr; start >= mp->memory && *start != '<'; --start)
-			;
-		value = strcasestr(start, "value=\"");
-		end = strchr(start, '>');
+static void
+infoDone(memBuf_t *mp, void *data)
+{
+	infoRequest_t *ir = (infoRequest_t *)data;
+	auctionInfo *aip = ir->aip;
+	usec_t latency;
+	int ret;
 
-		if (!value || !end || value > end)
-			continue;
-		free(aip->bidstok);
-		mp->readptr = value + 7;
-		aip->bidstok = myStrdup(getUntil(mp, '\"'));
-		log(("preBid(): bidstok is \"%s\"", aip->bidstok));
-		found |= TOKEN_FOUND_STOK;
-		break;
+	if (!aip) {
+		freeMembuf(mp);
+		infoFinish(ir, 1, -1);
+		return;
 	}
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
 
-	memReset(mp);
-	while (!match(mp, "name=\"srt\"")) {
-		char *start, *value, *end;
-
-		for (start = mp->readptr; start >= mp->memory && *start != '<'; --start)
-			;
-		value = strcasestr(start, "value=\"");
-		end = strchr(start, '>');
-
-		if (!value || !end || value > end)
-			continue;
-		free(aip->bidsrt);
-		mp->readptr = value + 7;
-		aip->bidsrt = myStrdup(getUntil(mp, '\"'));
-		log(("preBid(): bidsrt is \"%s\"", aip->bidsrt));
-		found |= TOKEN_FOUND_SRT;
-		break;
+	/* time from sending request to first byte of response.  Connection
+	 * setup is not included, the bid is sent on an open connection.
+	 */
+	if (mp && mp->timing.firstByte > 0)
+		latency = mp->timing.firstByte - mp->timing.request;
+	else
+		latency = usecNow() - ir->sent;
+	if (!mp) {
+		infoFinish(ir, httpError(aip), latency);
+		return;
 	}
-
-	if ((found & TOKEN_FOUND_ALL) != TOKEN_FOUND_ALL) {
-		pageInfo_t *pageInfo = getPageInfo(mp);
-
-		ret = makeBidError(pageInfo, aip);
-		if (ret < 0) {
-			ret = auctionError(aip, ae_bidtokens, NULL);
-			bugReport("preBid", __FILE__, __LINE__, aip, mp, optiontab, "cannot find bid token (found=%d)", found);
+	ret = historyPage(mp, aip, ir->start, ir->known);
+	if (ir->tries == 0 && ret == 1 && aip->auctionError == ae_mustsignin) {
+		if (!forceEbayLogin(aip)) {
+			++ir->tries;
+			metricCount(mc_retries, 1);
+			infoStart(ir);
+			return;
 		}
-		freePageInfo(pageInfo);
+	} else if (aip->auctionError == ae_notime && ir->tries < 2) {
+		/* Blank time remaining -- give it another chance */
+		++ir->tries;
+		metricCount(mc_retries, 1);
+		(void)scheduleEvent(time(NULL) + 2, infoRetry, ir);
+		return;
 	}
-	return ret;
+	infoFinish(ir, ret, latency);
 }
 
-static const char LOGIN_1_URL[] = "https://%s/ws/eBayISAPI.dll?SignIn";
-static const char LOGIN_2_URL[] = "https://%s/ws/eBayISAPI.dll?co_partnerId=2&siteid=0&UsingSSL=1";
-static const char LOGIN_DATA[] = "refId=&regUrl=%s&MfcISAPICommand=SignInWelcome&bhid=DEF_CI&UsingSSL=1&inputversion=2&lse=false&lsv=&mid=%s&kgver=1&kgupg=1&kgstate=&omid=&hmid=&rhr=f&srt=%s&siteid=0&co_partnerId=2&ru=&pp=&pa1=&pa2=&pa3=&i1=-1&pageType=-1&rtmData=&usid=%s&afbpmName=sess1&kgct=&userid_otp=&sgnBt=Continue&otp=&keepMeSignInOption3=1&userid=%s&%s=%s&runId2=%s&%s=%s&pass=%s&keepMeSignInOption2=1&keepMeSignInOption=1";
-
-static const char* id="id=\"";
-static const char* id2="value=\"";
-
-static const int USER_NUM=0;
-static const int PASS_NUM=1;
-
-static const int REGURL=0;
-static const int MID=1;
-static const int SRT=2;
-static const int USID=3;
-static const int RUNID2=4;
-
-static headerAttr_t headerAttrs[] = {"<label for=\"userid\">", 1, 1, 1, NULL,
-                            "\"password\"", 1, -1, 1, NULL};
+/*
+ * Pass the result to the function of the request, unless the auction is
+ * gone.
+ */
+static void
+infoFinish(infoRequest_t *ir, int ret, usec_t latency)
+{
+	infoRequest_t **irp;
 
-static headerVal_t headerVals[] = {"regUrl", 1, 1, 1, NULL,
-                           "mid", 1, 1, 1, NULL,
-                           "srt", 1, 1, 1, NULL,
-                           "usid", 1, 1, 1, NULL,
-                           "runId2", 1, 1, 0, NULL};
+	for (irp = &infoRequests; *irp != ir; irp = &(*irp)->next)
+		;
+	*irp = ir->next;
+	if (ir->aip)
+		(*ir->func)(ir->aip, ret, latency);
+	free(ir);
+}
 
+/*
+ * Validators of the last history page, if it was parsed and may be
+ * reused.  Without validators the page is always parsed again: it
+ * holds the time left, so it is never the same page twice.  Once the
+ * auction should have ended the final page is always fetched.
+ *
+ * returns 1 if the page is known, and cond is set up.
+ */
 static int
-signinFormSearch(char* src, size_t srcLen, headerAttr_t* searchdef, searchType_t searchfor)
+historyValidator(const auctionInfo *aip, httpValidator_t *cond)
 {
-	char* start = src;
-	char* end = src + srcLen;
-	char* search = NULL;
-	char pattern[128];
-	char res[4096];
-	int  i;
+	int known = (aip->etag || aip->lastModified) &&
+		    aip->auctionError == ae_none && aip->endTime > time(NULL);
+
+	cond->etag[0] = cond->lastModified[0] = '\0';
+	if (known && aip->etag)
+		strcpy(cond->etag, aip->etag);
+	if (known && aip->lastModified)
+		strcpy(cond->lastModified, aip->lastModified);
+	return known;
+}
 
-	if(searchfor == st_attribute)
-		strcpy(pattern, searchdef->name);
-	else
-		sprintf(pattern, "name=\"%s\"", searchdef->name);
+/*
+ * Take a history page fetched at start, which has not been parsed if the
+ * server said it is the known page again.  Frees mp.
+ *
+ * returns:
+ *	0 OK
+ *	1 error (badly formatted page, etc) set auctionError
+ */
+static int
+historyPage(memBuf_t *mp, auctionInfo *aip, time_t start, int known)
+{
+	int ret;
 
-	for(i = 0; i < searchdef->occurence; i++) {
-		search = strstr(start, pattern);
-		if( search == NULL )
-		{
-			searchdef->value = (char *)myMalloc(1);
-			strncpy(searchdef->value, "\0", 1);
-			return searchdef->mandatory;
-		}
-		start = search;
-		start += strlen(pattern);
-	}
-
-	while(src != search && end != search ) {
-                search += (searchdef->direction);
-
-		if(!strncmp(search, (searchfor == st_attribute ? id : id2), 
-                                       (searchfor == st_attribute ? strlen(id) : strlen(id2))) ) {
-			search += (searchfor == st_attribute ? strlen(id) : strlen(id2));
-			memset(res, '\0', sizeof(res));
-			for(i = 0;
-				((searchfor == st_value) || isdigit(*search)) && (*search) != '"' && i < sizeof(res);
-				res[i++] = *search++);
-			searchdef->value = (char *)myMalloc(strlen(res) + 1);
-			strncpy(searchdef->value, (char*) &res, strlen(res) + 1);
-			if (options.debug)
-				dlog("%s(): %s=%s", (searchfor == st_attribute ? "findAttr" : "searchvalue"), 
-					searchdef->name, searchdef->value);
-			return 0;
-		}
+	if (mp->timing.firstByte > 0)
+		metricTime(mh_historyFirstByte, mp->timing.firstByte);
+	if (known && mp->notModified) {
+		aip->remain = aip->endTime - start;
+		if (aip->remain <= 0)
+			aip->remain = 1;
+		printLog(stdout, "Auction %s: bid history not changed, %ld seconds remaining\n", aip->auction, (long)aip->remain);
+		freeMembuf(mp);
+		return 0;
 	}
-
-	if( searchdef->value == NULL )
-        {
-            searchdef->value = (char *)myMalloc(1);
-            strncpy(searchdef->value, "\0", 1);
-            return searchdef->mandatory;
-        }
-	return searchdef->mandatory;
+	ret = timedParseBidHistory(mp, aip, start);
+	savePageState(aip, ret ? NULL : mp);
+	freeMembuf(mp);
+	return ret;
 }
 
+/*
+ * parseBidHistory(), with parse time and time to first byte metrics.
+ */
 static int
-findAttr(char* src, size_t srcLen, headerAttr_t* attr)
+timedParseBidHistory(memBuf_t *mp, auctionInfo *aip, time_t start)
 {
-	return signinFormSearch(src, srcLen, attr, st_attribute);
+	usec_t begin = usecNow();
+	int ret = parseBidHistory(mp, aip, start, NULL, 0);
+
+	metricTime(mh_parseHistory, usecNow() - begin);
+	return ret;
 }
 
-static int
-getVals(char* src, size_t srcLen, headerVal_t* vals)
+/*
+ * Remember validators of a parsed history page, so the next update can
+ * skip the parse if the server says it has not changed.  mp is NULL if
+ * the page could not be parsed.
+ */
+static void
+savePageState(auctionInfo *aip, const memBuf_t *mp)
 {
-	return signinFormSearch(src, srcLen, vals, st_value);
+	if (!mp) {
+		setAuctionString(aip, &aip->etag, NULL);
+		setAuctionString(aip, &aip->lastModified, NULL);
+		return;
+	}
+	setAuctionString(aip, &aip->etag, mp->validator.etag[0] ? mp->validator.etag : NULL);
+	setAuctionString(aip, &aip->lastModified, mp->validator.lastModified[0] ? mp->validator.lastModified : NULL);
 }
 
 /*
- * Force an ebay login.
- *
- * Returns 0 on success, 1 on failure.
+ * URL of bid history page.
  */
-static int
-forceEbayLogin(auctionInfo *aip)
+static const char *
+historyQuery(auctionInfo *aip)
 {
-	loginTime = 0;
-	return ebayLogin(aip, 0);
+	if (!aip->query) {
+		size_t urlLen = sizeof(HISTORY_URL) + strlen(options.historyHost) + strlen(aip->auction) - (2*2);
+		char *query = (char *)myMalloc(urlLen);
+
+		sprintf(query, HISTORY_URL, options.historyHost, aip->auction);
+		setAuctionString(aip, &aip->query, query);
+		free(query);
+	}
+	return aip->query;
 }
 
 /*
- * Ebay login.  Make sure loging has been done with the given interval.
+ * Initial fetch of many auctions, see getAllInfo().  Auctions wait in
+ * fetchList until the rate limiter and the connection limit let them go.
+ */
+struct fetch {
+	auctionInfo *aip;
+	int tries;		/* failed attempts */
+	int retries;		/* retries within attempt (sign in, blank time) */
+	time_t start;		/* start of request */
+	struct fetch *next;
+};
+
+static fetch_t *fetchList = NULL;
+static fetch_t **fetchTail = &fetchList;
+static tokenBucket_t fetchBucket;
+static int fetchPumpScheduled = 0;
+static int fetchAborted = 0;
+
+/*
+ * Get info on all auctions.  History pages are fetched in parallel, no
+ * faster than one every options.delay seconds on average (with bursts of
+ * up to options.burst), and with no more than options.maxconn requests
+ * to the history host at a time.
  *
- * Returns 0 on success, 1 on failure.
+ * returns 0 when all auctions have been tried, 1 if it is pointless to
+ * go on (login failed or eBay wants a captcha).
  */
-static int
-ebayLogin(auctionInfo *aip, time_t interval)
+int
+getAllInfo(auctionInfo **auctions, int numAuctions)
 {
-	memBuf_t *mp = NULL;
-	size_t urlLen;
-	char *url, *data, *logdata;
-	pageInfo_t *pp;
-	int ret = 0;
-	char *password;
-	int i;	
+	fetch_t *fetches;
+	int i;
 
-	/* negative value forces login */
-	if (loginTime > 0) {
-		if (interval == 0)
-			interval = defaultLoginInterval;	/* default: 12 hours */
-		if ((time(NULL) - loginTime) <= interval)
-			return 0;
+	if (numAuctions <= 0)
+		return 0;
+	/* sign in every account, ebayLogin() knows the ones signed in */
+	for (i = 0; i < numAuctions; ++i) {
+		useAccount(auctions[i]->account);
+		if (ebayLogin(auctions[i], 0)) {
+			printAuctionError(auctions[i], stderr);
+			useAccount(NULL);
+			return 1;
+		}
 	}
 
-	cleanupCurlStuff();
-	if (initCurlStuff())
-		return auctionError(aip, ae_unknown, NULL);
+	initTokenBucket(&fetchBucket, options.delay > 0 ? 1.0 / options.delay : 0, options.burst);
+	fetchAborted = 0;
+	fetches = (fetch_t *)myMalloc(numAuctions * sizeof(fetch_t));
+	for (i = 0; i < numAuctions; ++i) {
+		fetches[i].aip = auctions[i];
+		fetches[i].tries = 0;
+		fetches[i].retries = 0;
+		fetches[i].start = 0;
+		fetchQueue(&fetches[i]);
+	}
+	fetchPump();
+	runEvents();
+	useAccount(NULL);
+
+	fetchList = NULL;
+	fetchTail = &fetchList;
+	free(fetches);
+	return fetchAborted;
+}
 
-	urlLen = sizeof(LOGIN_1_URL) + strlen(options.loginHost) - (1*2);
-	url = (char *)myMalloc(urlLen);
-	sprintf(url, LOGIN_1_URL, options.loginHost);
-	mp = httpGet(url, NULL);
-	free(url);
-	if (!mp)
-		return httpError(aip);
+static void
+fetchQueue(fetch_t *fp)
+{
+	fp->next = NULL;
+	*fetchTail = fp;
+	fetchTail = &fp->next;
+}
 
-	// Get all atrributes and values needed
-	for(i = 0; i < sizeof(headerAttrs)/sizeof(headerAttr_t); i++)
-		if(findAttr(mp->memory, mp->size, &headerAttrs[i]))
-			bugReport("ebayLogin", __FILE__, __LINE__, aip, mp, optiontab,
-				"findAttr cannot find %s", headerAttrs[i].name);
-	for(i = 0; i < sizeof(headerVals)/sizeof(headerVal_t); i++)
-		if(getVals(mp->memory, mp->size, &headerVals[i]))
-			bugReport("ebayLogin", __FILE__, __LINE__, aip, mp, optiontab,
-				"getVals cannot find %s", headerVals[i].name);
+/*
+ * Start as many waiting fetches as the limits allow.
+ */
+static void
+fetchPump(void)
+{
+	while (fetchList && !fetchAborted) {
+		fetch_t *fp = fetchList;
+		const char *url = historyQuery(fp->aip);
+		usec_t wait;
+
+		/* fetchDone() comes back here */
+		if (options.maxconn > 0 && httpActive(url) >= options.maxconn)
+			return;
+		if ((wait = takeToken(&fetchBucket))) {
+			if (!fetchPumpScheduled) {
+				fetchPumpScheduled = 1;
+				(void)scheduleEvent(time(NULL) + (time_t)((wait + 999999) / 1000000), fetchPumpEvent, NULL);
+			}
+			return;
+		}
 
-	freeMembuf(mp);
-	mp = NULL;
+		if (!(fetchList = fp->next))
+			fetchTail = &fetchList;
+		useAccount(fp->aip->account);
+		if (options.debug)
+			logOpen(fp->aip, options.logdir);
+		log(("\n\n*** getAllInfo auction %s price %s user %s\n", fp->aip->auction, fp->aip->bidPriceStr, options.username));
+		fp->start = time(NULL);
+		if (httpGetAsync(url, NULL, fetchDone, fp))
+			fetchResult(fp, httpError(fp->aip));
+	}
+}
 
-	urlLen = sizeof(LOGIN_2_URL) + strlen(options.loginHost) - (1*2);
-	password = getPassword();
-	url = (char *)myMalloc(urlLen);
-	sprintf(url, LOGIN_2_URL, options.loginHost);
-	data = (char *)myMalloc(	sizeof(LOGIN_DATA)
-                                      + strlen(headerAttrs[USER_NUM].value)
-                                      + strlen(headerAttrs[PASS_NUM].value)
-                                      + strlen(options.usernameEscape) * 2
-                                      + strlen(password) * 2
-                                      + strlen(headerVals[REGURL].value)
-                                      + strlen(headerVals[MID].value)
-                                      + strlen(headerVals[SRT].value)
-                                      + strlen(headerVals[USID].value)
-                                      + strlen(headerVals[RUNID2].value)
-				      - (11*2)
-                                      );
-	logdata = (char *)myMalloc(	sizeof(LOGIN_DATA)
-                                      + strlen(headerAttrs[USER_NUM].value)
-                                      + strlen(headerAttrs[PASS_NUM].value) 
-                                      + strlen(options.usernameEscape) * 2
-                                      + 5 * 2
-                                      + strlen(headerVals[REGURL].value)
-                                      + strlen(headerVals[MID].value)
-                                      + strlen(headerVals[SRT].value)
-                                      + strlen(headerVals[USID].value)
-                                      + strlen(headerVals[RUNID2].value)
-				      - (11*2)
-                                      );
-	sprintf(data, LOGIN_DATA,	headerVals[REGURL].value,
-					headerVals[MID].value,
-					headerVals[SRT].value,
-					headerVals[USID].value,
-					options.usernameEscape,
-					headerAttrs[USER_NUM].value,
-					options.usernameEscape,
-					headerVals[RUNID2].value,
-                                        headerAttrs[PASS_NUM].value,
-					password,
-					password
-					);
-	freePassword(password);
-	sprintf(logdata, LOGIN_DATA,	headerVals[REGURL].value,
-					headerVals[MID].value,
-					headerVals[SRT].value,
-					headerVals[USID].value,
-					options.usernameEscape,
-					headerAttrs[USER_NUM].value,
-					options.usernameEscape,
-					headerVals[RUNID2].value,
-                                        headerAttrs[PASS_NUM].value,
-					"*****",
-					"*****"
-					);
+static void
+fetchPumpEvent(void *data)
+{
+	fetchPumpScheduled = 0;
+	fetchPump();
+}
 
-	// Using POST method instead of GET
-	log(("HTTP POST login: %s", url));
-	mp = httpPost(url, data, logdata);
+/* retry after a pause */
+static void
+fetchRetry(void *data)
+{
+	fetchQueue((fetch_t *)data);
+	fetchPump();
+}
 
-	// Free memory
-	for(i=0; i < sizeof(headerAttrs)/sizeof(headerAttr_t); free(headerAttrs[i++].value));
-	for(i=0; i < sizeof(headerVals)/sizeof(headerVal_t); free(headerVals[i++].value));
-	free(url);
-	free(data);
-	free(logdata);
+static void
+fetchDone(memBuf_t *mp, void *data)
+{
+	fetch_t *fp = (fetch_t *)data;
+	int ret;
+
+	if (fetchAborted) {
+		freeMembuf(mp);
+		return;
+	}
+	useAccount(fp->aip->account);
+	if (options.debug)
+		logOpen(fp->aip, options.logdir);
+	if (!mp)
+		ret = httpError(fp->aip);
+	else {
+		if (mp->timing.firstByte > 0)
+			metricTime(mh_historyFirstByte, mp->timing.firstByte);
+		ret = timedParseBidHistory(mp, fp->aip, fp->start);
+		freeMembuf(mp);
+	}
+	fetchResult(fp, ret);
+	fetchPump();
+}
+
+/*
+ * Handle result of a fetch, with the retries of getInfoTiming() and the
+ * old sequential fetch.
+ */
+static void
+fetchResult(fetch_t *fp, int ret)
+{
+	auctionInfo *aip = fp->aip;
+
+	if (!ret) {
+		printLog(stdout, "\n");
+		return;
+	}
+	if (fp->retries == 0 && aip->auctionError == ae_mustsignin) {
+		++fp->retries;
+		if (!forceEbayLogin(aip)) {
+			metricCount(mc_retries, 1);
+			fetchQueue(fp);
+			return;
+		}
+	} else if (aip->auctionError == ae_notime && fp->retries < 2) {
+		/* Blank time remaining -- give it another chance */
+		++fp->retries;
+		metricCount(mc_retries, 1);
+		(void)scheduleEvent(time(NULL) + 2, fetchRetry, fp);
+		return;
+	}
+
+	fp->retries = 0;
+	printAuctionError(aip, stderr);
+	if (aip->auctionError == ae_unavailable) {
+		/* doesn't count as an attempt */
+		printLog(stderr, "%s: Will retry, sleeping for an hour\n", timestamp());
+		metricCount(mc_retries, 1);
+		(void)scheduleEvent(time(NULL) + 3600, fetchRetry, fp);
+	} else if (aip->auctionError == ae_login ||
+		   aip->auctionError == ae_captcha) {
+		fetchAbort();
+	} else if (++fp->tries < 3) {
+		printLog(stderr, "Retrying...\n");
+		metricCount(mc_retries, 1);
+		fetchQueue(fp);
+	} else
+		printLog(stdout, "\n");
+}
+
+/*
+ * Give up on all fetches, replies still on their way are ignored.
+ */
+static void
+fetchAbort(void)
+{
+	fetchAborted = 1;
+	clearEvents();
+	fetchPumpScheduled = 0;
+	fetchList = NULL;
+	fetchTail = &fetchList;
+}
+
+/*
+ * Note: quant=1 is just to dupe eBay into allowing the pre-bid to get
+ *	 through.  Actual quantity will be sent with bid.
+ */
+static const char PRE_BID_URL[] = "https://%s/ws/eBayISAPI.dll?MfcISAPICommand=MakeBid&fb=2&co_partner_id=&item=%s&maxbid=%s&quant=%s";
+
+/*
+ * Get bid key
+ *
+ * returns 0 on success, 1 on failure.
+ */
+static int
+preBid(auctionInfo *aip)
+{
+	memBuf_t *mp = NULL;
+	char *url;
+	int ret = 0;
+	usec_t begin;
+	preBidScan_t scan;
+
+	if (ebayLogin(aip, 0))
+		return 1;
+	url = preBidUrl(aip);
+	log(("\n\n*** preBid(): url is %s\n", url));
+	/* the bid tokens are near the top of the page, don't wait for the
+	 * rest.  Keep the connection if the bid goes to the same server.
+	 */
+	begin = usecNow();
+	memset(&scan, 0, sizeof(scan));
+	mp = httpGetStream(url, NULL, preBidTokens, &scan,
+			   strcmp(options.prebidHost, options.bidHost));
+	free(url);
+	if (!mp)
+		return httpError(aip);
+	metricTime(mh_preBid, usecNow() - begin);
+
+	ret = updateTokens(mp, aip);
+	freeMembuf(mp);
+	return ret;
+}
+
+static char *
+preBidUrl(auctionInfo *aip)
+{
+	int quantity = getQuantity(availableQuantity() > 0 ? availableQuantity() : options.quantity, aip->quantity);
+	char quantityStr[12];	/* must hold an int */
+	size_t urlLen;
+	char *url;
+
+	sprintf(quantityStr, "%d", quantity);
+	urlLen = sizeof(PRE_BID_URL) + strlen(options.prebidHost) + strlen(aip->auction) + strlen(aip->bidPriceStr) + strlen(quantityStr) - (4*2);
+	url = (char *)myMalloc(urlLen);
+	sprintf(url, PRE_BID_URL, options.prebidHost, aip->auction, aip->bidPriceStr, quantityStr);
+	return url;
+}
+
+/*
+ * Take the bid tokens of a pre-bid page and get the bid ready.  If there
+ * was a set before and it came back unchanged, tokens last at least that
+ * long.  A different set proves nothing, eBay may hand out new tokens
+ * while the old ones are still accepted.
+ *
+ * returns 0 on success, 1 on failure.
+ */
+static int
+updateTokens(memBuf_t *mp, auctionInfo *aip)
+{
+	char *old[3];
+	time_t now = time(NULL);
+	usec_t begin = usecNow();
+	int ret;
+
+	old[0] = myStrdup(aip->biduiid);
+	old[1] = myStrdup(aip->bidstok);
+	old[2] = myStrdup(aip->bidsrt);
+	ret = parsePreBid(mp, aip);
+	metricTime(mh_parsePreBid, usecNow() - begin);
+	if (!ret && aip->tokenTime && aip->tokenLogin == aip->account->loginTime && old[0] && old[1] && old[2]) {
+		time_t age = now - aip->tokenTime;
+		int changed = strcmp(old[0], aip->biduiid) ||
+			      strcmp(old[1], aip->bidstok) ||
+			      strcmp(old[2], aip->bidsrt);
+
+		if (!changed && age > tokenLifetime)
+			tokenLifetime = age;
+		log(("updateTokens(): tokens %s after %ld seconds, lifetime %ld seconds", changed ? "changed" : "unchanged", (long)age, (long)tokenLifetime));
+	}
+	free(old[0]);
+	free(old[1]);
+	free(old[2]);
+	/* get the bid ready, bid() checks the quantity again */
+	if (!ret)
+		ret = prepareBid(aip, getQuantity(availableQuantity(), aip->quantity));
+	if (!ret) {
+		aip->tokenTime = now;
+		aip->tokenLogin = aip->account->loginTime;
+		aip->tokenFailures = 0;
+		scheduleTokens(aip);
+	}
+	return ret;
+}
+
+/*
+ * returns 1 if the bid tokens are expected to be valid at the time of
+ * the bid.
+ */
+static int
+tokensReady(const auctionInfo *aip)
+{
+	return aip->biduiid && aip->bidstok && aip->bidsrt && aip->tokenTime &&
+	       aip->tokenLogin == aip->account->loginTime &&
+	       aip->endTime - options.bidtime - aip->tokenTime < tokenLifetime;
+}
+
+/*
+ * The bid has been turned down because of its tokens, so they last no
+ * longer than the age of this set.
+ */
+static void
+tokensRejected(const auctionInfo *aip)
+{
+	time_t age;
+
+	if (!aip->tokenTime)
+		return;
+	age = time(NULL) - aip->tokenTime;
+	if (age < tokenLifetime)
+		tokenLifetime = age < TOKEN_MIN_LIFETIME ? TOKEN_MIN_LIFETIME : age;
+	log(("tokensRejected(): tokens rejected after %ld seconds, lifetime %ld seconds", (long)age, (long)tokenLifetime));
+}
+
+static int
+tokenPending(const auctionInfo *aip)
+{
+	const pendingRequest_t *tp;
+
+	for (tp = tokenRequests; tp; tp = tp->next)
+		if (tp->aip == aip)
+			return 1;
+	return 0;
+}
+
+/*
+ * Schedule the next background fetch of bid tokens, if any is needed.
+ */
+static void
+scheduleTokens(auctionInfo *aip)
+{
+	time_t now = time(NULL);
+	time_t fire = aip->endTime - options.bidtime;
+	time_t when;
+
+	if (options.bidtime <= 0 || !aip->endTime || aip->bidResult != -1 ||
+	    aip->tokenEvent || tokenPending(aip))
+		return;
+	if (!aip->tokenTime)
+		when = fire - TOKEN_EARLY;
+	else {
+		time_t interval = tokenLifetime / 2;
+
+		/* last set has been fetched */
+		if (aip->tokenTime >= fire - TOKEN_LAST)
+			return;
+		if (interval > TOKEN_MAX_INTERVAL)
+			interval = TOKEN_MAX_INTERVAL;
+		when = aip->tokenTime + interval;
+		if (when > fire - TOKEN_LAST)
+			when = fire - TOKEN_LAST;
+	}
+	aip->tokenEvent = scheduleEvent(when < now ? now : when, tokenRefresh, aip);
+}
+
+/*
+ * Start a background fetch of bid tokens.
+ */
+static void
+tokenRefresh(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+
+	aip->tokenEvent = NULL;
+	if (aip->bidResult != -1 || tokenPending(aip))
+		return;
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	tokenFetch(aip);
+}
+
+/*
+ * Fetch bid tokens in the background, tokenFinish() gets the result.  The
+ * request is pending (see tokenPending()) from the sign in check on.
+ */
+static void
+tokenFetch(auctionInfo *aip)
+{
+	pendingRequest_t *tp;
+
+	tp = (pendingRequest_t *)myMalloc(sizeof(pendingRequest_t));
+	tp->aip = aip;
+	tp->start = 0;
+	tp->next = tokenRequests;
+	tokenRequests = tp;
+	ebayLoginAsync(aip, 0, tokenSignedIn);
+}
+
+static void
+tokenSignedIn(auctionInfo *aip, int ret)
+{
+	pendingRequest_t *tp;
+	char *url;
+
+	for (tp = tokenRequests; tp->aip != aip || tp->start; tp = tp->next)
+		;
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	if (ret) {
+		tokenDrop(tp);
+		tokenFinish(aip, 1);
+		return;
+	}
+	url = preBidUrl(aip);
+	log(("\n\n*** tokenRefresh(): url is %s\n", url));
+	tp->start = usecNow();
+	metricCount(mc_tokenRefreshes, 1);
+	if (httpGetAsync(url, NULL, tokenDone, tp)) {
+		tokenDrop(tp);
+		tokenFinish(aip, httpError(aip));
+	}
+	free(url);
+}
+
+static void
+tokenDone(memBuf_t *mp, void *data)
+{
+	pendingRequest_t *tp = (pendingRequest_t *)data;
+	auctionInfo *aip = tp->aip;
+	usec_t start = tp->start;
+	int ret;
+
+	tokenDrop(tp);
+	if (!aip) {
+		freeMembuf(mp);
+		return;
+	}
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	if (!mp)
+		ret = httpError(aip);
+	else {
+		metricTime(mh_preBid, usecNow() - start);
+		ret = updateTokens(mp, aip);
+		freeMembuf(mp);
+	}
+	tokenFinish(aip, ret);
+}
+
+/* remove token request tp from tokenRequests */
+static void
+tokenDrop(pendingRequest_t *tp)
+{
+	pendingRequest_t **tpp;
+
+	for (tpp = &tokenRequests; *tpp != tp; tpp = &(*tpp)->next)
+		;
+	*tpp = tp->next;
+	free(tp);
+}
+
+/*
+ * End of a token fetch.  If watch() waits for it, watchTokens() goes on.
+ * Otherwise errors that are not retried are left to watch() and
+ * snipeBid().
+ */
+static void
+tokenFinish(auctionInfo *aip, int ret)
+{
+	if (aip->tokenWait) {
+		aip->tokenWait = 0;
+		watchTokens(aip, ret);
+		return;
+	}
+	if (ret && retryTokens(aip)) {
+		printAuctionError(aip, stderr);
+		resetAuctionError(aip);
+		aip->bidResult = -1;
+	}
+}
+
+/*
+ * Retry a failed token fetch in the background, the retry signs in again
+ * if eBay wants that.
+ *
+ * returns 0 if a retry is scheduled, 1 if the error is not retried.
+ */
+static int
+retryTokens(auctionInfo *aip)
+{
+	switch (aip->auctionError) {
+	case ae_mustsignin:
+		/* session is no good, see forceEbayLogin() */
+		account->rejectedLogin = account->loginTime;
+		account->loginTime = 0;
+		break;
+	case ae_bidtokens:
+	case ae_curlerror:
+		break;
+	default:
+		return 1;
+	}
+	if (++aip->tokenFailures >= TOKEN_FAILURES)
+		return 1;
+	/* makeBidError() sets it, but the bid has not been sent yet */
+	aip->bidResult = -1;
+	printAuctionError(aip, stderr);
+	printLog(stdout, "Auction %s: Will get bid key again in the background\n", aip->auction);
+	resetAuctionError(aip);
+	metricCount(mc_retries, 1);
+	if (aip->tokenEvent)
+		cancelEvent(aip->tokenEvent);
+	aip->tokenEvent = scheduleEvent(time(NULL) + TOKEN_RETRY, tokenRefresh, aip);
+	return 0;
+}
+
+/*
+ * Streaming check for preBid: have the tags of all bid tokens arrived?
+ * Matches the patterns of parsePreBid(), and each call only looks at
+ * what is new since the last one (data is a preBidScan_t).
+ */
+static int
+preBidTokens(const memBuf_t *mp, void *data)
+{
+	preBidScan_t *sp = (preBidScan_t *)data;
+	int i;
+
+	for (i = 0; i < PS_COUNT; ++i) {
+		const scanPattern_t *pp = &preBidPatterns[i];
+		size_t len = strlen(pp->str);
+		const char *s;
+
+		if (sp->done & (1 << i))
+			continue;
+		s = pp->nocase ? strcasestr(mp->memory + sp->from[i], pp->str)
+			       : strstr(mp->memory + sp->from[i], pp->str);
+		if (!s) {
+			/* a match may start in the last len - 1 bytes */
+			if (mp->size >= len && mp->size - len + 1 > sp->from[i])
+				sp->from[i] = mp->size - len + 1;
+			continue;
+		}
+		/* wait for the end of the tag */
+		sp->from[i] = (size_t)(s - mp->memory);
+		if (strchr(s + len, '>'))
+			sp->done |= 1 << i;
+	}
+	return sp->done == (1 << PS_COUNT) - 1;
+}
+
+static int
+parsePreBid(memBuf_t *mp, auctionInfo *aip)
+{
+	int ret = 0;
+	int found = 0; //Used as binary store - 1=uiid,10=stok,100=srt
+	scanResult_t *rp;
+
+	if (!preBidScanner)
+		preBidScanner = newScanner(preBidPatterns, sizeof(preBidPatterns) / sizeof(preBidPatterns[0]));
+	rp = scanPage(preBidScanner, mp);
+
+	if (!getBidToken(mp, rp, ps_uiid, aip, &aip->biduiid)) {
+		log(("preBid(): biduiid is \"%s\"", aip->biduiid));
+		found |= TOKEN_FOUND_UIID;
+	}
+	if (!getBidToken(mp, rp, ps_stok, aip, &aip->bidstok)) {
+		log(("preBid(): bidstok is \"%s\"", aip->bidstok));
+		found |= TOKEN_FOUND_STOK;
+	}
+	if (!getBidToken(mp, rp, ps_srt, aip, &aip->bidsrt)) {
+		log(("preBid(): bidsrt is \"%s\"", aip->bidsrt));
+		found |= TOKEN_FOUND_SRT;
+	}
+	freeScanResult(rp);
+
+	if ((found & TOKEN_FOUND_ALL) != TOKEN_FOUND_ALL) {
+		pageInfo_t *pageInfo = getPageInfo(mp);
+
+		ret = makeBidError(pageInfo, aip);
+		if (ret < 0) {
+			ret = auctionError(aip, ae_bidtokens, NULL);
+			bugReport("preBid", __FILE__, __LINE__, aip, mp, optiontab, "cannot find bid token (found=%d)", found);
+		}
+		freePageInfo(pageInfo);
+	}
+	return ret;
+}
+
+/*
+ * Get value of the first input tag with a name matched by pattern.
+ *
+ * returns 0 on success, 1 if not found (token is unchanged).
+ */
+static int
+getBidToken(memBuf_t *mp, const scanResult_t *rp, int pattern, auctionInfo *aip, char **token)
+{
+	memReset(mp);
+	while (scanFind(rp, mp, pattern)) {
+		char *start, *value, *end;
+
+		for (start = mp->readptr; start >= mp->memory && *start != '<'; --start)
+			;
+		value = strcasestr(start, "value=\"");
+		end = strchr(start, '>');
+		memSkip(mp, 1);
+
+		if (!value || !end || value > end)
+			continue;
+		mp->readptr = value + 7;
+		setAuctionString(aip, token, getUntil(mp, '\"'));
+		return 0;
+	}
+	return 1;
+}
+
+static const char LOGIN_1_URL[] = "https://%s/ws/eBayISAPI.dll?SignIn";
+static const char LOGIN_2_URL[] = "https://%s/ws/eBayISAPI.dll?co_partnerId=2&siteid=0&UsingSSL=1";
+static const char LOGIN_DATA[] = "refId=&regUrl=%s&MfcISAPICommand=SignInWelcome&bhid=DEF_CI&UsingSSL=1&inputversion=2&lse=false&lsv=&mid=%s&kgver=1&kgupg=1&kgstate=&omid=&hmid=&rhr=f&srt=%s&siteid=0&co_partnerId=2&ru=&pp=&pa1=&pa2=&pa3=&i1=-1&pageType=-1&rtmData=&usid=%s&afbpmName=sess1&kgct=&userid_otp=&sgnBt=Continue&otp=&keepMeSignInOption3=1&userid=%s&%s=%s&runId2=%s&%s=%s&pass=%s&keepMeSignInOption2=1&keepMeSignInOption=1";
+
+/*
+ * Get the fields of the sign in form, all found in one scan of the page.
+ * Missing fields are empty, a missing mandatory field is reported.
+ *
+ * Returns 0 if all mandatory fields were found, 1 otherwise.
+ */
+static int
+parseSignIn(memBuf_t *mp, auctionInfo *aip, char **fields)
+{
+	scanResult_t *rp;
+	int i, ret = 0;
+
+	if (!signInScanner)
+		signInScanner = newScanner(signInPatterns, SF_COUNT);
+	rp = scanPage(signInScanner, mp);
+	for (i = 0; i < SF_COUNT; ++i) {
+		char *match;
+
+		memReset(mp);
+		match = scanFind(rp, mp, i);
+		fields[i] = match ? signInValue(mp, match, &signInFields[i]) : NULL;
+		if (fields[i]) {
+			if (options.debug)
+				dlog("parseSignIn(): %s=%s", signInPatterns[i].str, fields[i]);
+		} else {
+			fields[i] = myStrdup("");
+			if (signInFields[i].mandatory) {
+				bugReport("ebayLogin", __FILE__, __LINE__, aip, mp, optiontab,
+					"cannot find %s", signInPatterns[i].str);
+				ret = 1;
+			}
+		}
+	}
+	freeScanResult(rp);
+	return ret;
+}
+
+/*
+ * Value of a sign in form field, searched from the match of its pattern.
+ *
+ * Returns value, NULL if not found.
+ */
+static char *
+signInValue(const memBuf_t *mp, const char *match, const signInField_t *fp)
+{
+	const char *marker = fp->digits ? "id=\"" : "value=\"";
+	size_t len = strlen(marker);
+	const char *end = mp->memory + mp->size;
+	const char *p = match, *value;
+
+	do {
+		p += fp->direction;
+		if (p < mp->memory || p + len > end)
+			return NULL;
+	} while (strncmp(p, marker, len));
+	for (value = p += len; p < end && *p != '"'; ++p) {
+		if (fp->digits && !isdigit((unsigned char)*p))
+			break;
+	}
+	return myStrndup(value, (size_t)(p - value));
+}
+
+/*
+ * POST data of the sign in form.
+ */
+static char *
+signInData(char **fields, const char *password)
+{
+	char *data = (char *)myMalloc(sizeof(LOGIN_DATA)
+		+ strlen(fields[sf_regUrl]) + strlen(fields[sf_mid])
+		+ strlen(fields[sf_srt]) + strlen(fields[sf_usid])
+		+ strlen(fields[sf_userid]) + strlen(fields[sf_runId2])
+		+ strlen(fields[sf_password])
+		+ strlen(options.usernameEscape) * 2 + strlen(password) * 2
+		- (11*2));
+
+	sprintf(data, LOGIN_DATA, fields[sf_regUrl], fields[sf_mid],
+		fields[sf_srt], fields[sf_usid], options.usernameEscape,
+		fields[sf_userid], options.usernameEscape, fields[sf_runId2],
+		fields[sf_password], password, password);
+	return data;
+}
+
+/*
+ * Force an ebay login.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int
+forceEbayLogin(auctionInfo *aip)
+{
+	account->rejectedLogin = account->loginTime;
+	account->loginTime = 0;
+	return ebayLogin(aip, 0);
+}
+
+/*
+ * Ebay login.  Make sure loging has been done with the given interval.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int
+ebayLogin(auctionInfo *aip, time_t interval)
+{
+	int ret;
+	usec_t start;
+
+	if (interval == 0)
+		interval = defaultLoginInterval;	/* default: 12 hours */
+
+	/* negative value forces login */
+	if (account->loginTime > 0 && (time(NULL) - account->loginTime) <= interval) {
+		if (!account->refreshEvent)
+			scheduleRefresh(account);
+		return 0;
+	}
+
+	/* another esniper of this user may have logged in already */
+	(void)lockSession();
+	if (!loadSession(account->rejectedLogin, interval, &account->loginTime)) {
+		unlockSession();
+		scheduleRefresh(account);
+		return 0;
+	}
+	start = usecNow();
+	if (!(ret = ebayLoginInternal(aip)))
+		(void)saveSession(account->loginTime);
+	metricTime(mh_login, usecNow() - start);
+	metricCount(mc_logins, 1);
+	unlockSession();
+	if (!ret)
+		scheduleRefresh(account);
+	return ret;
+}
+
+/*
+ * Schedule the background refresh of the session of account ap, see
+ * refreshLogin().  Nothing to refresh if no auction of it is sniped.
+ */
+static void
+scheduleRefresh(account_t *ap)
+{
+	if (ap->refreshEvent) {
+		cancelEvent(ap->refreshEvent);
+		ap->refreshEvent = NULL;
+	}
+	if (!accountSniping(ap) || ap->loginTime <= 0)
+		return;
+	/* one second late, so the session is too old for refreshLogin() */
+	ap->refreshEvent = scheduleEvent(ap->loginTime + LOGIN_CHECK - LOGIN_REFRESH + 1, refreshLogin, ap);
+}
+
+/*
+ * Sign in again before watch() has to.  A sign in takes two page loads,
+ * so it waits while an auction of any account is about to be bid on.
+ */
+static void
+refreshLogin(void *data)
+{
+	time_t now = time(NULL);
+	auctionInfo *dummy;
+	int i;
+
+	useAccount((account_t *)data);
+	account->refreshEvent = NULL;
+	if (!accountSniping(account))
+		return;
+	for (i = 0; i < numSniping; ++i) {
+		const auctionInfo *aip = sniping[i];
+
+		if (aip->bidResult == -1 && aip->endTime > 0 &&
+		    aip->endTime > now - 60 && newRemain(aip) < LOGIN_QUIET) {
+			log(("refreshLogin(): auction %s is about to be bid on, later", aip->auction));
+			account->refreshEvent = scheduleEvent(now + 30, refreshLogin, account);
+			return;
+		}
+	}
+	log(("refreshLogin(): session is %ld seconds old", (long)(now - account->loginTime)));
+	dummy = newAuctionInfo("0", "0");
+	/* a second less, time() may not have caught up with the event */
+	ebayLoginAsync(dummy, LOGIN_CHECK - LOGIN_REFRESH - 1, refreshDone);
+}
+
+static void
+refreshDone(auctionInfo *aip, int ret)
+{
+	if (ret) {
+		printAuctionError(aip, stderr);
+		if (accountSniping(account) && !account->refreshEvent)
+			account->refreshEvent = scheduleEvent(time(NULL) + 300, refreshLogin, account);
+	}
+	freeAuction(aip);
+}
+
+/*
+ * returns 1 if an auction of account ap is being sniped
+ */
+static int
+accountSniping(const account_t *ap)
+{
+	int i;
+
+	for (i = 0; i < numSniping; ++i)
+		if (sniping[i]->account == ap)
+			return 1;
+	return 0;
+}
 
+/*
+ * ebayLogin() in the background: func is called with the result, right
+ * away if the session is recent enough.
+ *
+ * The session file is not locked while the pages load, so another
+ * esniper of this user may sign in at the same time.  No harm done,
+ * the last one saves its session.
+ */
+static void
+ebayLoginAsync(auctionInfo *aip, time_t interval, loginFunc_t func)
+{
+	loginRequest_t *lr, **lrp;
+	signIn_t *sp;
+	char *url;
+
+	if (interval == 0)
+		interval = defaultLoginInterval;	/* default: 12 hours */
+
+	if (account->loginTime > 0 && (time(NULL) - account->loginTime) <= interval) {
+		if (!account->refreshEvent)
+			scheduleRefresh(account);
+		(*func)(aip, 0);
+		return;
+	}
+
+	lr = (loginRequest_t *)myMalloc(sizeof(loginRequest_t));
+	lr->ap = account;
+	lr->aip = aip;
+	lr->func = func;
+	lr->next = NULL;
+	for (lrp = &loginRequests; *lrp; lrp = &(*lrp)->next)
+		;
+	*lrp = lr;
+	for (sp = signIns; sp; sp = sp->next)
+		if (sp->ap == account)
+			return;
+
+	/* another esniper of this user may have logged in already */
+	(void)lockSession();
+	if (!loadSession(account->rejectedLogin, interval, &account->loginTime)) {
+		unlockSession();
+		scheduleRefresh(account);
+		loginFinish(account, NULL);
+		return;
+	}
+	unlockSession();
+
+	log(("ebayLoginAsync(): signing in in the background"));
+	sp = (signIn_t *)myMalloc(sizeof(signIn_t));
+	sp->ap = account;
+	sp->status = newAuctionInfo("0", "0");
+	sp->start = usecNow();
+	sp->next = signIns;
+	signIns = sp;
+
+	/* new session, but keep connections for the bid */
+	if (resetCurlSession()) {
+		signInDone(sp, auctionError(sp->status, ae_unknown, NULL));
+		return;
+	}
+	url = loginUrl(LOGIN_1_URL);
+	if (httpGetAsync(url, NULL, signInPage, sp))
+		signInDone(sp, httpError(sp->status));
+	free(url);
+}
+
+/* the sign in form has arrived, send it */
+static void
+signInPage(memBuf_t *mp, void *data)
+{
+	signIn_t *sp = (signIn_t *)data;
+	char *url, *form, *logForm;
+
+	useAccount(sp->ap);
+	if (!mp) {
+		signInDone(sp, httpError(sp->status));
+		return;
+	}
+	form = signInForm(mp, sp->status, &logForm);
+	freeMembuf(mp);
+
+	url = loginUrl(LOGIN_2_URL);
+	log(("HTTP POST login: %s", url));
+	if (httpPostAsync(url, form, logForm, signInAnswer, sp))
+		signInDone(sp, httpError(sp->status));
+	free(url);
+	free(form);
+	free(logForm);
+}
+
+static void
+signInAnswer(memBuf_t *mp, void *data)
+{
+	signIn_t *sp = (signIn_t *)data;
+	int ret;
+
+	useAccount(sp->ap);
+	if (!mp)
+		ret = httpError(sp->status);
+	else {
+		ret = signInResult(mp, sp->status);
+		freeMembuf(mp);
+	}
+	if (!ret) {
+		(void)lockSession();
+		(void)saveSession(account->loginTime);
+		unlockSession();
+	}
+	signInDone(sp, ret);
+}
+
+static void
+signInDone(signIn_t *sp, int ret)
+{
+	signIn_t **spp;
+
+	for (spp = &signIns; *spp != sp; spp = &(*spp)->next)
+		;
+	*spp = sp->next;
+	metricTime(mh_login, usecNow() - sp->start);
+	metricCount(mc_logins, 1);
+	if (!ret)
+		scheduleRefresh(sp->ap);
+	loginFinish(sp->ap, ret ? sp->status : NULL);
+	freeAuction(sp->status);
+	free(sp);
+}
+
+/*
+ * Pass the result of the sign in of account ap to the ones waiting for
+ * it.  status has the error, NULL on success.
+ */
+static void
+loginFinish(account_t *ap, const auctionInfo *status)
+{
+	loginRequest_t *done = NULL, **lrp = &loginRequests, *lr;
+
+	/* functions may sign in again, their requests are not done yet */
+	while ((lr = *lrp)) {
+		if (lr->ap == ap) {
+			*lrp = lr->next;
+			lr->next = done;
+			done = lr;
+		} else
+			lrp = &lr->next;
+	}
+	while ((lr = done)) {
+		done = lr->next;
+		if (lr->aip) {
+			useAccount(ap);
+			if (status) {
+				resetAuctionError(lr->aip);
+				lr->aip->auctionError = status->auctionError;
+				if (status->auctionErrorDetail)
+					setAuctionString(lr->aip, &lr->aip->auctionErrorDetail, status->auctionErrorDetail);
+			}
+			(*lr->func)(lr->aip, status != NULL);
+		}
+		free(lr);
+	}
+}
+
+/*
+ * Sign in at eBay.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int
+ebayLoginInternal(auctionInfo *aip)
+{
+	memBuf_t *mp;
+	char *url, *data, *logdata;
+	int ret;
+
+	/* new session, but keep connections for the bid */
+	if (resetCurlSession())
+		return auctionError(aip, ae_unknown, NULL);
+
+	url = loginUrl(LOGIN_1_URL);
+	mp = httpGet(url, NULL);
+	free(url);
+	if (!mp)
+		return httpError(aip);
+
+	data = signInForm(mp, aip, &logdata);
+	freeMembuf(mp);
+
+	url = loginUrl(LOGIN_2_URL);
+	// Using POST method instead of GET
+	log(("HTTP POST login: %s", url));
+	mp = httpPost(url, data, logdata);
+	free(url);
+	free(data);
+	free(logdata);
 	if (!mp)
 		return httpError(aip);
 
+	ret = signInResult(mp, aip);
+	freeMembuf(mp);
+	return ret;
+}
+
+/*
+ * URL of a sign in page, format is LOGIN_1_URL or LOGIN_2_URL.
+ *
+ * returns malloc'ed string.
+ */
+static char *
+loginUrl(const char *format)
+{
+	char *url = (char *)myMalloc(strlen(format) + strlen(options.loginHost) + 1 - (1*2));
+
+	sprintf(url, format, options.loginHost);
+	return url;
+}
+
+/*
+ * POST data of the sign in form on page mp, and the same without password
+ * for the log in logData.
+ *
+ * returns malloc'ed string.
+ */
+static char *
+signInForm(memBuf_t *mp, auctionInfo *aip, char **logData)
+{
+	char *fields[SF_COUNT];
+	char *password, *data;
+	int i;
+
+	(void)parseSignIn(mp, aip, fields);
+	password = getPassword();
+	data = signInData(fields, password);
+	freePassword(password);
+	*logData = signInData(fields, "*****");
+	for (i = 0; i < SF_COUNT; ++i)
+		free(fields[i]);
+	return data;
+}
+
+/*
+ * Check the page eBay answers the sign in form with.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int
+signInResult(memBuf_t *mp, auctionInfo *aip)
+{
+	pageInfo_t *pp;
+	int ret = 0;
+
 	if ((pp = getPageInfo(mp))) {
 		log(("ebayLogin(): pagename = \"%s\", pageid = \"%s\", srcid = \"%s\"", nullStr(pp->pageName), nullStr(pp->pageId), nullStr(pp->srcId)));
 		/*
@@ -678,7 +1824,7 @@ ebayLogin(auctionInfo *aip, time_t interval)
 			 !strncasecmp(pp->pageName, "Black Friday", 12) ||
 			 !strncasecmp(pp->pageName, "Electronics", 11))
 		    ))
-			loginTime = time(NULL);
+			account->loginTime = time(NULL);
 		else if (pp->pageName &&
 				(!strcmp(pp->pageName, "Welcome to eBay") ||
 				 !strcmp(pp->pageName, "Welcome to eBay - Sign in - Error") ||
@@ -699,7 +1845,6 @@ ebayLogin(auctionInfo *aip, time_t interval)
 		ret = auctionError(aip, ae_login, NULL);
 		bugReport("ebayLogin", __FILE__, __LINE__, aip, mp, optiontab, "pageinfo is NULL");
 	}
-	freeMembuf(mp);
 	freePageInfo(pp);
 	return ret;
 }
@@ -835,6 +1980,9 @@ parseBid(memBuf_t *mp, auctionInfo *aip)
 	if ((ret = acceptBid(pageInfo->pageName, aip)) >= 0 ||
 	    (ret = makeBidError(pageInfo, aip)) >= 0) {
 		;
+	} else if (mp->memory && strcasestr(mp->memory, preBidPatterns[ps_uiid].str)) {
+		/* bid form again: the tokens have not been accepted */
+		ret = aip->bidResult = auctionError(aip, ae_bidtokens, NULL);
 	} else {
 		bugReport("parseBid", __FILE__, __LINE__, aip, mp, optiontab, "unknown pagename");
 		printLog(stdout, "Cannot determine result of bid\n");
@@ -844,23 +1992,164 @@ parseBid(memBuf_t *mp, auctionInfo *aip)
 	return ret;
 } /* parseBid() */
 
-static const char BID_URL[] = "http://%s/ws/eBayISAPI.dll?MfcISAPICommand=MakeBid&maxbid=%s&quant=%s&mode=1&uiid=%s&co_partnerid=2&user=%s&fb=2&item=%s&stok=%s&srt=%s";
+static const char BID_URL[] = "https://%s/ws/eBayISAPI.dll?MfcISAPICommand=MakeBid&maxbid=%s&quant=%s&mode=1&uiid=%s&co_partnerid=2&user=%s&fb=2&item=%s&stok=%s&srt=%s";
+static const char WARM_URL[] = "https://%s/";
+
+/*
+ * Place bid.  The prepared request (or both copies of a hedged bid) is
+ * sent in the background and bidAnswer() parses the answer; with bidding
+ * disabled the result is known here.  Either way bidDone() gets the
+ * result.  The items bid on count as pending from the moment the bid is
+ * sent.
+ *
+ * Returns:
+ * 0: OK, bid sent
+ * 1: error, bid not sent
+ */
+static int
+bid(auctionInfo *aip)
+{
+	int ret;
+	int quantity = getQuantity(availableQuantity(), aip->quantity);
+	pendingRequest_t *rp;
+
+	/* normally prepared by preBid(), unless the quantity changed */
+	if (quantity != aip->bidUrlQuantity || !aip->bidUrl ||
+	    (!aip->bidRequest && options.bid && !options.hedge)) {
+		log(("bid(): bid request not ready\n"));
+		if (prepareBid(aip, quantity))
+			return 1;
+	}
+
+	aip->bidQuantity = quantity;
+	pendingQuantity += quantity;
+	if (!options.bid) {
+		printLog(stdout, "Bidding disabled\n");
+		log(("bid(): would be sent %ld usec before end of auction", (long)((usec_t)aip->endTime * 1000000 - usecTime())));
+		log(("\n\nbid(): query url:\n%s\n", aip->bidLogUrl));
+		aip->bidResult = 0;
+		bidDone(aip, 0);
+		return 0;
+	}
+
+	bidFired(aip);
+	rp = (pendingRequest_t *)myMalloc(sizeof(pendingRequest_t));
+	rp->aip = aip;
+	rp->start = usecNow();
+	rp->next = bidRequests;
+	bidRequests = rp;
+	if (options.hedge)
+		ret = httpGetHedgedAsync(aip->bidUrl, aip->bidLogUrl, options.hedgeDelay, options.hedgeProxy, bidPageKnown, NULL, bidAnswer, rp);
+	else {
+		ret = httpFireAsync(aip->bidRequest, bidAnswer, rp);
+		aip->bidRequest = NULL;
+	}
+	if (ret) {
+		bidRequests = rp->next;
+		free(rp);
+		pendingQuantity -= aip->bidQuantity;
+		aip->bidQuantity = 0;
+		return httpError(aip);
+	}
+	return 0;
+} /* bid() */
+
+/*
+ * Answer to a bid, data is the pendingRequest_t of the bid.
+ */
+static void
+bidAnswer(memBuf_t *mp, void *data)
+{
+	pendingRequest_t *rp = (pendingRequest_t *)data, **rpp;
+	auctionInfo *aip = rp->aip;
+	usec_t begin = usecNow();
+	int ret;
+
+	for (rpp = &bidRequests; *rpp != rp; rpp = &(*rpp)->next)
+		;
+	*rpp = rp->next;
+	if (aip)
+		metricTime(mh_bid, begin - rp->start);
+	free(rp);
+	if (!aip) {
+		freeMembuf(mp);
+		return;
+	}
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	if (mp) {
+		ret = parseBid(mp, aip);
+		metricTime(mh_parseBid, usecNow() - begin);
+		if (ret && aip->auctionError == ae_bidtokens)
+			tokensRejected(aip);
+	} else
+		ret = httpError(aip);
+	freeMembuf(mp);
+	bidDone(aip, ret);
+}
+
+/*
+ * Bid is finished.  A failed bid is sent again after signing in, if eBay
+ * wants that, otherwise the auction is done.
+ */
+static void
+bidDone(auctionInfo *aip, int ret)
+{
+	if (!ret) {
+		postBidWait(aip);
+		return;
+	}
+	pendingQuantity -= aip->bidQuantity;
+	aip->bidQuantity = 0;
+	if (aip->auctionError == ae_mustsignin && !forceEbayLogin(aip) &&
+	    !bid(aip))
+		return;
+	printAuctionError(aip, stderr);
+	snipeDone(aip, 0);
+}
+
+/*
+ * Time the bid should be sent, so it arrives bidtime seconds before the
+ * end of the auction.
+ */
+static usec_t
+fireTime(const auctionInfo *aip)
+{
+	return ((usec_t)aip->endTime - options.bidtime) * 1000000 - bidLatency(aip);
+}
+
+/*
+ * Bid is being sent: compare with the time finalApproach() aimed at.
+ */
+static void
+bidFired(const auctionInfo *aip)
+{
+	usec_t error;
+
+	metricCount(mc_bids, 1);
+	if (options.bidtime <= 0)
+		return;
+	error = usecTime() - fireTime(aip);
+	metricTime(mh_fireError, error);
+	if (error > (usec_t)options.tolerance * 1000)
+		metricCount(mc_lateBids, 1);
+}
 
 /*
- * Place bid.
+ * Build the bid request for quantity items, and set it up on a handle of
+ * its own unless the bid is hedged (or bidding is disabled).  Called as
+ * soon as the bid tokens are known, so bid() only has to send it.
  *
  * Returns:
  * 0: OK
  * 1: error
  */
 static int
-bid(auctionInfo *aip)
+prepareBid(auctionInfo *aip, int quantity)
 {
-	memBuf_t *mp = NULL;
 	size_t urlLen;
-	char *url, *logUrl, *tmpUsername, *tmpUiid, *tmpStok, *tmpSrt;
-	int ret;
-	int quantity = getQuantity(options.quantity, aip->quantity);
+	char *tmpUsername, *tmpUiid, *tmpStok, *tmpSrt;
 	char quantityStr[12];	/* must hold an int */
 
 	if (!aip->biduiid || !aip->bidstok || !aip->bidsrt)
@@ -870,274 +2159,506 @@ bid(auctionInfo *aip)
 		return 1;
 	sprintf(quantityStr, "%d", quantity);
 
+	httpRelease(aip->bidRequest);
+	aip->bidRequest = NULL;
+	free(aip->bidUrl);
+	free(aip->bidLogUrl);
+
 	/* create url */
 	urlLen = sizeof(BID_URL) + strlen(options.bidHost) + strlen(aip->bidPriceStr) + strlen(quantityStr) + strlen(aip->biduiid) + strlen(options.usernameEscape) + strlen(aip->auction) + strlen(aip->bidstok) + strlen(aip->bidsrt) - (8*2);
-	url = (char *)myMalloc(urlLen);
-	sprintf(url, BID_URL, options.bidHost, aip->bidPriceStr, quantityStr, aip->biduiid, options.usernameEscape, aip->auction, aip->bidstok, aip->bidsrt);
+	aip->bidUrl = (char *)myMalloc(urlLen);
+	sprintf(aip->bidUrl, BID_URL, options.bidHost, aip->bidPriceStr, quantityStr, aip->biduiid, options.usernameEscape, aip->auction, aip->bidstok, aip->bidsrt);
 
-	logUrl = (char *)myMalloc(urlLen);
+	aip->bidLogUrl = (char *)myMalloc(urlLen);
 	tmpUsername = stars(strlen(options.usernameEscape));
 	tmpUiid = stars(strlen(aip->biduiid));
 	tmpStok = stars(strlen(aip->bidstok));
 	tmpSrt = stars(strlen(aip->bidsrt));
-	sprintf(logUrl, BID_URL, options.bidHost, aip->bidPriceStr, quantityStr, tmpUiid, tmpUsername, aip->auction, tmpStok, tmpSrt);
+	sprintf(aip->bidLogUrl, BID_URL, options.bidHost, aip->bidPriceStr, quantityStr, tmpUiid, tmpUsername, aip->auction, tmpStok, tmpSrt);
 	free(tmpUsername);
 	free(tmpUiid);
-    free(tmpStok);
-    free(tmpSrt);
+	free(tmpStok);
+	free(tmpSrt);
+	aip->bidUrlQuantity = quantity;
 
-	if (!options.bid) {
-		printLog(stdout, "Bidding disabled\n");
-		log(("\n\nbid(): query url:\n%s\n", logUrl));
-		ret = aip->bidResult = 0;
-	} else if (!(mp = httpGet(url, logUrl))) {
-		ret = httpError(aip);
+	if (options.bid && !options.hedge &&
+	    !(aip->bidRequest = httpPrepareGet(aip->bidUrl, aip->bidLogUrl)))
+		return httpError(aip);
+	return 0;
+}
+
+/*
+ * Hedged bid: a page is definitive if eBay says what happened to the bid.
+ */
+static int
+bidPageKnown(const memBuf_t *mp, void *data)
+{
+	pageInfo_t *pageInfo = getPageInfo((memBuf_t *)mp);
+	int ret = pageInfo->pageName || pageInfo->srcId;
+
+	freePageInfo(pageInfo);
+	return ret;
+}
+
+/*
+ * Sniping engine.
+ *
+ * All auctions are active at the same time.  Each auction runs through
+ * the steps below, each step is an event in the event queue (see
+ * schedule.c), which is ordered by the time the auction needs to be
+ * updated next:
+ *
+ *	snipeStart	check login, get bid key if bidding "now"
+ *	watch		update auction info, get bid key when we are close
+ *			to bidding (repeated until it is time to bid)
+ *	snipeBid	place bid
+ *	postBid		view auction after it has ended, count items won
+ */
+
+/*
+ * snipeStart(): first step for an auction
+ */
+static void
+snipeStart(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+	char *tmpUsername;
+
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+
+	tmpUsername = stars(strlen(options.username));
+	log(("auction %s price %s quantity %d user %s bidtime %ld\n",
+	     aip->auction, aip->bidPriceStr,
+	     options.quantity, tmpUsername, options.bidtime));
+	free(tmpUsername);
+
+	if (ebayLogin(aip, 0)) {
+		printAuctionError(aip, stderr);
+		snipeDone(aip, 0);
+		return;
+	}
+
+	/* 0 means "now" */
+	if (options.bidtime == 0) {
+		if (preBid(aip)) {
+			watchFailed(aip);
+			return;
+		}
+		snipeBid(aip);
 	} else {
-		ret = parseBid(mp, aip);
+		log(("*** WATCHING auction %s price-each %s quantity %d bidtime %ld\n", aip->auction, aip->bidPriceStr, options.quantity, options.bidtime));
+		watch(aip);
 	}
-	free(url);
-	free(logUrl);
-	freeMembuf(mp);
-	return ret;
-} /* bid() */
+}
+
+/*
+ * watch(): update auction info, watchInfo() goes on when it is there.
+ */
+static void
+watch(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	getInfoAsync(aip, watchInfo);
+}
+
+/*
+ * watchInfo(): get bid key if we are close to bidding, and schedule next
+ * update (or the bid, if it is time).
+ */
+static void
+watchInfo(auctionInfo *aip, int ret, usec_t latency)
+{
+	if (latency >= 0) {
+		if (latency < (usec_t)600 * 1000000)
+			addLatency(aip, latency);
+		printLog(stdout, "Latency: %.3f seconds, estimate %.3f seconds\n",
+			 (double)latency / 1000000, (double)bidLatency(aip) / 1000000);
+	}
+
+	if (ret) {
+		printAuctionError(aip, stderr);
+
+		/*
+		 * Fatal error?  We allow up to 50 errors, then quit.
+		 * eBay "unavailable" doesn't count towards the total.
+		 */
+		if (aip->auctionError == ae_unavailable) {
+			if (!aip->updates || newRemain(aip) > 86400) {
+				/* typical eBay maintenance period
+				 * is two hours.  Sleep for half that
+				 * amount of time.
+				 */
+				printLog(stdout, "%s: Will try again, sleeping for an hour\n", timestamp());
+				(void)scheduleEvent(time(NULL) + 3600, watch, aip);
+				return;
+			}
+		} else if (!aip->updates) {
+			/* first time through?  Give it 3 chances then
+			 * make the error fatal.
+			 */
+			if (aip->auctionError == ae_notitle && ++aip->errorCount <= 3) {
+				getInfoAsync(aip, watchInfo);
+				return;
+			}
+			watchFailed(aip);
+			return;
+		} else {
+			/* non-fatal error */
+			log(("ERROR %d!!!\n", ++aip->errorCount));
+			if (aip->errorCount > 50) {
+				(void)auctionError(aip, ae_toomany, NULL);
+				watchFailed(aip);
+				return;
+			}
+			printLog(stdout, "Cannot find auction - internet or eBay problem?\nWill try again after sleep.\n");
+		}
+	} else if (!isValidBidPrice(aip)) {
+		(void)auctionError(aip, ae_bidprice, NULL);
+		watchFailed(aip);
+		return;
+	} else
+		pollUpdate(aip, time(NULL));
+	++aip->updates;
+
+	/*
+	 * Check login when we are close to bidding.
+	 */
+	if (newRemain(aip) <= LOGIN_QUIET)
+		ebayLoginAsync(aip, LOGIN_CHECK, watchSignedIn);
+	else
+		watchNext(aip);
+}
+
+static void
+watchSignedIn(auctionInfo *aip, int ret)
+{
+	if (options.debug)
+		logOpen(aip, options.logdir);
+	if (ret) {
+		watchFailed(aip);
+		return;
+	}
+	watchNext(aip);
+}
+
+/*
+ * watchNext(): rest of watchInfo(), once the session is checked.
+ */
+static void
+watchNext(auctionInfo *aip)
+{
+	/*
+	 * if we're less than two minutes away and the background fetches
+	 * have no usable bid key, get one and wait for it in
+	 * watchTokens().  A fetch already running is waited for.
+	 */
+	if (newRemain(aip) <= 150 && !tokensReady(aip) && aip->auctionError == ae_none) {
+		printf("\n");
+		aip->tokenWait = 1;
+		if (!tokenPending(aip)) {
+			if (aip->tokenEvent) {
+				cancelEvent(aip->tokenEvent);
+				aip->tokenEvent = NULL;
+			}
+			tokenFetch(aip);
+		}
+		return;
+	}
+	watchSleep(aip);
+}
+
+/*
+ * Bid key fetched for watchNext().  Sign in and token errors are retried
+ * in the background, snipeBid() checks again.
+ */
+static void
+watchTokens(auctionInfo *aip, int ret)
+{
+	if (ret && aip->auctionError != ae_highbidder && retryTokens(aip)) {
+		printLog(stderr, "Cannot get bid key\n");
+		watchFailed(aip);
+		return;
+	}
+	watchSleep(aip);
+}
 
 /*
- * watch(): watch auction until it is time to bid
- *
- * returns:
- *	0 OK
- *	1 Error
+ * watchSleep(): schedule next update, or the bid.
  */
-static int
-watch(auctionInfo *aip)
+static void
+watchSleep(auctionInfo *aip)
 {
-	int errorCount = 0;
-	long remain = LONG_MIN;
+	long remain;
 	unsigned int sleepTime = 0;
 
-	log(("*** WATCHING auction %s price-each %s quantity %d bidtime %ld\n", aip->auction, aip->bidPriceStr, options.quantity, options.bidtime));
+	scheduleTokens(aip);
 
-	for (;;) {
-		time_t tmpLatency;
-		time_t start = time(NULL);
-		time_t timeToFirstByte = 0;
-		int ret = getInfoTiming(aip, &timeToFirstByte);
-		time_t end = time(NULL);
-
-		if (timeToFirstByte == 0)
-			timeToFirstByte = end;
-		tmpLatency = (timeToFirstByte - start);
-		if ((tmpLatency >= 0) && (tmpLatency < 600))
-			aip->latency = tmpLatency;
-		printLog(stdout, "Latency: %d seconds\n", aip->latency);
-
-		if (ret) {
-			printAuctionError(aip, stderr);
-
-			/*
-			 * Fatal error?  We allow up to 50 errors, then quit.
-			 * eBay "unavailable" doesn't count towards the total.
-			 */
-			if (aip->auctionError == ae_unavailable) {
-				if (remain >= 0)
-					remain = newRemain(aip);
-				if (remain == LONG_MIN || remain > 86400) {
-					/* typical eBay maintenance period
-					 * is two hours.  Sleep for half that
-					 * amount of time.
-					 */
-					printLog(stdout, "%s: Will try again, sleeping for an hour\n", timestamp());
-					sleepTime = 3600;
-					sleep(sleepTime);
-					continue;
-				}
-			} else if (remain == LONG_MIN) {
-				/* first time through?  Give it 3 chances then
-				 * make the error fatal.
-				 */
-				int j;
-
-				for (j = 0; ret && j < 3 && aip->auctionError == ae_notitle; ++j)
-					ret = getInfo(aip);
-				if (ret)
-					return 1;
-				remain = newRemain(aip);
-			} else {
-				/* non-fatal error */
-				log(("ERROR %d!!!\n", ++errorCount));
-				if (errorCount > 50)
-					return auctionError(aip, ae_toomany, NULL);
-				printLog(stdout, "Cannot find auction - internet or eBay problem?\nWill try again after sleep.\n");
-				remain = newRemain(aip);
-			}
-		} else if (!isValidBidPrice(aip))
-			return auctionError(aip, ae_bidprice, NULL);
-		else
-			remain = newRemain(aip);
+	remain = newRemain(aip);
 
-		/*
-		 * Check login when we are close to bidding.
-		 */
-		if (remain <= 300) {
-			if (ebayLogin(aip, defaultLoginInterval - 600))
-				return 1;
-			remain = newRemain(aip);
-		}
+	/* it's time!!! */
+	if (remain <= 0) {
+		snipeBid(aip);
+		return;
+	}
 
-		/*
-		 * if we're less than two minutes away, get bid key
-		 */
-		if (remain <= 150 && !aip->biduiid && aip->auctionError == ae_none) {
-			int i;
-
-			printf("\n");
-			for (i = 0; i < 5; ++i) {
-				/* ae_bidtokens is used when the page loaded
-				 * but failed for some unknown reason.
-				 * Do not try again in this situation.
-				 */
-				if (!preBid(aip) ||
-				    aip->auctionError == ae_bidtokens)
-					break;
-				if (aip->auctionError == ae_mustsignin &&
-				    forceEbayLogin(aip))
-					break;
-			}
-			if (aip->auctionError != ae_none &&
-			    aip->auctionError != ae_highbidder) {
-				printLog(stderr, "Cannot get bid key\n");
-				return 1;
-			}
-		}
+	/*
+	 * Within 2 minutes + 30 seconds (slop) sleep until the bid,
+	 * otherwise the polling policy decides (see polling.c).
+	 */
+	if (remain <= 150)
+		sleepTime = (unsigned int)remain;
+	else {
+		pollInput_t in;
+
+		in.remain = remain;
+		in.latency = bidLatency(aip);
+		in.auctions = numSniping;
+		in.spacing = options.delay;
+		sleepTime = (*pollPolicyByName(options.poll))(aip, &in);
+		log(("poll policy %s: bid rate %g/h, sleep %u\n", options.poll,
+		     aip->bidRate < 0 ? -1.0 : aip->bidRate * 3600, sleepTime));
+	}
 
-		remain = newRemain(aip);
+	printf("%s: Auction %s: ", timestamp(), aip->auction);
+	if (sleepTime >= 86400)
+		printLog(stdout, "Sleeping for a day\n");
+	else if (sleepTime >= 3600)
+		printLog(stdout, "Sleeping for %d hours %d minutes\n",
+			sleepTime/3600, (sleepTime % 3600) / 60);
+	else if (sleepTime >= 60)
+		printLog(stdout, "Sleeping for %d minutes %d seconds\n",
+			sleepTime/60, sleepTime % 60);
+	else
+		printLog(stdout, "Sleeping for %ld seconds\n", sleepTime);
+	printf("\n");
+
+	/* bid key has been fetched, so next step is the bid */
+	if (remain <= 150)
+		keepWarm(aip);
+	(void)scheduleEvent(time(NULL) + sleepTime,
+			    remain <= 150 ? snipeBid : watch, aip);
+} /* watch() */
 
-		/* it's time!!! */
-		if (remain <= 0)
-			break;
+/*
+ * Keep connection to bidHost (and prebidHost, if bid key is still
+ * needed) open until it is time to bid.
+ */
+static void
+keepWarm(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+	long remain = newRemain(aip);
+	char *url;
 
-		/*
-		 * Setup sleep schedule so we get updates once a day, then
-		 * at 2 hours, 1 hour, 5 minutes, 2 minutes
-		 */
-		if (remain <= 150)	/* 2 minutes + 30 seconds (slop) */
-			sleepTime = (unsigned int)remain;
-		else if (remain < 720)	/* 5 minutes + 2 minutes (slop) */
-			sleepTime = (unsigned int)remain - 120;
-		else if (remain < 3900)	/* 1 hour + 5 minutes (slop) */
-			sleepTime = (unsigned int)remain - 600;
-		else if (remain < 10800)/* 2 hours + 1 hour (slop) */
-			sleepTime = (unsigned int)remain - 3600;
-		else if (remain < 97200)/* 1 day + 3 hours (slop) */
-			sleepTime = (unsigned int)remain - 7200;
-		else			/* knock off one day */
-			sleepTime = 86400;
-
-		printf("%s: ", timestamp());
-		if (sleepTime >= 86400)
-			printLog(stdout, "Sleeping for a day\n");
-		else if (sleepTime >= 3600)
-			printLog(stdout, "Sleeping for %d hours %d minutes\n",
-				sleepTime/3600, (sleepTime % 3600) / 60);
-		else if (sleepTime >= 60)
-			printLog(stdout, "Sleeping for %d minutes %d seconds\n",
-				sleepTime/60, sleepTime % 60);
-		else
-			printLog(stdout, "Sleeping for %ld seconds\n", sleepTime);
-		sleep(sleepTime);
-		printf("\n");
+	/* bid placed or too close to bid */
+	if (aip->bidResult != -1 || remain < WARM_LEAD / 2)
+		return;
+	useAccount(aip->account);
 
-		if ((remain=newRemain(aip)) <= 0)
-			break;
+	url = (char *)myMalloc(sizeof(WARM_URL) + strlen(options.bidHost));
+	sprintf(url, WARM_URL, options.bidHost);
+	(void)httpWarmup(url);
+	free(url);
+	if (!aip->biduiid && strcmp(options.prebidHost, options.bidHost)) {
+		url = (char *)myMalloc(sizeof(WARM_URL) + strlen(options.prebidHost));
+		sprintf(url, WARM_URL, options.prebidHost);
+		(void)httpWarmup(url);
+		free(url);
 	}
-	return 0;
-} /* watch() */
+
+	if (remain > WARM_LEAD)
+		(void)scheduleEvent(time(NULL) + (remain - WARM_LEAD < WARM_INTERVAL ? remain - WARM_LEAD : WARM_INTERVAL), keepWarm, aip);
+}
 
 /*
- * parameters:
- * aip	auction to bid on
- *
- * return number of items won
+ * Watching or pre-bid failed.  If we are already high bidder there
+ * is no need to bid, but we still want to know the outcome.
  */
-int
-snipeAuction(auctionInfo *aip)
+static void
+watchFailed(auctionInfo *aip)
 {
-	int won = 0;
-	char *tmpUsername;
+	printAuctionError(aip, stderr);
+	if (aip->auctionError != ae_highbidder)
+		snipeDone(aip, 0);
+	else
+		snipeBid(aip);
+}
 
-	if (!aip)
-		return 0;
+/*
+ * snipeBid(): place bid, unless enough items have been won already or
+ * bids on other auctions may win the remaining quantity.
+ */
+static void
+snipeBid(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
 
+	useAccount(aip->account);
 	if (options.debug)
 		logOpen(aip, options.logdir);
 
-	tmpUsername = stars(strlen(options.username));
-	log(("auction %s price %s quantity %d user %s bidtime %ld\n",
-	     aip->auction, aip->bidPriceStr,
-	     options.quantity, tmpUsername, options.bidtime));
-	free(tmpUsername);
-
-	if (ebayLogin(aip, 0)) {
-		printAuctionError(aip, stderr);
-		return 0;
-	}
-
-	/* 0 means "now" */
-	if ((options.bidtime == 0) ? preBid(aip) : watch(aip)) {
-		printAuctionError(aip, stderr);
-		if (aip->auctionError != ae_highbidder)
-			return 0;
-	}
-
 	/* ran out of time! */
 	if (aip->endTime <= time(NULL)) {
 		(void)auctionError(aip, ae_ended, NULL);
 		printAuctionError(aip, stderr);
-		return 0;
+		snipeDone(aip, 0);
+		return;
 	}
 
 	if (aip->auctionError != ae_highbidder) {
-		printLog(stdout, "\nAuction %s: Bidding...\n", aip->auction);
-		for (;;) {
-			if (bid(aip)) {
-				/* failed bid */
-				if (aip->auctionError == ae_mustsignin) {
-					if (!forceEbayLogin(aip))
-						continue;
-				}
+		if (availableQuantity() <= 0) {
+			printLog(stdout, "\nAuction %s: Not bidding, outcome of %d item(s) bid on in other auctions is not known yet\n", aip->auction, pendingQuantity);
+			snipeDone(aip, 0);
+			return;
+		}
+		/*
+		 * The background fetches failed: bid with the set we have,
+		 * or give up if there is none and none is on the way.
+		 */
+		if (!tokensReady(aip) && options.bidtime > 0) {
+			if ((!aip->biduiid || !aip->bidstok || !aip->bidsrt) &&
+			    !tokenPending(aip)) {
+				(void)auctionError(aip, ae_bidtokens, NULL);
 				printAuctionError(aip, stderr);
-				return 0;
+				snipeDone(aip, 0);
+				return;
 			}
-			break;
+			log(("snipeBid(): bid tokens may have expired, trying them anyway"));
 		}
+		if (finalApproach(aip))
+			return;
+		fireBid(aip);
+		return;
 	}
+	postBidWait(aip);
+}
 
-	/* view auction after bid.
-	 * Stick it in a loop in case our timing is a bit off (due
-	 * to wild swings in latency, for instance).
-	 */
-	for (;;) {
-		if (options.bidtime > 0 && options.bidtime < 60) {
-			time_t seconds = aip->endTime - time(NULL);
-
-			if (seconds < 0)
-				seconds = 0;
-			/* extra 2 seconds to make sure auction is over */
-			seconds += 2;
-			printLog(stdout, "Auction %s: Waiting %d seconds for auction to complete...\n", aip->auction, seconds);
-			sleep((unsigned int)seconds);
+/*
+ * Wait for the exact time to bid: bidtime seconds before the end of the
+ * auction, minus the expected latency.  Other events run in the meantime,
+ * fireBid() is scheduled for options.tolerance milliseconds before that
+ * time.
+ *
+ * returns 1 if bid has been rescheduled because it is too early.
+ */
+static int
+finalApproach(auctionInfo *aip)
+{
+	usec_t planned, wait;
+	usec_t tolerance = (usec_t)options.tolerance * 1000;
+
+	if (options.bidtime <= 0)
+		return 0;
+	planned = fireTime(aip);
+	wait = planned - usecTime();
+	if (wait > MAX_APPROACH) {
+		log(("finalApproach(): %ld usec early, rescheduled", (long)wait));
+		(void)scheduleEvent((time_t)(planned / 1000000), snipeBid, aip);
+		return 1;
+	}
+	if (wait <= tolerance)
+		return 0;
+	log(("finalApproach(): bid in %ld usec", (long)wait));
+	(void)scheduleEventUsec(planned - tolerance, fireBid, aip);
+	return 1;
+}
+
+/*
+ * Send the bid, after spinning until the exact time to bid (see
+ * finalApproach()).
+ */
+static void
+fireBid(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+
+	/* bids on other auctions may have been sent since snipeBid() */
+	if (availableQuantity() <= 0) {
+		printLog(stdout, "\nAuction %s: Not bidding, outcome of %d item(s) bid on in other auctions is not known yet\n", aip->auction, pendingQuantity);
+		snipeDone(aip, 0);
+		return;
+	}
+	if (options.bidtime > 0) {
+		usec_t tolerance = (usec_t)options.tolerance * 1000;
+		usec_t wait = fireTime(aip) - usecTime();
+
+		if (wait <= 0)
+			log(("fireBid(): %ld usec late", (long)-wait));
+		else {
+			usec_t error = sleepUntil(usecNow() + wait, tolerance);
+
+			log(("fireBid(): waited %ld usec, timer error %ld usec", (long)wait, (long)error));
+			if (error > tolerance || error < -tolerance)
+				printLog(stdout, "Auction %s: Bid timer missed target by %.3f seconds\n", aip->auction, (double)error / 1000000);
 		}
+	}
+	printLog(stdout, "\nAuction %s: Bidding...\n", aip->auction);
+	if (bid(aip))
+		bidDone(aip, 1);
+}
 
-		printLog(stdout, "\nAuction %s: Post-bid info:\n",
-			 aip->auction);
-		if (getInfo(aip))
-			printAuctionError(aip, stderr);
-		if (aip->remain > 0 && aip->remain < 60 &&
-		    options.bidtime > 0 && options.bidtime < 60)
-			continue;
-		break;
+/*
+ * View auction after bid.  Wait until it is over, in case our timing
+ * is a bit off (due to wild swings in latency, for instance).
+ */
+static void
+postBidWait(auctionInfo *aip)
+{
+	time_t seconds = 0;
+
+	if (options.bidtime > 0 && options.bidtime < 60) {
+		seconds = aip->endTime - time(NULL);
+
+		if (seconds < 0)
+			seconds = 0;
+		/* extra 2 seconds to make sure auction is over */
+		seconds += 2;
+		printLog(stdout, "Auction %s: Waiting %d seconds for auction to complete...\n", aip->auction, seconds);
+	}
+	(void)scheduleEvent(time(NULL) + seconds, postBid, aip);
+}
+
+/*
+ * postBid(): get auction result, postBidInfo() goes on when it is there.
+ */
+static void
+postBid(void *data)
+{
+	auctionInfo *aip = (auctionInfo *)data;
+
+	useAccount(aip->account);
+	if (options.debug)
+		logOpen(aip, options.logdir);
+
+	printLog(stdout, "\nAuction %s: Post-bid info:\n", aip->auction);
+	getInfoAsync(aip, postBidInfo);
+}
+
+static void
+postBidInfo(auctionInfo *aip, int ret, usec_t latency)
+{
+	int won;
+
+	if (ret)
+		printAuctionError(aip, stderr);
+	if (aip->remain > 0 && aip->remain < 60 &&
+	    options.bidtime > 0 && options.bidtime < 60) {
+		postBidWait(aip);
+		return;
 	}
 
+	pendingQuantity -= aip->bidQuantity;
+	aip->bidQuantity = 0;
 	if (aip->won == -1) {
 		won = options.quantity < aip->quantity ?
 			options.quantity : aip->quantity;
@@ -1147,7 +2668,158 @@ snipeAuction(auctionInfo *aip)
 		printLog(stdout, "\nwon %d item(s)\n", won);
 	}
 	options.quantity -= won;
-	return won;
+	snipeDone(aip, won);
+}
+
+/*
+ * Auction is finished.  Stop all other auctions if we have won enough.
+ */
+static void
+snipeDone(auctionInfo *aip, int won)
+{
+	totalWon += won;
+	if (won > 0)
+		metricCount(mc_won, won);
+	snipeUnregister(aip);
+	if (options.quantity <= 0) {
+		if (numSniping > 0) {
+			printLog(stdout, "\nWon all item(s), %d auction(s) not sniped\n", numSniping);
+			while (numSniping > 0) {
+				cancelEvents(sniping[numSniping - 1]);
+				snipeUnregister(sniping[numSniping - 1]);
+			}
+		}
+	} else if (numSniping > 0)
+		printRemain(numSniping);
+}
+
+/*
+ * Remove auction from the list of auctions being sniped.
+ */
+static void
+snipeUnregister(auctionInfo *aip)
+{
+	pendingRequest_t *tp, **tpp;
+	infoRequest_t *ir;
+	loginRequest_t *lr;
+	int i;
+
+	for (i = 0; i < numSniping; ++i) {
+		if (sniping[i] == aip) {
+			memmove(&sniping[i], &sniping[i + 1],
+				(size_t)(numSniping - i - 1) * sizeof(auctionInfo *));
+			--numSniping;
+			break;
+		}
+	}
+	/* no more token refreshes, and no bid answer */
+	cancelEvents(aip);
+	aip->tokenEvent = NULL;
+	for (tpp = &tokenRequests; (tp = *tpp); ) {
+		if (tp->aip == aip && !tp->start) {
+			/* waits for a sign in, which won't call back now */
+			*tpp = tp->next;
+			free(tp);
+			continue;
+		}
+		if (tp->aip == aip)
+			tp->aip = NULL;
+		tpp = &tp->next;
+	}
+	for (tp = bidRequests; tp; tp = tp->next)
+		if (tp->aip == aip)
+			tp->aip = NULL;
+	for (ir = infoRequests; ir; ir = ir->next)
+		if (ir->aip == aip)
+			ir->aip = NULL;
+	for (lr = loginRequests; lr; lr = lr->next)
+		if (lr->aip == aip)
+			lr->aip = NULL;
+	if (!accountSniping(aip->account) && aip->account->refreshEvent) {
+		cancelEvent(aip->account->refreshEvent);
+		aip->account->refreshEvent = NULL;
+	}
+}
+
+/*
+ * Start sniping an auction at time when.  The auction must not be
+ * freed until it is done (see snipeActive()) or removed.
+ */
+void
+snipeAdd(auctionInfo *aip, time_t when)
+{
+	if (numSniping == snipingSize) {
+		snipingSize = snipingSize ? snipingSize * 2 : 8;
+		sniping = (auctionInfo **)myRealloc(sniping, (size_t)snipingSize * sizeof(auctionInfo *));
+	}
+	sniping[numSniping++] = aip;
+	(void)scheduleEvent(when, snipeStart, aip);
+	if (!aip->account->refreshEvent)
+		scheduleRefresh(aip->account);
+}
+
+/*
+ * Stop sniping an auction.  An auction cannot be removed after a bid has
+ * been placed on it, its outcome is still needed to count items won.
+ *
+ * returns 0 on success, 1 if the auction is not removed
+ */
+int
+snipeRemove(auctionInfo *aip)
+{
+	if (!snipeActive(aip) || aip->bidQuantity > 0)
+		return 1;
+	cancelEvents(aip);
+	snipeUnregister(aip);
+	return 0;
+}
+
+/*
+ * returns 1 if auction is still being sniped
+ */
+int
+snipeActive(const auctionInfo *aip)
+{
+	int i;
+
+	for (i = 0; i < numSniping; ++i)
+		if (sniping[i] == aip)
+			return 1;
+	return 0;
+}
+
+/*
+ * returns number of items won since the last snipeAuctions()
+ */
+int
+snipeWon(void)
+{
+	return totalWon;
+}
+
+/*
+ * Snipe all auctions.  Auctions must be sorted by end time (see
+ * sortAuctions()).
+ *
+ * return number of items won
+ */
+int
+snipeAuctions(auctionInfo **auctions, int numAuctions)
+{
+	time_t now = time(NULL);
+	int i;
+
+	totalWon = 0;
+	pendingQuantity = 0;
+	for (i = 0; i < numAuctions && options.quantity > 0; ++i) {
+		/* spread initial updates to avoid ebay's "security measure" */
+		time_t when = now + (options.delay > 0 ? i * options.delay : 0);
+
+		snipeAdd(auctions[i], when);
+	}
+	runEvents();
+	useAccount(NULL);
+	return totalWon;
 }
 
 /* Max \td in the description table (is 8 on 02 of May 2010): */
@@ -1156,10 +2828,10 @@ snipeAuction(auctionInfo *aip)
 
 /*
  * On first call, use printNewline to 0.  On subsequent calls, use return
- * value from previous call.
+ * value from previous call.  If print is 0, the row is parsed only.
  */
 static int
-printMyItemsRow(char **row, int printNewline)
+printMyItemsRow(memBuf_t *mp, const tableRow_t *row, int printNewline, int print)
 {
 	const char *myitems_description[MAX_TDS][MAX_TDS_LENGTH] = {
 		{0, 0, 0, 0, 0, 0},
@@ -1175,36 +2847,41 @@ printMyItemsRow(char **row, int printNewline)
 	int ret = printNewline;
 	int item_nr=0;	/* count no_tag item */
 
-	for (; row[column]; ++column) {
-		memBuf_t buf;
+	if (!print)
+		return ret;
+	for (; column < row->numCells; ++column) {
+		htmlSpan_t span = row->cells[column];
 		char *value = NULL;
 
 		if (column == 0) { /* item nr on checkbox in 1st (-1) column */
 			static const char search[] = "value=";
-			char *tmp = strstr(row[column], search);
+			const char *tmp = span.start, *end = span.start + span.len;
 
-			if (tmp) {
-				int i;
+			for (; tmp + sizeof(search) - 1 <= end; ++tmp)
+				if (!strncmp(tmp, search, sizeof(search) - 1))
+					break;
+			if (tmp + sizeof(search) - 1 <= end) {
+				const char *digits;
 
 				tmp += sizeof(search) - 1;
-				for (; !isdigit(*tmp); ++tmp)
+				for (; tmp < end && !isdigit((unsigned char)*tmp); ++tmp)
 					;
-				for (i = 1; isdigit(tmp[i]); ++i)
+				for (digits = tmp; tmp < end && isdigit((unsigned char)*tmp); ++tmp)
 					;
-				value = myStrndup(tmp, (size_t)(i));
-				printLog(stdout, "ItemNr:\t\t%s\n", value);
-				free(value);
+				if (tmp > digits)
+					printLog(stdout, "ItemNr:\t\t%.*s\n", (int)(tmp - digits), digits);
 			}
 		}
-		strToMemBuf(row[column], &buf); /* load new row */
+		if (column >= MAX_TDS)
+			continue;
 		for (item_nr = 0; item_nr < MAX_TDS_LENGTH; item_nr++) {
-			value = getNonTag(&buf);
+			value = getSpanText(mp, &span);
 
 			/* there may be a "ENDING SOON" message */
-			if ((column==2)&&(item_nr==0)&&strstr(value,"ENDING SOON"))
-				value = getNonTag(&buf);
+			if ((column==2)&&(item_nr==0)&&value&&strstr(value,"ENDING SOON"))
+				value = getSpanText(mp, &span);
 			/* when nothing interesting in row */
-			if (column >= MAX_TDS || !myitems_description[column][item_nr])
+			if (!myitems_description[column][item_nr])
 				continue;
 			/* print the entry */
 			printLog(stdout, myitems_description[column][item_nr], value ? value : "");
@@ -1214,7 +2891,37 @@ printMyItemsRow(char **row, int printNewline)
 	return ret;
 }
 
-static const char MYITEMS_URL[] = "http://%s/ws/eBayISAPI.dll?MyeBay&CurrentPage=MyeBayWatching";
+/*
+ * Go through the item tables of a My eBay page.
+ *
+ * Returns number of items found.
+ */
+static int
+myItemsTables(memBuf_t *mp, int print)
+{
+	const char *table;
+	tableRow_t row = TABLE_ROW_INIT;
+	int numItems = 0;
+
+	while ((table = getTableStart(mp))) {
+		int printNewline = 0;
+
+		/* search for table containing my itmes */
+		if (!strstr(table, "class=\"my_itl-iT\""))
+			continue;
+		/* skip first descriptive table row */
+		if (!getTableSpans(mp, &row))
+			break; /* error? */
+		while (getTableSpans(mp, &row)) {
+			printNewline = printMyItemsRow(mp, &row, printNewline, print);
+			++numItems;
+		}
+	}
+	freeTableSpans(&row);
+	return numItems;
+}
+
+static const char MYITEMS_URL[] = "https://%s/ws/eBayISAPI.dll?MyeBay&CurrentPage=MyeBayWatching";
 
 /*
  * TODO: allow user configuration of myItems.
@@ -1223,8 +2930,6 @@ int
 printMyItems(void)
 {
 	memBuf_t *mp = NULL;
-	const char *table;
-	char **row;
 	auctionInfo *dummy = newAuctionInfo("0", "0");
 	char *url;
 	size_t urlLen;
@@ -1246,24 +2951,7 @@ printMyItems(void)
 		freeMembuf(mp);
 		return 1;
 	}
-	while ((table = getTableStart(mp))) {
-		int printNewline = 0;
-
-		/* search for table containing my itmes */
-		if (!strstr(table, "class=\"my_itl-iT\""))
-			continue;
-		/* skip first descriptive table row */
-		if ((row = getTableRow(mp)))
-			freeTableRow(row);
-		else {
-			freeAuction(dummy);
-			return 0; /* error? */
-		}
-		while ((row = getTableRow(mp))) {
-			printNewline = printMyItemsRow(row, printNewline);
-			freeTableRow(row);
-		}
-	}
+	(void)myItemsTables(mp, 1);
 	freeAuction(dummy);
 	freeMembuf(mp);
 	return 0;
@@ -1318,7 +3006,7 @@ testParser(int flag)
 	    {
 		/* print bid history table */
 		const char *table;
-		char **row;
+		tableRow_t row = TABLE_ROW_INIT;
 		char *cp;
 		int rowNum = 0;
 
@@ -1340,18 +3028,17 @@ testParser(int flag)
 		}
 
 		printf("table: %s\n", table);
-		while ((row = getTableRow(mp))) {
+		while (getTableSpans(mp, &row)) {
 			int columnNum = 0;
 
 			printf("\trow %d:\n", rowNum++);
-			for (; row[columnNum]; ++columnNum) {
-				memBuf_t buf;
+			for (; columnNum < row.numCells; ++columnNum) {
+				const char *text = getCellText(mp, &row, columnNum, 1);
 
-				strToMemBuf(row[columnNum], &buf);
-				printf("\t\tcolumn %d: %s\n", columnNum, getNonTag(mp));
-				free(row[columnNum]);
+				printf("\t\tcolumn %d: %s\n", columnNum, text ? text : "");
 			}
 		}
+		freeTableSpans(&row);
 		break;
 	    }
 	case 5:
@@ -1367,3 +3054,144 @@ testParser(int flag)
 		}
 	}
 }
+
+typedef enum {
+	bk_history, bk_prebid, bk_bid, bk_myebay, bk_signin
+} benchKind_t;
+
+/* page kind is given by the beginning of the file name */
+static const struct {
+	const char *prefix;
+	benchKind_t kind;
+} benchKinds[] = {
+	{ "history", bk_history },
+	{ "prebid", bk_prebid },
+	{ "bid", bk_bid },
+	{ "myebay", bk_myebay },
+	{ "signin", bk_signin },
+};
+
+/*
+ * Parse page once, like esniper does when it gets a page of this kind.
+ *
+ * Returns 0 if page was parsed successfully.
+ */
+static int
+benchParse(benchKind_t kind, memBuf_t *mp, auctionInfo *aip, time_t start)
+{
+	int ret = 0;
+
+	memReset(mp);
+	switch (kind) {
+	case bk_history:
+		ret = parseBidHistory(mp, aip, start, NULL, 1);
+		break;
+	case bk_prebid:
+		ret = parsePreBid(mp, aip);
+		break;
+	case bk_bid:
+		ret = parseBid(mp, aip);
+		break;
+	case bk_myebay:
+		ret = myItemsTables(mp, 0) == 0;
+		break;
+	case bk_signin:
+	    {
+		pageInfo_t *pp;
+		char *fields[SF_COUNT];
+		int i;
+
+		ret = parseSignIn(mp, aip, fields);
+		for (i = 0; i < SF_COUNT; ++i)
+			free(fields[i]);
+		if ((pp = getPageInfo(mp)))
+			freePageInfo(pp);
+		else
+			ret = 1;
+		break;
+	    }
+	}
+	return ret;
+}
+
+/*
+ * secret option - benchmark parsers
+ *
+ * Each page is parsed iterations times by the parser given by its file
+ * name (history*, prebid*, bid*, myebay*, signin*).  Reports parse time,
+ * throughput and allocations per parse on stderr; parser output is
+ * discarded.
+ *
+ * Returns 0 if all pages were parsed successfully, 1 otherwise.
+ */
+int
+benchParser(int iterations, char **files, int numFiles)
+{
+	int i, failed = 0;
+	usec_t totalTime = 0;
+	double totalBytes = 0;
+	time_t start = time(NULL);
+
+	/* parsers compare with the user name, without login there is none */
+	if (!options.username)
+		setUsername(myStrdup(""));
+	/* parsers talk to the user, but only the results are of interest */
+#if defined(WIN32)
+	(void)freopen("NUL", "w", stdout);
+#else
+	(void)freopen("/dev/null", "w", stdout);
+#endif
+	fprintf(stderr, "%-24s %-8s %9s %11s %9s %13s\n", "page", "kind", "bytes",
+	       "usec/parse", "MB/s", "allocs/parse");
+	for (i = 0; i < numFiles; ++i) {
+		const char *name = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+		auctionInfo *aip;
+		memBuf_t *mp;
+		FILE *fp;
+		usec_t begin, elapsed;
+		unsigned long allocs;
+		size_t k;
+		int n, ret = 0;
+
+		for (k = 0; k < sizeof(benchKinds)/sizeof(benchKinds[0]); ++k) {
+			if (!strncmp(name, benchKinds[k].prefix, strlen(benchKinds[k].prefix)))
+				break;
+		}
+		if (k == sizeof(benchKinds)/sizeof(benchKinds[0])) {
+			printLog(stderr, "%s: unknown page kind\n", files[i]);
+			failed = 1;
+			continue;
+		}
+		if (!(fp = fopen(files[i], "r"))) {
+			printLog(stderr, "%s: %s\n", files[i], strerror(errno));
+			failed = 1;
+			continue;
+		}
+		mp = readFile(fp);
+		fclose(fp);
+
+		/* first parse builds scanners, not counted */
+		aip = newAuctionInfo("1", "2");
+		(void)benchParse(benchKinds[k].kind, mp, aip, start);
+
+		allocs = allocCount();
+		begin = usecNow();
+		for (n = 0; n < iterations; ++n)
+			ret |= benchParse(benchKinds[k].kind, mp, aip, start);
+		elapsed = usecNow() - begin;
+		allocs = allocCount() - allocs;
+		freeAuction(aip);
+
+		fprintf(stderr, "%-24s %-8s %9lu %11.2f %9.1f %13.1f%s\n", name,
+		       benchKinds[k].prefix, (unsigned long)mp->size,
+		       (double)elapsed / iterations,
+		       elapsed ? (double)mp->size * iterations / elapsed : 0.0,
+		       (double)allocs / iterations, ret ? " FAILED" : "");
+		totalTime += elapsed;
+		totalBytes += (double)mp->size * iterations;
+		failed |= ret;
+	}
+	if (totalTime)
+		fprintf(stderr, "total: %.1f MB/s\n", totalBytes / totalTime);
+	return failed;
+}
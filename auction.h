@@ -32,7 +32,12 @@
 #include "http.h"
 
 extern int getInfo(auctionInfo *aip);
-extern int snipeAuction(auctionInfo *aip);
+extern int getAllInfo(auctionInfo **auctions, int numAuctions);
+extern int snipeAuctions(auctionInfo **auctions, int numAuctions);
+extern void snipeAdd(auctionInfo *aip, time_t when);
+extern int snipeRemove(auctionInfo *aip);
+extern int snipeActive(const auctionInfo *aip);
+extern int snipeWon(void);
 extern int printMyItems(void);
 
 typedef struct {
@@ -44,7 +49,8 @@ typedef struct {
 extern pageInfo_t *getPageInfo(memBuf_t *mp);
 extern void freePageInfo(pageInfo_t *pp);
 
-/* secret option */
+/* secret options */
 extern void testParser(int flag);
+extern int benchParser(int iterations, char **files, int numFiles);
 
 #endif /* AUCTION_H_INCLUDED */
@@ -32,12 +32,23 @@
  */
 
 #include "auctionfile.h"
-#include "buffer.h"
 #include "util.h"
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#if !defined(WIN32)
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+static int readFileData(const char *filename, auctionFile_t *afp);
+static int parseAuctionFile(auctionFile_t *afp);
+static const char *skipBlanks(const char *p, const char *end);
+static const char *skipLine(const char *p, const char *end);
+static void invalidLine(const char *line, const char *end);
 
 /*
  * readAuctionFile(): read a file listing auctions to watch.
@@ -47,97 +58,212 @@
 int
 readAuctionFile(const char *filename, auctionInfo ***aip)
 {
-	FILE *fp = fopen(filename, "r");
-	char *buf = NULL;
-	size_t bufsize = 0, count = 0, line;
-	int c, i, j, numAuctions = 0;
+	auctionFile_t af;
+	int i, numAuctions = loadAuctionFile(filename, &af);
+
+	if (numAuctions > 0) {
+		*aip = (auctionInfo **)myMalloc(sizeof(auctionInfo *) * (size_t)numAuctions);
+		for (i = 0; i < numAuctions; ++i)
+			(*aip)[i] = newLineAuction(&af.lines[i]);
+	} else if (numAuctions == 0)
+		fprintf(stderr, "Cannot find any auctions!\n");
+	unloadAuctionFile(&af);
+	return numAuctions;
+} /* readAuctions() */
 
-	if (fp == NULL) {
+/*
+ * loadAuctionFile(): read an auction file and find its auction lines, in
+ * one pass.  Lines point into the file data, nothing is copied.  Call
+ * unloadAuctionFile() when done, also after an error.
+ *
+ * returns: number of auction lines, -1 on error
+ */
+int
+loadAuctionFile(const char *filename, auctionFile_t *afp)
+{
+	afp->data = NULL;
+	afp->size = 0;
+	afp->lines = NULL;
+	afp->numLines = 0;
+	if (readFileData(filename, afp)) {
 		fprintf(stderr, "Cannot open auction file %s: %s\n", filename,
 			strerror(errno));
 		return -1;
 	}
+	return parseAuctionFile(afp) ? -1 : afp->numLines;
+}
 
-	while (numAuctions != -1 && (c = getc(fp)) != EOF) {
-		if (isspace(c))
-			continue;
-		/* skip comments and anything starting with a letter
-		 * (assume it is a configuration option)
-		 */
-		if ((c == '#') || isalpha(c))
-			c = skipline(fp);
-		else if (isdigit(c)) {
-			++numAuctions;
-			/* get auction number */
-			line = count;
-			do {
-				addchar(buf, bufsize, count, (char)c);
-			} while (isdigit(c = getc(fp)));
-			while (isspace(c) && c != '\n' && c != '\r')
-				c = getc(fp);
-			if (c == '#')	/* comment? */
-				c = skipline(fp);
-			/* no price? */
-			if (c == EOF || c == '\n' || c == '\r') {
-				/* use price of previous auction */
-				if (numAuctions == 1) {
-					fprintf(stderr, "Cannot find price on first auction\n");
-					numAuctions = -1;
-				}
-			} else {
-				addchar(buf, bufsize, count, ' ');
-				/* get price */
-				for (; isdigit(c) || c == '.' || c == ','; c = getc(fp))
-					addchar(buf, bufsize, count, (char)c);
-				while (isspace(c) && c != '\n' && c != '\r')
-					c = getc(fp);
-				if (c == '#')	/* comment? */
-					c = skipline(fp);
-				if (c != EOF && c != '\n' && c != '\r') {
-					term(buf, bufsize, count);
-					fprintf(stderr, "Invalid auction line: %s\n", &buf[line]);
-					numAuctions = -1;
-				}
-			}
-			addchar(buf, bufsize, count, '\n');
-		} else {
-			fprintf(stderr, "Invalid auction line: ");
-			do {
-				putc(c, stderr);
-			} while ((c = getc(fp)) != EOF && c != '\n' && c != '\r');
-			putc('\n', stderr);
-			numAuctions = -1;
+void
+unloadAuctionFile(auctionFile_t *afp)
+{
+	free(afp->data);
+	free(afp->lines);
+	afp->data = NULL;
+	afp->lines = NULL;
+	afp->size = 0;
+	afp->numLines = 0;
+}
+
+/*
+ * New auction for a line of an auction file.
+ */
+auctionInfo *
+newLineAuction(const auctionLine_t *lp)
+{
+	char *auction = myStrndup(lp->auction, lp->auctionLen);
+	char *price = myStrndup(lp->price, lp->priceLen);
+	auctionInfo *aip = newAuctionInfo(auction, price);
+
+	free(auction);
+	free(price);
+	return aip;
+}
+
+/*
+ * Get the contents of a file.  It is read, not mapped: other programs
+ * may rewrite it in place while the daemon parses it, and a mapping of
+ * a truncated file would kill the process with SIGBUS.
+ *
+ * returns 0 on success, 1 on error (errno is set)
+ */
+static int
+readFileData(const char *filename, auctionFile_t *afp)
+{
+#if !defined(WIN32)
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	size_t alloc;
+	ssize_t n;
+
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return 1;
+	}
+	/* one read for the whole file, unless it grows meanwhile */
+	alloc = (size_t)st.st_size + 1;
+	afp->data = (char *)myMalloc(alloc);
+	while ((n = read(fd, afp->data + afp->size, alloc - afp->size)) > 0) {
+		afp->size += (size_t)n;
+		if (afp->size == alloc) {
+			alloc *= 2;
+			afp->data = (char *)myRealloc(afp->data, alloc);
 		}
-		if (c == EOF)
-			break;
+	}
+	close(fd);
+	return n < 0;
+#else
+	FILE *fp = fopen(filename, "rb");
+	size_t n;
+	char buf[8192];
+
+	if (!fp)
+		return 1;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		afp->data = (char *)myRealloc(afp->data, afp->size + n);
+		memcpy(afp->data + afp->size, buf, n);
+		afp->size += n;
 	}
 	fclose(fp);
+	return 0;
+#endif
+}
 
-	if (numAuctions > 0) {
-		*aip = (auctionInfo **)myMalloc(sizeof(auctionInfo *) * (size_t)numAuctions);
+/*
+ * Find the auction lines.  Blank lines, comments and anything starting
+ * with a letter (assumed to be a configuration option) are skipped.  An
+ * auction line has an auction number and an optional price, the price
+ * of the previous auction is used if it is missing.
+ *
+ * returns 0 on success, 1 on error
+ */
+static int
+parseAuctionFile(auctionFile_t *afp)
+{
+	const char *p = afp->data, *end = p + afp->size;
+	const char *price = NULL;
+	size_t priceLen = 0;
+	int linesSize = 0;
 
-		for (i = 0, j = 0; i < numAuctions; ++i, ++j) {
-			char *auction, *bidPriceStr;
+	while (p < end) {
+		const char *line = p, *auction;
+		size_t auctionLen;
+		auctionLine_t *lp;
 
-			auction = &buf[j];
-			for (; !isspace((int)(buf[j])); ++j)
+		if (isspace((unsigned char)*p)) {
+			++p;
+			continue;
+		}
+		if (*p == '#' || isalpha((unsigned char)*p)) {
+			p = skipLine(p, end);
+			continue;
+		}
+		if (!isdigit((unsigned char)*p)) {
+			invalidLine(line, end);
+			return 1;
+		}
+		/* get auction number */
+		for (auction = p; p < end && isdigit((unsigned char)*p); ++p)
+			;
+		auctionLen = (size_t)(p - auction);
+		p = skipBlanks(p, end);
+		if (p < end && *p == '#')	/* comment? */
+			p = skipLine(p, end);
+		/* no price? */
+		if (p == end || *p == '\n' || *p == '\r') {
+			/* use price of previous auction */
+			if (!price) {
+				fprintf(stderr, "Cannot find price on first auction\n");
+				return 1;
+			}
+		} else {
+			/* get price */
+			for (price = p; p < end && (isdigit((unsigned char)*p) || *p == '.' || *p == ','); ++p)
 				;
-			if (buf[j] == '\n') {
-				buf[j] = '\0';
-				bidPriceStr = (*aip)[i-1]->bidPriceStr;
-			} else {
-				buf[j] = '\0';
-				bidPriceStr = &buf[++j];
-				for (; buf[j] != '\n'; ++j)
-					;
-				buf[j] = '\0';
+			priceLen = (size_t)(p - price);
+			p = skipBlanks(p, end);
+			if (p < end && *p == '#')	/* comment? */
+				p = skipLine(p, end);
+			if (p < end && *p != '\n' && *p != '\r') {
+				invalidLine(line, end);
+				return 1;
 			}
-			(*aip)[i] = newAuctionInfo(auction, bidPriceStr);
 		}
-	} else if (numAuctions == 0)
-		fprintf(stderr, "Cannot find any auctions!\n");
+		if (afp->numLines == linesSize) {
+			linesSize = linesSize ? linesSize * 2 : 64;
+			afp->lines = (auctionLine_t *)myRealloc(afp->lines, (size_t)linesSize * sizeof(auctionLine_t));
+		}
+		lp = &afp->lines[afp->numLines++];
+		lp->auction = auction;
+		lp->auctionLen = auctionLen;
+		lp->price = price;
+		lp->priceLen = priceLen;
+	}
+	return 0;
+}
 
-	free(buf);
+/* skip spaces and tabs */
+static const char *
+skipBlanks(const char *p, const char *end)
+{
+	while (p < end && isspace((unsigned char)*p) && *p != '\n' && *p != '\r')
+		++p;
+	return p;
+}
 
-	return numAuctions;
-} /* readAuctions() */
+/* skip to end of line, returns end or the newline */
+static const char *
+skipLine(const char *p, const char *end)
+{
+	while (p < end && *p != '\n' && *p != '\r')
+		++p;
+	return p;
+}
+
+static void
+invalidLine(const char *line, const char *end)
+{
+	fprintf(stderr, "Invalid auction line: %.*s\n",
+		(int)(skipLine(line, end) - line), line);
+}
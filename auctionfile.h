@@ -29,6 +29,28 @@
 
 #include "auctioninfo.h"
 
+/*
+ * Auction line of an auction file.  Strings point into the file and are
+ * not terminated.
+ */
+typedef struct {
+	const char *auction;
+	size_t auctionLen;
+	const char *price;	/* price of this or an earlier line */
+	size_t priceLen;
+} auctionLine_t;
+
+/* auction file loaded by loadAuctionFile() */
+typedef struct {
+	char *data;		/* file contents */
+	size_t size;
+	auctionLine_t *lines;
+	int numLines;
+} auctionFile_t;
+
 int readAuctionFile(const char *filename, auctionInfo ***aip);
+int loadAuctionFile(const char *filename, auctionFile_t *afp);
+void unloadAuctionFile(auctionFile_t *afp);
+auctionInfo *newLineAuction(const auctionLine_t *lp);
 
 #endif /* AUCTIONFILE_H_INCLUDED */
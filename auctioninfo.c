@@ -25,9 +25,12 @@
  */
 
 #include "auctioninfo.h"
+#include "account.h"
 #include "esniper.h"
 #include "auction.h"
+#include "metrics.h"
 #include "util.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #if defined(WIN32)
@@ -36,7 +39,27 @@
 #	include <unistd.h>
 #endif
 
-static double *getIncrements(const auctionInfo *aip);
+static void compactStrings(auctionInfo *aip);
+static int compareSortKeys(const void *p1, const void *p2);
+
+/* string fields of auctionInfo kept in its arena */
+static const size_t stringFields[] = {
+	offsetof(auctionInfo, auction),
+	offsetof(auctionInfo, title),
+	offsetof(auctionInfo, bidPriceStr),
+	offsetof(auctionInfo, remainRaw),
+	offsetof(auctionInfo, query),
+	offsetof(auctionInfo, biduiid),
+	offsetof(auctionInfo, bidstok),
+	offsetof(auctionInfo, bidsrt),
+	offsetof(auctionInfo, shipping),
+	offsetof(auctionInfo, etag),
+	offsetof(auctionInfo, lastModified),
+	offsetof(auctionInfo, auctionErrorDetail)
+};
+
+/* compact the arena when more than this, and half of it, is dead */
+#define DEAD_STRINGS 1024
 
 /*
  * Bidding increments
@@ -216,6 +239,39 @@ static double defaultIncrements[] = {
 	-1.00, 0.01
 };
 
+/*
+ * Increment tables by currency, in order of enum currencyCode.  steps is
+ * the number of thresholds before the -1.00 end marker.
+ */
+typedef struct {
+	const char *currency;
+	const double *increments;
+	int steps;
+} incrementTable_t;
+
+#define INCREMENTS(currency, table) \
+	{ currency, table, (int)(sizeof(table) / sizeof(table[0]) / 2) - 1 }
+
+static const incrementTable_t incrementTables[] = {
+	INCREMENTS(NULL, USIncrements),		/* cc_none */
+	INCREMENTS(NULL, defaultIncrements),	/* cc_other */
+	INCREMENTS("AU", AUIncrements),
+	INCREMENTS("C", CADIncrements),
+	INCREMENTS("CHF", CHFIncrements),
+	INCREMENTS("EUR", EURIncrements),
+	INCREMENTS("GBP", GBPIncrements),
+	INCREMENTS("HKD", HKDIncrements),
+	INCREMENTS("NT", NTIncrements),
+	INCREMENTS("RMB", RMBIncrements),
+	INCREMENTS("SGD", SGDIncrements),
+	INCREMENTS("US", USIncrements)
+};
+
+/* table must match enum currencyCode */
+typedef char incrementTablesSize[sizeof(incrementTables) / sizeof(incrementTables[0]) == cc_US + 1 ? 1 : -1];
+
+static double findIncrement(const incrementTable_t *tp, double price);
+
 static const char *auctionErrorString[] = {
 	"",
 	"Auction %s: Unknown item\n",
@@ -261,28 +317,53 @@ newAuctionInfo(const char *auction, const char *bidPriceStr)
 {
 	auctionInfo *aip = (auctionInfo *)myMalloc(sizeof(auctionInfo));
 
-	aip->auction = myStrdup(auction);
+	aip->strings.chunks = NULL;
+	aip->strings.used = 0;
+	aip->deadStrings = 0;
+	aip->auction = arenaStrdup(&aip->strings, auction);
 	aip->title = NULL;
-	aip->bidPriceStr = priceFixup(myStrdup(bidPriceStr), NULL);
+	aip->bidPriceStr = priceFixup(arenaStrdup(&aip->strings, bidPriceStr), NULL);
 	aip->bidPrice = aip->bidPriceStr ? atof(aip->bidPriceStr) : -1;
 	aip->remain = 0;
 	aip->remainRaw = NULL;
 	aip->endTime = 0;
 	aip->latency = 0;
+	aip->latencySamples = 0;
 	aip->query = NULL;
 	aip->biduiid = NULL;
 	aip->bidstok = NULL;
 	aip->bidsrt = NULL;
+	aip->tokenTime = 0;
+	aip->tokenLogin = 0;
+	aip->tokenFailures = 0;
+	aip->tokenEvent = NULL;
+	aip->tokenWait = 0;
+	aip->account = account;
+	aip->bidUrl = NULL;
+	aip->bidLogUrl = NULL;
+	aip->bidUrlQuantity = 0;
+	aip->bidRequest = NULL;
 	aip->quantity = 0;
 	aip->quantityBid = 0;
 	aip->bids = 0;
 	aip->price = 0;
 	aip->shipping = NULL;
 	aip->currency = NULL;
+	aip->currencyCode = cc_none;
+	aip->minBid = 0;
 	aip->bidResult = -1;
 	aip->reserve = 0;
 	aip->won = -1;
+	aip->errorCount = 0;
+	aip->updates = 0;
+	aip->bidQuantity = 0;
 	aip->winning = 0;
+	aip->pollBids = 0;
+	aip->pollPrice = 0;
+	aip->pollTime = 0;
+	aip->bidRate = -1;
+	aip->etag = NULL;
+	aip->lastModified = NULL;
 	aip->auctionError = ae_none;
 	aip->auctionErrorDetail = NULL;
 	return aip;
@@ -293,47 +374,85 @@ freeAuction(auctionInfo *aip)
 {
 	if (!aip)
 		return;
-	free(aip->auction);
-	free(aip->title);
-	free(aip->bidPriceStr);
-	free(aip->remainRaw);
-	free(aip->query);
-	free(aip->biduiid);
-	free(aip->shipping);
-	free(aip->currency);
-	free(aip->auctionErrorDetail);
+	free(aip->bidUrl);
+	free(aip->bidLogUrl);
+	httpRelease(aip->bidRequest);
+	arenaFree(&aip->strings);
 	free(aip);
 }
 
 /*
- * compareAuctionInfo(): used to sort auctionInfo table
- *
- * returns (-1, 0, 1) if time remaining in p1 is (less than, equal to, greater
- * than) p2
+ * Set one of the arena strings of aip (see stringFields) to a copy of
+ * value, or NULL.  Unchanged values are not copied again, so pages that
+ * are parsed over and over do not grow the arena.  Setting a value may
+ * move the other strings, setting NULL never does.
  */
-int
-compareAuctionInfo(const void *p1, const void *p2)
+void
+setAuctionString(auctionInfo *aip, char **field, const char *value)
+{
+	if (*field == value || (*field && value && !strcmp(*field, value)))
+		return;
+	if (*field)
+		aip->deadStrings += strlen(*field) + 1;
+	*field = arenaStrdup(&aip->strings, value);
+	if (value && aip->deadStrings > DEAD_STRINGS &&
+	    2 * aip->deadStrings > aip->strings.used)
+		compactStrings(aip);
+}
+
+/*
+ * Copy the live strings to a new arena, release the old one.
+ */
+static void
+compactStrings(auctionInfo *aip)
 {
-	const auctionInfo * a1, * a2;
+	arena_t old = aip->strings;
+	size_t i;
 
-	a1 = *((const auctionInfo * const *)p1);
-	a2 = *((const auctionInfo * const *)p2);
+	aip->strings.chunks = NULL;
+	aip->strings.used = 0;
+	for (i = 0; i < sizeof(stringFields) / sizeof(stringFields[0]); ++i) {
+		char **field = (char **)((char *)aip + stringFields[i]);
+
+		*field = arenaStrdup(&aip->strings, *field);
+	}
+	arenaFree(&old);
+	aip->deadStrings = 0;
+}
+
+/*
+ * Sort key of an auction.  Sorting copies of the fields, side by side,
+ * does not chase an auctionInfo pointer for every comparison.
+ */
+typedef struct {
+	int winning;
+	time_t endTime;
+	double price;
+	const char *auction;
+	auctionInfo *aip;
+} sortKey_t;
+
+/*
+ * compareSortKeys(): used to sort auctionInfo table
+ *
+ * returns (-1, 0, 1) if p1 is to be sniped (before, same time as, after) p2
+ */
+static int
+compareSortKeys(const void *p1, const void *p2)
+{
+	const sortKey_t *k1 = (const sortKey_t *)p1;
+	const sortKey_t *k2 = (const sortKey_t *)p2;
 
-	/* auctions are the same? */
-	if (!strcmp(a1->auction, a2->auction))
-		return 0;
 	/* Currently winning bids go first */
-	if (a1->winning != a2->winning)
-		return a1->winning > a2->winning ? -1 : 1;
-	/* if end time is the same we compare the current price
-	 * and use the lower price first
-	 */
-	if (a1->endTime == a2->endTime)
-		/* comparison function must return an integer so we
-		 * convert the price to cent or whatever it's called
-		 */
-		return (int)((a1->price * 100.0) - (a2->price * 100.0));
-	return (int)(a1->endTime - a2->endTime);
+	if (k1->winning != k2->winning)
+		return k1->winning > k2->winning ? -1 : 1;
+	if (k1->endTime != k2->endTime)
+		return k1->endTime < k2->endTime ? -1 : 1;
+	/* if end time is the same use the lower price first */
+	if (k1->price != k2->price)
+		return k1->price < k2->price ? -1 : 1;
+	/* same auction twice must end up side by side */
+	return strcmp(k1->auction, k2->auction);
 }
 
 /*
@@ -360,8 +479,7 @@ void
 resetAuctionError(auctionInfo *aip)
 {
 	aip->auctionError = ae_none;
-	free(aip->auctionErrorDetail);
-	aip->auctionErrorDetail = NULL;
+	setAuctionString(aip, &aip->auctionErrorDetail, NULL);
 }
 
 /*
@@ -374,11 +492,56 @@ auctionError(auctionInfo *aip, enum auctionErrorCode pe, const char *details)
 {
 	resetAuctionError(aip);
 	aip->auctionError = pe;
+	metricError(pe);
 	if (details)
-		aip->auctionErrorDetail = myStrdup(details);
+		setAuctionString(aip, &aip->auctionErrorDetail, details);
 	return 1;
 }
 
+/*
+ * Add latency sample.  The latency estimate is an exponentially weighted
+ * moving average, new samples have a weight of 1/LATENCY_WEIGHT.
+ */
+#define LATENCY_WEIGHT 4
+
+void
+addLatency(auctionInfo *aip, usec_t sample)
+{
+	usec_t dev;
+
+	if (aip->latencySamples == 0)
+		aip->latency = sample;
+	else
+		aip->latency += (sample - aip->latency) / LATENCY_WEIGHT;
+	dev = sample > aip->latency ? sample - aip->latency : aip->latency - sample;
+	aip->latencyDev[aip->latencySamples++ % LATENCY_SAMPLES] = dev;
+}
+
+/*
+ * Latency to allow for when bidding: latency estimate plus a margin that
+ * covers 95% of the deviations of recent samples.
+ */
+usec_t
+bidLatency(const auctionInfo *aip)
+{
+	usec_t dev[LATENCY_SAMPLES];
+	int n = aip->latencySamples < LATENCY_SAMPLES ?
+		aip->latencySamples : LATENCY_SAMPLES;
+	int i, j;
+
+	if (n == 0)
+		return 0;
+	/* insertion sort, there are only a few samples */
+	for (i = 0; i < n; ++i) {
+		usec_t d = aip->latencyDev[i];
+
+		for (j = i; j > 0 && dev[j - 1] > d; --j)
+			dev[j] = dev[j - 1];
+		dev[j] = d;
+	}
+	return aip->latency + dev[(n * 95 + 99) / 100 - 1];
+}
+
 /*
  * isValidBidPrice(): Determine if the bid price is valid.
  *
@@ -392,72 +555,62 @@ auctionError(auctionInfo *aip, enum auctionErrorCode pe, const char *details)
 int
 isValidBidPrice(const auctionInfo *aip)
 {
-	double increment = 0.0;
 	static double EPSILON = 0.0001;
 
-	if (aip->quantityBid == aip->quantity && aip->winning == 0) {
-		int i;
-		double *increments = getIncrements(aip);
-
-		for (i = 0; increments[i] > 0; i += 2) {
-			if (aip->price < increments[i])
-				break;
-		}
-		increment = increments[i+1];
-	}
 	/*
 	 * Use EPSILON to avoid floating point
 	 * rounding errors on "=" comparison
 	 */
-	return aip->bidPrice >= (aip->price + increment - EPSILON);
+	return aip->bidPrice >= (minimumBid(aip) - EPSILON);
+}
+
+/*
+ * Lowest price a bid must have to be accepted now, see isValidBidPrice().
+ */
+double
+minimumBid(const auctionInfo *aip)
+{
+	if (aip->quantityBid == aip->quantity && aip->winning == 0)
+		return aip->price + findIncrement(&incrementTables[aip->currencyCode], aip->price);
+	return aip->price;
+}
+
+/*
+ * Currency code of a currency name from an auction page.
+ */
+enum currencyCode
+lookupCurrency(const char *currency)
+{
+	int i;
+
+	if (!currency)
+		return cc_none;
+	for (i = cc_AU; i <= cc_US; ++i) {
+		if (!strcmp(incrementTables[i].currency, currency))
+			return (enum currencyCode)i;
+	}
+	return cc_other;
 }
 
-static double *
-getIncrements(const auctionInfo *aip)
+/*
+ * Increment for a bid over price: table tp has pairs of threshold and
+ * increment, ordered by threshold, binary search for the first threshold
+ * above price.
+ */
+static double
+findIncrement(const incrementTable_t *tp, double price)
 {
-	if (!aip->currency)
-		return USIncrements;
-	switch (aip->currency[0]) {
-	case 'A':
-		if (!strcmp(aip->currency, "AU"))
-			return AUIncrements;
-		break;
-	case 'C':
-		if (!strcmp(aip->currency, "C"))
-			return CADIncrements;
-		if (!strcmp(aip->currency, "CHF"))
-			return CHFIncrements;
-		break;
-	case 'E':
-		if (!strcmp(aip->currency, "EUR"))
-			return EURIncrements;
-		break;
-	case 'G':
-		if (!strcmp(aip->currency, "GBP"))
-			return GBPIncrements;
-		break;
-	case 'H':
-		if (!strcmp(aip->currency, "HKD"))
-			return HKDIncrements;
-		break;
-	case 'N':
-		if (!strcmp(aip->currency, "NT"))
-			return NTIncrements;
-		break;
-	case 'R':
-		if (!strcmp(aip->currency, "RMB"))
-			return RMBIncrements;
-		break;
-	case 'S':
-		if (!strcmp(aip->currency, "SGD"))
-			return SGDIncrements;
-		break;
-	case 'U':
-		if (!strcmp(aip->currency, "US"))
-			return USIncrements;
-		break;
+	int lo = 0, hi = tp->steps;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (price < tp->increments[2 * mid])
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-	return defaultIncrements;
+	return tp->increments[2 * lo + 1];
 }
 
 /*
@@ -471,35 +624,25 @@ sortAuctions(auctionInfo **auctions, int numAuctions, int *quantity)
 {
 	int i, sawError = 0;
 
-	for (i = 0; i < numAuctions; ++i) {
-		int j;
-
-		if (options.debug)
-			logOpen(auctions[i], options.logdir);
-		for (j = 0; j < 3; ++j) {
-			if (j > 0)
-				printLog(stderr, "Retrying...\n");
-			/* delay to avoid ebay's "security measure" */
-			if(options.delay > 0)
-				sleep(options.delay);
-			if (!getInfo(auctions[i]))
-				break;
-			printAuctionError(auctions[i], stderr);
-			if (auctions[i]->auctionError == ae_unavailable) {
-				--j;	/* doesn't count as an attempt */
-				printLog(stderr, "%s: Will retry, sleeping for an hour\n", timestamp());
-				sleep(3600);
-			} else if (auctions[i]->auctionError == ae_login ||
-				   auctions[i]->auctionError == ae_captcha)
-				return 0;
-		}
-		printLog(stdout, "\n");
-	}
+	/* all info must be in before sorting */
+	if (getAllInfo(auctions, numAuctions))
+		return 0;
 	if (numAuctions > 1) {
+		sortKey_t *keys = (sortKey_t *)myMalloc((size_t)numAuctions * sizeof(sortKey_t));
+
 		printLog(stdout, "Sorting auctions...\n");
+		for (i = 0; i < numAuctions; ++i) {
+			keys[i].winning = auctions[i]->winning;
+			keys[i].endTime = auctions[i]->endTime;
+			keys[i].price = auctions[i]->price;
+			keys[i].auction = auctions[i]->auction;
+			keys[i].aip = auctions[i];
+		}
 		/* sort by status and end time */
-		qsort(auctions, (size_t)numAuctions,
-		      sizeof(auctionInfo *), compareAuctionInfo);
+		qsort(keys, (size_t)numAuctions, sizeof(sortKey_t), compareSortKeys);
+		for (i = 0; i < numAuctions; ++i)
+			auctions[i] = keys[i].aip;
+		free(keys);
 	}
 
 	/* get rid of obvious cases */
@@ -27,9 +27,24 @@
 #ifndef AUCTIONINFO_H_INCLUDED
 #define AUCTIONINFO_H_INCLUDED
 
+#include "arena.h"
 #include <stdio.h>
 #include <time.h>
 
+/* time interval in microseconds */
+#if defined(WIN32)
+typedef __int64 usec_t;
+#else
+typedef long long usec_t;
+#endif
+
+struct httpHandle;
+struct event;
+struct account;
+
+/* number of latency samples used for bid latency margin */
+#define LATENCY_SAMPLES 16
+
 /*
  * errors from parseError(), getAuctionInfo(), watchAuction()
  */
@@ -74,43 +89,91 @@ enum auctionErrorCode {
 };
 
 /*
- * All information associated with an auction
+ * Currencies with known bid increments, see lookupCurrency()
+ */
+enum currencyCode {
+	cc_none,	/* no currency seen yet, US increments */
+	cc_other,	/* increments not known */
+	cc_AU,
+	cc_C,
+	cc_CHF,
+	cc_EUR,
+	cc_GBP,
+	cc_HKD,
+	cc_NT,
+	cc_RMB,
+	cc_SGD,
+	cc_US
+};
+
+/*
+ * All information associated with an auction.  The strings marked
+ * (arena) live in strings, set them with setAuctionString().
  */
 typedef struct {
-	char *auction;	/* auction number */
-	char *title;	/* auction title */
-	char *bidPriceStr;/* price you want to bid */
+	char *auction;	/* auction number (arena) */
+	char *title;	/* auction title (arena) */
+	char *bidPriceStr;/* price you want to bid (arena) */
 	double bidPrice;/* price you want to bid (converted to double) */
 	time_t remain;	/* remaining seconds */
-	char *remainRaw;/* remaining time string, from ebay */
+	char *remainRaw;/* remaining time string, from ebay (arena) */
 	time_t endTime;	/* end time as calculated from remaining seconds */
-	time_t latency; /* latency from HTTP request to first page data */
-	char *query;	/* bid history query */
-	char *biduiid;	/* bid uiid */
-	char *bidstok;	/* bid stok */
-	char *bidsrt;	/* bid srt */
+	usec_t latency; /* latency from HTTP request to first page data (EWMA) */
+	usec_t latencyDev[LATENCY_SAMPLES];/* deviation of recent samples */
+	int latencySamples;/* number of latency samples */
+	char *query;	/* bid history query (arena) */
+	char *biduiid;	/* bid uiid (arena) */
+	char *bidstok;	/* bid stok (arena) */
+	char *bidsrt;	/* bid srt (arena) */
+	time_t tokenTime;/* when the bid tokens were fetched, 0 = never */
+	time_t tokenLogin;/* sign in the bid tokens were fetched with */
+	int tokenFailures;/* failed token fetches in a row */
+	struct event *tokenEvent;/* next token refresh, see scheduleTokens() */
+	int tokenWait;	/* watch() waits for the token fetch, see tokenFinish() */
+	struct account *account;/* account bidding, see account.c */
+	char *bidUrl;	/* bid request, built when the bid tokens arrive */
+	char *bidLogUrl;/* same, without secrets */
+	int bidUrlQuantity;/* quantity in bidUrl */
+	struct httpHandle *bidRequest;/* bidUrl, ready to send */
 	int quantity;	/* number of items available */
 	int quantityBid;/* number of items currently bid on */
 	int bids;	/* number of bids made */
 	double price;	/* current price */
-	char *shipping;	/* shipping cost */
-	char *currency;	/* currency used in auction */
+	char *shipping;	/* shipping cost (arena) */
+	const char *currency;/* currency used in auction, see internString() */
+	enum currencyCode currencyCode;/* currency, for bid increments */
+	double minBid;	/* minimum winning bid at last update */
 	int bidResult;	/* result code from bid (-1=no bid yet, 0=success, 1 = error) */
 	int reserve;	/* auction has reserve and it hasn't been met. */
 	int won;	/* number won (-1 = no clue, 0 or greater = actual #) */
+	int errorCount;	/* non-fatal errors while watching */
+	int updates;	/* successful updates while watching */
+	int bidQuantity;/* quantity of placed bid, outcome pending */
 	int winning;	/* number currently winning (-1 = no clue, 0 or greater = actual #) */
+	int pollBids;	/* bids at last update */
+	double pollPrice;/* price at last update */
+	time_t pollTime;/* time of last update */
+	double bidRate;	/* price changes per second (-1 = no clue) */
+	char *etag;	/* validators of last parsed history page (arena) */
+	char *lastModified;/* (arena) */
 	enum auctionErrorCode auctionError;/* error encountered while parsing */
-	char *auctionErrorDetail;/* details of error */
+	char *auctionErrorDetail;/* details of error (arena) */
+	arena_t strings;/* storage of the strings above */
+	size_t deadStrings;/* bytes of strings replaced since */
 } auctionInfo;
 
 extern auctionInfo *newAuctionInfo(const char *auction, const char *bidPriceStr);
 extern void freeAuction(auctionInfo *aip);
-extern int compareAuctionInfo(const void *p1, const void *p2);
+extern void setAuctionString(auctionInfo *aip, char **field, const char *value);
 extern void printAuctionError(auctionInfo *aip, FILE *fp);
 extern void resetAuctionError(auctionInfo *aip);
 extern int auctionError(auctionInfo *aip, enum auctionErrorCode pe,
 			const char *details);
+extern enum currencyCode lookupCurrency(const char *currency);
+extern double minimumBid(const auctionInfo *aip);
 extern int isValidBidPrice(const auctionInfo *aip);
+extern void addLatency(auctionInfo *aip, usec_t sample);
+extern usec_t bidLatency(const auctionInfo *aip);
 extern int sortAuctions(auctionInfo **auctions, int numAuctions, int *quantity);
 
 #endif /* AUCTIONINFO_H_INCLUDED */
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sealed data layout:
+ *
+ *	magic (8) | salt (16) | nonce (12) | ciphertext | HMAC (32)
+ *
+ * The HMAC covers everything before it.  PBKDF2 derives both the
+ * ChaCha20 key and the HMAC key from the passphrase and salt.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "cipher.h"
+#include "util.h"
+
+#if !defined(WIN32)
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+/* at least 32 bits */
+typedef unsigned long u32_t;
+
+#define U32(x) ((x) & 0xffffffffUL)
+#define ROTL(x, n) U32(((x) << (n)) | (U32(x) >> (32 - (n))))
+#define ROTR(x, n) U32((U32(x) >> (n)) | ((x) << (32 - (n))))
+
+static const char MAGIC[] = "esniper1";
+#define MAGIC_LEN 8
+#define SALT_LEN 16
+#define NONCE_LEN 12
+#define HEADER_LEN (MAGIC_LEN + SALT_LEN + NONCE_LEN)
+#define PBKDF2_ROUNDS 10000
+
+typedef struct {
+	u32_t state[8];
+	unsigned char block[64];
+	size_t used;		/* bytes in block */
+	unsigned long bits[2];	/* message length in bits, low and high */
+} sha256_t;
+
+static void sha256Init(sha256_t *sp);
+static void sha256Update(sha256_t *sp, const void *data, size_t len);
+static void sha256Final(sha256_t *sp, unsigned char *digest);
+static void sha256Block(sha256_t *sp, const unsigned char *p);
+static void pbkdf2(const char *pass, const unsigned char *salt, size_t saltLen, unsigned char *out, size_t outLen);
+static void chacha20(const unsigned char *key, const unsigned char *nonce, unsigned char *buf, size_t len);
+static void chachaBlock(const u32_t *in, unsigned char *out);
+static u32_t get32le(const unsigned char *p);
+static void randomBytes(unsigned char *buf, size_t len);
+
+static const u32_t K[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+	0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+	0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+	0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+	0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+	0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+	0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+	0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+void
+sha256(const void *data, size_t len, unsigned char *digest)
+{
+	sha256_t s;
+
+	sha256Init(&s);
+	sha256Update(&s, data, len);
+	sha256Final(&s, digest);
+}
+
+static void
+sha256Init(sha256_t *sp)
+{
+	sp->state[0] = 0x6a09e667UL;
+	sp->state[1] = 0xbb67ae85UL;
+	sp->state[2] = 0x3c6ef372UL;
+	sp->state[3] = 0xa54ff53aUL;
+	sp->state[4] = 0x510e527fUL;
+	sp->state[5] = 0x9b05688cUL;
+	sp->state[6] = 0x1f83d9abUL;
+	sp->state[7] = 0x5be0cd19UL;
+	sp->used = 0;
+	sp->bits[0] = sp->bits[1] = 0;
+}
+
+static void
+sha256Update(sha256_t *sp, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	while (len > 0) {
+		size_t n = 64 - sp->used;
+
+		if (n > len)
+			n = len;
+		memcpy(sp->block + sp->used, p, n);
+		sp->used += n;
+		p += n;
+		len -= n;
+		sp->bits[0] = U32(sp->bits[0] + (unsigned long)n * 8);
+		if (sp->bits[0] < (unsigned long)n * 8)
+			++sp->bits[1];
+		if (sp->used == 64) {
+			sha256Block(sp, sp->block);
+			sp->used = 0;
+		}
+	}
+}
+
+static void
+sha256Final(sha256_t *sp, unsigned char *digest)
+{
+	unsigned char pad[72];
+	unsigned long lo = sp->bits[0], hi = sp->bits[1];
+	size_t padLen = (sp->used < 56 ? 56 : 120) - sp->used;
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 4; ++i) {
+		pad[padLen + i] = (unsigned char)(hi >> (24 - 8 * i));
+		pad[padLen + 4 + i] = (unsigned char)(lo >> (24 - 8 * i));
+	}
+	sha256Update(sp, pad, padLen + 8);
+	for (i = 0; i < 32; ++i)
+		digest[i] = (unsigned char)(sp->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void
+sha256Block(sha256_t *sp, const unsigned char *p)
+{
+	u32_t w[64], a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = ((u32_t)p[4*i] << 24) | ((u32_t)p[4*i+1] << 16) |
+		       ((u32_t)p[4*i+2] << 8) | (u32_t)p[4*i+3];
+	for (; i < 64; ++i) {
+		u32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		u32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+
+		w[i] = U32(w[i-16] + s0 + w[i-7] + s1);
+	}
+	a = sp->state[0]; b = sp->state[1]; c = sp->state[2]; d = sp->state[3];
+	e = sp->state[4]; f = sp->state[5]; g = sp->state[6]; h = sp->state[7];
+	for (i = 0; i < 64; ++i) {
+		u32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+		u32_t ch = (e & f) ^ (~e & g);
+		u32_t t1 = U32(h + s1 + ch + K[i] + w[i]);
+		u32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+		u32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		u32_t t2 = U32(s0 + maj);
+
+		h = g; g = f; f = e; e = U32(d + t1);
+		d = c; c = b; b = a; a = U32(t1 + t2);
+	}
+	sp->state[0] = U32(sp->state[0] + a);
+	sp->state[1] = U32(sp->state[1] + b);
+	sp->state[2] = U32(sp->state[2] + c);
+	sp->state[3] = U32(sp->state[3] + d);
+	sp->state[4] = U32(sp->state[4] + e);
+	sp->state[5] = U32(sp->state[5] + f);
+	sp->state[6] = U32(sp->state[6] + g);
+	sp->state[7] = U32(sp->state[7] + h);
+}
+
+void
+hmacSha256(const unsigned char *key, size_t keyLen, const void *data, size_t len, unsigned char *mac)
+{
+	unsigned char k[64], pad[64], inner[SHA256_LEN];
+	sha256_t s;
+	int i;
+
+	memset(k, 0, sizeof(k));
+	if (keyLen > sizeof(k))
+		sha256(key, keyLen, k);
+	else
+		memcpy(k, key, keyLen);
+
+	for (i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x36;
+	sha256Init(&s);
+	sha256Update(&s, pad, sizeof(pad));
+	sha256Update(&s, data, len);
+	sha256Final(&s, inner);
+
+	for (i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x5c;
+	sha256Init(&s);
+	sha256Update(&s, pad, sizeof(pad));
+	sha256Update(&s, inner, sizeof(inner));
+	sha256Final(&s, mac);
+	memset(k, 0, sizeof(k));
+}
+
+/* PBKDF2-HMAC-SHA256 */
+static void
+pbkdf2(const char *pass, const unsigned char *salt, size_t saltLen, unsigned char *out, size_t outLen)
+{
+	size_t passLen = strlen(pass);
+	unsigned char *buf = (unsigned char *)myMalloc(saltLen + 4);
+	unsigned long blockNum;
+
+	memcpy(buf, salt, saltLen);
+	for (blockNum = 1; outLen > 0; ++blockNum) {
+		unsigned char u[SHA256_LEN], t[SHA256_LEN];
+		size_t n = outLen < SHA256_LEN ? outLen : SHA256_LEN;
+		int i, j;
+
+		buf[saltLen] = (unsigned char)(blockNum >> 24);
+		buf[saltLen + 1] = (unsigned char)(blockNum >> 16);
+		buf[saltLen + 2] = (unsigned char)(blockNum >> 8);
+		buf[saltLen + 3] = (unsigned char)blockNum;
+		hmacSha256((const unsigned char *)pass, passLen, buf, saltLen + 4, u);
+		memcpy(t, u, sizeof(t));
+		for (i = 1; i < PBKDF2_ROUNDS; ++i) {
+			hmacSha256((const unsigned char *)pass, passLen, u, sizeof(u), u);
+			for (j = 0; j < SHA256_LEN; ++j)
+				t[j] ^= u[j];
+		}
+		memcpy(out, t, n);
+		out += n;
+		outLen -= n;
+	}
+	free(buf);
+}
+
+static u32_t
+get32le(const unsigned char *p)
+{
+	return (u32_t)p[0] | ((u32_t)p[1] << 8) | ((u32_t)p[2] << 16) | ((u32_t)p[3] << 24);
+}
+
+#define QR(a, b, c, d) \
+	x[a] = U32(x[a] + x[b]); x[d] = ROTL(x[d] ^ x[a], 16); \
+	x[c] = U32(x[c] + x[d]); x[b] = ROTL(x[b] ^ x[c], 12); \
+	x[a] = U32(x[a] + x[b]); x[d] = ROTL(x[d] ^ x[a], 8); \
+	x[c] = U32(x[c] + x[d]); x[b] = ROTL(x[b] ^ x[c], 7)
+
+static void
+chachaBlock(const u32_t *in, unsigned char *out)
+{
+	u32_t x[16];
+	int i;
+
+	memcpy(x, in, sizeof(x));
+	for (i = 0; i < 10; ++i) {
+		QR(0, 4, 8, 12); QR(1, 5, 9, 13); QR(2, 6, 10, 14); QR(3, 7, 11, 15);
+		QR(0, 5, 10, 15); QR(1, 6, 11, 12); QR(2, 7, 8, 13); QR(3, 4, 9, 14);
+	}
+	for (i = 0; i < 16; ++i) {
+		u32_t v = U32(x[i] + in[i]);
+
+		out[4*i] = (unsigned char)v;
+		out[4*i+1] = (unsigned char)(v >> 8);
+		out[4*i+2] = (unsigned char)(v >> 16);
+		out[4*i+3] = (unsigned char)(v >> 24);
+	}
+}
+
+/* RFC 7539 ChaCha20, block counter starts at 1 */
+static void
+chacha20(const unsigned char *key, const unsigned char *nonce, unsigned char *buf, size_t len)
+{
+	u32_t in[16];
+	unsigned char stream[64];
+	int i;
+
+	in[0] = 0x61707865UL; in[1] = 0x3320646eUL;
+	in[2] = 0x79622d32UL; in[3] = 0x6b206574UL;
+	for (i = 0; i < 8; ++i)
+		in[4 + i] = get32le(key + 4 * i);
+	in[12] = 1;
+	for (i = 0; i < 3; ++i)
+		in[13 + i] = get32le(nonce + 4 * i);
+
+	while (len > 0) {
+		size_t n = len < 64 ? len : 64;
+		size_t j;
+
+		chachaBlock(in, stream);
+		for (j = 0; j < n; ++j)
+			buf[j] ^= stream[j];
+		buf += n;
+		len -= n;
+		in[12] = U32(in[12] + 1);
+	}
+	memset(stream, 0, sizeof(stream));
+}
+
+static void
+randomBytes(unsigned char *buf, size_t len)
+{
+	size_t i = 0;
+#if !defined(WIN32)
+	FILE *fp = fopen("/dev/urandom", "rb");
+
+	if (fp) {
+		i = fread(buf, 1, len, fp);
+		fclose(fp);
+	}
+#endif
+	if (i < len) {
+		unsigned char seed[SHA256_LEN];
+		usec_t now = usecTime();
+
+		/* no random device, salt and nonce only need to be unique */
+		sha256(&now, sizeof(now), seed);
+		for (; i < len; ++i)
+			buf[i] = seed[i % SHA256_LEN] ^ (unsigned char)rand();
+	}
+}
+
+unsigned char *
+sealData(const char *pass, const void *data, size_t len, size_t *outLen)
+{
+	unsigned char keys[64];
+	unsigned char *out = (unsigned char *)myMalloc(HEADER_LEN + len + SHA256_LEN);
+
+	memcpy(out, MAGIC, MAGIC_LEN);
+	randomBytes(out + MAGIC_LEN, SALT_LEN + NONCE_LEN);
+	pbkdf2(pass, out + MAGIC_LEN, SALT_LEN, keys, sizeof(keys));
+	memcpy(out + HEADER_LEN, data, len);
+	chacha20(keys, out + MAGIC_LEN + SALT_LEN, out + HEADER_LEN, len);
+	hmacSha256(keys + 32, 32, out, HEADER_LEN + len, out + HEADER_LEN + len);
+	memset(keys, 0, sizeof(keys));
+	*outLen = HEADER_LEN + len + SHA256_LEN;
+	return out;
+}
+
+char *
+openData(const char *pass, const unsigned char *data, size_t len, size_t *outLen)
+{
+	unsigned char keys[64], mac[SHA256_LEN];
+	unsigned char diff = 0;
+	char *out;
+	size_t i;
+
+	if (len < HEADER_LEN + SHA256_LEN || memcmp(data, MAGIC, MAGIC_LEN))
+		return NULL;
+	len -= HEADER_LEN + SHA256_LEN;
+	pbkdf2(pass, data + MAGIC_LEN, SALT_LEN, keys, sizeof(keys));
+	hmacSha256(keys + 32, 32, data, HEADER_LEN + len, mac);
+	for (i = 0; i < SHA256_LEN; ++i)
+		diff |= mac[i] ^ data[HEADER_LEN + len + i];
+	if (diff) {
+		memset(keys, 0, sizeof(keys));
+		return NULL;
+	}
+	out = (char *)myMalloc(len + 1);
+	memcpy(out, data + HEADER_LEN, len);
+	chacha20(keys, data + MAGIC_LEN + SALT_LEN, (unsigned char *)out, len);
+	out[len] = '\0';
+	memset(keys, 0, sizeof(keys));
+	if (outLen)
+		*outLen = len;
+	return out;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CIPHER_H_INCLUDED
+#define CIPHER_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * Small, self-contained crypto for files esniper keeps on disk:
+ * ChaCha20 encryption, authenticated with HMAC-SHA256, key derived from
+ * a passphrase with PBKDF2.
+ */
+#define SHA256_LEN 32
+
+extern void sha256(const void *data, size_t len, unsigned char *digest);
+extern void hmacSha256(const unsigned char *key, size_t keyLen, const void *data, size_t len, unsigned char *mac);
+
+/*
+ * Encrypt data.  returns malloc'ed result, length in *outLen.
+ */
+extern unsigned char *sealData(const char *pass, const void *data, size_t len, size_t *outLen);
+
+/*
+ * Decrypt result of sealData().  returns malloc'ed, null-terminated
+ * data, or NULL if pass is wrong or data has been tampered with.
+ */
+extern char *openData(const char *pass, const unsigned char *data, size_t len, size_t *outLen);
+
+#endif /* CIPHER_H_INCLUDED */
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Clock synchronisation with eBay.
+ *
+ * The Date header of a response has been generated by the server between
+ * sending the request and receiving the first byte of the response.  It
+ * has a resolution of one second, so server time at that moment is in
+ * [Date, Date + 1).  Each response therefore gives an interval for the
+ * offset (server time - local time):
+ *
+ *	[Date - received, Date + 1 - sent]
+ *
+ * Intervals of all responses are intersected, so the estimate gets more
+ * accurate with each sample.  Between samples, the interval is widened
+ * by the maximum drift of the local clock.  If a sample does not overlap
+ * the current interval (clock was set, for instance), estimation starts
+ * again from this sample.
+ *
+ * Drift is estimated from the change of the offset over at least an hour.
+ */
+
+#include "clocksync.h"
+#include "esniper.h"
+#include "util.h"
+
+/* maximum local clock drift, microseconds per second */
+static const usec_t MAX_DRIFT = 200;
+/* minimum time for drift estimation, seconds */
+static const usec_t DRIFT_BASE = 3600;
+
+static int samples = 0;
+static usec_t offsetLow = 0;	/* offset interval */
+static usec_t offsetHigh = 0;
+static usec_t offsetTime = 0;	/* local time of interval */
+static usec_t baseOffset = 0;	/* offset at start of drift estimation */
+static usec_t baseTime = 0;
+static double drift = 0;	/* drift, microseconds per microsecond */
+
+static void widen(usec_t now);
+
+/*
+ * Widen offset interval to local time now.
+ */
+static void
+widen(usec_t now)
+{
+	usec_t elapsed = now - offsetTime;
+	usec_t change = (usec_t)(drift * (double)elapsed);
+	usec_t maxChange = elapsed / 1000000 * MAX_DRIFT;
+
+	if (elapsed <= 0)
+		return;
+	offsetLow += change - maxChange;
+	offsetHigh += change + maxChange;
+	offsetTime = now;
+}
+
+/*
+ * Add sample: response with Date header serverTime, request sent and
+ * first byte received at the given local times.
+ */
+void
+clockSample(time_t serverTime, usec_t sent, usec_t received)
+{
+	usec_t server = (usec_t)serverTime * 1000000;
+	usec_t low = server - received;
+	usec_t high = server + 1000000 - sent;
+
+	if (serverTime <= 0 || received < sent)
+		return;
+
+	if (samples > 0) {
+		widen(received);
+		if (low > offsetHigh || high < offsetLow) {
+			log(("clockSample(): offset %ld..%ld usec does not match %ld..%ld usec, restarting", (long)low, (long)high, (long)offsetLow, (long)offsetHigh));
+			samples = 0;
+		}
+	}
+	if (samples == 0) {
+		offsetLow = low;
+		offsetHigh = high;
+		offsetTime = received;
+		baseOffset = (low + high) / 2;
+		baseTime = received;
+		drift = 0;
+	} else {
+		if (low > offsetLow)
+			offsetLow = low;
+		if (high < offsetHigh)
+			offsetHigh = high;
+		if (received - baseTime >= DRIFT_BASE * 1000000) {
+			drift = (double)(clockOffset() - baseOffset) /
+				(double)(received - baseTime);
+			if (drift > (double)MAX_DRIFT / 1000000)
+				drift = (double)MAX_DRIFT / 1000000;
+			else if (drift < -(double)MAX_DRIFT / 1000000)
+				drift = -(double)MAX_DRIFT / 1000000;
+		}
+	}
+	++samples;
+	log(("clockSample(): offset %ld usec +/- %ld usec, drift %.1f ppm, %d samples", (long)clockOffset(), (long)clockError(), drift * 1000000, samples));
+}
+
+int
+clockOffsetKnown(void)
+{
+	return samples > 0;
+}
+
+/*
+ * Best estimate of offset (server time - local time).
+ */
+usec_t
+clockOffset(void)
+{
+	usec_t now = usecTime();
+
+	if (samples == 0)
+		return 0;
+	return (offsetLow + offsetHigh) / 2 +
+		(usec_t)(drift * (double)(now - offsetTime));
+}
+
+/*
+ * Maximum error of clockOffset().
+ */
+usec_t
+clockError(void)
+{
+	usec_t elapsed = usecTime() - offsetTime;
+
+	if (samples == 0)
+		return 0;
+	return (offsetHigh - offsetLow) / 2 +
+		(elapsed > 0 ? elapsed / 1000000 * MAX_DRIFT : 0);
+}
+
+/*
+ * Convert server time to local time.
+ */
+time_t
+serverToLocal(time_t serverTime)
+{
+	usec_t offset = clockOffset();
+
+	/* round to nearest second */
+	return serverTime - (time_t)((offset >= 0 ? offset + 500000 : offset - 500000) / 1000000);
+}
@@ -0,0 +1,938 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Daemon mode.
+ *
+ * Auctions are sniped as usual, but esniper does not exit when they are
+ * done.  The auction file is watched (inotify where available, otherwise
+ * its modification time is polled) and reloaded when it changes: only
+ * auctions that were added, removed or got a new price are touched, the
+ * others keep their state and are not fetched again.  Commands are
+ * accepted on a UNIX socket, one per line:
+ *
+ *	add <auction> <price>	snipe another auction
+ *	remove <auction>	stop sniping an auction
+ *	status			list auctions
+ *	reload			reload the auction file now
+ *	metrics			timings and counters, Prometheus text format
+ *	quit			stop, auctions bid on are still finished
+ *
+ * Each reply ends with a line "OK" or "ERROR <message>".
+ *
+ * Added and reloaded auctions are sniped with the main account, the
+ * auctions of other accounts (see account.c) are kept like added ones.
+ */
+
+#include "daemon.h"
+#include "account.h"
+#include "auction.h"
+#include "auctionfile.h"
+#include "esniper.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "util.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(WIN32)
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+/* auction known to the daemon */
+typedef struct {
+	auctionInfo *aip;
+	int fromFile;		/* listed in auction file */
+	int seen;		/* found by current reload */
+} entry_t;
+
+/* auction number, for matching the auction file with entries */
+typedef struct {
+	const char *auction;
+	size_t len;
+	int index;		/* of line or entry */
+} auctionKey_t;
+
+/* matchLines() result for a repeated line */
+#define MATCH_REPEATED (-2)
+
+/* control connection */
+typedef struct {
+	int fd;
+	size_t len;
+	char buf[1024];
+	char *out;		/* output the socket did not take yet */
+	size_t outLen;
+	size_t outSize;
+	int failed;		/* output lost, close the connection */
+} client_t;
+
+/* auction file is polled every FILE_POLL seconds without inotify */
+static const time_t FILE_POLL = 5;
+
+/* output queued for a client that does not read it, before giving up */
+static const size_t MAX_CLIENT_OUTPUT = 1024 * 1024;
+
+static entry_t *entries = NULL;
+static int numEntries = 0;
+static int entriesSize = 0;
+
+static client_t **clients = NULL;
+static int numClients = 0;
+
+static char *controlPath = NULL;
+static int controlFd = -1;
+static int notifyFd = -1;
+static char *fileBase = NULL;
+static time_t fileMtime = 0;
+static int stopping = 0;
+static int nextDelay = 0;
+
+static char *defaultControl(void);
+static int openControl(void);
+static void acceptClient(int fd, void *data);
+static void readClient(int fd, void *data);
+static void closeClient(client_t *cp);
+static void command(client_t *cp, char *line);
+static void reply(client_t *cp, const char *fmt, ...);
+static void sendClient(client_t *cp, const char *data, size_t len);
+static void flushClient(int fd, void *data);
+static void cmdAdd(client_t *cp, char *args);
+static void cmdRemove(client_t *cp, char *args);
+static void cmdStatus(client_t *cp);
+static void watchFile(void);
+static void unwatchFile(void);
+static void fileChanged(int fd, void *data);
+static void filePoll(void *data);
+static time_t fileTime(void);
+static int reload(void);
+static int *matchLines(const auctionFile_t *afp);
+static int compareAuctions(const auctionKey_t *k1, const auctionKey_t *k2);
+static int compareKeys(const void *p1, const void *p2);
+static int samePrice(const char *bidPriceStr, const auctionLine_t *lp);
+static int findEntry(const char *auction);
+static entry_t *addEntry(auctionInfo *aip, int fromFile);
+static int dropEntry(int i);
+static int changeEntry(int i, auctionInfo *aip);
+static void startEntry(entry_t *ep);
+static void stopDaemon(void);
+
+int
+runDaemon(auctionInfo **auctions, int numAuctions)
+{
+	int i;
+
+	controlPath = options.control ? myStrdup(options.control) : defaultControl();
+	if (openControl()) {
+		for (i = 0; i < numAuctions; ++i)
+			freeAuction(auctions[i]);
+		free(controlPath);
+		return 0;
+	}
+	printLog(stdout, "Daemon control socket is %s\n", controlPath);
+
+	for (i = 0; i < numAuctions; ++i)
+		startEntry(addEntry(auctions[i], 0));
+
+	/* remember entries from the auction file, including the ones
+	 * dropped by sortAuctions(), so reloads only see real changes.
+	 */
+	if (options.auctfilename) {
+		auctionFile_t af;
+		int n = loadAuctionFile(options.auctfilename, &af);
+
+		if (n > 0) {
+			int *match = matchLines(&af);
+
+			for (i = 0; i < n; ++i) {
+				if (match[i] == MATCH_REPEATED)
+					continue;
+				if (match[i] < 0)
+					(void)addEntry(newLineAuction(&af.lines[i]), 1);
+				else
+					entries[match[i]].fromFile = 1;
+			}
+			free(match);
+		}
+		unloadAuctionFile(&af);
+		fileMtime = fileTime();
+		watchFile();
+	}
+
+	runEvents();
+
+	for (i = 0; i < numEntries; ++i)
+		freeAuction(entries[i].aip);
+	free(entries);
+	entries = NULL;
+	numEntries = entriesSize = 0;
+	free(controlPath);
+	controlPath = NULL;
+	return snipeWon();
+}
+
+/*
+ * Default control socket is next to the auction file, or in $HOME.
+ */
+static char *
+defaultControl(void)
+{
+	const char *home;
+
+	if (options.auctfilename)
+		return myStrdup2(options.auctfilename, ".ctl");
+	home = getenv("HOME");
+	return myStrdup2(home ? home : ".", "/.esniper.ctl");
+}
+
+/*
+ * Create the control socket.  A socket left behind by an esniper that
+ * is gone is removed, one that accepts connections is not.
+ *
+ * returns 0 on success, 1 on error
+ */
+static int
+openControl(void)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(controlPath) >= sizeof(addr.sun_path)) {
+		printLog(stderr, "Control socket name %s is too long\n", controlPath);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, controlPath);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		printLog(stderr, "Cannot create control socket: %s\n", strerror(errno));
+		return 1;
+	}
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		printLog(stderr, "Control socket %s is in use, is another esniper running?\n", controlPath);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	if (!lstat(controlPath, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printLog(stderr, "%s exists and is not a socket\n", controlPath);
+			return 1;
+		}
+		(void)unlink(controlPath);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 5)) {
+		printLog(stderr, "Cannot create control socket %s: %s\n", controlPath, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	controlFd = fd;
+	watchFd(fd, acceptClient, NULL);
+	return 0;
+}
+
+static void
+acceptClient(int fd, void *data)
+{
+	client_t *cp;
+	int cfd = accept(fd, NULL, NULL);
+
+	if (cfd < 0) {
+		log(("accept failed: %s\n", strerror(errno)));
+		return;
+	}
+	(void)fcntl(cfd, F_SETFD, FD_CLOEXEC);
+	/* replies must not block the event loop, see sendClient() */
+	(void)fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+	cp = (client_t *)myMalloc(sizeof(client_t));
+	cp->fd = cfd;
+	cp->len = 0;
+	cp->out = NULL;
+	cp->outLen = cp->outSize = 0;
+	cp->failed = 0;
+	clients = (client_t **)myRealloc(clients, (size_t)(numClients + 1) * sizeof(client_t *));
+	clients[numClients++] = cp;
+	watchFd(cfd, readClient, cp);
+}
+
+/*
+ * Read from a control connection, run each complete line.
+ */
+static void
+readClient(int fd, void *data)
+{
+	client_t *cp = (client_t *)data;
+	ssize_t n = read(fd, cp->buf + cp->len, sizeof(cp->buf) - cp->len);
+	char *line, *nl;
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n <= 0) {
+		closeClient(cp);
+		return;
+	}
+	cp->len += (size_t)n;
+	line = cp->buf;
+	while ((nl = memchr(line, '\n', cp->len - (size_t)(line - cp->buf)))) {
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		command(cp, line);
+		/* quit closes all connections */
+		if (stopping)
+			return;
+		if (cp->failed) {
+			closeClient(cp);
+			return;
+		}
+		line = nl + 1;
+	}
+	cp->len -= (size_t)(line - cp->buf);
+	memmove(cp->buf, line, cp->len);
+	if (cp->len == sizeof(cp->buf)) {
+		reply(cp, "ERROR line too long\n");
+		closeClient(cp);
+	}
+}
+
+static void
+closeClient(client_t *cp)
+{
+	int i;
+
+	unwatchFd(cp->fd);
+	close(cp->fd);
+	for (i = 0; i < numClients; ++i) {
+		if (clients[i] == cp) {
+			clients[i] = clients[--numClients];
+			break;
+		}
+	}
+	free(cp->out);
+	free(cp);
+}
+
+static void
+command(client_t *cp, char *line)
+{
+	char *cmd, *args;
+
+	while (isspace((unsigned char)*line))
+		++line;
+	cmd = line;
+	while (*line && !isspace((unsigned char)*line))
+		++line;
+	if (*line)
+		*line++ = '\0';
+	args = line;
+	log(("daemon command: %s %s\n", cmd, args));
+	useAccount(NULL);
+
+	if (!*cmd)
+		return;
+	if (!strcmp(cmd, "add"))
+		cmdAdd(cp, args);
+	else if (!strcmp(cmd, "remove"))
+		cmdRemove(cp, args);
+	else if (!strcmp(cmd, "status"))
+		cmdStatus(cp);
+	else if (!strcmp(cmd, "reload")) {
+		if (!options.auctfilename)
+			reply(cp, "ERROR no auction file\n");
+		else if (reload())
+			reply(cp, "ERROR cannot read %s\n", options.auctfilename);
+		else
+			reply(cp, "OK\n");
+	} else if (!strcmp(cmd, "metrics")) {
+		char *text = metricsText();
+
+		sendClient(cp, text, strlen(text));
+		free(text);
+		reply(cp, "OK\n");
+	} else if (!strcmp(cmd, "quit")) {
+		reply(cp, "OK\n");
+		stopDaemon();
+	} else
+		reply(cp, "ERROR unknown command %s\n", cmd);
+}
+
+static void
+reply(client_t *cp, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list arglist;
+	int len;
+
+	va_start(arglist, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, arglist);
+	va_end(arglist);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(buf))
+		len = (int)sizeof(buf) - 1;
+	sendClient(cp, buf, (size_t)len);
+}
+
+/*
+ * Send to a client without blocking.  What the socket does not take now
+ * is queued and sent by flushClient() when the socket is writable.  A
+ * client that lets too much output pile up is marked failed.
+ */
+static void
+sendClient(client_t *cp, const char *data, size_t len)
+{
+	if (cp->failed)
+		return;
+	if (cp->outLen == 0) {
+		ssize_t n = write(cp->fd, data, len);
+
+		if (n < 0) {
+			/* a client that went away is noticed by readClient() */
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return;
+			n = 0;
+		}
+		data += n;
+		len -= (size_t)n;
+		if (len == 0)
+			return;
+		watchFdWrite(cp->fd, flushClient, cp);
+	}
+	if (cp->outLen + len > MAX_CLIENT_OUTPUT) {
+		log(("control connection %d does not read its output, closing\n", cp->fd));
+		cp->failed = 1;
+		unwatchFdWrite(cp->fd);
+		cp->outLen = 0;
+		return;
+	}
+	if (cp->outLen + len > cp->outSize) {
+		cp->outSize = cp->outLen + len;
+		cp->out = (char *)myRealloc(cp->out, cp->outSize);
+	}
+	memcpy(cp->out + cp->outLen, data, len);
+	cp->outLen += len;
+}
+
+static void
+flushClient(int fd, void *data)
+{
+	client_t *cp = (client_t *)data;
+	ssize_t n = write(fd, cp->out, cp->outLen);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			closeClient(cp);
+		return;
+	}
+	cp->outLen -= (size_t)n;
+	memmove(cp->out, cp->out + n, cp->outLen);
+	if (cp->outLen == 0)
+		unwatchFdWrite(fd);
+}
+
+/*
+ * add <auction> <price>
+ */
+static void
+cmdAdd(client_t *cp, char *args)
+{
+	char *auction = strtok(args, " \t");
+	char *price = strtok(NULL, " \t");
+	auctionInfo *aip;
+	const char *s;
+	int i;
+
+	if (!auction || !price || strtok(NULL, " \t")) {
+		reply(cp, "ERROR usage: add <auction> <price>\n");
+		return;
+	}
+	for (s = auction; isdigit((unsigned char)*s); ++s)
+		;
+	if (*s) {
+		reply(cp, "ERROR invalid auction number %s\n", auction);
+		return;
+	}
+	aip = newAuctionInfo(auction, price);
+	if (!aip->bidPriceStr || aip->bidPrice <= 0) {
+		reply(cp, "ERROR invalid price %s\n", price);
+		freeAuction(aip);
+		return;
+	}
+	nextDelay = 0;
+	if ((i = findEntry(auction)) < 0)
+		startEntry(addEntry(aip, 0));
+	else if (snipeActive(entries[i].aip)) {
+		reply(cp, "ERROR already sniping auction %s\n", auction);
+		freeAuction(aip);
+		return;
+	} else
+		(void)changeEntry(i, aip);
+	printLog(stdout, "Auction %s added, price %s\n", aip->auction, aip->bidPriceStr);
+	reply(cp, "OK\n");
+}
+
+/*
+ * remove <auction>
+ */
+static void
+cmdRemove(client_t *cp, char *args)
+{
+	char *auction = strtok(args, " \t");
+	int i;
+
+	if (!auction || strtok(NULL, " \t")) {
+		reply(cp, "ERROR usage: remove <auction>\n");
+		return;
+	}
+	if ((i = findEntry(auction)) < 0)
+		reply(cp, "ERROR unknown auction %s\n", auction);
+	else if (dropEntry(i))
+		reply(cp, "ERROR bid on auction %s placed already\n", auction);
+	else {
+		printLog(stdout, "Auction %s removed\n", auction);
+		reply(cp, "OK\n");
+	}
+}
+
+/*
+ * status: one line per auction, with number, price, state and title.
+ */
+static void
+cmdStatus(client_t *cp)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < numEntries; ++i) {
+		const auctionInfo *aip = entries[i].aip;
+		const char *state;
+
+		if (snipeActive(aip))
+			state = aip->bidQuantity > 0 ? "bid" : "active";
+		else if (aip->won > 0)
+			state = "won";
+		else
+			state = "done";
+		reply(cp, "%s %s %s %s %ld %s\n", aip->auction,
+		      aip->bidPriceStr, state,
+		      entries[i].fromFile ? "file" : "manual",
+		      aip->endTime ? (long)(aip->endTime - now) : -1L,
+		      aip->title ? aip->title : "");
+	}
+	reply(cp, "OK\n");
+}
+
+/*
+ * Watch the auction file for changes.  Editors often replace the file,
+ * so the directory is watched.
+ */
+static void
+watchFile(void)
+{
+	char *tmp = myStrdup(options.auctfilename);
+
+	fileBase = myStrdup(basename(tmp));
+	free(tmp);
+#if defined(__linux__)
+	if ((notifyFd = inotify_init()) >= 0) {
+		char *dir;
+
+		tmp = myStrdup(options.auctfilename);
+		dir = dirname(tmp);
+		if (inotify_add_watch(notifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			log(("inotify_add_watch %s: %s\n", dir, strerror(errno)));
+			close(notifyFd);
+			notifyFd = -1;
+		}
+		free(tmp);
+	}
+	if (notifyFd >= 0) {
+		(void)fcntl(notifyFd, F_SETFD, FD_CLOEXEC);
+		watchFd(notifyFd, fileChanged, NULL);
+		return;
+	}
+#endif
+	(void)scheduleEvent(time(NULL) + FILE_POLL, filePoll, &fileMtime);
+}
+
+static void
+unwatchFile(void)
+{
+	if (notifyFd >= 0) {
+		unwatchFd(notifyFd);
+		close(notifyFd);
+		notifyFd = -1;
+	}
+	cancelEvents(&fileMtime);
+	free(fileBase);
+	fileBase = NULL;
+}
+
+/*
+ * inotify event for the auction file's directory.
+ */
+static void
+fileChanged(int fd, void *data)
+{
+#if defined(__linux__)
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	ssize_t n = read(fd, u.buf, sizeof(u.buf));
+	ssize_t i;
+	int changed = 0;
+
+	for (i = 0; i < n; ) {
+		const struct inotify_event *ep = (const struct inotify_event *)(u.buf + i);
+
+		if (ep->len && !strcmp(ep->name, fileBase))
+			changed = 1;
+		i += (ssize_t)(sizeof(struct inotify_event) + ep->len);
+	}
+	if (changed)
+		(void)reload();
+#endif
+}
+
+/*
+ * Poll auction file for changes.
+ */
+static void
+filePoll(void *data)
+{
+	time_t mtime = fileTime();
+
+	if (mtime != fileMtime)
+		(void)reload();
+	(void)scheduleEvent(time(NULL) + FILE_POLL, filePoll, &fileMtime);
+}
+
+static time_t
+fileTime(void)
+{
+	struct stat st;
+
+	return stat(options.auctfilename, &st) ? 0 : st.st_mtime;
+}
+
+/*
+ * Read the auction file again and apply the differences.
+ *
+ * returns 0 on success, 1 if the file cannot be read
+ */
+static int
+reload(void)
+{
+	auctionFile_t af;
+	int *match = NULL;
+	int added = 0, removed = 0, changed = 0;
+	int i, n;
+
+	useAccount(NULL);
+	fileMtime = fileTime();
+	n = loadAuctionFile(options.auctfilename, &af);
+	if (n < 0) {
+		unloadAuctionFile(&af);
+		printLog(stderr, "Auction file %s not reloaded\n", options.auctfilename);
+		return 1;
+	}
+	nextDelay = 0;
+	for (i = 0; i < numEntries; ++i)
+		entries[i].seen = 0;
+
+	if (n > 0)
+		match = matchLines(&af);
+	for (i = 0; i < n; ++i) {
+		const auctionLine_t *lp = &af.lines[i];
+		int j = match[i];
+		auctionInfo *aip;
+
+		if (j == MATCH_REPEATED)
+			continue;
+		if (j < 0) {
+			startEntry(addEntry(newLineAuction(lp), 1));
+			entries[numEntries - 1].seen = 1;
+			++added;
+			continue;
+		}
+		entries[j].fromFile = 1;
+		entries[j].seen = 1;
+		if (samePrice(entries[j].aip->bidPriceStr, lp))
+			continue;
+		aip = newLineAuction(lp);
+		if (changeEntry(j, aip)) {
+			printLog(stderr, "Auction %s: bid placed already, price not changed\n", aip->auction);
+			freeAuction(aip);
+		} else
+			++changed;
+	}
+	free(match);
+	unloadAuctionFile(&af);
+
+	for (i = numEntries - 1; i >= 0; --i) {
+		if (!entries[i].fromFile || entries[i].seen)
+			continue;
+		if (dropEntry(i))
+			printLog(stderr, "Auction %s: bid placed already, not removed\n", entries[i].aip->auction);
+		else
+			++removed;
+	}
+	printLog(stdout, "Auction file reloaded: %d added, %d removed, %d changed\n", added, removed, changed);
+	return 0;
+}
+
+/*
+ * Match the lines of an auction file with the entries: both are sorted
+ * by auction number and merged, instead of searching the entries for
+ * every line.
+ *
+ * returns for each line the index of its entry, -1 for a new auction or
+ * MATCH_REPEATED if an earlier line has the same auction.
+ */
+static int *
+matchLines(const auctionFile_t *afp)
+{
+	int n = afp->numLines;
+	int *match = (int *)myMalloc((size_t)n * sizeof(int));
+	auctionKey_t *lineKeys = (auctionKey_t *)myMalloc((size_t)n * sizeof(auctionKey_t));
+	auctionKey_t *entryKeys = (auctionKey_t *)myMalloc((size_t)(numEntries + 1) * sizeof(auctionKey_t));
+	int i, j;
+
+	for (i = 0; i < n; ++i) {
+		lineKeys[i].auction = afp->lines[i].auction;
+		lineKeys[i].len = afp->lines[i].auctionLen;
+		lineKeys[i].index = i;
+	}
+	for (i = 0; i < numEntries; ++i) {
+		entryKeys[i].auction = entries[i].aip->auction;
+		entryKeys[i].len = strlen(entries[i].aip->auction);
+		entryKeys[i].index = i;
+	}
+	qsort(lineKeys, (size_t)n, sizeof(auctionKey_t), compareKeys);
+	qsort(entryKeys, (size_t)numEntries, sizeof(auctionKey_t), compareKeys);
+
+	for (i = j = 0; i < n; ++i) {
+		const auctionKey_t *kp = &lineKeys[i];
+
+		/* equal keys are sorted by line, so the first line wins */
+		if (i > 0 && !compareAuctions(kp, kp - 1)) {
+			match[kp->index] = MATCH_REPEATED;
+			continue;
+		}
+		while (j < numEntries && compareAuctions(&entryKeys[j], kp) < 0)
+			++j;
+		if (j < numEntries && !compareAuctions(&entryKeys[j], kp))
+			match[kp->index] = entryKeys[j].index;
+		else
+			match[kp->index] = -1;
+	}
+	free(lineKeys);
+	free(entryKeys);
+	return match;
+}
+
+/*
+ * Order of auction numbers: shorter numbers first, then by digits.
+ */
+static int
+compareAuctions(const auctionKey_t *k1, const auctionKey_t *k2)
+{
+	if (k1->len != k2->len)
+		return k1->len < k2->len ? -1 : 1;
+	return memcmp(k1->auction, k2->auction, k1->len);
+}
+
+/* qsort() order, equal auction numbers are ordered by index */
+static int
+compareKeys(const void *p1, const void *p2)
+{
+	const auctionKey_t *k1 = (const auctionKey_t *)p1;
+	const auctionKey_t *k2 = (const auctionKey_t *)p2;
+	int ret = compareAuctions(k1, k2);
+
+	return ret ? ret : k1->index - k2->index;
+}
+
+/*
+ * Bid price of an auction is the price of an auction line, after
+ * priceFixup().
+ */
+static int
+samePrice(const char *bidPriceStr, const auctionLine_t *lp)
+{
+	char buf[32];
+	char *price = lp->priceLen < sizeof(buf) ? buf : (char *)myMalloc(lp->priceLen + 1);
+	int ret;
+
+	memcpy(price, lp->price, lp->priceLen);
+	price[lp->priceLen] = '\0';
+	ret = !strcmp(bidPriceStr, priceFixup(price, NULL));
+	if (price != buf)
+		free(price);
+	return ret;
+}
+
+static int
+findEntry(const char *auction)
+{
+	int i;
+
+	for (i = 0; i < numEntries; ++i)
+		if (!strcmp(entries[i].aip->auction, auction))
+			return i;
+	return -1;
+}
+
+static entry_t *
+addEntry(auctionInfo *aip, int fromFile)
+{
+	entry_t *ep;
+
+	if (numEntries == entriesSize) {
+		entriesSize = entriesSize ? entriesSize * 2 : 16;
+		entries = (entry_t *)myRealloc(entries, (size_t)entriesSize * sizeof(entry_t));
+	}
+	ep = &entries[numEntries++];
+	ep->aip = aip;
+	ep->fromFile = fromFile;
+	ep->seen = 0;
+	return ep;
+}
+
+/*
+ * Stop sniping and forget an auction.
+ *
+ * returns 0 on success, 1 if a bid has been placed already
+ */
+static int
+dropEntry(int i)
+{
+	auctionInfo *aip = entries[i].aip;
+
+	if (snipeActive(aip) && snipeRemove(aip))
+		return 1;
+	freeAuction(aip);
+	memmove(&entries[i], &entries[i + 1], (size_t)(numEntries - i - 1) * sizeof(entry_t));
+	--numEntries;
+	return 0;
+}
+
+/*
+ * Replace an auction by a new one (with a different price), and start
+ * sniping it.
+ *
+ * returns 0 on success, 1 if a bid has been placed already
+ */
+static int
+changeEntry(int i, auctionInfo *aip)
+{
+	entry_t *ep = &entries[i];
+
+	if (snipeActive(ep->aip) && snipeRemove(ep->aip))
+		return 1;
+	freeAuction(ep->aip);
+	ep->aip = aip;
+	startEntry(ep);
+	return 0;
+}
+
+/*
+ * Start sniping, spreading initial updates like snipeAuctions() does.
+ */
+static void
+startEntry(entry_t *ep)
+{
+	time_t when = time(NULL);
+
+	if (options.delay > 0)
+		when += nextDelay++ * options.delay;
+	snipeAdd(ep->aip, when);
+}
+
+/*
+ * Stop watching everything, and stop sniping the auctions that have not
+ * been bid on.  runEvents() returns when the rest are finished.
+ */
+static void
+stopDaemon(void)
+{
+	int i;
+
+	stopping = 1;
+	while (numClients > 0)
+		closeClient(clients[0]);
+	free(clients);
+	clients = NULL;
+	if (controlFd >= 0) {
+		unwatchFd(controlFd);
+		close(controlFd);
+		controlFd = -1;
+		(void)unlink(controlPath);
+	}
+	if (options.auctfilename)
+		unwatchFile();
+	for (i = 0; i < numEntries; ++i)
+		if (snipeActive(entries[i].aip))
+			(void)snipeRemove(entries[i].aip);
+	printLog(stdout, "Daemon stopped\n");
+}
+
+#else /* WIN32 */
+
+int
+runDaemon(auctionInfo **auctions, int numAuctions)
+{
+	int i;
+
+	printLog(stderr, "Daemon mode is not supported on this platform\n");
+	for (i = 0; i < numAuctions; ++i)
+		freeAuction(auctions[i]);
+	return 0;
+}
+
+#endif /* WIN32 */
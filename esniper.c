@@ -32,10 +32,15 @@
  */
 
 #include "esniper.h"
+#include "account.h"
 #include "auction.h"
 #include "auctionfile.h"
 #include "auctioninfo.h"
+#include "daemon.h"
+#include "metrics.h"
 #include "options.h"
+#include "polling.h"
+#include "trace.h"
 #include "util.h"
 
 static const char *progname = NULL;
@@ -94,7 +99,27 @@ option_t options = {
 	NULL,		/* loginHost */
 	NULL,		/* bidHost */
 	0,		/* curldebug */
-	2      /* delay */
+	2,		/* delay */
+	10,		/* tolerance */
+	4,		/* burst */
+	4,		/* maxconn */
+	1,		/* session */
+	NULL,		/* sessionFile */
+	0,		/* daemon */
+	NULL,		/* control */
+	NULL,		/* poll */
+	1,		/* compress */
+	1,		/* http2 */
+	1,		/* resolve */
+	0,		/* hedge */
+	5,		/* hedgeDelay */
+	NULL,		/* hedgeProxy */
+	NULL,		/* record */
+	NULL,		/* replay */
+	NULL,		/* replayLatency */
+	NULL,		/* metricsFile */
+	NULL,		/* account */
+	NULL		/* userAgent */
 };
 
 /* used for option table */
@@ -108,6 +133,8 @@ static int ReadUser(const void *valueptr, const optionTable_t *tableptr,
 		    const char *filename, const char *line);
 static int ReadPass(const void *valueptr, const optionTable_t *tableptr,
 		    const char *filename, const char *line);
+static int CheckAccount(const void *valueptr, const optionTable_t *tableptr,
+			const char *filename, const char *line);
 static int CheckAuctionFile(const void *valueptr, const optionTable_t *tableptr,
 			    const char *filename, const char *line);
 static int CheckConfigFile(const void *valueptr, const optionTable_t *tableptr,
@@ -120,6 +147,12 @@ static int CheckUser(const void *valueptr, const optionTable_t *tableptr,
 	  const char *filename, const char *line);
 static int CheckPass(const void *valueptr, const optionTable_t *tableptr,
 	  const char *filename, const char *line);
+static int CheckReplayFile(const void *valueptr, const optionTable_t *tableptr,
+			   const char *filename, const char *line);
+static int CheckReplayLatency(const void *valueptr, const optionTable_t *tableptr,
+			      const char *filename, const char *line);
+static int CheckPoll(const void *valueptr, const optionTable_t *tableptr,
+	  const char *filename, const char *line);
 
 /* this table describes options and config entries */
 optionTable_t optiontab[] = {
@@ -152,12 +185,39 @@ optionTable_t optiontab[] = {
    {"loginHost",NULL,(void*)&options.loginHost,    OPTION_STRING,  LOG_NORMAL, NULL, 0},
    {"myeBayHost",NULL,(void*)&options.myeBayHost,  OPTION_STRING,  LOG_NORMAL, NULL, 0},
    {"delay",    "D", (void*)&options.delay,        OPTION_INT,     LOG_NORMAL, NULL, 0},
+   {"tolerance",NULL,(void*)&options.tolerance,    OPTION_INT,     LOG_NORMAL, NULL, 0},
+   {"burst",   NULL, (void*)&options.burst,        OPTION_INT,     LOG_NORMAL, NULL, 0},
+   {"maxconn", NULL, (void*)&options.maxconn,      OPTION_INT,     LOG_NORMAL, NULL, 0},
+   {"session", NULL, (void*)&options.session,      OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"sessionFile",NULL,(void*)&options.sessionFile,OPTION_STRING,  LOG_NORMAL, NULL, 0},
+   {"daemon",  NULL, (void*)&options.daemon,       OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"control", NULL, (void*)&options.control,      OPTION_STRING,  LOG_NORMAL, NULL, 0},
+   {"poll",    NULL, (void*)&options.poll,         OPTION_STRING,  LOG_NORMAL, &CheckPoll, 0},
+   {"compress",NULL, (void*)&options.compress,     OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"http2",   NULL, (void*)&options.http2,        OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"resolve", NULL, (void*)&options.resolve,      OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"hedge",   NULL, (void*)&options.hedge,        OPTION_BOOL,    LOG_NORMAL, NULL, 0},
+   {"hedgeDelay",NULL,(void*)&options.hedgeDelay,  OPTION_INT,     LOG_NORMAL, NULL, 0},
+   {"hedgeProxy",NULL,(void*)&options.hedgeProxy,  OPTION_STRING,  LOG_NORMAL, NULL, 0},
+   {"record",  NULL, (void*)&options.record,       OPTION_STRING,  LOG_NORMAL, NULL, 0},
+   {"replay",  NULL, (void*)&options.replay,       OPTION_STRING,  LOG_NORMAL, &CheckReplayFile, 0},
+   {"replayLatency",NULL,(void*)&options.replayLatency,OPTION_STRING,LOG_NORMAL,&CheckReplayLatency, 0},
+   {"metricsFile",NULL,(void*)&options.metricsFile,OPTION_STRING,  LOG_NORMAL, NULL, 0},
+   {"account", NULL, (void*)&options.account,      OPTION_STRING,  LOG_NORMAL, &CheckAccount, 0},
+   {"userAgent",NULL,(void*)&options.userAgent,    OPTION_STRING,  LOG_NORMAL, NULL, 0},
    {NULL,       "?", (void*)&options.usage,        OPTION_BOOL,    LOG_NORMAL, NULL, 0},
    {NULL,       "h", (void*)&options.usage,        OPTION_BOOL,    LOG_NORMAL, SetLongHelp, 0},
    {NULL,       "H", (void*)&options.usage,        OPTION_BOOL,    LOG_NORMAL, SetConfigHelp, 0},
    {NULL, NULL, NULL, 0, 0, NULL, 0}
 };
 
+/* options allowed in the auction file of an account */
+static optionTable_t accounttab[] = {
+   {"username", NULL, (void*)&options.username,     OPTION_STRING,  LOG_CONFID, &CheckUser, 0},
+   {"password",NULL, (void*)&options.password,     OPTION_SPECSTR, LOG_CONFID, &CheckPass, 0},
+   {NULL, NULL, NULL, 0, 0, NULL, 0}
+};
+
 /* support functions */
 #if !defined(WIN32)
 static void sigAlarm(int sig);
@@ -165,8 +225,8 @@ static void sigAlarm(int sig);
 static void sigTerm(int sig);
 static void cleanup(void);
 static int usage(int helptype);
-static void printRemain(int remain);
 static void printVersion(void);
+static int readAccounts(auctionInfo ***aip, int numAuctions);
 #define USAGE_SUMMARY	0x01
 #define USAGE_LONG	0x02
 #define USAGE_CONFIG	0x04
@@ -190,20 +250,48 @@ getProgname(void)
 	return progname ? progname : "esniper";
 }
 
+/*
+ * Signal handlers only note the signal.  Logging from a handler would make
+ * it a second producer for the log ring, so checkSignals() does the rest
+ * from the main loop.
+ */
+static volatile sig_atomic_t caughtAlarm = 0;
+static volatile sig_atomic_t caughtTerm = 0;
+
 #if !defined(WIN32)
 static void
 sigAlarm(int sig)
 {
 	signal(sig, sigAlarm);
-	log((" SIGALRM"));
+	caughtAlarm = 1;
 }
 #endif
 
 static void
 sigTerm(int sig)
 {
-	signal(sig, SIG_DFL);
+	caughtTerm = sig;
+}
+
+/*
+ * Act on signals caught since the last call.  On SIGTERM the log is
+ * flushed and closed, then the signal is raised again with the default
+ * action.
+ */
+void
+checkSignals(void)
+{
+	int sig = caughtTerm;
+
+	if (caughtAlarm) {
+		caughtAlarm = 0;
+		log((" SIGALRM"));
+	}
+	if (!sig)
+		return;
 	log(("SIGTERM...\n"));
+	logClose();
+	signal(sig, SIG_DFL);
 	raise(sig);
 }
 
@@ -211,7 +299,11 @@ sigTerm(int sig)
 static void
 cleanup()
 {
+	if (options.metricsFile)
+		(void)metricsDump(options.metricsFile);
+	traceClose();
 	logClose();
+	freeAccounts();
 }
 
 /* specific check functions would reside in main module */
@@ -311,6 +403,50 @@ CheckPass(const void *valueptr, const optionTable_t *tableptr,
 	return 0;
 }
 
+/*
+ * CheckPoll(): accept known polling policies only
+ *
+ * returns: 0 = OK, else error
+ */
+static int
+CheckPoll(const void *valueptr, const optionTable_t *tableptr,
+	  const char *filename, const char *line)
+{
+	if (!valueptr || !pollPolicyByName((const char *)valueptr)) {
+		if (filename)
+			printLog(stderr, "Configuration option \"%s\" in file %s", line, filename);
+		else
+			printLog(stderr, "Option -%s", line);
+		printLog(stderr, " accepts \"adaptive\" or \"fixed\"\n");
+		return 1;
+	}
+	free(*(char **)(tableptr->value));
+	*(char **)(tableptr->value) = myStrdup(valueptr);
+	return 0;
+}
+
+/*
+ * CheckReplayLatency(): accept "recorded", "<ms>" or "<min>-<max>" only
+ *
+ * returns: 0 = OK, else error
+ */
+static int
+CheckReplayLatency(const void *valueptr, const optionTable_t *tableptr,
+		   const char *filename, const char *line)
+{
+	if (!valueptr || !traceLatencyValid((const char *)valueptr)) {
+		if (filename)
+			printLog(stderr, "Configuration option \"%s\" in file %s", line, filename);
+		else
+			printLog(stderr, "Option -%s", line);
+		printLog(stderr, " accepts \"recorded\", milliseconds or a range of milliseconds\n");
+		return 1;
+	}
+	free(*(char **)(tableptr->value));
+	*(char **)(tableptr->value) = myStrdup(valueptr);
+	return 0;
+}
+
 /*
  * CheckQuantity(): convert integer value, check for positive value
  *
@@ -403,6 +539,20 @@ ReadPass(const void *valueptr, const optionTable_t *tableptr,
 	return 0;
 }
 
+/*
+ * CheckAccount(): accept accessible files only, each one is an account
+ *
+ * returns: 0 = OK, else error
+ */
+static int CheckAccount(const void *valueptr, const optionTable_t *tableptr,
+			const char *filename, const char *line)
+{
+	if (CheckFile(valueptr, tableptr, filename, line, "Account"))
+		return 1;
+	(void)newAccount((const char *)valueptr);
+	return 0;
+}
+
 /*
  * CheckAuctionFile(): accept accessible files only
  *
@@ -425,6 +575,15 @@ static int CheckConfigFile(const void *valueptr, const optionTable_t *tableptr,
 	return CheckFile(valueptr, tableptr, filename, line, "Config");
 }
 
+/*
+ * CheckReplayFile(): accept accessible files only
+ */
+static int CheckReplayFile(const void *valueptr, const optionTable_t *tableptr,
+			   const char *filename, const char *line)
+{
+	return CheckFile(valueptr, tableptr, filename, line, "Replay");
+}
+
 /*
  * CheckFile(): accept accessible files only
  *
@@ -474,13 +633,53 @@ static int SetConfigHelp(const void *valueptr, const optionTable_t *tableptr,
 /*
  * Print number of auctions remaining.
  */
-static void
+void
 printRemain(int remain)
 {
 	printLog(stdout, "\nNeed to win %d item(s), %d auction(s) remain\n\n",
 		options.quantity, remain);
 }
 
+/*
+ * readAccounts(): add the auctions of the account files.  Each file is
+ * read as its account, with its own username and password.
+ *
+ * returns: number of auctions, -1 on error
+ */
+static int
+readAccounts(auctionInfo ***aip, int numAuctions)
+{
+	account_t *ap;
+
+	for (ap = getAccounts(); ap; ap = ap->next) {
+		auctionInfo **more = NULL;
+		int n;
+
+		useAccount(ap);
+		if (readConfigFile(ap->filename, accounttab)) {
+			useAccount(NULL);
+			return -1;
+		}
+		if (!options.username || !options.password) {
+			printLog(stderr, "Error: no username or password in account file %s.\n", ap->filename);
+			useAccount(NULL);
+			return -1;
+		}
+		if ((n = readAuctionFile(ap->filename, &more)) < 0) {
+			useAccount(NULL);
+			return -1;
+		}
+		if (n > 0) {
+			*aip = (auctionInfo **)myRealloc(*aip, (size_t)(numAuctions + n) * sizeof(auctionInfo *));
+			memcpy(*aip + numAuctions, more, (size_t)n * sizeof(auctionInfo *));
+			numAuctions += n;
+			free(more);
+		}
+	}
+	useAccount(NULL);
+	return numAuctions;
+}
+
 static void
 printVersion(void)
 {
@@ -541,8 +740,14 @@ static const char usageConfig1[] =
  "  Boolean: (valid values: true,y,yes,on,1,enabled  false,n,no,off,0,disabled)\n"
  "    batch = false\n"
  "    bid = true\n"
+ "    compress = true\n"
+ "    daemon = false\n"
  "    debug = false\n"
+ "    hedge = false (send bid on two connections)\n"
+ "    http2 = true\n"
  "    reduce = true\n"
+ "    resolve = true\n"
+ "    session = true\n"
  "  String:\n"
  "    logdir = .\n"
  "    password =\n"
@@ -553,10 +758,24 @@ static const char usageConfig1[] =
  "    bidHost = %s\n"
  "    loginHost = %s\n"
  "    myeBayHost = %s\n"
+ "    sessionFile = $HOME/.esniper.session.<username>\n"
+ "    control = <auction file>.ctl or $HOME/.esniper.ctl\n"
+ "    hedgeProxy = <proxy>\n"
+ "    record = <file to write HTTP trace to>\n"
+ "    replay = <HTTP trace file to answer requests from, no network is used>\n"
+ "    replayLatency = recorded (or milliseconds, or <min>-<max> milliseconds)\n"
+ "    metricsFile = <file to write timings and counters to at exit, JSON>\n"
+ "    account = <auction file of another eBay user, may be repeated>\n"
+ "    userAgent = <User-Agent header, default is a current Firefox>\n"
+ "    poll = adaptive (or fixed: 1 day, 2 hours, 1 hour, 5, 2 minutes)\n"
  "  Numeric: (seconds may also be \"now\")\n"
+ "    burst = 4\n"
  "    delay = 2\n"
+ "    hedgeDelay = 5 (milliseconds)\n"
+ "    maxconn = 4\n"
  "    quantity = 1\n"
  "    seconds = %d\n"
+ "    tolerance = 10 (milliseconds)\n"
  "\n";
 static const char usageConfig2[] =
  "A configuration file consists of option settings, blank lines, and comment\n"
@@ -565,7 +784,16 @@ static const char usageConfig2[] =
  "An auction file is similar to a configuration file, but it also has one or\n"
  "more auction lines.  An auction line contains an auction number, optionally\n"
  "followed by a bid price.  If no bid price is given, the auction number uses\n"
- "the bid price of the first prior auction line that contains a bid price.\n";
+ "the bid price of the first prior auction line that contains a bid price.\n"
+ "\n"
+ "The auction file of an account has only username and password settings and\n"
+ "auction lines.  Its auctions are sniped as that user, together with the\n"
+ "others, and the quantity counts the items won by all users.\n";
+static const char usageConfig3[] =
+ "\n"
+ "In daemon mode esniper keeps running, reloads the auction file when it\n"
+ "changes and accepts the commands \"add <auction> <price>\", \"remove\n"
+ "<auction>\", \"status\", \"reload\" and \"quit\" on the control socket.\n";
 
 static int
 usage(int helplevel)
@@ -580,6 +808,7 @@ usage(int helplevel)
 	if (helplevel & USAGE_CONFIG) {
 		fprintf(stderr, usageConfig1, options.historyHost, options.prebidHost, options.bidHost, options.loginHost, options.myeBayHost, DEFAULT_BIDTIME);
 		fprintf(stderr, usageConfig2);
+		fprintf(stderr, usageConfig3);
 	}
 	if (helplevel == USAGE_SUMMARY)
 		fprintf(stderr, "Try \"%s -h\" for more help.\n", getProgname());
@@ -594,9 +823,10 @@ main(int argc, char *argv[])
 	auctionInfo **auctions = NULL;
 	int c, i, numAuctions = 0, numAuctionsOrig = 0;
 	int XFlag = 0;
+	int benchIterations = 0;
 
 	/* all known options */
-	static const char optionstring[]="bc:dhHil:mnp:Pq:rs:u:UvX";
+	static const char optionstring[]="B:bc:dhHil:mnp:Pq:rs:u:UvX";
 
 	atexit(cleanup);
 	progname = basename(argv[0]);
@@ -607,6 +837,7 @@ main(int argc, char *argv[])
 	options.bidHost = myStrdup(DEFAULT_BID_HOST);
 	options.loginHost = myStrdup(DEFAULT_LOGIN_HOST);
 	options.myeBayHost = myStrdup(DEFAULT_MYEBAY_HOST);
+	options.poll = myStrdup("adaptive");
 
 	/* first, check for debug, configuration file and auction file
 	 * options but accept all other options to avoid error messages
@@ -634,6 +865,12 @@ main(int argc, char *argv[])
 		case 'X': /* secret option - for testing page parsing */
 			++XFlag;
 			break;
+		case 'B': /* secret option - for benchmarking page parsing */
+			if ((benchIterations = atoi(optarg)) <= 0) {
+				printLog(stderr, "Error: bad benchmark iterations \"%s\".\n", optarg);
+				options.usage |= USAGE_SUMMARY;
+			}
+			break;
 		case 'v': /* version */
 			printVersion();
 			exit(0);
@@ -650,7 +887,7 @@ main(int argc, char *argv[])
 		exit(usage(options.usage));
 
 	/* One argument after options?  Must be an auction file. */
-	if ((argc - optind) == 1) {
+	if (!benchIterations && (argc - optind) == 1) {
 		if (parseGetoptValue('f', argv[optind], optiontab)) {
 			options.usage |= USAGE_SUMMARY;
 			exit(usage(options.usage));
@@ -787,6 +1024,10 @@ main(int argc, char *argv[])
 	log(("options.info=%d\n", options.info));
 	log(("options.myitems=%d\n", options.myitems));
 
+	/* no login needed */
+	if (benchIterations && !options.usage)
+		exit(benchParser(benchIterations, argv, argc));
+
 	if (!options.usage) {
 		if (!XFlag) {
 			if (options.auctfilename) {
@@ -848,7 +1089,10 @@ main(int argc, char *argv[])
 
  	if (options.myitems)
 		exit(printMyItems());
-	if (numAuctions <= 0)
+	if (numAuctions >= 0 && getAccounts())
+		numAuctions = readAccounts(&auctions, numAuctions);
+	/* a daemon can start without auctions, they may be added later */
+	if (numAuctions < 0 || (numAuctions == 0 && !options.daemon))
 		exit(usage(USAGE_SUMMARY));
 
 #if !defined(WIN32)
@@ -861,7 +1105,9 @@ main(int argc, char *argv[])
 	numAuctionsOrig = numAuctions;
 	{
 		int quantity = options.quantity;
-		numAuctions = sortAuctions(auctions, numAuctions, &quantity);
+
+		if (numAuctions > 0)
+			numAuctions = sortAuctions(auctions, numAuctions, &quantity);
 
 		if (quantity < options.quantity) {
 			printLog(stdout, "\nYou have already won %d item(s).\n",
@@ -881,13 +1127,16 @@ main(int argc, char *argv[])
 		exit(0);
 	}
 
-	for (i = 0; i < numAuctions && options.quantity > 0; ++i) {
-		if (numAuctionsOrig > 1)
-			printRemain(numAuctions - i);
-		won += snipeAuction(auctions[i]);
+	if (numAuctionsOrig > 1)
+		printRemain(numAuctions);
+	if (options.daemon)
+		/* daemon frees the auctions */
+		won = runDaemon(auctions, numAuctions);
+	else {
+		won = snipeAuctions(auctions, numAuctions);
+		for (i = 0; i < numAuctions; ++i)
+			freeAuction(auctions[i]);
 	}
-	for (i = 0; i < numAuctions && options.quantity > 0; ++i)
-		freeAuction(auctions[i]);
 	free(auctions);
 
 	cleanupCurlStuff();
@@ -56,6 +56,26 @@ typedef struct {
 	char *myeBayHost;
 	int curldebug;
 	int delay;
+	int tolerance;		/* bid timer tolerance, milliseconds */
+	int burst;		/* requests allowed at once despite delay */
+	int maxconn;		/* parallel requests per host, 0 = no limit */
+	int session;		/* keep login session between runs */
+	char *sessionFile;	/* NULL: $HOME/.esniper.session.<user> */
+	int daemon;		/* keep running, see daemon.c */
+	char *control;		/* control socket, NULL: default */
+	char *poll;		/* polling policy, see polling.c */
+	int compress;		/* accept compressed pages */
+	int http2;		/* use HTTP/2 where possible */
+	int resolve;		/* resolve hosts in the background */
+	int hedge;		/* send bid twice, first answer wins */
+	int hedgeDelay;		/* milliseconds between the two bids */
+	char *hedgeProxy;	/* proxy for second bid, NULL: as first */
+	char *record;		/* write HTTP trace, see trace.c */
+	char *replay;		/* answer requests from HTTP trace */
+	char *replayLatency;	/* "recorded", "<ms>" or "<min>-<max>" */
+	char *metricsFile;	/* write metrics as JSON at exit */
+	char *account;		/* last account file, see account.c */
+	char *userAgent;	/* NULL: USER_AGENT in http.c */
 } option_t;
 
 extern option_t options;
@@ -63,6 +83,8 @@ extern optionTable_t optiontab[];
 
 extern const char *getVersion(void);
 extern const char *getProgname(void);
+extern void printRemain(int remain);
+extern void checkSignals(void);
 
 #ifdef __lint
 #define log(x) if (!options.debug) 0; else dlog x
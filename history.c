@@ -31,12 +31,47 @@
 #include "html.h"
 #include "auction.h"
 #include "auctioninfo.h"
+#include "clocksync.h"
 #include "history.h"
+#include "scan.h"
 #include "esniper.h"
 
 static long getSeconds(char *timestr);
 static int checkPageType(auctionInfo *aip, int pageType, int auctionState, int auctionResult);
-static int parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t start, int debugMode);
+static int parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, const scanResult_t *rp, auctionInfo *aip, time_t start, int debugMode);
+
+/* anchors on bid history pages, found in one pass by scanPage() */
+enum {
+	hs_bidLabel, hs_vizItemNum, hs_itemNo, hs_itemNumber, hs_itemTitle,
+	hs_BHitemTitle, hs_itemDesc, hs_itemInfo, hs_offerTitle, hs_ctBid,
+	hs_timeEnded, hs_timeLeftLabel, hs_day, hs_hour, hs_minute, hs_second,
+	hs_timeLeft, hs_viewBids, hs_bids, hs_bidsLabel
+};
+
+static const scanPattern_t historyPatterns[] = {
+	{ "\"BHCtBidLabel\"", 0 },
+	{ "\"vizItemNum\"", 0 },
+	{ "\"BHitemNo\"", 0 },
+	{ ">Item number:<", 0 },
+	{ "\"itemTitle\"", 0 },
+	{ "\"BHitemTitle\"", 0 },
+	{ "\"BHitemDesc\"", 0 },
+	{ ">Item info<", 0 },
+	{ "\"offer-title-top_panel_main\"", 0 },
+	{ "\"BHCtBid\"", 0 },
+	{ "Time Ended:", 1 },
+	{ ">Time left:<", 0 },
+	{ "\"_counter_itemEndDate_day\"", 0 },
+	{ "\"_counter_itemEndDate_hour\"", 0 },
+	{ "\"_counter_itemEndDate_minute\"", 0 },
+	{ "\"_counter_itemEndDate_second\"", 0 },
+	{ "timeLeft", 0 },
+	{ "ViewBids:", 0 },
+	{ "Bids:", 0 },
+	{ ">Bids:<", 0 },
+};
+
+static scanner_t *historyScanner = NULL;
 
 static const char PRIVATE[] = "private auction - bidders' identities protected";
 
@@ -78,7 +113,17 @@ parseBidHistory(memBuf_t *mp, auctionInfo *aip, time_t start, time_t *timeToFirs
 		*timeToFirstByte = getTimeToFirstByte(mp);
 
 	if ((pp = getPageInfo(mp))) {
-		ret = parseBidHistoryInternal(pp, mp, aip, start, debugMode);
+		scanResult_t *rp;
+
+		if (!historyScanner)
+			historyScanner = newScanner(historyPatterns, sizeof(historyPatterns) / sizeof(historyPatterns[0]));
+		rp = scanPage(historyScanner, mp);
+		ret = parseBidHistoryInternal(pp, mp, rp, aip, start, debugMode);
+		if (!ret) {
+			aip->minBid = minimumBid(aip);
+			log(("parseBidHistory(): minimum bid %.2f", aip->minBid));
+		}
+		freeScanResult(rp);
 		freePageInfo(pp);
 	} else {
 		log(("parseBidHistory(): pageinfo is NULL\n"));
@@ -88,11 +133,12 @@ parseBidHistory(memBuf_t *mp, auctionInfo *aip, time_t start, time_t *timeToFirs
 	return ret;
 }
 
-int
-parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t start, int debugMode)
+static int
+parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, const scanResult_t *rp, auctionInfo *aip, time_t start, int debugMode)
 {
 	char *line;
-	char **row = NULL;
+	tableRow_t row = TABLE_ROW_INIT;
+	int ncolumns;
 	int ret = 0;		/* 0 = OK, 1 = failed */
 	int foundHeader = 0;	/* found bid history table header */
 	int pageType = 0;
@@ -156,9 +202,9 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 
 	/* Auction number */
 	memReset(mp);
-	if (memStr(mp, "\"BHCtBidLabel\"") ||
-		memStr(mp, "\"vizItemNum\"") ||
-		memStr(mp, "\"BHitemNo\"")) { /* obsolete as of 2.22 */
+	if (scanFind(rp, mp, hs_bidLabel) ||
+		scanFind(rp, mp, hs_vizItemNum) ||
+		scanFind(rp, mp, hs_itemNo)) { /* obsolete as of 2.22 */
 		memChr(mp, '>');
 		memSkip(mp, 1);
 		line = getNonTag(mp);	/* Item number: */
@@ -168,7 +214,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 			bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "no item number");
 			return auctionError(aip, ae_baditem, NULL);
 		}
-	} else if (memStr(mp, ">Item number:<")) {
+	} else if (scanFind(rp, mp, hs_itemNumber)) {
                 line = getNonTag(mp);   /* Item number: */
                 line = getNonTag(mp);   /* number */
 		if (!line) {
@@ -182,8 +228,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		return auctionError(aip, ae_baditem, NULL);
 	}
 	if (debugMode) {
-		free(aip->auction);
-		aip->auction = myStrdup(line);
+		setAuctionString(aip, &aip->auction, line);
 	} else {
 		if (strcmp(aip->auction, line)) {
 			log(("parseBidHistory(): auction number %s does not match given number %s", line, aip->auction));
@@ -194,9 +239,9 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 
 	/* Auction title */
 	memReset(mp);
-	if (memStr(mp, "\"itemTitle\"") ||
-		memStr(mp, "\"BHitemTitle\"") || /* obsolete as of 2.22 */
-		memStr(mp, "\"BHitemDesc\"")) {	/* obsolete before 2.22 */
+	if (scanFind(rp, mp, hs_itemTitle) ||
+		scanFind(rp, mp, hs_BHitemTitle) || /* obsolete as of 2.22 */
+		scanFind(rp, mp, hs_itemDesc)) {	/* obsolete before 2.22 */
 		memChr(mp, '>');
 		memSkip(mp, 1);
 		line = getNonTag(mp);	/* Item title: */
@@ -207,7 +252,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 			return auctionError(aip, ae_baditem, NULL);
 		}
 	/* Active auction */
-        } else if (memStr(mp, ">Item info<")) {
+        } else if (scanFind(rp, mp, hs_itemInfo)) {
                 line = getNonTag(mp);   /* Item title: */
                 line = getNonTag(mp);   /* title */
                 if (!line) {
@@ -215,7 +260,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
                         bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "item title not found");
         	}
 	/* Post bid */
-        } else if (memStr(mp, "\"offer-title-top_panel_main\"")) {
+        } else if (scanFind(rp, mp, hs_offerTitle)) {
 		memChr(mp, '>');
 		memSkip(mp, 1);
                 line = getNonTag(mp);   /* title */
@@ -228,8 +273,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "item title or description not found");
 		return auctionError(aip, ae_baditem, NULL);
 	}
-	free(aip->title);
-	aip->title = myStrdup(line);
+	setAuctionString(aip, &aip->title, line);
 	printLog(stdout, "Auction %s: %s\n", aip->auction, aip->title);
 	printLog(stdout, "Auction URL: http://www.ebay.com/itm/%s\n", aip->auction);
 
@@ -237,7 +281,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 	memReset(mp);
 	aip->quantity = 1;	/* If quantity not found, assume 1 */
 	got = NOTHING;
-	while (got != EVERYTHING && memStr(mp, "\"BHCtBid\"")) {
+	while (got != EVERYTHING && scanFind(rp, mp, hs_ctBid)) {
 		memChr(mp, '>');
 		memSkip(mp, 1);
 		line = getNonTag(mp);
@@ -291,21 +335,18 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 			got |= QUANTITY;
 		} else if (!strcasecmp(line, "Shipping:")) {
 			line = getNonTag(mp);
-			if (line) {
-				free(aip->shipping);
-				aip->shipping = myStrdup(line);
-			}
+			if (line)
+				setAuctionString(aip, &aip->shipping, line);
 			got |= SHIPPING;
 		}
 	}
 
 	/* Time Left */
 	memReset(mp);
-	if (aip->quantity == 0 || memCaseStr(mp, "Time Ended:")) {
-		free(aip->remainRaw);
-		aip->remainRaw = myStrdup("--");
+	if (aip->quantity == 0 || scanFind(rp, mp, hs_timeEnded)) {
+		setAuctionString(aip, &aip->remainRaw, "--");
 		aip->remain = 0;
-	} else if (memStr(mp, ">Time left:<")) {
+	} else if (scanFind(rp, mp, hs_timeLeftLabel)) {
 		char* days = myMalloc(12);
 		char* hours = myMalloc(12);
 		char* minutes = myMalloc(12);
@@ -317,28 +358,28 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		memset(seconds, '\0', sizeof(seconds));
 		memset(tmpTimeLeft, '\0', sizeof(tmpTimeLeft));
 
-		if (memStr(mp, "\"_counter_itemEndDate_day\"")) {
+		if (scanFind(rp, mp, hs_day)) {
             memChr(mp, '>');
             memSkip(mp, 1);
 			strncpy(days, getNonTag(mp), 4);
 		}
 		else
 			strcpy(days, "0");
-		if (memStr(mp, "\"_counter_itemEndDate_hour\"")) {
+		if (scanFind(rp, mp, hs_hour)) {
 	                memChr(mp, '>');
 	                memSkip(mp, 1);
 			strncpy(hours, getNonTag(mp), 4);
 		}
 		else
 			strcpy(hours, "0");
-		if (memStr(mp, "\"_counter_itemEndDate_minute\"")) {
+		if (scanFind(rp, mp, hs_minute)) {
                         memChr(mp, '>');
                         memSkip(mp, 1);
 			strncpy(minutes, getNonTag(mp), 2);
 		}
 		else
 			strcpy(seconds, "0");
-		if (memStr(mp, "\"_counter_itemEndDate_second\"")) {
+		if (scanFind(rp, mp, hs_second)) {
                         memChr(mp, '>');
                         memSkip(mp, 1);
 			strncpy(seconds , getNonTag(mp), 2);
@@ -347,31 +388,28 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 			strcpy(seconds, "0");
 		sprintf(tmpTimeLeft, "%s days %s hours %s mins %s secs", days, hours, minutes, seconds);
 		free(days); free(hours); free(minutes); free(seconds);
-		aip->remainRaw = myStrdup(tmpTimeLeft);
+		setAuctionString(aip, &aip->remainRaw, tmpTimeLeft);
  		aip->remain = getSeconds(tmpTimeLeft);
                 if (aip->remain < 0) {
                         bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "remaining time could not be converted (NEW)");
                         return auctionError(aip, ae_badtime, aip->remainRaw);
 		}
-	} else if (memStr(mp, "timeLeft")) {
+	} else if (scanFind(rp, mp, hs_timeLeft)) {
 		memChr(mp, '>');
 		memSkip(mp, 1);
-		free(aip->remainRaw);
-		aip->remainRaw = myStrdup(getNonTag(mp));
+		setAuctionString(aip, &aip->remainRaw, getNonTag(mp));
 		if (!strcasecmp(aip->remainRaw, "Duration:")) {
 			/* Duration may follow Time left.  If we
 			 * see this, time left must be empty.  Assume 1 second.
 			 */
-			free(aip->remainRaw);
-			aip->remainRaw = myStrdup("");
+			setAuctionString(aip, &aip->remainRaw, "");
 			aip->remain = 1;
 		}
 		if (!strcasecmp(aip->remainRaw, "Refresh")) {
 			/* Refresh is the label on the next button.  If we
 			 * see this, time left must be empty.  Assume 1 second.
 			 */
-			free(aip->remainRaw);
-			aip->remainRaw = myStrdup("");
+			setAuctionString(aip, &aip->remainRaw, "");
 			aip->remain = 1;
 		} else if (!strncasecmp(aip->remainRaw, "undefined", 9)) {
 			/* Shows up very rarely, seems to be an intermediate
@@ -394,7 +432,11 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		struct tm *tmPtr;
 		char timestr[20];
 
-		aip->endTime = start + aip->remain;
+		/* page was generated at Date, if we know eBay's clock */
+		if (mp->date && clockOffsetKnown())
+			aip->endTime = serverToLocal(mp->date) + aip->remain;
+		else
+			aip->endTime = start + aip->remain;
 		/* formated time/date output */
 		tmPtr = localtime(&(aip->endTime));
 		strftime(timestr , 20, "%Y-%m-%d %H:%M:%S", tmPtr);
@@ -406,12 +448,12 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 	/* bid history */
 	memReset(mp);
 	aip->bids = -1;
-	if (memStr(mp, "ViewBids:")) {	/* Skip over 'ViewBids' */
+	if (scanFind(rp, mp, hs_viewBids)) {	/* Skip over 'ViewBids' */
 		line = 	getNonTag(mp);
 	} else {
 		memReset(mp);
 	}
-	if (memStr(mp, "Bids:")) {
+	if (scanFind(rp, mp, hs_bids)) {
 		line = getNonTag(mp);	/* Bids: */
 		line = getNonTag(mp);	/* number */
 		log(("bids: %d", line));
@@ -497,45 +539,38 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 	/* find bid history table */
 	memReset(mp);
 	while (!foundHeader && getTableStart(mp)) {
-		int ncolumns;
 		char *saveptr = mp->readptr;
 
-		row = getTableRow(mp);
-		ncolumns = numColumns(row);
+		ncolumns = getTableSpans(mp, &row);
 		if ( (pagetype == phclassic && ncolumns >= 5) || (pagetype == ph201702 && ncolumns >= 3) ) {
-			char *rawHeader = (pagetype == phclassic ? row[1] : row[0]);
-			char *header = getNonTagFromString(rawHeader);
+			const char *header = getCellText(mp, &row, (pagetype == phclassic ? 1 : 0), 1);
 
 			foundHeader = header &&
 					(!strncmp(header, "Bidder", 6) ||
 					 !strncmp(header, "User ID", 7));
-			free(header);
 		}
 		if (!foundHeader)
 			mp->readptr = saveptr;
-		freeTableRow(row);
 	}
 	if (!foundHeader) {
+		freeTableSpans(&row);
 		bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "Cannot find bid table header");
 		return auctionError(aip, ae_nohighbid, NULL);
 	}
 
 	/* skip over initial single-column rows */
-	while ((row = getTableRow(mp))) {
-		if (numColumns(row) != 1)
-			break;
-		freeTableRow(row);
-	}
+	while ((ncolumns = getTableSpans(mp, &row)) == 1)
+		;
 
-	log(("numColumns=%d", numColumns(row)));
+	log(("numColumns=%d", ncolumns));
 	/* roll through table */
-	switch (numColumns(row)) {
+	switch (ncolumns) {
 	case 2:	/* auction with no bids */
 	    {
-		char *s = getNonTagFromString(row[1]);
+		const char *s = getCellText(mp, &row, 1, 1);
 
-		if (!strcmp("No bids have been placed.", s) ||
-		    !strcmp("No purchases have been made.", s)) {
+		if (s && (!strcmp("No bids have been placed.", s) ||
+			  !strcmp("No purchases have been made.", s))) {
 			aip->quantityBid = 0;
 			aip->bids = 0;
 			aip->price = 0;
@@ -553,8 +588,6 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 				ret = auctionError(aip, ae_nohighbid, NULL);
 			}
 		}
-		freeTableRow(row);
-		free(s);
 		break;
 	    }
 
@@ -565,26 +598,24 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		 */
 	    if(pageType != VIEWBIDS)
 	    {
-			char *currently = getNonTagFromString((pagetype == phclassic ? row[2] : row[1]));
+			char *currently = myStrdup(getCellText(mp, &row, (pagetype == phclassic ? 2 : 1), 1));
 			aip->bids = 0;
 			aip->quantityBid = 0;
 			aip->won = 0;
 			aip->winning = 0;
 			/* find your purchase, count number of purchases */
 			/* blank, user, price, quantity, date, blank */
-			for (; row; row = getTableRow(mp)) {
-				if ( (pagetype == phclassic && numColumns(row) == 6) || (pagetype == ph201702 && numColumns(row) == 4) ) {
-					int quantity = getIntFromString((pagetype == phclassic ? row[3] : row[2]));
-					char *bidder;
+			for (; ncolumns > 0; ncolumns = getTableSpans(mp, &row)) {
+				if ( (pagetype == phclassic && ncolumns == 6) || (pagetype == ph201702 && ncolumns == 4) ) {
+					int quantity = getCellInt(mp, &row, (pagetype == phclassic ? 3 : 2));
+					const char *bidder;
 
 					++aip->bids;
 					aip->quantityBid += quantity;
-					bidder = getNonTagFromString((pagetype == phclassic ? row[1] : row[0]));
-					if (!strcasecmp(bidder, options.username))
+					bidder = getCellText(mp, &row, (pagetype == phclassic ? 1 : 0), 1);
+					if (bidder && !strcasecmp(bidder, options.username))
 						aip->won = aip->winning = quantity;
-					free(bidder);
 				}
-				freeTableRow(row);
 			}
 			printf("# of bids: %d\n", aip->bids);
 			printf("Currently: %s  (your maximum bid: %s)\n",
@@ -611,16 +642,16 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 	case 5: /* single auction with bids */
 	    {
 		/* blank, user, price, date, blank */
-		char *winner = NULL;
+		int bidderColumn = (pagetype == phclassic ? 1 : 0);
+		const char *s = getCellText(mp, &row, bidderColumn, 1);
+		char *winner, *currently;
 		const char *priceStr;
-		if (pagetype == phclassic)
-			winner = getNonTagFromString(row[1]);
-		else
-			winner = getNthNonTagFromString(row[0], 1);
-		char *currently = getNonTagFromString((pagetype == phclassic ? row[2] : row[1]));
 
-		if (!strcasecmp(winner, "Member Id:"))
-		   winner = getNthNonTagFromString((pagetype == phclassic ? row[1] : row[0]), (pagetype == phclassic ? 2 : 1));
+		if (s && !strcasecmp(s, "Member Id:") && pagetype == phclassic)
+			s = getCellText(mp, &row, bidderColumn, 2);
+		/* both are needed after the next lookup */
+		winner = myStrdup(s ? s : "");
+		currently = myStrdup(getCellText(mp, &row, (pagetype == phclassic ? 2 : 1), 1));
 
 		aip->quantityBid = 1;
 
@@ -632,10 +663,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 			free(winner);
 			free(currently);
 			if (checkPageType(aip, pageType, auctionState, auctionResult) == 0)
-			{
-				freeTableRow(row);
 				break;
-			}
 			bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "bid price could not be converted");
 			return auctionError(aip, ae_convprice, currently);
 #else // 0
@@ -654,25 +682,18 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 					    (aip->bidResult == 0 ||
 					     (aip->bidResult == -1 && aip->endTime - time(NULL) < options.bidtime))) ?  options.username : "[private]");
 		}
-		freeTableRow(row);
 
 		/* count bids */
 		if (aip->bids < 0) {
 			int foundStartPrice = 0;
-			for (aip->bids = 1; !foundStartPrice && (row = getTableRow(mp)); ) {
-				if ( (pagetype == phclassic && numColumns(row) == 5) || (pagetype == ph201702 && numColumns(row) == 3) ) {
-					char *bidder = NULL;
-					if (pagetype == phclassic)
-						bidder = getNonTagFromString(row[1]);
-					else
-						bidder = getNthNonTagFromString(row[0], 1);
-
-					foundStartPrice = !strcmp(bidder, "Starting Price");
+			for (aip->bids = 1; !foundStartPrice && (ncolumns = getTableSpans(mp, &row)) > 0; ) {
+				if ( (pagetype == phclassic && ncolumns == 5) || (pagetype == ph201702 && ncolumns == 3) ) {
+					const char *bidder = getCellText(mp, &row, bidderColumn, 1);
+
+					foundStartPrice = bidder && !strcmp(bidder, "Starting Price");
 					if (!foundStartPrice)
 						++aip->bids;
-					free(bidder);
 				}
-				freeTableRow(row);
 			}
 		}
 		if (pagetype == phclassic)
@@ -683,7 +704,7 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 		{
 			int bids2 = aip->bids;
 			memReset(mp);
-		        if (memStr(mp, ">Bids:<")) {
+		        if (scanFind(rp, mp, hs_bidsLabel)) {
                         	line = getNonTag(mp); /* Bids: */
                         	line = getNonTag(mp); /* Num. of bids */
 				aip->bids = (int)strtol(line, NULL, 10);
@@ -722,11 +743,11 @@ parseBidHistoryInternal(pageInfo_t *pp, memBuf_t *mp, auctionInfo *aip, time_t s
 	default:
 		if (checkPageType(aip, pageType, auctionState, auctionResult) != 0)
 		{
-			bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "%d columns in bid table", numColumns(row));
+			bugReport("parseBidHistory", __FILE__, __LINE__, aip, mp, optiontab, "%d columns in bid table", ncolumns);
 			ret = auctionError(aip, ae_nohighbid, NULL);
 		}
-		freeTableRow(row);
 	}
+	freeTableSpans(&row);
 
 	return ret;
 } /* parseBidHistory() */
@@ -25,104 +25,186 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
-#include "buffer.h"
 #include "http.h"
 #include "html.h"
 #include "esniper.h"
 
 /*
  * rudimentary HTML parser, maybe, we should use libxml2 instead?
+ *
+ * getToken() splits the page into tags and text.  Tokens point into the
+ * page, nothing is copied.  getTokenTag() and getTokenText() normalize
+ * whitespace and decode entities when (and if) the text is needed.  The
+ * results are kept in scratch buffers of the memBuf, so pages can be
+ * parsed at the same time.
  */
 
+static const char *tagEnd(const char *p, const char *end, int *comment);
+static char *scratch(memScratch_t *sp, size_t len);
 
 /*
- * Get next tag text, eliminating leading and trailing whitespace
- * and leaving only a single space for all internal whitespace.
+ * Find end of tag.  p points to first character after '<'.
+ *
+ * returns pointer to '>', or end of page if tag not terminated.
  */
-const char *
-getTag(memBuf_t *mp)
+static const char *
+tagEnd(const char *p, const char *end, int *comment)
 {
-	static char *buf = NULL;
-	static size_t bufsize = 0;
-	size_t count = 0;
-	int inStr = 0, comment = 0, c;
-
-	if (memEof(mp)) {
-		log(("getTag(): returning NULL\n"));
-		return NULL;
-	}
-	while ((c = memGetc(mp)) != EOF && c != '<')
-		;
-	if (c == EOF) {
-		log(("getTag(): returning NULL\n"));
-		return NULL;
+	const char *start = p;
+	int inStr = 0;
+
+	*comment = 0;
+	if (p == end || *p == '>')
+		return p;
+	/* first character is never special */
+	++p;
+	if (*start == '!') {
+		if (p == end || *p == '>')
+			return p;
+		if (*p++ == '-') {
+			if (p == end || *p == '>')
+				return p;
+			/* "<!--" comment, ends with "-->" */
+			*comment = 1;
+			for (++p; p < end; ++p)
+				if (*p == '>' && p[-1] == '-' && p[-2] == '-')
+					return p;
+			return end;
+		}
 	}
+	for (; p < end; ++p) {
+		const char *gt;
 
-	/* first char - check for comment */
-	c = memGetc(mp);
-	if (c == '>') {
-		log(("getTag(): returning empty tag\n"));
-		return "";
-	} else if (c == EOF) {
-		log(("getTag(): returning NULL\n"));
-		return NULL;
-	}
-	addchar(buf, bufsize, count, (char)c);
-	if (c == '!') {
-		int c2 = memGetc(mp);
-
-		if (c2 == '>' || c2 == EOF) {
-			term(buf, bufsize, count);
-			log(("getTag(): returning %s\n", buf));
-			return buf;
-		}
-		addchar(buf, bufsize, count, (char)c2);
-		if (c2 == '-') {
-			int c3 = memGetc(mp);
-
-			if (c3 == '>' || c3 == EOF) {
-				term(buf, bufsize, count);
-				log(("getTag(): returning %s\n", buf));
-				return buf;
+		switch (*p) {
+		case '\\':
+			if (++p == end)
+				return end;
+			break;
+		case '"':
+			inStr = !inStr;
+			break;
+		case '>':
+			if (!inStr)
+				return p;
+			break;
+		default:
+			/* skip quickly to next special character */
+			if (!inStr && (gt = memchr(p, '>', (size_t)(end - p)))) {
+				const char *q;
+
+				for (q = p; q < gt && *q != '"' && *q != '\\'; ++q)
+					;
+				p = q - 1;
 			}
-			addchar(buf, bufsize, count, (char)c3);
-			comment = 1;
 		}
 	}
+	return end;
+}
 
-	if (comment) {
-		while ((c = memGetc(mp)) != EOF) {
-			if (c=='>' && buf[count-1]=='-' && buf[count-2]=='-') {
-				term(buf, bufsize, count);
-				log(("getTag(): returning %s\n", buf));
-				return buf;
-			}
-			if (isspace(c) && buf[count-1] == ' ')
+/*
+ * Get next token.
+ *
+ * returns 1 if a token has been found, 0 at end of page.
+ */
+int
+getToken(memBuf_t *mp, htmlToken_t *tp)
+{
+	const char *p, *end, *e;
+
+	if (memEof(mp))
+		return 0;
+	p = mp->readptr;
+	end = mp->memory + mp->size;
+	if (*p == '<') {
+		if (++p == end) {
+			mp->readptr = (char *)end;
+			return 0;
+		}
+		e = tagEnd(p, end, &tp->comment);
+		tp->type = tt_tag;
+		mp->readptr = (char *)(e < end ? e + 1 : end);
+	} else {
+		if (!(e = memchr(p, '<', (size_t)(end - p))))
+			e = end;
+		tp->type = tt_text;
+		tp->comment = 0;
+		mp->readptr = (char *)e;
+	}
+	tp->start = p;
+	tp->len = (size_t)(e - p);
+	return 1;
+}
+
+/*
+ * Check if token is tag name, optionally followed by attributes.
+ */
+int
+tokenIsTag(const htmlToken_t *tp, const char *name)
+{
+	size_t len = strlen(name);
+
+	return tp->type == tt_tag && tp->len >= len &&
+	       !strncmp(tp->start, name, len) &&
+	       (tp->len == len || isspace((int)(unsigned char)tp->start[len]));
+}
+
+/*
+ * Make sure scratch buffer can hold len characters plus terminating null.
+ */
+static char *
+scratch(memScratch_t *sp, size_t len)
+{
+	if (len >= sp->size) {
+		size_t size = sp->size ? sp->size : 1024;
+
+		while (len >= size)
+			size *= 2;
+		sp->buf = (char *)myRealloc(sp->buf, size);
+		sp->size = size;
+	}
+	return sp->buf;
+}
+
+/*
+ * Tag text, eliminating leading and trailing whitespace and leaving only
+ * a single space for all internal whitespace.  Result is valid until the
+ * next call for this memBuf.
+ */
+const char *
+getTokenTag(memBuf_t *mp, const htmlToken_t *tp)
+{
+	const char *p = tp->start, *end = tp->start + tp->len;
+	char *buf;
+	size_t count = 0;
+	int inStr = 0;
+
+	if (tp->len == 0)
+		return "";
+	buf = scratch(&mp->tagBuf, tp->len);
+	/* first character (and "!-" of comment) is kept as is */
+	buf[count++] = *p++;
+	if (*buf == '!' && p < end) {
+		buf[count++] = *p++;
+		if (buf[1] == '-' && p < end)
+			buf[count++] = *p++;
+	}
+	if (tp->comment) {
+		for (; p < end; ++p) {
+			if (isspace((int)(unsigned char)*p) && buf[count-1] == ' ')
 				continue;
-			addchar(buf, bufsize, count, (char)c);
+			buf[count++] = *p;
 		}
 	} else {
-		while ((c = memGetc(mp)) != EOF) {
-			switch (c) {
+		for (; p < end; ++p) {
+			switch (*p) {
 			case '\\':
-				addchar(buf, bufsize, count, (char)c);
-				c = memGetc(mp);
-				if (c == EOF) {
-					term(buf, bufsize, count);
-					log(("getTag(): returning %s\n", buf));
-					return buf;
-				}
-				addchar(buf, bufsize, count, (char)c);
-				break;
-			case '>':
-				if (inStr)
-					addchar(buf, bufsize, count, (char)c);
-				else {
-					term(buf, bufsize, count);
-					log(("getTag(): returning %s\n", buf));
-					return buf;
-				}
+				buf[count++] = *p;
+				if (++p < end)
+					buf[count++] = *p;
+				else
+					--p;
 				break;
 			case ' ':
 			case '\n':
@@ -130,52 +212,39 @@ getTag(memBuf_t *mp)
 			case '\t':
 			case '\v':
 				if (inStr)
-					addchar(buf, bufsize, count, (char)c);
-				else if (count > 0 && buf[count-1] != ' ')
-					addchar(buf, bufsize, count, ' ');
+					buf[count++] = *p;
+				else if (buf[count-1] != ' ')
+					buf[count++] = ' ';
 				break;
 			case '"':
 				inStr = !inStr;
 				/* fall through */
 			default:
-				addchar(buf, bufsize, count, (char)c);
+				buf[count++] = *p;
 			}
 		}
 	}
-	term(buf, bufsize, count);
-	log(("getTag(): returning %s\n", count ? buf : "NULL"));
-	return count ? buf : NULL;
+	buf[count] = '\0';
+	return buf;
 }
 
 /*
- * Get next non-tag text, eliminating leading and trailing whitespace
- * and leaving only a single space for all internal whitespace.
+ * Text with entities decoded, eliminating leading and trailing whitespace
+ * and leaving only a single space for all internal whitespace.  Result is
+ * valid until the next call for this memBuf.
+ *
+ * returns NULL if there is only whitespace.
  */
 char *
-getNonTag(memBuf_t *mp)
+getTokenText(memBuf_t *mp, const htmlToken_t *tp)
 {
-	static char *buf = NULL;
-	static size_t bufsize = 0;
+	const unsigned char *p = (const unsigned char *)tp->start;
+	const unsigned char *end = p + tp->len;
+	char *buf = scratch(&mp->textBuf, tp->len);
 	size_t count = 0, amp = 0;
-	int c;
 
-	if (memEof(mp)) {
-		log(("getNonTag(): returning NULL\n"));
-		return NULL;
-	}
-	while ((c = memGetc(mp)) != EOF) {
-		switch (c) {
-		case '<':
-			memUngetc(mp);
-			if (count) {
-				if (buf[count-1] == ' ')
-					--count;
-				term(buf, bufsize, count);
-				log(("getNonTag(): returning %s\n", buf));
-				return buf;
-			} else
-				(void)getTag(mp);
-			break;
+	for (; p < end; ++p) {
+		switch (*p) {
 		case ' ':
 		case '\n':
 		case '\r':
@@ -186,13 +255,13 @@ getNonTag(memBuf_t *mp)
 		case 0xC3: /* UTF-8 */
 		case 0xA0: /* iso-8859-1 nbsp */
 			if (count && buf[count-1] != ' ')
-				addchar(buf, bufsize, count, ' ');
+				buf[count++] = ' ';
 			break;
 		case ';':
 			if (amp > 0) {
 				char *cp = &buf[amp];
 
-				term(buf, bufsize, count);
+				buf[count] = '\0';
 				if (*cp == '#') {
 					buf[amp-1] = (char)atoi(cp+1);
 					count = amp;
@@ -213,54 +282,65 @@ getNonTag(memBuf_t *mp)
 					buf[amp-1] = '&';
 					count = amp;
 				} else
-					addchar(buf, bufsize, count, (char)c);
+					buf[count++] = (char)*p;
 				amp = 0;
 			} else
-				addchar(buf, bufsize, count, (char)c);
+				buf[count++] = (char)*p;
 			break;
 		case '&':
 			amp = count + 1;
 			/* fall through */
 		default:
-			addchar(buf, bufsize, count, (char)c);
+			buf[count++] = (char)*p;
 		}
 	}
 	if (count && buf[count-1] == ' ')
 		--count;
-	term(buf, bufsize, count);
-	log(("getNonTag(): returning %s\n", count ? buf : "NULL"));
+	buf[count] = '\0';
 	return count ? buf : NULL;
-} /* getNonTag() */
+}
 
-char *
-getNthNonTagFromString(const char *s, int n)
+/*
+ * Get next tag text, eliminating leading and trailing whitespace
+ * and leaving only a single space for all internal whitespace.
+ */
+const char *
+getTag(memBuf_t *mp)
 {
-	memBuf_t buf;
-	int i;
+	htmlToken_t tok;
+
+	while (getToken(mp, &tok)) {
+		if (tok.type == tt_tag) {
+			const char *ret = getTokenTag(mp, &tok);
 
-	strToMemBuf(s, &buf);
-	for (i = 1; i < n; i++)
-		getNonTag(&buf);
-	return myStrdup(getNonTag(&buf));
+			log(("getTag(): returning %s\n", ret));
+			return ret;
+		}
+	}
+	log(("getTag(): returning NULL\n"));
+	return NULL;
 }
 
+/*
+ * Get next non-tag text, eliminating leading and trailing whitespace
+ * and leaving only a single space for all internal whitespace.
+ */
 char *
-getNonTagFromString(const char *s)
+getNonTag(memBuf_t *mp)
 {
-	memBuf_t buf;
+	htmlToken_t tok;
 
-	strToMemBuf(s, &buf);
-	return myStrdup(getNonTag(&buf));
-}
+	while (getToken(mp, &tok)) {
+		char *ret;
 
-int
-getIntFromString(const char *s)
-{
-	memBuf_t buf;
-
-	strToMemBuf(s, &buf);
-	return atoi(getNonTag(&buf));
-}
+		if (tok.type == tt_text && (ret = getTokenText(mp, &tok))) {
+			log(("getNonTag(): returning %s\n", ret));
+			return ret;
+		}
+	}
+	log(("getNonTag(): returning NULL\n"));
+	return NULL;
+} /* getNonTag() */
 
 const char PAGENAME[] = "var pageName = \"";
 
@@ -271,13 +351,15 @@ char *
 getPageName(memBuf_t *mp)
 {
 	const char *line;
+	htmlToken_t tok;
 
 	log(("getPageName():\n"));
-	while ((line = getTag(mp))) {
+	while (getToken(mp, &tok)) {
 		char *tmp;
 
-		if (strncmp(line, "!--", 3))
+		if (!tok.comment)
 			continue;
+		line = getTokenTag(mp, &tok);
 		if ((tmp = strstr(line, PAGENAME))) {
 			tmp = getPageNameInternal(tmp);
 			log(("getPageName(): pagename = %s\n", nullStr(tmp)));
@@ -311,14 +393,13 @@ const char *
 getTableEnd(memBuf_t *mp)
 {
 	int nesting = 1;
-	const char *cp;
+	htmlToken_t tok;
 
-	while ((cp = getTag(mp))) {
-		if (!strcmp(cp, "/table")) {
+	while (getToken(mp, &tok)) {
+		if (tokenIsTag(&tok, "/table")) {
 			if (--nesting == 0)
-				return cp;
-		} else if (!strncmp(cp, "table", 5) &&
-			   (isspace((int)*(cp+5)) || *(cp+5) == '\0')) {
+				return getTokenTag(mp, &tok);
+		} else if (tokenIsTag(&tok, "table")) {
 			++nesting;
 		}
 	}
@@ -326,101 +407,117 @@ getTableEnd(memBuf_t *mp)
 }
 
 /*
- * Search for next table item.  Return NULL at end of a row, and another NULL
- * at the end of a table.
+ * Get next table row as spans of its cells, nothing is copied.  Spans
+ * exclude the <td> and </td> tags (or <th> and </th>).  Embedded tables
+ * are part of their cell.  The cells array of row is reused, call
+ * freeTableSpans() when done.
+ *
+ * returns number of cells, 0 at end of table (or an empty row).
  */
-char *
-getTableCell(memBuf_t *mp)
+int
+getTableSpans(memBuf_t *mp, tableRow_t *row)
 {
 	int nesting = 1;
-	const char *cp, *start = mp->readptr, *end = NULL;
-	static char *buf = NULL;
-	static size_t bufsize = 0;
-	size_t count = 0;
+	const char *start = mp->readptr;
+	htmlToken_t tok;
 
-	while ((cp = getTag(mp))) {
-		if (nesting == 1 && 
-		    (!strncmp(cp, "td", 2) || !strncmp(cp, "th", 2)) &&
-		    (isspace((int)*(cp+2)) || *(cp+2) == '\0')) {
+	row->numCells = 0;
+	while (getToken(mp, &tok)) {
+		if (tok.type != tt_tag)
+			continue;
+		if (nesting == 1 &&
+		    (tokenIsTag(&tok, "td") || tokenIsTag(&tok, "th"))) {
 			/* found <td>, now must find </td> */
 			start = mp->readptr;
-		} else if (nesting == 1 && 
-			(!strcmp(cp, "/td") || !strcmp(cp, "/th"))) {
-			/* end of this item */
-			for (end = mp->readptr - 1; *end != '<'; --end)
-				;
-			for (cp = start; cp < end; ++cp) {
-				addchar(buf, bufsize, count, *cp);
+		} else if (nesting == 1 &&
+			(tokenIsTag(&tok, "/td") || tokenIsTag(&tok, "/th"))) {
+			/* end of this item, up to '<' of </td> */
+			htmlSpan_t *sp;
+
+			if (row->numCells == row->size) {
+				row->size = row->size ? row->size * 2 : 8;
+				row->cells = (htmlSpan_t *)myRealloc(row->cells, (size_t)row->size * sizeof(htmlSpan_t));
 			}
-			term(buf, bufsize, count);
-			return buf;
-		} else if (nesting == 1 && !strcmp(cp, "/tr")) {
+			sp = &row->cells[row->numCells++];
+			sp->start = start;
+			sp->len = (size_t)(tok.start - 1 - start);
+			start = mp->readptr;
+		} else if (nesting == 1 && tokenIsTag(&tok, "/tr")) {
 			/* end of this row */
-			return NULL;
-		} else if (!strcmp(cp, "/table")) {
+			break;
+		} else if (tokenIsTag(&tok, "/table")) {
 			/* end of this table? */
 			if (--nesting == 0)
-				return NULL;
-		} else if (!strncmp(cp, "table", 5) &&
-			   (isspace((int)*(cp+5)) || *(cp+5) == '\0')) {
+				break;
+		} else if (tokenIsTag(&tok, "table")) {
 			++nesting;
 		}
 	}
-	/* error? */
-	return NULL;
+	return row->numCells;
+}
+
+void
+freeTableSpans(tableRow_t *row)
+{
+	free(row->cells);
+	row->cells = NULL;
+	row->numCells = row->size = 0;
 }
 
 /*
- * Return NULL-terminated table row, or NULL at end of table.
- * All cells are malloc'ed and should be freed by the calling function.
+ * Next non-tag text of a span, see getNonTag().  The span is advanced
+ * past the text.  Result is valid until the next call for this memBuf.
  */
-char **
-getTableRow(memBuf_t *mp)
+char *
+getSpanText(memBuf_t *mp, htmlSpan_t *sp)
 {
-	char **ret = NULL, *cp = NULL;
-	size_t size = 0, i = 0;
-
-	do {
-		cp = getTableCell(mp);
-		if (cp || i) {
-			if (i >= size) {
-				size += 10;
-				ret = (char **)myRealloc(ret, size * sizeof(char *));
-			}
-			ret[i++] = myStrdup(cp);
+	memBuf_t view;
+	htmlToken_t tok;
+
+	/* getToken() only needs these */
+	view.memory = view.readptr = (char *)sp->start;
+	view.size = sp->len;
+	while (getToken(&view, &tok)) {
+		char *ret;
+
+		if (tok.type == tt_text && (ret = getTokenText(mp, &tok))) {
+			sp->len -= (size_t)(view.readptr - sp->start);
+			sp->start = view.readptr;
+			return ret;
 		}
-	} while ((cp));
-	return ret;
+	}
+	sp->start += sp->len;
+	sp->len = 0;
+	return NULL;
 }
 
 /*
- * Return number of columns in row, or -1 if null.
+ * n-th non-tag text (starting with 1) of a cell, or NULL if not found.
+ * Result is valid until the next call for this memBuf.
  */
-int
-numColumns(char **row)
+char *
+getCellText(memBuf_t *mp, const tableRow_t *row, int column, int n)
 {
-	int ncols = 0;
+	htmlSpan_t span;
+	char *ret = NULL;
 
-	if (!row)
-		return -1;
-	while (row[ncols++])
+	if (column < 0 || column >= row->numCells)
+		return NULL;
+	span = row->cells[column];
+	while (n-- > 0 && (ret = getSpanText(mp, &span)))
 		;
-	return --ncols;
+	return ret;
 }
 
 /*
- * Free a TableRow allocated by getTableRow
+ * First non-tag text of a cell as integer, 0 if there is none.
  */
-void
-freeTableRow(char **row)
+int
+getCellInt(memBuf_t *mp, const tableRow_t *row, int column)
 {
-	char **cpp;
+	const char *s = getCellText(mp, row, column, 1);
 
-	if (row) {
-		for (cpp = row; *cpp; ++cpp)
-			free(*cpp);
-		free(row);
-	}
+	return s ? atoi(s) : 0;
 }
 
 /*
@@ -429,12 +526,11 @@ freeTableRow(char **row)
 const char *
 getTableStart(memBuf_t *mp)
 {
-	const char *cp;
+	htmlToken_t tok;
 
-	while ((cp = getTag(mp))) {
-		if (!strncmp(cp, "table", 5) &&
-		    (isspace((int)*(cp+5)) || *(cp+5) == '\0'))
-			return cp;
+	while (getToken(mp, &tok)) {
+		if (tokenIsTag(&tok, "table"))
+			return getTokenTag(mp, &tok);
 	}
 	return NULL;
 }
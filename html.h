@@ -29,6 +29,24 @@
 
 #include "http.h"
 
+/*
+ * HTML tokens.  A token points into the page, it is not null-terminated.
+ * Tag tokens exclude the enclosing '<' and '>'.
+ */
+typedef enum { tt_tag, tt_text } tokenType_t;
+
+typedef struct {
+	tokenType_t type;
+	const char *start;
+	size_t len;
+	int comment;	/* tag is a <!-- comment --> */
+} htmlToken_t;
+
+extern int getToken(memBuf_t *mp, htmlToken_t *tp);
+extern int tokenIsTag(const htmlToken_t *tp, const char *name);
+extern const char *getTokenTag(memBuf_t *mp, const htmlToken_t *tp);
+extern char *getTokenText(memBuf_t *mp, const htmlToken_t *tp);
+
 /*
  * Get next tag text, eliminating leading and trailing whitespace
  * and leaving only a single space for all internal whitespace.
@@ -40,9 +58,6 @@ extern const char *getTag(memBuf_t *mp);
  * and leaving only a single space for all internal whitespace.
  */
 extern char *getNonTag(memBuf_t *mp);
-extern char *getNthNonTagFromString(const char *s, int n);
-extern char *getNonTagFromString(const char *s);
-extern int getIntFromString(const char *s);
 
 /*
  * Get pagename variable, or NULL if not found.
@@ -58,26 +73,34 @@ extern const char PAGENAME[];
 extern const char *getTableStart(memBuf_t *mp);
 
 /*
- * Return NULL-terminated table row, or NULL at end of table.
- * All cells are malloc'ed and should be freed by the calling function.
+ * Table row, cells are spans of the page.
  */
-extern char **getTableRow(memBuf_t *mp);
+typedef struct {
+	const char *start;	/* not null-terminated */
+	size_t len;
+} htmlSpan_t;
 
-/*
- * Free a TableRow allocated by getTableRow
- */
-extern void freeTableRow(char **row);
+typedef struct {
+	htmlSpan_t *cells;
+	int numCells;
+	int size;		/* allocated cells */
+} tableRow_t;
+
+#define TABLE_ROW_INIT { NULL, 0, 0 }
 
 /*
- * Return number of columns in row, or -1 if null.
+ * Get next table row, returns number of cells, 0 at end of table.
  */
-extern int numColumns(char **row);
+extern int getTableSpans(memBuf_t *mp, tableRow_t *row);
+extern void freeTableSpans(tableRow_t *row);
 
 /*
- * Search for next table item.  Return NULL at end of a row, and another NULL
- * at the end of a table.
+ * Text of cells, extracted when needed.  Results are valid until the
+ * next call for this memBuf.
  */
-extern char *getTableCell(memBuf_t *mp);
+extern char *getSpanText(memBuf_t *mp, htmlSpan_t *sp);
+extern char *getCellText(memBuf_t *mp, const tableRow_t *row, int column, int n);
+extern int getCellInt(memBuf_t *mp, const tableRow_t *row, int column);
 
 /*
  * Search to end of table, returning /table tag (or NULL if not found).
@@ -27,6 +27,11 @@
 #define _GNU_SOURCE
 #include "http.h"
 #include "esniper.h"
+#include "buffer.h"
+#include "clocksync.h"
+#include "resolve.h"
+#include "schedule.h"
+#include "trace.h"
 #include <ctype.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
@@ -38,17 +43,138 @@
 #	define DEVNULL "/dev/null"
 #endif
 
-enum requestType {GET, POST};
+enum requestType {GET, POST, HEAD};
 
-static CURL *easyhandle = NULL;
+/*
+ * Pool of easy handles.  All handles share cookies, DNS cache and SSL
+ * sessions, and are driven by one multi handle, so they also share
+ * connections.  A handle is busy from the start of a request until its
+ * result has been handed to the caller.
+ */
+typedef struct httpHandle {
+	CURL *easyhandle;
+	memBuf_t *mp;		/* response */
+	char *url;		/* URL of current request */
+	char *logUrl;		/* same without secrets, NULL if url has none */
+	httpCallback_t func;	/* NULL for synchronous requests */
+	void *data;		/* argument for func */
+	usec_t started;		/* wall clock time request was started */
+	int busy;		/* request active or result not collected */
+	int done;		/* transfer finished */
+	httpEnough_t enough;	/* streaming: page is complete enough */
+	void *enoughData;	/* argument for enough */
+	int abortRest;		/* streaming: cancel rest of transfer */
+	int early;		/* streaming: enough data has arrived */
+	int hedge;		/* fresh connection or other proxy set */
+	int prepared;		/* set up by httpPrepareGet(), not started */
+	enum requestType rt;
+	int replaying;		/* waiting for answer from trace, see trace.c */
+	const traceEntry_t *answer;
+	usec_t due;		/* answer is due, see usecNow() */
+	httpTiming_t replayTiming;
+	CURLcode rc;		/* result of transfer */
+	struct curl_slist *reqHeaders;/* headers of conditional request */
+	unsigned int resolveGen;/* CURLOPT_RESOLVE list set, see resolve.c */
+	struct httpSession *session;/* cookies of this handle */
+	char errorbuf[CURL_ERROR_SIZE];
+	struct httpHandle *next;
+} httpHandle_t;
+
+/*
+ * Cookie jar, DNS and SSL session cache shared by the handles of one
+ * account.  Connections are kept by the multi handle for all of them.
+ */
+struct httpSession {
+	CURLSH *share;		/* created by newShare() when first used */
+	struct httpSession *next;
+};
+
+/*
+ * Hedged request in the background, see httpGetHedgedAsync().  Each copy
+ * gets a hedgeCopy_t as callback data, to tell which one has finished.
+ */
+typedef struct hedge hedge_t;
+
+typedef struct hedgeCopy {
+	hedge_t *hedge;
+	int n;			/* 0: first copy, 1: second copy */
+} hedgeCopy_t;
+
+struct hedge {
+	char *url;
+	char *logUrl;
+	char *proxy;		/* proxy for second copy, NULL: as first */
+	httpEnough_t definitive;/* page is an answer */
+	void *definitiveData;
+	httpCallback_t func;	/* called with the answer */
+	void *data;
+	httpSession_t *session;	/* cookies of both copies */
+	httpHandle_t *hp[2];	/* copies running */
+	hedgeCopy_t copy[2];
+	event_t *event;		/* start of second copy */
+	int second;		/* second copy has been started */
+	usec_t start;
+};
+
+static CURLM *multihandle = NULL;
+static httpSession_t defaultSession = { NULL, NULL };
+static httpSession_t *sessions = &defaultSession;
+static httpSession_t *session = &defaultSession;
+static struct curl_slist *headers = NULL;
+
+/* sent unless options.userAgent is set */
+static const char USER_AGENT[] = "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0";
+static httpHandle_t *pool = NULL;
 static CURLcode curlrc = CURLE_OK;
 static char *lastURL = NULL;
 static int curlInitDone = 0;
 static char globalErrorbuf[CURL_ERROR_SIZE];
 
-static memBuf_t *httpRequest(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType);
+/*
+ * Idle membufs.  Page memory and parser scratch buffers are kept, so
+ * steady state polling hardly touches the heap.
+ */
+#define MEMBUF_POOL 8			/* max. number of idle membufs */
+#define MEMBUF_KEEP (1024 * 1024)	/* don't keep larger buffers */
+#define MEMBUF_MIN (16 * 1024)		/* first allocation for a page */
+#define MEMBUF_HINT (16 * 1024 * 1024)	/* max. Content-Length to trust */
+static memBuf_t *membufPool[MEMBUF_POOL];
+static int membufPoolSize = 0;
+
+static memBuf_t *httpRequest(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType, httpEnough_t enough, void *enoughData, int abortRest, const httpValidator_t *cond);
+static int httpRequestAsync(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt, httpCallback_t func, void *cbdata, const httpValidator_t *cond);
 static memBuf_t *httpRequestFailed(memBuf_t *mp);
+static void initMembuf(memBuf_t *mp);
+static const char *urlHost(const char *url, size_t *len);
+static memBuf_t *newMembuf(void);
+static void reserveMembuf(memBuf_t *mp, size_t size);
+static void warmupDone(memBuf_t *mp, void *data);
+static void drainDone(memBuf_t *mp, void *data);
+static void getTiming(CURL *easyhandle, httpTiming_t *timing);
+static usec_t getTime(CURL *easyhandle, CURLINFO info);
+static httpHandle_t *getHandle(void);
+static httpHandle_t *sessionHandle(void);
+static int newShare(httpSession_t *sp);
+static httpHandle_t *newHandle(void);
+static httpHandle_t *hedgeCopy(hedge_t *h, int n);
+static void hedgeSecond(void *data);
+static void hedgeDone(memBuf_t *mp, void *data);
+static void hedgeFinish(hedge_t *h, memBuf_t *mp, int n);
+static void freeHedge(hedge_t *h);
+static void endHedge(httpHandle_t *hp);
+static int launchRequest(httpHandle_t *hp);
+static memBuf_t *waitRequest(httpHandle_t *hp);
+static void cancelRequest(httpHandle_t *hp);
+static int startRequest(httpHandle_t *hp, const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt, const httpValidator_t *cond);
+static void copyHeader(char *dst, size_t size, const char *src, size_t len);
+static void pollRequests(long timeout, struct curl_waitfd *extra, unsigned int nextra);
+static memBuf_t *finishRequest(httpHandle_t *hp);
+static void transferDone(httpHandle_t *hp, long code, long redirects);
+static void recordTransfer(const httpHandle_t *hp, const memBuf_t *mp, long code);
+static usec_t replayDue(void);
+static void replayAnswers(void);
 static size_t WriteMemoryCallback(void *ptr, size_t size, size_t nmemb, void *data);
+static size_t HeaderCallback(void *ptr, size_t size, size_t nmemb, void *data);
 static int initCurlStuffFailed(void);
 
 #ifdef NEED_CURL_EASY_STRERROR
@@ -76,14 +202,471 @@ httpError(auctionInfo *aip)
 memBuf_t *
 httpGet(const char *url, const char *logUrl)
 {
-	return httpRequest(url, logUrl, "", NULL, GET);
+	return httpRequest(url, logUrl, "", NULL, GET, NULL, NULL, 0, NULL);
+}
+
+/*
+ * GET with If-None-Match/If-Modified-Since from cond.  If the server
+ * says the page has not changed, the page returned is empty and has
+ * notModified set.
+ *
+ * returns page, or NULL on error.
+ */
+memBuf_t *
+httpGetIfChanged(const char *url, const char *logUrl, const httpValidator_t *cond)
+{
+	return httpRequest(url, logUrl, "", NULL, GET, NULL, NULL, 0, cond);
+}
+
+/*
+ * Streaming GET: enough is called whenever data has arrived.  When it
+ * returns non-0, the page received so far already has everything the
+ * caller needs, and it is returned right away.  If abortRest is set the
+ * rest of the transfer is cancelled, which also closes the connection.
+ * Otherwise the rest is read and discarded in the background, so the
+ * connection can be reused.
+ *
+ * returns page, or NULL on error.
+ */
+memBuf_t *
+httpGetStream(const char *url, const char *logUrl, httpEnough_t enough, void *data, int abortRest)
+{
+	return httpRequest(url, logUrl, "", NULL, GET, enough, data, abortRest, NULL);
 }
 
 /* returns open socket, or NULL on error */
 memBuf_t *
 httpPost(const char *url, const char *data, const char *logData)
 {
-	return httpRequest(url, NULL, data, logData, POST);
+	return httpRequest(url, NULL, data, logData, POST, NULL, NULL, 0, NULL);
+}
+
+/*
+ * Start a GET request in the background.  func is called from httpWait()
+ * with the page, or with NULL on error.  Until func returns, httpError()
+ * reports the error of this request.
+ *
+ * returns 0 if the request was started, non-0 otherwise.
+ */
+int
+httpGetAsync(const char *url, const char *logUrl, httpCallback_t func, void *data)
+{
+	return httpRequestAsync(url, logUrl, "", NULL, GET, func, data, NULL);
+}
+
+/*
+ * Conditional GET in the background, see httpGetIfChanged() and
+ * httpGetAsync().
+ */
+int
+httpGetIfChangedAsync(const char *url, const char *logUrl, const httpValidator_t *cond, httpCallback_t func, void *data)
+{
+	return httpRequestAsync(url, logUrl, "", NULL, GET, func, data, cond);
+}
+
+/*
+ * Hedged GET in the background: the request is sent on the usual (warm)
+ * connection, and stagger milliseconds later once more on a new
+ * connection, through proxy if that is not NULL.  The first copy that
+ * finishes with a page that definitive accepts wins, the other one is
+ * abandoned.  If both fail, func gets the result of the last one.  See
+ * httpGetAsync() about func.
+ *
+ * returns 0 if the request was started, non-0 otherwise.
+ */
+int
+httpGetHedgedAsync(const char *url, const char *logUrl, long stagger, const char *proxy, httpEnough_t definitive, void *definitiveData, httpCallback_t func, void *data)
+{
+	hedge_t *h;
+	int i;
+
+	if (!curlInitDone && initCurlStuff())
+		return 1;
+	h = (hedge_t *)myMalloc(sizeof(hedge_t));
+	h->url = myStrdup(url);
+	h->logUrl = myStrdup(logUrl);
+	h->proxy = myStrdup(proxy);
+	h->definitive = definitive;
+	h->definitiveData = definitiveData;
+	h->func = func;
+	h->data = data;
+	h->session = session;
+	for (i = 0; i < 2; ++i) {
+		h->hp[i] = NULL;
+		h->copy[i].hedge = h;
+		h->copy[i].n = i;
+	}
+	h->event = NULL;
+	h->second = 0;
+	h->start = usecTime();
+	if ((h->hp[0] = hedgeCopy(h, 0)))
+		h->event = scheduleEventUsec(h->start + (usec_t)stagger * 1000, hedgeSecond, h);
+	else {
+		log(("hedged request: first copy failed to start\n"));
+		h->second = 1;
+		if (!(h->hp[1] = hedgeCopy(h, 1))) {
+			freeHedge(h);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start copy n of a hedged request, the second one on a new connection.
+ *
+ * returns handle, or NULL on error.
+ */
+static httpHandle_t *
+hedgeCopy(hedge_t *h, int n)
+{
+	httpSession_t *current = session;
+	httpHandle_t *hp;
+
+	session = h->session;
+	hp = getHandle();
+	session = current;
+	if (!hp)
+		return NULL;
+	hp->func = hedgeDone;
+	hp->data = &h->copy[n];
+	hp->enough = NULL;
+	hp->enoughData = NULL;
+	hp->abortRest = 0;
+	if (n) {
+		hp->hedge = 1;
+		(void)curl_easy_setopt(hp->easyhandle, CURLOPT_FRESH_CONNECT, 1L);
+		if (h->proxy)
+			(void)curl_easy_setopt(hp->easyhandle, CURLOPT_PROXY, h->proxy);
+	}
+	if (startRequest(hp, h->url, h->logUrl, "", NULL, GET, NULL)) {
+		hp->func = NULL;
+		freeMembuf(finishRequest(hp));
+		return NULL;
+	}
+	return hp;
+}
+
+/* the second copy is due */
+static void
+hedgeSecond(void *data)
+{
+	hedge_t *h = (hedge_t *)data;
+
+	h->event = NULL;
+	h->second = 1;
+	if ((h->hp[1] = hedgeCopy(h, 1)))
+		return;
+	log(("hedged request: second copy failed to start\n"));
+	if (!h->hp[0])
+		hedgeFinish(h, NULL, 1);
+}
+
+static void
+hedgeDone(memBuf_t *mp, void *data)
+{
+	hedgeCopy_t *cp = (hedgeCopy_t *)data;
+	hedge_t *h = cp->hedge;
+	int n = cp->n;
+
+	h->hp[n] = NULL;
+	if ((mp && (!h->definitive || (*h->definitive)(mp, h->definitiveData))) ||
+	    (!h->hp[1 - n] && h->second)) {
+		/* winner, or the last one: report its result */
+		hedgeFinish(h, mp, n);
+		return;
+	}
+	/* other copy may still make it */
+	log(("hedged request: copy %d failed after %.3f seconds: %s\n",
+	     n + 1, (double)(usecTime() - h->start) / 1000000,
+	     mp ? "no definitive page" : curl_easy_strerror(curlrc)));
+	freeMembuf(mp);
+	if (!h->second) {
+		cancelEvent(h->event);
+		hedgeSecond(h);
+	}
+}
+
+/*
+ * Copy n of a hedged request is the answer, abandon the other one.
+ */
+static void
+hedgeFinish(hedge_t *h, memBuf_t *mp, int n)
+{
+	log(("hedged request: copy %d answered after %.3f seconds\n",
+	     n + 1, (double)(usecTime() - h->start) / 1000000));
+	if (h->hp[1 - n]) {
+		log(("hedged request: copy %d abandoned\n", 2 - n));
+		cancelRequest(h->hp[1 - n]);
+		h->hp[1 - n] = NULL;
+	}
+	if (h->event)
+		cancelEvent(h->event);
+	(*h->func)(mp, h->data);
+	freeHedge(h);
+}
+
+static void
+freeHedge(hedge_t *h)
+{
+	free(h->url);
+	free(h->logUrl);
+	free(h->proxy);
+	free(h);
+}
+
+/*
+ * Restore settings changed by hedgeCopy().
+ */
+static void
+endHedge(httpHandle_t *hp)
+{
+	if (!hp->hedge)
+		return;
+	hp->hedge = 0;
+	(void)curl_easy_setopt(hp->easyhandle, CURLOPT_FRESH_CONNECT, 0L);
+	(void)curl_easy_setopt(hp->easyhandle, CURLOPT_PROXY, options.proxy);
+}
+
+/*
+ * Abandon a request, its connection is closed if it is still running.
+ */
+static void
+cancelRequest(httpHandle_t *hp)
+{
+	if (!hp->done && !hp->replaying)
+		curl_multi_remove_handle(multihandle, hp->easyhandle);
+	hp->replaying = 0;
+	endHedge(hp);
+	freeMembuf(hp->mp);
+	hp->mp = NULL;
+	hp->done = 0;
+	hp->busy = 0;
+}
+
+/*
+ * Set up a GET request on a handle of its own, to be sent later by
+ * httpFire().  Everything that can be done in advance is done here, so
+ * firing does not allocate memory or format anything.
+ *
+ * returns request, or NULL on error.
+ */
+httpRequest_t *
+httpPrepareGet(const char *url, const char *logUrl)
+{
+	httpHandle_t *hp;
+
+	if (!curlInitDone && initCurlStuff())
+		return NULL;
+	if (!(hp = getHandle()))
+		return NULL;
+	hp->func = NULL;
+	hp->data = NULL;
+	hp->enough = NULL;
+	hp->enoughData = NULL;
+	hp->abortRest = 0;
+	hp->prepared = 1;
+	if (startRequest(hp, url, logUrl, "", NULL, GET, NULL)) {
+		hp->prepared = 0;
+		freeMembuf(finishRequest(hp));
+		return NULL;
+	}
+	/* reserved, but not counted as running by httpActive() */
+	hp->done = 1;
+	return hp;
+}
+
+/*
+ * Send a request set up by httpPrepareGet() and wait for the answer.
+ * The request is gone afterwards.
+ *
+ * returns page, or NULL on error.
+ */
+memBuf_t *
+httpFire(httpRequest_t *hp)
+{
+	hp->prepared = 0;
+	if (launchRequest(hp))
+		return finishRequest(hp);
+	return waitRequest(hp);
+}
+
+/*
+ * Send a request set up by httpPrepareGet() in the background, func is
+ * called with the answer (see httpGetAsync()).  The request is gone
+ * afterwards, also on error.
+ *
+ * returns 0 if the request was sent, non-0 otherwise.
+ */
+int
+httpFireAsync(httpRequest_t *hp, httpCallback_t func, void *data)
+{
+	hp->prepared = 0;
+	if (launchRequest(hp)) {
+		freeMembuf(finishRequest(hp));
+		return 1;
+	}
+	hp->func = func;
+	hp->data = data;
+	return 0;
+}
+
+/*
+ * Drop a request set up by httpPrepareGet() without sending it.
+ */
+void
+httpRelease(httpRequest_t *hp)
+{
+	if (!hp)
+		return;
+	hp->prepared = 0;
+	hp->done = 0;
+	hp->busy = 0;
+	freeMembuf(hp->mp);
+	hp->mp = NULL;
+}
+
+/*
+ * Start a POST request in the background, see httpGetAsync().
+ */
+int
+httpPostAsync(const char *url, const char *data, const char *logData, httpCallback_t func, void *cbdata)
+{
+	return httpRequestAsync(url, NULL, data, logData, POST, func, cbdata, NULL);
+}
+
+/*
+ * Open (or keep alive) a connection to the server of url with a cheap
+ * HEAD request in the background, so a later request does not have to
+ * wait for DNS lookup, TCP connect and SSL handshake.
+ *
+ * returns 0 if the request was started, non-0 otherwise.
+ */
+int
+httpWarmup(const char *url)
+{
+	return httpRequestAsync(url, NULL, NULL, NULL, HEAD, warmupDone, NULL, NULL);
+}
+
+static void
+warmupDone(memBuf_t *mp, void *data)
+{
+	freeMembuf(mp);
+}
+
+/* end of a streamed transfer, page was returned before */
+static void
+drainDone(memBuf_t *mp, void *data)
+{
+	freeMembuf(mp);
+}
+
+/*
+ * Number of background requests whose callback has not been called yet.
+ */
+int
+httpPending(void)
+{
+	httpHandle_t *hp;
+	int count = 0;
+
+	for (hp = pool; hp; hp = hp->next)
+		if (hp->busy && hp->func)
+			++count;
+	return count;
+}
+
+/*
+ * Number of transfers in progress to the server of url.
+ */
+int
+httpActive(const char *url)
+{
+	httpHandle_t *hp;
+	size_t len;
+	const char *host = urlHost(url, &len);
+	int count = 0;
+
+	for (hp = pool; hp; hp = hp->next) {
+		const char *h;
+		size_t l;
+
+		if (!hp->busy || hp->done || !hp->url)
+			continue;
+		h = urlHost(hp->url, &l);
+		if (l == len && !strncasecmp(h, host, len))
+			++count;
+	}
+	return count;
+}
+
+/* host[:port] part of url */
+static const char *
+urlHost(const char *url, size_t *len)
+{
+	const char *s = strstr(url, "://");
+
+	s = s ? s + 3 : url;
+	*len = strcspn(s, "/?#");
+	return s;
+}
+
+/*
+ * Wait up to timeout milliseconds for background requests, and call
+ * the callbacks of all requests that have finished.
+ *
+ * returns number of callbacks called.
+ */
+int
+httpWait(long timeout)
+{
+	return httpWaitFds(timeout, NULL, NULL, NULL, 0);
+}
+
+/*
+ * Like httpWait(), but also wait for nfds other file descriptors.
+ * ready[i] is set non-0 if fds[i] is readable, or writable if writing[i]
+ * is non-0.
+ */
+int
+httpWaitFds(long timeout, const int *fds, const int *writing, int *ready, int nfds)
+{
+	httpHandle_t *hp;
+	struct curl_waitfd *extra = NULL;
+	int count = 0, i;
+
+	if (!curlInitDone && (nfds == 0 || initCurlStuff()))
+		return 0;
+	for (hp = pool; hp; hp = hp->next)
+		if (hp->busy && hp->func && hp->done)
+			timeout = 0;
+	if (nfds > 0) {
+		extra = (struct curl_waitfd *)myMalloc(nfds * sizeof(struct curl_waitfd));
+		for (i = 0; i < nfds; ++i) {
+			extra[i].fd = fds[i];
+			extra[i].events = writing[i] ? CURL_WAIT_POLLOUT : CURL_WAIT_POLLIN;
+			extra[i].revents = 0;
+		}
+	}
+	pollRequests(timeout, extra, (unsigned int)nfds);
+	for (i = 0; i < nfds; ++i)
+		ready[i] = extra[i].revents != 0;
+	free(extra);
+
+	/* callbacks may start new requests, so rescan after each one */
+	for (hp = pool; hp; ) {
+		if (hp->busy && hp->func && hp->done) {
+			httpCallback_t func = hp->func;
+			void *data = hp->data;
+			memBuf_t *mp = finishRequest(hp);
+
+			++count;
+			(*func)(mp, data);
+			hp = pool;
+		} else
+			hp = hp->next;
+	}
+	return count;
 }
 
 /*
@@ -92,21 +675,92 @@ httpPost(const char *url, const char *data, const char *logData)
 memBuf_t *
 strToMemBuf(const char *s, memBuf_t *mp)
 {
+	initMembuf(mp);
 	mp->timeToFirstByte = time(NULL);
 	mp->memory = myStrdup(s);
 	mp->readptr = mp->memory;
 	mp->size = s ? strlen(s) : 0;
+	mp->alloc = s ? mp->size + 1 : 0;
+	return mp;
+}
+
+static void
+initMembuf(memBuf_t *mp)
+{
+	memset(mp, 0, sizeof(memBuf_t));
+}
+
+/*
+ * Get an empty membuf, recycled if possible.
+ */
+static memBuf_t *
+newMembuf(void)
+{
+	memBuf_t *mp;
+
+	if (membufPoolSize > 0)
+		return membufPool[--membufPoolSize];
+	mp = (memBuf_t *)myMalloc(sizeof(memBuf_t));
+	initMembuf(mp);
 	return mp;
 }
 
 /*
- * Free membuf.
+ * Make room for size bytes.  Memory grows geometrically, so a page
+ * arriving in many small chunks is not copied over and over.
+ */
+static void
+reserveMembuf(memBuf_t *mp, size_t size)
+{
+	size_t alloc = mp->alloc ? mp->alloc : MEMBUF_MIN;
+
+	if (size <= mp->alloc)
+		return;
+	while (alloc < size)
+		alloc *= 2;
+	mp->memory = (char *)myRealloc(mp->memory, alloc);
+	mp->readptr = mp->memory;
+	mp->alloc = alloc;
+}
+
+/*
+ * Free contents of membuf, but not membuf itself (for membufs on the
+ * stack, see strToMemBuf()).
  */
 void
-freeMembuf(memBuf_t *mp)
+clearMembuf(memBuf_t *mp)
 {
 	if (mp) {
 		free(mp->memory);
+		free(mp->tagBuf.buf);
+		free(mp->textBuf.buf);
+		initMembuf(mp);
+	}
+}
+
+/*
+ * Free membuf.  Up to MEMBUF_POOL membufs are kept with their buffers
+ * for the next request.
+ */
+void
+freeMembuf(memBuf_t *mp)
+{
+	if (!mp)
+		return;
+	if (membufPoolSize < MEMBUF_POOL && mp->alloc <= MEMBUF_KEEP) {
+		memBuf_t keep = *mp;
+
+		initMembuf(mp);
+		mp->memory = keep.memory;
+		mp->alloc = keep.alloc;
+		mp->readptr = mp->memory;
+		if (mp->memory)
+			mp->memory[0] = '\0';
+		mp->tagBuf = keep.tagBuf;
+		mp->textBuf = keep.textBuf;
+		membufPool[membufPoolSize++] = mp;
+	} else {
+		clearMembuf(mp);
 		free(mp);
 	}
 }
@@ -118,72 +772,505 @@ memBuf_t *
 readFile(FILE *fp)
 {
 	static memBuf_t membuf = { NULL, 0, NULL, 0 };
-	static const size_t BUFINC = 20 * 1024;
 	size_t i = 0;
 	int c;
 
-	if (membuf.memory)
-		free(membuf.memory);
-	membuf.size = BUFINC;
-	membuf.memory = (char *)myMalloc(membuf.size);
+	clearMembuf(&membuf);
 	while ((c = getc(fp)) != EOF) {
-		if (i == membuf.size) {
-			membuf.size += BUFINC;
-			membuf.memory = (char *)myRealloc(membuf.memory, membuf.size);
-		}
+		if (i + 1 >= membuf.alloc)
+			reserveMembuf(&membuf, i + 2);
 		membuf.memory[i++] = (char)c;
 	}
+	reserveMembuf(&membuf, i + 1);
+	membuf.memory[i] = '\0';
 	membuf.size = i;
 	membuf.readptr = membuf.memory;
 	return &membuf;
 }
 
 static memBuf_t *
-httpRequest(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt)
+httpRequest(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt, httpEnough_t enough, void *enoughData, int abortRest, const httpValidator_t *cond)
 {
-	const char *nonNullData = data ? data : "";
-	memBuf_t *mp = (memBuf_t *)myMalloc(sizeof(memBuf_t));
-	char *metaRefresh;
-
-	mp->memory = mp->readptr = NULL;
-	mp->size = 0;
-	mp->timeToFirstByte = 0;
+	httpHandle_t *hp;
 
-	if(lastURL) free(lastURL);
+	if (lastURL) free(lastURL);
 	lastURL = myStrdup(url);
 
 	if (!curlInitDone && initCurlStuff())
 		return NULL;
 
+	if (!(hp = getHandle()))
+		return NULL;
+	hp->func = NULL;
+	hp->data = NULL;
+	hp->enough = enough;
+	hp->enoughData = enoughData;
+	hp->abortRest = abortRest;
+	if (startRequest(hp, url, logUrl, data, logData, rt, cond))
+		return finishRequest(hp);
+	return waitRequest(hp);
+}
+
+/*
+ * Wait for a synchronous request to finish, or (streaming) to have
+ * enough data.
+ */
+static memBuf_t *
+waitRequest(httpHandle_t *hp)
+{
+	memBuf_t *mp;
+
+	/* other requests make progress too, but their callbacks are
+	 * left for httpWait()
+	 */
+	while (!hp->done && !(hp->early && !hp->abortRest))
+		pollRequests(1000, NULL, 0);
+	if (hp->done)
+		return finishRequest(hp);
+
+	/* enough of the page is here, rest is drained in the background */
+	log(("got enough of page, reading rest in background"));
+	mp = hp->mp;
+	hp->mp = NULL;
+	hp->func = drainDone;
+	curlrc = CURLE_OK;
+	globalErrorbuf[0] = '\0';
+	getTiming(hp->easyhandle, &mp->timing);
+	if (options.record) {
+		long code = 0;
+
+		curl_easy_getinfo(hp->easyhandle, CURLINFO_RESPONSE_CODE, &code);
+		recordTransfer(hp, mp, code);
+	}
+	return mp;
+}
+
+static int
+httpRequestAsync(const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt, httpCallback_t func, void *cbdata, const httpValidator_t *cond)
+{
+	httpHandle_t *hp;
+
+	if (!curlInitDone && initCurlStuff())
+		return 1;
+
+	if (!(hp = getHandle()))
+		return 1;
+	hp->func = func;
+	hp->data = cbdata;
+	hp->enough = NULL;
+	hp->enoughData = NULL;
+	hp->abortRest = 0;
+	if (startRequest(hp, url, logUrl, data, logData, rt, cond)) {
+		/* report error to caller, not callback */
+		hp->func = NULL;
+		freeMembuf(finishRequest(hp));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Get an idle handle of the current session from the pool, add a new one
+ * if all are busy.
+ */
+static httpHandle_t *
+getHandle(void)
+{
+	httpHandle_t *hp, **hpp;
+
+	for (hpp = &pool; (hp = *hpp); hpp = &hp->next)
+		if (!hp->busy && hp->session == session)
+			return hp;
+	return (*hpp = newHandle());
+}
+
+/*
+ * Any handle of the current session, for access to its cookies.
+ */
+static httpHandle_t *
+sessionHandle(void)
+{
+	httpHandle_t *hp, **hpp;
+
+	for (hpp = &pool; (hp = *hpp); hpp = &hp->next)
+		if (hp->session == session)
+			return hp;
+	return (*hpp = newHandle());
+}
+
+/*
+ * New session with its own cookies, see httpUseSession().
+ */
+httpSession_t *
+httpNewSession(void)
+{
+	httpSession_t *sp = (httpSession_t *)myMalloc(sizeof(httpSession_t));
+
+	sp->share = NULL;
+	sp->next = sessions;
+	sessions = sp;
+	return sp;
+}
+
+/*
+ * Send the following requests with the cookies of session sp, NULL
+ * switches back to the default session.  Background requests keep the
+ * session they were started in.
+ */
+void
+httpUseSession(httpSession_t *sp)
+{
+	session = sp ? sp : &defaultSession;
+}
+
+/*
+ * Share cookies, DNS and SSL sessions between all handles of a session.
+ *
+ * Returns 0 on success, non-0 otherwise.
+ */
+static int
+newShare(httpSession_t *sp)
+{
+	if (!(sp->share = curl_share_init()))
+		return -1;
+	curl_share_setopt(sp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	curl_share_setopt(sp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(sp->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	return 0;
+}
+
+/*
+ * Set up request on handle and add it to the multi handle.
+ *
+ * returns 0 on success, non-0 otherwise (handle is still busy, result
+ * must be collected with finishRequest()).
+ */
+static int
+startRequest(httpHandle_t *hp, const char *url, const char *logUrl, const char *data, const char *logData, enum requestType rt, const httpValidator_t *cond)
+{
+	CURL *easyhandle = hp->easyhandle;
+	const char *nonNullData = data ? data : "";
+	memBuf_t *mp = newMembuf();
+
+	hp->busy = 1;
+	hp->done = 1;
+	hp->early = 0;
+	hp->mp = mp;
+	hp->errorbuf[0] = '\0';
+	hp->rt = rt;
+	hp->replaying = 0;
+	free(hp->url);
+	hp->url = myStrdup(url);
+	free(hp->logUrl);
+	hp->logUrl = logUrl ? myStrdup(logUrl) : NULL;
+
 	/* Note: was CURLOPT_WRITEDATA, which is the same as CURLOPT_FILE.
 	 * Some older versions of libcurl don't have CURLOPT_WRITEDATA.
 	 */
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_FILE, (void *)mp)))
-		return httpRequestFailed(mp);
+	if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_FILE, (void *)hp)))
+		return 1;
+	if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_WRITEHEADER, (void *)hp)))
+		return 1;
 
 	if (rt == GET) {
-		if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_HTTPGET, 1)))
-			return httpRequestFailed(mp);
+		if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_HTTPGET, 1L)))
+			return 1;
+	} else if (rt == HEAD) {
+		if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_NOBODY, 1L)))
+			return 1;
 	} else {
 		log(("%s", logData ? logData : nonNullData));
-		if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_POSTFIELDS, nonNullData)))
-			return httpRequestFailed(mp);
+		if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_NOBODY, 0L)))
+			return 1;
+		/* request may outlive data, so let libcurl copy it */
+		if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_COPYPOSTFIELDS, nonNullData)))
+			return 1;
+	}
+
+	/* conditional request: common headers plus validators */
+	curl_slist_free_all(hp->reqHeaders);
+	hp->reqHeaders = NULL;
+	if (cond && (cond->etag[0] || cond->lastModified[0])) {
+		struct curl_slist *sp;
+		char buf[sizeof(cond->etag) + 20];
+
+		for (sp = headers; sp; sp = sp->next)
+			hp->reqHeaders = curl_slist_append(hp->reqHeaders, sp->data);
+		if (cond->etag[0]) {
+			sprintf(buf, "If-None-Match: %s", cond->etag);
+			hp->reqHeaders = curl_slist_append(hp->reqHeaders, buf);
+		}
+		if (cond->lastModified[0]) {
+			sprintf(buf, "If-Modified-Since: %s", cond->lastModified);
+			hp->reqHeaders = curl_slist_append(hp->reqHeaders, buf);
+		}
 	}
+	if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, hp->reqHeaders ? hp->reqHeaders : headers)))
+		return 1;
+
+#if LIBCURL_VERSION_NUM >= 0x071503
+	/* addresses resolved in the background */
+	if (options.resolve) {
+		unsigned int gen;
+		struct curl_slist *resolve = resolveList(&gen);
+
+		if (gen != hp->resolveGen) {
+			if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_RESOLVE, resolve)))
+				return 1;
+			hp->resolveGen = gen;
+		}
+	}
+#endif
 
 	log(("%s", logUrl ? logUrl : url));
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_URL, url)))
-		return httpRequestFailed(mp);
+	if ((hp->rc = curl_easy_setopt(easyhandle, CURLOPT_URL, hp->url)))
+		return 1;
 
-	if ((curlrc = curl_easy_perform(easyhandle)))
-		return httpRequestFailed(mp);
+	return hp->prepared ? 0 : launchRequest(hp);
+}
+
+/*
+ * Add handle set up by startRequest() to the multi handle.
+ *
+ * returns 0 on success, non-0 otherwise.
+ */
+static int
+launchRequest(httpHandle_t *hp)
+{
+	/* answer comes from trace, no network */
+	if (options.replay) {
+		hp->answer = traceFind(hp->rt == GET ? "GET" : hp->rt == POST ? "POST" : "HEAD", hp->url);
+		hp->due = usecNow() + traceLatency(hp->answer, &hp->replayTiming);
+		hp->replaying = 1;
+		hp->done = 0;
+		hp->started = usecTime();
+		return 0;
+	}
+	if (curl_multi_add_handle(multihandle, hp->easyhandle) != CURLM_OK) {
+		hp->rc = CURLE_FAILED_INIT;
+		return 1;
+	}
+	hp->done = 0;
+	hp->started = usecTime();
+	return 0;
+}
+
+/*
+ * Run transfers, waiting up to timeout milliseconds for network
+ * activity or the extra file descriptors.  Finished transfers are marked
+ * done, pages redirected by META Refresh are fetched on the same handle.
+ */
+static void
+pollRequests(long timeout, struct curl_waitfd *extra, unsigned int nextra)
+{
+	CURLMsg *msg;
+	int running = 0;
+	int left;
+	usec_t due = options.replay ? replayDue() : -1;
+	usec_t wait = (usec_t)timeout * 1000;
+
+	/* wake up when the next replayed answer is due */
+	if (due >= 0 && due < wait) {
+		wait = due;
+		timeout = (long)((due + 999) / 1000);
+	}
+	curl_multi_perform(multihandle, &running);
+	if (running || nextra > 0) {
+		curl_multi_wait(multihandle, extra, nextra, (int)timeout, NULL);
+		checkSignals();
+		curl_multi_perform(multihandle, &running);
+	} else if (due >= 0 && wait > 0)
+		(void)sleepUntil(usecNow() + wait, 0);
+	if (options.replay)
+		replayAnswers();
+
+	while ((msg = curl_multi_info_read(multihandle, &left))) {
+		httpHandle_t *hp = NULL;
+		long code = 0, redirects = 0;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&hp);
+		hp->rc = msg->data.result;
+		curl_multi_remove_handle(multihandle, hp->easyhandle);
+		hp->done = 1;
+		/* streamed transfer cancelled on purpose */
+		if (hp->early && hp->rc == CURLE_WRITE_ERROR) {
+			hp->rc = CURLE_OK;
+			hp->errorbuf[0] = '\0';
+		}
+		/* page already returned */
+		if (!hp->mp)
+			continue;
+		if (hp->rc != CURLE_OK) {
+			if (options.record)
+				recordTransfer(hp, NULL, 0);
+			continue;
+		}
+		getTiming(hp->easyhandle, &hp->mp->timing);
+		curl_easy_getinfo(hp->easyhandle, CURLINFO_RESPONSE_CODE, &code);
+		curl_easy_getinfo(hp->easyhandle, CURLINFO_REDIRECT_COUNT, &redirects);
+		if (options.record)
+			recordTransfer(hp, hp->mp, code);
+		transferDone(hp, code, redirects);
+	}
+}
+
+/*
+ * Page has arrived: note clock sample, follow META Refresh.
+ */
+static void
+transferDone(httpHandle_t *hp, long code, long redirects)
+{
+	char *metaRefresh;
+
+	hp->mp->notModified = code == 304;
+	/* timing of redirected requests is not known */
+	if (hp->mp->date && hp->mp->timing.firstByte > 0 && redirects == 0)
+		clockSample(hp->mp->date,
+			    hp->started + hp->mp->timing.request,
+			    hp->started + hp->mp->timing.firstByte);
 
 	log(("checking for META Refresh"));
-	if ((metaRefresh = memGetMetaRefresh(mp)) != NULL) {
+	if ((metaRefresh = memGetMetaRefresh(hp->mp)) != NULL) {
 		log(("page redirection by META Refresh: %s\n", metaRefresh));
-		freeMembuf(mp);
-		return httpGet(metaRefresh, NULL);
+		freeMembuf(hp->mp);
+		hp->mp = NULL;
+		(void)startRequest(hp, metaRefresh, NULL, NULL, NULL, GET, NULL);
+		free(metaRefresh);
+	}
+}
+
+/*
+ * Write transfer to trace file, mp is NULL if it failed.
+ */
+static void
+recordTransfer(const httpHandle_t *hp, const memBuf_t *mp, long code)
+{
+	traceEntry_t entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.started = hp->started;
+	entry.method = hp->rt == GET ? "GET" : hp->rt == POST ? "POST" : "HEAD";
+	/* the trace must not reveal what the log does not */
+	entry.url = hp->logUrl ? hp->logUrl : hp->url;
+	entry.rc = (int)hp->rc;
+	entry.code = code;
+	if (mp) {
+		entry.date = mp->date;
+		entry.timing = mp->timing;
+		entry.validator = mp->validator;
+		entry.body = mp->memory;
+		entry.size = mp->size;
+	}
+	traceRecord(&entry);
+}
+
+/*
+ * returns microseconds until the next replayed answer is due (0 if one
+ * is due now), -1 if no answers are outstanding.
+ */
+static usec_t
+replayDue(void)
+{
+	httpHandle_t *hp;
+	usec_t now = usecNow(), due = -1;
+
+	for (hp = pool; hp; hp = hp->next) {
+		if (!hp->busy || !hp->replaying)
+			continue;
+		if (hp->due <= now)
+			return 0;
+		if (due < 0 || hp->due - now < due)
+			due = hp->due - now;
+	}
+	return due;
+}
+
+/*
+ * Hand out replayed answers that are due, as if they had just arrived.
+ */
+static void
+replayAnswers(void)
+{
+	httpHandle_t *hp;
+	usec_t now = usecNow();
+
+	for (hp = pool; hp; hp = hp->next) {
+		const traceEntry_t *tp = hp->answer;
+		memBuf_t *mp = hp->mp;
+
+		if (!hp->busy || !hp->replaying || hp->due > now)
+			continue;
+		hp->replaying = 0;
+		hp->done = 1;
+		if (!tp) {
+			hp->rc = CURLE_COULDNT_CONNECT;
+			sprintf(hp->errorbuf, "no answer in trace file");
+			continue;
+		}
+		hp->rc = (CURLcode)tp->rc;
+		if (hp->rc != CURLE_OK || !mp)
+			continue;
+		reserveMembuf(mp, tp->size + 1);
+		memcpy(mp->memory, tp->body, tp->size + 1);
+		mp->size = tp->size;
+		mp->timeToFirstByte = time(NULL);
+		mp->date = traceDate(tp);
+		mp->validator = tp->validator;
+		mp->timing = hp->replayTiming;
+		transferDone(hp, tp->code, 0);
 	}
+}
+
+/*
+ * Get timing of last transfer on handle.
+ */
+static void
+getTiming(CURL *easyhandle, httpTiming_t *timing)
+{
+	timing->dns = getTime(easyhandle, CURLINFO_NAMELOOKUP_TIME);
+	timing->connect = getTime(easyhandle, CURLINFO_CONNECT_TIME);
+	timing->ssl = getTime(easyhandle, CURLINFO_APPCONNECT_TIME);
+	timing->request = getTime(easyhandle, CURLINFO_PRETRANSFER_TIME);
+	timing->firstByte = getTime(easyhandle, CURLINFO_STARTTRANSFER_TIME);
+	timing->total = getTime(easyhandle, CURLINFO_TOTAL_TIME);
+	log(("timing: dns %ld connect %ld ssl %ld request %ld first byte %ld total %ld usec",
+	     (long)timing->dns, (long)timing->connect, (long)timing->ssl,
+	     (long)timing->request, (long)timing->firstByte,
+	     (long)timing->total));
+}
 
+static usec_t
+getTime(CURL *easyhandle, CURLINFO info)
+{
+	double t = 0;
+
+	if (curl_easy_getinfo(easyhandle, info, &t) != CURLE_OK)
+		return 0;
+	return (usec_t)(t * 1000000);
+}
+
+/*
+ * Collect result of request and release handle.  Sets error details
+ * for httpError().
+ *
+ * returns page, or NULL on error.
+ */
+static memBuf_t *
+finishRequest(httpHandle_t *hp)
+{
+	memBuf_t *mp = hp->mp;
+
+	hp->mp = NULL;
+	hp->busy = 0;
+	endHedge(hp);
+	curlrc = hp->rc;
+	strcpy(globalErrorbuf, hp->errorbuf);
+	if (lastURL) free(lastURL);
+	lastURL = myStrdup(hp->url);
+	if (curlrc != CURLE_OK)
+		return httpRequestFailed(mp);
 	return mp;
 }
 
@@ -202,65 +1289,252 @@ httpRequestFailed(memBuf_t *mp)
 int
 initCurlStuff(void)
 {
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	if (!(multihandle = curl_multi_init()))
+		return -1;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	/* several HTTP/2 requests to a host can share one connection */
+	if (options.http2)
+		curl_multi_setopt(multihandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+	if (!defaultSession.share && newShare(&defaultSession))
+		return -1;
+
 	/* list for custom headers */
-	struct curl_slist *slist=NULL;
+	headers = curl_slist_append(headers, "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8");
+	headers = curl_slist_append(headers, "Accept-Language: en-US,en;q=0.5");
+	headers = curl_slist_append(headers, "Cache-Control: no-cache");
 
-	curl_global_init(CURL_GLOBAL_ALL);
+	/* first handle, so setup errors are reported early */
+	if (!(pool = newHandle()))
+		return -1;
+
+	if (options.resolve && !options.replay)
+		resolveStart();
+
+	curlInitDone = 1;
+	return 0;
+}
+
+/*
+ * Create and set up a new easy handle.
+ *
+ * returns handle, or NULL on error.
+ */
+static httpHandle_t *
+newHandle(void)
+{
+	httpHandle_t *hp = (httpHandle_t *)myMalloc(sizeof(httpHandle_t));
+	CURL *easyhandle;
+
+	hp->mp = NULL;
+	hp->url = NULL;
+	hp->logUrl = NULL;
+	hp->func = NULL;
+	hp->data = NULL;
+	hp->busy = 0;
+	hp->done = 0;
+	hp->enough = NULL;
+	hp->enoughData = NULL;
+	hp->abortRest = 0;
+	hp->early = 0;
+	hp->hedge = 0;
+	hp->prepared = 0;
+	hp->rc = CURLE_OK;
+	hp->reqHeaders = NULL;
+	hp->resolveGen = 0;
+	hp->session = session;
+	hp->errorbuf[0] = '\0';
+	hp->next = NULL;
+
+	if (!session->share && newShare(session)) {
+		free(hp);
+		return NULL;
+	}
 
 	/* init the curl session */
-	if (!(easyhandle = curl_easy_init()))
-		return -1;
+	if (!(hp->easyhandle = easyhandle = curl_easy_init())) {
+		free(hp);
+		return NULL;
+	}
 
 	/* buffer for error messages */
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, globalErrorbuf)))
-		return initCurlStuffFailed();
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, hp->errorbuf)))
+		goto failed;
+
+	/* find handle again when transfer is done */
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_PRIVATE, (char *)hp)))
+		goto failed;
+
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_SHARE, session->share)))
+		goto failed;
 
 	/* debug output, show what libcurl does */
 	if (options.curldebug &&
-		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1)))
-		return initCurlStuffFailed();
+		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 1L)))
+		goto failed;
+
+	/* detect dead idle connections */
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_TCP_KEEPALIVE, 1L)))
+		goto failed;
 
 	/* follow all redirects */
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_FOLLOWLOCATION, 1)))
-		return initCurlStuffFailed();
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_FOLLOWLOCATION, 1L)))
+		goto failed;
+
+	/* compressed pages, libcurl decodes them before WriteMemoryCallback()
+	 * sees the data.  "" means all encodings libcurl supports.
+	 */
+#if LIBCURL_VERSION_NUM >= 0x071506
+	if (options.compress &&
+		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_ACCEPT_ENCODING, "")))
+		goto failed;
+#else
+	if (options.compress &&
+		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_ENCODING, "")))
+		goto failed;
+#endif
+
+	/* HTTP/2 for https, and wait for a connection that can be shared
+	 * rather than opening another one
+	 */
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_HTTP_VERSION,
+			options.http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1)))
+		goto failed;
+	if (options.http2 &&
+		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_PIPEWAIT, 1L)))
+		goto failed;
+#endif
 
 	/* use proxy */
 	if (options.proxy &&
 		 (curlrc = curl_easy_setopt(easyhandle, CURLOPT_PROXY, options.proxy)))
-		return initCurlStuffFailed();
+		goto failed;
 
 /* bug#677: don't force SSLv3 because ebay deactivated it */
 #if 0
 	/* enforce usage of SSLv3 to avoid GnuTLS errors */
 	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_SSLVERSION, CURL_SSLVERSION_SSLv3)))
-		return initCurlStuffFailed();
+		goto failed;
 #endif
 
 	/* send all data to this function */
 	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback)))
-		return initCurlStuffFailed();
+		goto failed;
 
-	/* some servers don't like requests that are made without a user-agent
-	 * field, so we provide one */
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_USERAGENT, "Mozilla/4.7 [en] (X11; U; Linux 2.2.12 i686)")))
-		return initCurlStuffFailed();
+	/* headers, for Date */
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_HEADERFUNCTION, HeaderCallback)))
+		goto failed;
 
 	/* some servers don't like requests that are made without a user-agent
-	 * field, so we provide one */
+	 * field, or with an ancient one, so we provide a current one */
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_USERAGENT, options.userAgent ? options.userAgent : USER_AGENT)))
+		goto failed;
+
+	/* enable cookie engine */
 	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_COOKIEFILE, "")))
-		return initCurlStuffFailed();
+		goto failed;
 
-	slist = curl_slist_append(slist, "Accept: text/*");
-	slist = curl_slist_append(slist, "Accept-Language: en");
-	slist = curl_slist_append(slist, "Accept-Charset: iso-8859-1,*,utf-8");
-	slist = curl_slist_append(slist, "Cache-Control: no-cache");
-	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, slist)))
-		return initCurlStuffFailed();
+	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_HTTPHEADER, headers)))
+		goto failed;
 
 	if ((curlrc = curl_easy_setopt(easyhandle, CURLOPT_COOKIEFILE, DEVNULL)))
+		goto failed;
+
+	return hp;
+
+failed:
+	strcpy(globalErrorbuf, hp->errorbuf);
+	curl_easy_cleanup(easyhandle);
+	free(hp);
+	(void)initCurlStuffFailed();
+	return NULL;
+}
+
+/*
+ * Start a new session: drop all cookies, but keep connections open.
+ *
+ * Returns 0 on success, non-0 otherwise.
+ */
+int
+resetCurlSession(void)
+{
+	httpHandle_t *hp;
+
+	if (!curlInitDone)
+		return initCurlStuff();
+	if (!(hp = sessionHandle()))
+		return -1;
+	if ((curlrc = curl_easy_setopt(hp->easyhandle, CURLOPT_COOKIELIST, "ALL")))
 		return initCurlStuffFailed();
+	return 0;
+}
 
-	curlInitDone = 1;
+/*
+ * Cookies of the current session, one per line in Netscape cookie file
+ * format.
+ *
+ * returns malloc'ed string, or NULL on error.
+ */
+char *
+httpGetCookies(void)
+{
+	struct curl_slist *list = NULL, *lp;
+	size_t len = 1;
+	char *cookies, *cp;
+	httpHandle_t *hp;
+
+	if (!curlInitDone && initCurlStuff())
+		return NULL;
+	if (!(hp = sessionHandle()))
+		return NULL;
+	if ((curlrc = curl_easy_getinfo(hp->easyhandle, CURLINFO_COOKIELIST, &list)))
+		return NULL;
+	for (lp = list; lp; lp = lp->next)
+		len += strlen(lp->data) + 1;
+	cp = cookies = (char *)myMalloc(len);
+	for (lp = list; lp; lp = lp->next) {
+		size_t n = strlen(lp->data);
+
+		memcpy(cp, lp->data, n);
+		cp += n;
+		*cp++ = '\n';
+	}
+	*cp = '\0';
+	curl_slist_free_all(list);
+	return cookies;
+}
+
+/*
+ * Add cookies from httpGetCookies() to the current session.
+ *
+ * Returns 0 on success, non-0 otherwise.
+ */
+int
+httpSetCookies(const char *cookies)
+{
+	const char *end;
+	httpHandle_t *hp;
+
+	if (!curlInitDone && initCurlStuff())
+		return -1;
+	if (!(hp = sessionHandle()))
+		return -1;
+	for (; *cookies; cookies = *end ? end + 1 : end) {
+		char *line;
+
+		end = cookies + strcspn(cookies, "\n");
+		if (end == cookies)
+			continue;
+		line = myStrndup(cookies, (size_t)(end - cookies));
+		curlrc = curl_easy_setopt(hp->easyhandle, CURLOPT_COOKIELIST, line);
+		free(line);
+		if (curlrc)
+			return initCurlStuffFailed();
+	}
 	return 0;
 }
 
@@ -275,9 +1549,40 @@ initCurlStuffFailed(void)
 void
 cleanupCurlStuff(void)
 {
-	if (easyhandle) {
-		curl_easy_cleanup(easyhandle);
-		easyhandle = NULL;
+	httpSession_t *sp;
+
+	while (pool) {
+		httpHandle_t *hp = pool;
+
+		pool = hp->next;
+		if (hp->busy && !hp->done)
+			curl_multi_remove_handle(multihandle, hp->easyhandle);
+		curl_easy_cleanup(hp->easyhandle);
+		curl_slist_free_all(hp->reqHeaders);
+		freeMembuf(hp->mp);
+		free(hp->url);
+		free(hp->logUrl);
+		free(hp);
+	}
+	if (multihandle) {
+		curl_multi_cleanup(multihandle);
+		multihandle = NULL;
+	}
+	/* sessions stay valid, their shares are created again when used */
+	for (sp = sessions; sp; sp = sp->next) {
+		if (sp->share) {
+			curl_share_cleanup(sp->share);
+			sp->share = NULL;
+		}
+	}
+	curl_slist_free_all(headers);
+	headers = NULL;
+	resolveCleanup();
+	while (membufPoolSize > 0) {
+		memBuf_t *mp = membufPool[--membufPoolSize];
+
+		clearMembuf(mp);
+		free(mp);
 	}
 	curl_global_cleanup();
 	curlInitDone = 0;
@@ -287,19 +1592,93 @@ static size_t
 WriteMemoryCallback(void *ptr, size_t size, size_t nmemb, void *data)
 {
 	register size_t realsize = size * nmemb;
-	memBuf_t *mp = (memBuf_t *)data;
+	httpHandle_t *hp = (httpHandle_t *)data;
+	memBuf_t *mp = hp->mp;
+
+	/* streamed page already returned, discard the rest */
+	if (hp->early)
+		return realsize;
 
 	if (!mp->timeToFirstByte)
 		mp->timeToFirstByte = time(NULL);
 
-	mp->memory = (char *)myRealloc(mp->memory, mp->size + realsize + 1);
-	mp->readptr = mp->memory;
+	reserveMembuf(mp, mp->size + realsize + 1);
 	memcpy(&(mp->memory[mp->size]), ptr, realsize);
 	mp->size += realsize;
 	mp->memory[mp->size] = 0;
+
+	if (hp->enough && (*hp->enough)(mp, hp->enoughData)) {
+		hp->early = 1;
+		/* returning short count makes libcurl cancel the transfer */
+		if (hp->abortRest)
+			return 0;
+	}
+	return realsize;
+}
+
+/*
+ * Get Date header.  With redirects, the date of the last response is kept.
+ * Content-Length is used to allocate the page in one go.
+ */
+static size_t
+HeaderCallback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+	size_t realsize = size * nmemb;
+	memBuf_t *mp = ((httpHandle_t *)data)->mp;
+	char buf[80];
+
+	if (mp && realsize > 5 && realsize < sizeof(buf) &&
+	    !strncasecmp((char *)ptr, "Date:", 5)) {
+		time_t t;
+
+		memcpy(buf, (char *)ptr + 5, realsize - 5);
+		buf[realsize - 5] = '\0';
+		if ((t = curl_getdate(buf, NULL)) > 0)
+			mp->date = t;
+	} else if (mp && realsize > 5 && !strncmp((char *)ptr, "HTTP/", 5)) {
+		/* new response (redirect), forget validators of previous one */
+		mp->validator.etag[0] = '\0';
+		mp->validator.lastModified[0] = '\0';
+	} else if (mp && realsize > 5 && !strncasecmp((char *)ptr, "ETag:", 5)) {
+		copyHeader(mp->validator.etag, sizeof(mp->validator.etag),
+			   (char *)ptr + 5, realsize - 5);
+	} else if (mp && realsize > 14 &&
+		   !strncasecmp((char *)ptr, "Last-Modified:", 14)) {
+		copyHeader(mp->validator.lastModified,
+			   sizeof(mp->validator.lastModified),
+			   (char *)ptr + 14, realsize - 14);
+	} else if (mp && realsize > 15 && realsize < sizeof(buf) &&
+		   !strncasecmp((char *)ptr, "Content-Length:", 15)) {
+		unsigned long len;
+
+		memcpy(buf, (char *)ptr + 15, realsize - 15);
+		buf[realsize - 15] = '\0';
+		len = strtoul(buf, NULL, 10);
+		if (len > 0 && len <= MEMBUF_HINT)
+			reserveMembuf(mp, mp->size + len + 1);
+	}
 	return realsize;
 }
 
+/*
+ * Copy header value without surrounding white space.  Values that do not
+ * fit are dropped, a truncated validator would be wrong.
+ */
+static void
+copyHeader(char *dst, size_t size, const char *src, size_t len)
+{
+	while (len > 0 && isspace((unsigned char)*src)) {
+		++src;
+		--len;
+	}
+	while (len > 0 && isspace((unsigned char)src[len - 1]))
+		--len;
+	if (len >= size)
+		len = 0;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
 int
 memEof(memBuf_t *mp)
 {
@@ -360,37 +1739,31 @@ memChr(memBuf_t *mp, char c)
 	return ret;
 }
 
-/* get META refresh URL (if any) */
+/*
+ * get META refresh URL (if any)
+ *
+ * returns malloc'ed string, or NULL.
+ */
 char *
 memGetMetaRefresh(memBuf_t *mp)
 {
 	char *cp;
-	static char *buf = NULL;
+	char *buf = NULL;
 	char *bufptr;
-	static size_t bufsize = 0;
+	size_t bufsize = 0;
 	char *metaRefresh = NULL;
 
-	if (!buf) {
-		bufsize = 1024;
-		buf = myMalloc(bufsize);
-	}
-
 	/* look for all "meta" tags until Refresh found */
 	while (!metaRefresh && (cp = memStr(mp, "<meta")) != NULL) {
+		size_t count = 0;
 		int c;
 
-		bufptr = buf;
 		/* copy whole tag to buffer for processing */
-		for (c = memGetc(mp); c != EOF && c != '>'; c = memGetc(mp)) {
-			*bufptr++ = (char)c;
-			if (bufptr > buf + (bufsize -1)) {
-				bufsize += 1024;
-				buf = myRealloc(buf, bufsize);
-			}
-		}
+		for (c = memGetc(mp); c != EOF && c != '>'; c = memGetc(mp))
+			addchar(buf, bufsize, count, (char)c);
 
 		/* terminate string */
-		*bufptr = '\0';
+		term(buf, bufsize, count);
 		log(("found META tag: %s", buf));
 
 		cp = strstr(buf, "http-equiv=");
@@ -443,7 +1816,7 @@ memGetMetaRefresh(memBuf_t *mp)
 		}
 		/* cut off terminating '"' and other trailing garbage */
 		*cp = '\0';
-		metaRefresh = bufptr;
+		metaRefresh = myStrdup(bufptr);
 	}
 
 	if (metaRefresh)
@@ -451,6 +1824,7 @@ memGetMetaRefresh(memBuf_t *mp)
 	else
 		log(("no redirection found"));
 
+	free(buf);
 	memReset(mp);
 
 	return metaRefresh;
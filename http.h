@@ -29,11 +29,45 @@
 
 #include "auctioninfo.h"
 
+/*
+ * Request timing from libcurl, microseconds since start of request.
+ * All 0 if not known.
+ */
+typedef struct {
+   usec_t dns;		/* name lookup done */
+   usec_t connect;	/* TCP connection established */
+   usec_t ssl;		/* SSL handshake done */
+   usec_t request;	/* request about to be sent */
+   usec_t firstByte;	/* first byte of response received */
+   usec_t total;	/* transfer done */
+} httpTiming_t;
+
+/*
+ * Cache validators of a page, empty strings if none.
+ */
+typedef struct {
+   char etag[128];
+   char lastModified[64];
+} httpValidator_t;
+
+/* buffer for parser results */
+typedef struct {
+   char *buf;
+   size_t size;
+} memScratch_t;
+
 typedef struct {
    char *memory;
    size_t size;
    char *readptr;
    time_t timeToFirstByte;
+   httpTiming_t timing;
+   time_t date;		/* Date header of response, 0 if none */
+   memScratch_t tagBuf;	/* see html.c */
+   memScratch_t textBuf;
+   size_t alloc;	/* allocated size of memory */
+   httpValidator_t validator;/* validators sent with the page */
+   int notModified;	/* 304 response to a conditional request */
 } memBuf_t;
 
 extern int memEof(memBuf_t *mp);
@@ -49,11 +83,53 @@ extern time_t getTimeToFirstByte(memBuf_t *mp);
 
 extern int initCurlStuff(void);
 extern void cleanupCurlStuff(void);
+extern int resetCurlSession(void);
+extern char *httpGetCookies(void);
+extern int httpSetCookies(const char *cookies);
+
+/* separate cookies for each account, see account.c */
+typedef struct httpSession httpSession_t;
+
+extern httpSession_t *httpNewSession(void);
+extern void httpUseSession(httpSession_t *sp);
 
 extern int httpError(auctionInfo *aip);
 extern memBuf_t *httpGet(const char *url, const char *logUrl);
+extern memBuf_t *httpGetIfChanged(const char *url, const char *logUrl, const httpValidator_t *cond);
 extern memBuf_t *httpPost(const char *url, const char *data, const char *logData);
+
+/*
+ * Streaming requests: enough() is called as data arrives, and returns
+ * non-0 when the page has everything the caller needs.
+ */
+typedef int (*httpEnough_t)(const memBuf_t *mp, void *data);
+
+typedef struct httpHandle httpRequest_t;
+
+extern httpRequest_t *httpPrepareGet(const char *url, const char *logUrl);
+extern memBuf_t *httpFire(httpRequest_t *rp);
+extern void httpRelease(httpRequest_t *rp);
+extern memBuf_t *httpGetStream(const char *url, const char *logUrl, httpEnough_t enough, void *data, int abortRest);
 extern void freeMembuf(memBuf_t *mp);
+extern void clearMembuf(memBuf_t *mp);
+
+/*
+ * Background requests.  Callbacks are only called from httpWait(), never
+ * from within another (synchronous or background) request.  mp is NULL
+ * on error, use httpError() for details.  Callback must free mp.
+ */
+typedef void (*httpCallback_t)(memBuf_t *mp, void *data);
+
+extern int httpGetAsync(const char *url, const char *logUrl, httpCallback_t func, void *data);
+extern int httpGetIfChangedAsync(const char *url, const char *logUrl, const httpValidator_t *cond, httpCallback_t func, void *data);
+extern int httpFireAsync(httpRequest_t *rp, httpCallback_t func, void *data);
+extern int httpGetHedgedAsync(const char *url, const char *logUrl, long stagger, const char *proxy, httpEnough_t definitive, void *definitiveData, httpCallback_t func, void *data);
+extern int httpPostAsync(const char *url, const char *data, const char *logData, httpCallback_t func, void *cbdata);
+extern int httpWarmup(const char *url);
+extern int httpPending(void);
+extern int httpActive(const char *url);
+extern int httpWait(long timeout);
+extern int httpWaitFds(long timeout, const int *fds, const int *writing, int *ready, int nfds);
 extern memBuf_t *strToMemBuf(const char *s, memBuf_t *buf);
 
 #include <stdio.h>
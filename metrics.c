@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "metrics.h"
+#include "util.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Values below SUB_BUCKETS microseconds get a bucket each, above that
+ * each power of 2 is split into SUB_BUCKETS buckets.
+ */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_BITS 40		/* 2^40 usec is about 12 days */
+#define NUM_BUCKETS (SUB_BUCKETS + (MAX_BITS - SUB_BITS) * SUB_BUCKETS)
+
+typedef struct {
+	unsigned long count;
+	double sum;		/* microseconds */
+	usec_t min;
+	usec_t max;
+	unsigned long buckets[NUM_BUCKETS];
+} histogram_t;
+
+/* Prometheus name (without "esniper_" and "_seconds"), label, JSON key */
+static const struct {
+	const char *name;
+	const char *label;
+	const char *key;
+	const char *help;
+} histogramInfo[MH_COUNT] = {
+	{ "login", NULL, "login",
+	  "Duration of eBay sign in" },
+	{ "history_first_byte", NULL, "history_first_byte",
+	  "Bid history request to first byte" },
+	{ "parse", "page=\"history\"", "parse_history",
+	  "Parse time per page type" },
+	{ "parse", "page=\"prebid\"", "parse_prebid", NULL },
+	{ "parse", "page=\"bid\"", "parse_bid", NULL },
+	{ "prebid", NULL, "prebid",
+	  "Pre-bid round trip" },
+	{ "bid", NULL, "bid",
+	  "Bid round trip" },
+	{ "fire_error", NULL, "fire_error",
+	  "Difference between planned and actual time of sending the bid" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counterInfo[MC_COUNT] = {
+	{ "logins", "eBay sign ins" },
+	{ "retries", "Requests repeated after an error" },
+	{ "token_refreshes", "Bid tokens fetched in the background" },
+	{ "bids", "Bids sent" },
+	{ "late_bids", "Bids sent after the planned time" },
+	{ "won", "Items won" },
+};
+
+/* label values for enum auctionErrorCode */
+static const char *errorNames[] = {
+	"none",
+	"baditem",
+	"notitle",
+	"noprice",
+	"convprice",
+	"noquantity",
+	"notime",
+	"badtime",
+	"nohighbid",
+	"curlerror",
+	"bidprice",
+	"bidtokens",
+	"badpass",
+	"outbid",
+	"reservenotmet",
+	"ended",
+	"duplicate",
+	"toomany",
+	"unavailable",
+	"login",
+	"buyerblockpref",
+	"buyerblockprefdoesnotshiptolocation",
+	"buyerblockprefnolinkedpaypalaccount",
+	"highbidder",
+	"mustsignin",
+	"cannotbid",
+	"dutchsamebidquantity",
+	"captcha",
+	"cancelled",
+	"bidassistant",
+	"buyerblockprefitemcountlimitexceeded",
+	"bidgreaterthanbin_binblock",
+	"alert",
+	"buyerrequirements",
+	"manualaction",
+	"unknown",
+};
+/* fails to compile if errorNames does not match enum auctionErrorCode */
+typedef char errorNamesCheck[sizeof(errorNames) / sizeof(errorNames[0]) == ae_unknown + 1 ? 1 : -1];
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+#define NUM_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static histogram_t histograms[MH_COUNT];
+static unsigned long counters[MC_COUNT];
+static unsigned long errors[ae_unknown + 1];
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} text_t;
+
+static int bucketIndex(usec_t value);
+static usec_t bucketValue(int index);
+static usec_t quantile(const histogram_t *hp, double q);
+static void addText(text_t *tp, const char *fmt, ...);
+
+/*
+ * Add a sample to histogram h.  Negative values count as their
+ * absolute value.
+ */
+void
+metricTime(enum metricHistogram h, usec_t value)
+{
+	histogram_t *hp = &histograms[h];
+
+	if (value < 0)
+		value = -value;
+	if (hp->count == 0 || value < hp->min)
+		hp->min = value;
+	if (value > hp->max)
+		hp->max = value;
+	++hp->count;
+	hp->sum += (double)value;
+	++hp->buckets[bucketIndex(value)];
+}
+
+void
+metricCount(enum metricCounter c, int n)
+{
+	counters[c] += (unsigned long)n;
+}
+
+void
+metricError(enum auctionErrorCode code)
+{
+	if (code < ae_none || code > ae_unknown)
+		code = ae_unknown;
+	++errors[code];
+}
+
+static int
+bucketIndex(usec_t value)
+{
+	int bits = 0;
+	int index;
+
+	if (value < SUB_BUCKETS)
+		return (int)value;
+	while ((value >> bits) >= 2 * SUB_BUCKETS)
+		++bits;
+	/* value >> bits is between SUB_BUCKETS and 2 * SUB_BUCKETS - 1 */
+	index = SUB_BUCKETS + bits * SUB_BUCKETS + (int)((value >> bits) - SUB_BUCKETS);
+	return index < NUM_BUCKETS ? index : NUM_BUCKETS - 1;
+}
+
+/* middle of bucket */
+static usec_t
+bucketValue(int index)
+{
+	int bits;
+	usec_t low;
+
+	if (index < SUB_BUCKETS)
+		return (usec_t)index;
+	bits = (index - SUB_BUCKETS) / SUB_BUCKETS;
+	low = (usec_t)(SUB_BUCKETS + (index - SUB_BUCKETS) % SUB_BUCKETS) << bits;
+	return low + (((usec_t)1 << bits) - 1) / 2;
+}
+
+static usec_t
+quantile(const histogram_t *hp, double q)
+{
+	unsigned long seen = 0, want;
+	int i;
+
+	if (hp->count == 0)
+		return 0;
+	want = (unsigned long)(q * (double)hp->count + 0.5);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < NUM_BUCKETS; ++i) {
+		seen += hp->buckets[i];
+		if (seen >= want) {
+			usec_t v = bucketValue(i);
+
+			return v < hp->min ? hp->min : v > hp->max ? hp->max : v;
+		}
+	}
+	return hp->max;
+}
+
+/*
+ * Metrics in Prometheus text format.  Histograms are summaries with
+ * quantiles, times are in seconds.
+ *
+ * returns text, to be freed by caller.
+ */
+char *
+metricsText(void)
+{
+	text_t text = { NULL, 0, 0 };
+	int i, j;
+	size_t q;
+
+	for (i = 0; i < MH_COUNT; ++i) {
+		const histogram_t *hp = &histograms[i];
+		const char *name = histogramInfo[i].name;
+		const char *label = histogramInfo[i].label;
+
+		if (histogramInfo[i].help) {
+			addText(&text, "# HELP esniper_%s_seconds %s\n", name, histogramInfo[i].help);
+			addText(&text, "# TYPE esniper_%s_seconds summary\n", name);
+		}
+		for (q = 0; q < NUM_QUANTILES; ++q)
+			addText(&text, "esniper_%s_seconds{%s%squantile=\"%g\"} %.6f\n",
+				name, label ? label : "", label ? "," : "",
+				quantiles[q], (double)quantile(hp, quantiles[q]) / 1000000);
+		addText(&text, "esniper_%s_seconds_sum%s%s%s %.6f\n", name,
+			label ? "{" : "", label ? label : "", label ? "}" : "",
+			hp->sum / 1000000);
+		addText(&text, "esniper_%s_seconds_count%s%s%s %lu\n", name,
+			label ? "{" : "", label ? label : "", label ? "}" : "",
+			hp->count);
+	}
+	for (i = 0; i < MC_COUNT; ++i) {
+		addText(&text, "# HELP esniper_%s_total %s\n", counterInfo[i].name, counterInfo[i].help);
+		addText(&text, "# TYPE esniper_%s_total counter\n", counterInfo[i].name);
+		addText(&text, "esniper_%s_total %lu\n", counterInfo[i].name, counters[i]);
+	}
+	addText(&text, "# HELP esniper_auction_errors_total Auction errors and bid results by code\n");
+	addText(&text, "# TYPE esniper_auction_errors_total counter\n");
+	for (j = ae_none + 1; j <= ae_unknown; ++j)
+		if (errors[j])
+			addText(&text, "esniper_auction_errors_total{code=\"%s\"} %lu\n", errorNames[j], errors[j]);
+	return text.buf;
+}
+
+/*
+ * Metrics as JSON object, times are in seconds.
+ *
+ * returns text, to be freed by caller.
+ */
+char *
+metricsJson(void)
+{
+	text_t text = { NULL, 0, 0 };
+	const char *sep = "";
+	int i, j;
+	size_t q;
+
+	addText(&text, "{\n  \"histograms\": {");
+	for (i = 0; i < MH_COUNT; ++i) {
+		const histogram_t *hp = &histograms[i];
+
+		addText(&text, "%s\n    \"%s\": { \"count\": %lu, \"sum\": %.6f, \"min\": %.6f, \"max\": %.6f",
+			i ? "," : "", histogramInfo[i].key, hp->count,
+			hp->sum / 1000000, (double)hp->min / 1000000,
+			(double)hp->max / 1000000);
+		for (q = 0; q < NUM_QUANTILES; ++q)
+			addText(&text, ", \"p%g\": %.6f", quantiles[q] * 100,
+				(double)quantile(hp, quantiles[q]) / 1000000);
+		addText(&text, " }");
+	}
+	addText(&text, "\n  },\n  \"counters\": {");
+	for (i = 0; i < MC_COUNT; ++i)
+		addText(&text, "%s\n    \"%s\": %lu", i ? "," : "", counterInfo[i].name, counters[i]);
+	addText(&text, "\n  },\n  \"auction_errors\": {");
+	for (j = ae_none + 1; j <= ae_unknown; ++j) {
+		if (!errors[j])
+			continue;
+		addText(&text, "%s\n    \"%s\": %lu", sep, errorNames[j], errors[j]);
+		sep = ",";
+	}
+	addText(&text, "\n  }\n}\n");
+	return text.buf;
+}
+
+/*
+ * Write metrics as JSON to filename.
+ *
+ * returns 0 on success, 1 on error.
+ */
+int
+metricsDump(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	char *json;
+	int ret = 0;
+
+	if (!fp) {
+		printLog(stderr, "Cannot write metrics to %s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	json = metricsJson();
+	if (fputs(json, fp) == EOF)
+		ret = 1;
+	if (fclose(fp))
+		ret = 1;
+	if (ret)
+		printLog(stderr, "Cannot write metrics to %s: %s\n", filename, strerror(errno));
+	free(json);
+	return ret;
+}
+
+/*
+ * printf to end of text, which grows as needed.
+ */
+static void
+addText(text_t *tp, const char *fmt, ...)
+{
+	va_list arglist;
+	int len;
+
+	for (;;) {
+		if (tp->size - tp->len < 2) {
+			tp->size = tp->size ? tp->size * 2 : 4096;
+			tp->buf = (char *)myRealloc(tp->buf, tp->size);
+		}
+		va_start(arglist, fmt);
+		len = vsnprintf(tp->buf + tp->len, tp->size - tp->len, fmt, arglist);
+		va_end(arglist);
+		if (len < 0)
+			return;
+		if ((size_t)len < tp->size - tp->len) {
+			tp->len += (size_t)len;
+			return;
+		}
+		tp->size = tp->len + (size_t)len + 1 > tp->size * 2 ? tp->len + (size_t)len + 1 : tp->size * 2;
+		tp->buf = (char *)myRealloc(tp->buf, tp->size);
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include "auctioninfo.h"
+
+/*
+ * Counters and latency histograms.  Histograms have log-linear buckets
+ * (16 per power of 2, so values are kept within 6%), which gives
+ * quantiles without keeping the samples.
+ */
+enum metricHistogram {
+	mh_login,		/* eBay sign in */
+	mh_historyFirstByte,	/* bid history request to first byte */
+	mh_parseHistory,	/* parse time of bid history page */
+	mh_parsePreBid,		/* parse time of pre-bid page */
+	mh_parseBid,		/* parse time of bid result page */
+	mh_preBid,		/* pre-bid round trip */
+	mh_bid,			/* bid round trip */
+	mh_fireError,		/* bid sent vs. planned time */
+	MH_COUNT
+};
+
+enum metricCounter {
+	mc_logins,		/* sign ins */
+	mc_retries,		/* requests repeated after an error */
+	mc_tokenRefreshes,	/* background bid token fetches */
+	mc_bids,		/* bids sent */
+	mc_lateBids,		/* bids sent after the planned time */
+	mc_won,			/* items won */
+	MC_COUNT
+};
+
+extern void metricTime(enum metricHistogram h, usec_t value);
+extern void metricCount(enum metricCounter c, int n);
+extern void metricError(enum auctionErrorCode code);
+extern char *metricsText(void);
+extern char *metricsJson(void);
+extern int metricsDump(const char *filename);
+
+#endif /* METRICS_H_INCLUDED */
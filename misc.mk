@@ -5,8 +5,10 @@
 #	 of gcc's warning options enabled
 #
 
-SRC = auction.c auctionfile.c auctioninfo.c buffer.c esniper.c \
-	history.c html.c http.c options.c util.c
+SRC = account.c arena.c auction.c auctionfile.c auctioninfo.c buffer.c \
+	cipher.c clocksync.c daemon.c esniper.c history.c html.c http.c \
+	metrics.c options.c polling.c resolve.c scan.c schedule.c session.c \
+	trace.c util.c
 
 # System dependencies
 # HP-UX 10.20
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "polling.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The update before the bid must leave BID_WINDOW seconds, so the bid key
+ * can be fetched in the following update.
+ */
+static const long BID_WINDOW = 120;
+static const double MIN_POLL = 10;
+static const double MAX_POLL = 86400;
+
+static unsigned int fixedPoll(const auctionInfo *aip, const pollInput_t *in);
+static unsigned int adaptivePoll(const auctionInfo *aip, const pollInput_t *in);
+
+static const struct {
+	const char *name;
+	pollPolicy_t policy;
+} policies[] = {
+	{ "adaptive", adaptivePoll },
+	{ "fixed", fixedPoll },
+	{ NULL, NULL }
+};
+
+/*
+ * returns policy, or NULL if there is none with that name
+ */
+pollPolicy_t
+pollPolicyByName(const char *name)
+{
+	int i;
+
+	for (i = 0; policies[i].name; ++i)
+		if (!strcmp(policies[i].name, name))
+			return policies[i].policy;
+	return NULL;
+}
+
+/*
+ * Record an update of the auction.  bidRate is an average of the price
+ * changes per second seen between updates, -1 until there are two
+ * updates.
+ */
+void
+pollUpdate(auctionInfo *aip, time_t now)
+{
+	if (aip->pollTime > 0 && now > aip->pollTime) {
+		int changes = aip->bids - aip->pollBids;
+		double sample;
+
+		if (changes <= 0 && aip->price != aip->pollPrice)
+			changes = 1;
+		if (changes < 0)
+			changes = 0;
+		sample = (double)changes / (double)(now - aip->pollTime);
+		aip->bidRate = aip->bidRate < 0 ? sample : (aip->bidRate + sample) / 2;
+	}
+	aip->pollBids = aip->bids;
+	aip->pollPrice = aip->price;
+	aip->pollTime = now;
+}
+
+/*
+ * Fixed schedule: updates once a day, then at 2 hours, 1 hour, 5 minutes
+ * and 2 minutes.
+ */
+static unsigned int
+fixedPoll(const auctionInfo *aip, const pollInput_t *in)
+{
+	long remain = in->remain;
+
+	if (remain < 720)	/* 5 minutes + 2 minutes (slop) */
+		return (unsigned int)(remain - BID_WINDOW);
+	else if (remain < 3900)	/* 1 hour + 5 minutes (slop) */
+		return (unsigned int)(remain - 600);
+	else if (remain < 10800)/* 2 hours + 1 hour (slop) */
+		return (unsigned int)(remain - 3600);
+	else if (remain < 97200)/* 1 day + 3 hours (slop) */
+		return (unsigned int)(remain - 7200);
+	return (unsigned int)MAX_POLL;	/* knock off one day */
+}
+
+/*
+ * Adaptive schedule: the interval shrinks with the remaining time, so
+ * updates cluster near the end.  Quiet auctions are polled less often,
+ * busy ones about as often as their price changes.  Far from the end all
+ * watched auctions share the request budget given by the delay option.
+ */
+static unsigned int
+adaptivePoll(const auctionInfo *aip, const pollInput_t *in)
+{
+	double remain = (double)in->remain;
+	double lead = (double)in->latency / 1000000 + 1;
+	double interval;
+
+	if (aip->bidRate < 0)		/* nothing known yet */
+		interval = remain / 3;
+	else if (aip->bidRate == 0)	/* quiet */
+		interval = remain / 2;
+	else {
+		interval = 1 / aip->bidRate;
+		if (interval > remain / 3)
+			interval = remain / 3;
+		else if (interval < remain / 16)
+			interval = remain / 16;
+	}
+
+	if (remain > 600 && in->auctions > 1 && in->spacing > 0 &&
+	    interval < (double)in->auctions * in->spacing)
+		interval = (double)in->auctions * in->spacing;
+	if (interval > MAX_POLL)
+		interval = MAX_POLL;
+	if (interval < MIN_POLL)
+		interval = MIN_POLL;
+
+	/* wake up early enough for the request to finish in time */
+	if (interval > remain - (double)BID_WINDOW - lead)
+		interval = remain - (double)BID_WINDOW - lead;
+	return interval < 1 ? 1 : (unsigned int)interval;
+}
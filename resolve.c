@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "resolve.h"
+#include "esniper.h"
+#include "util.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(WIN32)
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RESOLVE_HOSTS 5		/* hosts in options */
+#define RESOLVE_LISTS 3		/* lists that libcurl may still use */
+static const time_t RESOLVE_REFRESH = 300;
+
+typedef struct {
+	char *name;
+	char *port;		/* NULL: 80 and 443 */
+	char *addrs;		/* comma separated, NULL if not known */
+} resolveHost_t;
+
+static resolveHost_t hosts[RESOLVE_HOSTS];
+static int numHosts = 0;
+
+static struct curl_slist *lists[RESOLVE_LISTS];
+static unsigned int generation = 0;
+
+static pid_t child = -1;
+static int childFd = -1;
+static char *childBuf = NULL;
+static size_t childLen = 0, childSize = 0;
+static time_t lastStart = 0;
+
+static void addHost(const char *host);
+static void resolveChild(int fd);
+static void readChild(void);
+static void childDone(void);
+static void buildList(void);
+static struct curl_slist *addEntry(struct curl_slist *list, const resolveHost_t *hp, const char *port);
+
+/*
+ * Start resolving the configured hosts in the background.  Nothing
+ * happens if a lookup is running already.
+ */
+void
+resolveStart(void)
+{
+	int fds[2];
+
+	if (child != -1)
+		return;
+	if (numHosts == 0) {
+		addHost(options.historyHost);
+		addHost(options.prebidHost);
+		addHost(options.bidHost);
+		addHost(options.loginHost);
+		addHost(options.myeBayHost);
+	}
+	lastStart = time(NULL);
+	if (numHosts == 0)
+		return;
+	if (pipe(fds)) {
+		log(("resolveStart: pipe failed: %s\n", strerror(errno)));
+		return;
+	}
+	if ((child = fork()) == -1) {
+		log(("resolveStart: fork failed: %s\n", strerror(errno)));
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if (child == 0) {
+		close(fds[0]);
+		resolveChild(fds[1]);
+	}
+	close(fds[1]);
+	(void)fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	childFd = fds[0];
+	childLen = 0;
+}
+
+/*
+ * Current CURLOPT_RESOLVE list.  Collects the results of a finished
+ * lookup, and starts a new lookup if the last one is too old.
+ * generation is changed whenever the list changes.
+ *
+ * returns list, NULL if there is nothing to resolve
+ */
+struct curl_slist *
+resolveList(unsigned int *gen)
+{
+	if (childFd != -1)
+		readChild();
+	if (child == -1 && time(NULL) - lastStart >= RESOLVE_REFRESH)
+		resolveStart();
+	*gen = generation;
+	return lists[generation % RESOLVE_LISTS];
+}
+
+void
+resolveCleanup(void)
+{
+	int i;
+
+	if (child != -1) {
+		(void)kill(child, SIGTERM);
+		childDone();
+	}
+	for (i = 0; i < numHosts; ++i) {
+		free(hosts[i].name);
+		free(hosts[i].port);
+		free(hosts[i].addrs);
+	}
+	numHosts = 0;
+	for (i = 0; i < RESOLVE_LISTS; ++i) {
+		curl_slist_free_all(lists[i]);
+		lists[i] = NULL;
+	}
+	free(childBuf);
+	childBuf = NULL;
+	childSize = 0;
+}
+
+/*
+ * Add host[:port], unless it is already known or a numeric address.
+ */
+static void
+addHost(const char *host)
+{
+	struct in6_addr a6;
+	struct in_addr a4;
+	const char *colon;
+	char *name;
+	int i;
+
+	if (!host || !*host || numHosts == RESOLVE_HOSTS)
+		return;
+	colon = strrchr(host, ':');
+	/* IPv6 literal or more than one colon: leave it to libcurl */
+	if (*host == '[' || (colon && strchr(host, ':') != colon))
+		return;
+	name = colon ? myStrndup(host, (size_t)(colon - host)) : myStrdup(host);
+	if (inet_pton(AF_INET, name, &a4) == 1 ||
+	    inet_pton(AF_INET6, name, &a6) == 1) {
+		free(name);
+		return;
+	}
+	for (i = 0; i < numHosts; ++i) {
+		int samePort = hosts[i].port ?
+			colon && !strcmp(hosts[i].port, colon + 1) : !colon;
+
+		if (samePort && !strcmp(hosts[i].name, name)) {
+			free(name);
+			return;
+		}
+	}
+	hosts[numHosts].name = name;
+	hosts[numHosts].port = colon ? myStrdup(colon + 1) : NULL;
+	hosts[numHosts].addrs = NULL;
+	++numHosts;
+}
+
+/*
+ * Child: write "index address,address...\n" for each host, and exit.
+ */
+static void
+resolveChild(int fd)
+{
+	int i;
+
+	for (i = 0; i < numHosts; ++i) {
+		struct addrinfo hints, *res, *rp;
+		char line[1024];
+		size_t len;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(hosts[i].name, NULL, &hints, &res))
+			continue;
+		len = (size_t)sprintf(line, "%d ", i);
+		for (rp = res; rp; rp = rp->ai_next) {
+			char addr[INET6_ADDRSTRLEN + 2];
+			const void *ap;
+
+			if (rp->ai_family == AF_INET)
+				ap = &((struct sockaddr_in *)rp->ai_addr)->sin_addr;
+			else if (rp->ai_family == AF_INET6)
+				ap = &((struct sockaddr_in6 *)rp->ai_addr)->sin6_addr;
+			else
+				continue;
+			if (rp->ai_family == AF_INET6) {
+				addr[0] = '[';
+				if (!inet_ntop(AF_INET6, ap, addr + 1, INET6_ADDRSTRLEN))
+					continue;
+				strcat(addr, "]");
+			} else if (!inet_ntop(AF_INET, ap, addr, sizeof(addr)))
+				continue;
+			/* no duplicates, no overflow */
+			if (strstr(line, addr) || len + strlen(addr) + 2 >= sizeof(line))
+				continue;
+			len += (size_t)sprintf(line + len, "%s%s",
+				line[len - 1] == ' ' ? "" : ",", addr);
+		}
+		freeaddrinfo(res);
+		if (line[len - 1] != ' ') {
+			line[len++] = '\n';
+			(void)write(fd, line, len);
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Read what the child has written so far.  At EOF, use the results.
+ */
+static void
+readChild(void)
+{
+	char *line, *nl;
+	ssize_t n;
+	int changed = 0;
+
+	for (;;) {
+		if (childLen + 1024 > childSize) {
+			childSize = childLen + 4096;
+			childBuf = (char *)myRealloc(childBuf, childSize);
+		}
+		n = read(childFd, childBuf + childLen, childSize - childLen - 1);
+		if (n > 0)
+			childLen += (size_t)n;
+		else if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		else
+			break;
+	}
+	childBuf[childLen] = '\0';
+	for (line = childBuf; (nl = strchr(line, '\n')); line = nl + 1) {
+		char *addrs;
+		int i;
+
+		*nl = '\0';
+		i = (int)strtol(line, &addrs, 10);
+		if (i < 0 || i >= numHosts || *addrs != ' ')
+			continue;
+		++addrs;
+		if (hosts[i].addrs && !strcmp(hosts[i].addrs, addrs))
+			continue;
+		log(("resolved %s: %s\n", hosts[i].name, addrs));
+		free(hosts[i].addrs);
+		hosts[i].addrs = myStrdup(addrs);
+		changed = 1;
+	}
+	childDone();
+	if (changed) {
+		++generation;
+		buildList();
+	}
+}
+
+static void
+childDone(void)
+{
+	if (childFd != -1) {
+		close(childFd);
+		childFd = -1;
+	}
+	(void)waitpid(child, NULL, 0);
+	child = -1;
+}
+
+/*
+ * Build list for current generation.  Old entries are removed from the
+ * DNS cache first, or libcurl would keep them.
+ */
+static void
+buildList(void)
+{
+	struct curl_slist **lp = &lists[generation % RESOLVE_LISTS];
+	int i;
+
+	curl_slist_free_all(*lp);
+	*lp = NULL;
+	for (i = 0; i < numHosts; ++i) {
+		if (!hosts[i].addrs)
+			continue;
+		if (hosts[i].port)
+			*lp = addEntry(*lp, &hosts[i], hosts[i].port);
+		else {
+			*lp = addEntry(*lp, &hosts[i], "80");
+			*lp = addEntry(*lp, &hosts[i], "443");
+		}
+	}
+}
+
+static struct curl_slist *
+addEntry(struct curl_slist *list, const resolveHost_t *hp, const char *port)
+{
+	char *entry = (char *)myMalloc(strlen(hp->name) + strlen(port) + strlen(hp->addrs) + 4);
+
+	sprintf(entry, "-%s:%s", hp->name, port);
+	list = curl_slist_append(list, entry);
+	sprintf(entry, "%s:%s:%s", hp->name, port, hp->addrs);
+	list = curl_slist_append(list, entry);
+	free(entry);
+	return list;
+}
+
+#else /* WIN32 */
+
+void
+resolveStart(void)
+{
+}
+
+struct curl_slist *
+resolveList(unsigned int *gen)
+{
+	*gen = 0;
+	return NULL;
+}
+
+void
+resolveCleanup(void)
+{
+}
+
+#endif /* WIN32 */
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The automaton is a DFA over character classes: every character used by
+ * a pattern gets a class (upper and lower case share one), all other
+ * characters are class 0.  Case sensitive patterns are checked again
+ * when they match.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+#include "util.h"
+
+struct scanner {
+	int npatterns;
+	char **patterns;
+	size_t *lengths;
+	int *nocase;
+	int *samePattern;	/* next pattern with same end state, or -1 */
+	int nstates;
+	int nclasses;
+	unsigned char classes[256];
+	int *delta;		/* nstates * nclasses transitions */
+	int *pattern;		/* first pattern ending in state, or -1 */
+	int *dict;		/* next state on fail chain with a pattern */
+};
+
+typedef struct {
+	size_t *offsets;
+	size_t count;
+	size_t size;
+} scanMatches_t;
+
+struct scanResult {
+	int npatterns;
+	scanMatches_t *matches;
+};
+
+static void addMatch(scanMatches_t *mp, size_t offset);
+
+/*
+ * Compile patterns.
+ *
+ * returns scanner, or NULL if there are no patterns.
+ */
+scanner_t *
+newScanner(const scanPattern_t *patterns, int count)
+{
+	scanner_t *sp;
+	int *fail, *queue;
+	int i, maxStates = 1, head = 0, tail = 0;
+
+	if (count <= 0)
+		return NULL;
+	sp = (scanner_t *)myMalloc(sizeof(scanner_t));
+	sp->npatterns = count;
+	sp->patterns = (char **)myMalloc(count * sizeof(char *));
+	sp->lengths = (size_t *)myMalloc(count * sizeof(size_t));
+	sp->nocase = (int *)myMalloc(count * sizeof(int));
+	sp->samePattern = (int *)myMalloc(count * sizeof(int));
+
+	/* character classes */
+	memset(sp->classes, 0, sizeof(sp->classes));
+	sp->nclasses = 1;
+	for (i = 0; i < count; ++i) {
+		const unsigned char *s = (const unsigned char *)patterns[i].str;
+
+		sp->patterns[i] = myStrdup(patterns[i].str);
+		sp->lengths[i] = strlen(patterns[i].str);
+		sp->nocase[i] = patterns[i].nocase;
+		sp->samePattern[i] = -1;
+		maxStates += (int)sp->lengths[i];
+		for (; *s; ++s) {
+			if (!sp->classes[*s]) {
+				sp->classes[tolower(*s)] = (unsigned char)sp->nclasses;
+				sp->classes[toupper(*s)] = (unsigned char)sp->nclasses;
+				++sp->nclasses;
+			}
+		}
+	}
+
+	/* trie */
+	sp->delta = (int *)myMalloc(maxStates * sp->nclasses * sizeof(int));
+	sp->pattern = (int *)myMalloc(maxStates * sizeof(int));
+	sp->dict = (int *)myMalloc(maxStates * sizeof(int));
+	for (i = 0; i < maxStates * sp->nclasses; ++i)
+		sp->delta[i] = -1;
+	for (i = 0; i < maxStates; ++i) {
+		sp->pattern[i] = -1;
+		sp->dict[i] = 0;
+	}
+	sp->nstates = 1;
+	for (i = 0; i < count; ++i) {
+		const unsigned char *s = (const unsigned char *)sp->patterns[i];
+		int state = 0;
+
+		for (; *s; ++s) {
+			int *next = &sp->delta[state * sp->nclasses + sp->classes[*s]];
+
+			if (*next < 0)
+				*next = sp->nstates++;
+			state = *next;
+		}
+		sp->samePattern[i] = sp->pattern[state];
+		sp->pattern[state] = i;
+	}
+
+	/* fail links, breadth first, turning the trie into a DFA */
+	fail = (int *)myMalloc(sp->nstates * sizeof(int));
+	queue = (int *)myMalloc(sp->nstates * sizeof(int));
+	fail[0] = 0;
+	for (i = 0; i < sp->nclasses; ++i) {
+		int *next = &sp->delta[i];
+
+		if (*next < 0)
+			*next = 0;
+		else {
+			fail[*next] = 0;
+			queue[tail++] = *next;
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		int f = fail[state];
+
+		sp->dict[state] = sp->pattern[f] >= 0 ? f : sp->dict[f];
+		for (i = 0; i < sp->nclasses; ++i) {
+			int *next = &sp->delta[state * sp->nclasses + i];
+			int target = sp->delta[f * sp->nclasses + i];
+
+			if (*next < 0)
+				*next = target;
+			else {
+				fail[*next] = target;
+				queue[tail++] = *next;
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+	return sp;
+}
+
+void
+freeScanner(scanner_t *sp)
+{
+	int i;
+
+	if (!sp)
+		return;
+	for (i = 0; i < sp->npatterns; ++i)
+		free(sp->patterns[i]);
+	free(sp->patterns);
+	free(sp->lengths);
+	free(sp->nocase);
+	free(sp->samePattern);
+	free(sp->delta);
+	free(sp->pattern);
+	free(sp->dict);
+	free(sp);
+}
+
+/*
+ * Find all matches of all patterns in page.  Like strstr(), the search
+ * stops at a null character.
+ */
+scanResult_t *
+scanPage(const scanner_t *sp, const memBuf_t *mp)
+{
+	scanResult_t *rp = (scanResult_t *)myMalloc(sizeof(scanResult_t));
+	const unsigned char *s, *end;
+	int state = 0;
+
+	rp->npatterns = sp ? sp->npatterns : 0;
+	rp->matches = (scanMatches_t *)myMalloc((rp->npatterns ? rp->npatterns : 1) * sizeof(scanMatches_t));
+	memset(rp->matches, 0, (rp->npatterns ? rp->npatterns : 1) * sizeof(scanMatches_t));
+	if (!sp || !mp || !mp->memory)
+		return rp;
+
+	s = (const unsigned char *)mp->memory;
+	end = s + mp->size;
+	for (; s < end && *s; ++s) {
+		int t;
+
+		state = sp->delta[state * sp->nclasses + sp->classes[*s]];
+		for (t = sp->pattern[state] >= 0 ? state : sp->dict[state]; t > 0; t = sp->dict[t]) {
+			int i;
+
+			for (i = sp->pattern[t]; i >= 0; i = sp->samePattern[i]) {
+				const char *start = (const char *)s + 1 - sp->lengths[i];
+
+				if (!sp->nocase[i] &&
+				    memcmp(start, sp->patterns[i], sp->lengths[i]))
+					continue;
+				addMatch(&rp->matches[i], start - mp->memory);
+			}
+		}
+	}
+	return rp;
+}
+
+static void
+addMatch(scanMatches_t *mp, size_t offset)
+{
+	if (mp->count == mp->size) {
+		mp->size = mp->size ? mp->size * 2 : 8;
+		mp->offsets = (size_t *)myRealloc(mp->offsets, mp->size * sizeof(size_t));
+	}
+	mp->offsets[mp->count++] = offset;
+}
+
+void
+freeScanResult(scanResult_t *rp)
+{
+	int i;
+
+	if (!rp)
+		return;
+	for (i = 0; i < rp->npatterns; ++i)
+		free(rp->matches[i].offsets);
+	free(rp->matches);
+	free(rp);
+}
+
+char *
+scanFind(const scanResult_t *rp, memBuf_t *mp, int pattern)
+{
+	const scanMatches_t *matches;
+	size_t pos, lo = 0, hi;
+
+	if (!rp || pattern < 0 || pattern >= rp->npatterns || !mp->memory)
+		return NULL;
+	matches = &rp->matches[pattern];
+	pos = mp->readptr - mp->memory;
+
+	/* offsets are sorted, find first one >= pos */
+	hi = matches->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (matches->offsets[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == matches->count)
+		return NULL;
+	mp->readptr = mp->memory + matches->offsets[lo];
+	return mp->readptr;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCAN_H_INCLUDED
+#define SCAN_H_INCLUDED
+
+#include "http.h"
+
+/*
+ * Multi-pattern search.  A scanner finds all its patterns in a single
+ * pass over a page (Aho-Corasick), parsers then look up the matches by
+ * pattern number instead of searching the page again.
+ */
+typedef struct {
+	const char *str;
+	int nocase;	/* ignore case */
+} scanPattern_t;
+
+typedef struct scanner scanner_t;
+typedef struct scanResult scanResult_t;
+
+extern scanner_t *newScanner(const scanPattern_t *patterns, int count);
+extern void freeScanner(scanner_t *sp);
+extern scanResult_t *scanPage(const scanner_t *sp, const memBuf_t *mp);
+extern void freeScanResult(scanResult_t *rp);
+
+/*
+ * Like memStr(): find first match of pattern at or after mp->readptr and
+ * move readptr there.  Returns pointer to match, or NULL if not found.
+ */
+extern char *scanFind(const scanResult_t *rp, memBuf_t *mp, int pattern);
+
+#endif /* SCAN_H_INCLUDED */
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "schedule.h"
+#include "esniper.h"
+#include "http.h"
+#include "util.h"
+#include <stdlib.h>
+
+struct event {
+	usec_t when;		/* time the event is due, see usecTime() */
+	unsigned long seq;	/* keeps events due at the same time in order */
+	eventFunc_t func;	/* function to call */
+	void *data;		/* argument for func */
+	size_t index;		/* position in heap */
+};
+
+/* binary heap, earliest event first */
+static event_t **heap = NULL;
+static size_t heapSize = 0;
+static size_t numEvents = 0;
+static unsigned long eventSeq = 0;
+
+/* file descriptors watched by runEvents() */
+typedef struct {
+	int fd;
+	int writing;		/* wait for fd to be writable, not readable */
+	fdFunc_t func;
+	void *data;
+} fdWatch_t;
+
+static fdWatch_t *watches = NULL;
+static int numWatches = 0;
+static int watchesSize = 0;
+
+static int eventBefore(const event_t *e1, const event_t *e2);
+static void heapSet(size_t i, event_t *ep);
+static void siftUp(size_t i);
+static void siftDown(size_t i);
+static void removeEvent(event_t *ep);
+static void addWatch(int fd, int writing, fdFunc_t func, void *data);
+static void removeWatch(int fd, int writing);
+static void runWatchesWait(long timeout);
+
+static int
+eventBefore(const event_t *e1, const event_t *e2)
+{
+	if (e1->when != e2->when)
+		return e1->when < e2->when;
+	return e1->seq < e2->seq;
+}
+
+static void
+heapSet(size_t i, event_t *ep)
+{
+	heap[i] = ep;
+	ep->index = i;
+}
+
+static void
+siftUp(size_t i)
+{
+	event_t *ep = heap[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (!eventBefore(ep, heap[parent]))
+			break;
+		heapSet(i, heap[parent]);
+		i = parent;
+	}
+	heapSet(i, ep);
+}
+
+static void
+siftDown(size_t i)
+{
+	event_t *ep = heap[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+
+		if (child >= numEvents)
+			break;
+		if (child + 1 < numEvents &&
+		    eventBefore(heap[child + 1], heap[child]))
+			++child;
+		if (!eventBefore(heap[child], ep))
+			break;
+		heapSet(i, heap[child]);
+		i = child;
+	}
+	heapSet(i, ep);
+}
+
+/*
+ * Remove event from heap, but don't free it.
+ */
+static void
+removeEvent(event_t *ep)
+{
+	size_t i = ep->index;
+
+	if (--numEvents == i)
+		return;
+	heapSet(i, heap[numEvents]);
+	if (i > 0 && eventBefore(heap[i], heap[(i - 1) / 2]))
+		siftUp(i);
+	else
+		siftDown(i);
+}
+
+/*
+ * Schedule func(data) to be called at the given time.  Times in the past
+ * are due immediately.
+ *
+ * returns event, which may be used to cancel it until it is run.
+ */
+event_t *
+scheduleEvent(time_t when, eventFunc_t func, void *data)
+{
+	return scheduleEventUsec((usec_t)when * 1000000, func, data);
+}
+
+/*
+ * Like scheduleEvent(), but when is in microseconds (see usecTime()).
+ * The event runs within a millisecond or so of that time, unless other
+ * events keep runEvents() busy.
+ */
+event_t *
+scheduleEventUsec(usec_t when, eventFunc_t func, void *data)
+{
+	event_t *ep = (event_t *)myMalloc(sizeof(event_t));
+
+	ep->when = when;
+	ep->seq = eventSeq++;
+	ep->func = func;
+	ep->data = data;
+	if (numEvents >= heapSize) {
+		heapSize += 16;
+		heap = (event_t **)myRealloc(heap, heapSize * sizeof(event_t *));
+	}
+	heapSet(numEvents++, ep);
+	siftUp(ep->index);
+	return ep;
+}
+
+/*
+ * Cancel an event that has not been run yet.
+ */
+void
+cancelEvent(event_t *ep)
+{
+	if (!ep)
+		return;
+	removeEvent(ep);
+	free(ep);
+}
+
+/*
+ * Cancel all events for data.
+ */
+void
+cancelEvents(const void *data)
+{
+	size_t i = 0;
+
+	while (i < numEvents) {
+		event_t *ep = heap[i];
+
+		if (ep->data == data) {
+			/* heap is reordered, start over */
+			cancelEvent(ep);
+			i = 0;
+		} else
+			++i;
+	}
+}
+
+/*
+ * Cancel all events.
+ */
+void
+clearEvents(void)
+{
+	while (numEvents > 0)
+		free(heap[--numEvents]);
+}
+
+int
+countEvents(void)
+{
+	return (int)numEvents;
+}
+
+/*
+ * Time of next event, or 0 if there are no events.
+ */
+time_t
+nextEventTime(void)
+{
+	return numEvents > 0 ? (time_t)(heap[0]->when / 1000000) : 0;
+}
+
+/*
+ * Call func(fd, data) from runEvents() whenever fd is readable.  While
+ * file descriptors are watched, runEvents() does not return.
+ */
+void
+watchFd(int fd, fdFunc_t func, void *data)
+{
+	addWatch(fd, 0, func, data);
+}
+
+/*
+ * Like watchFd(), but whenever fd is writable.  A file descriptor can be
+ * watched for reading and writing at the same time.
+ */
+void
+watchFdWrite(int fd, fdFunc_t func, void *data)
+{
+	addWatch(fd, 1, func, data);
+}
+
+/*
+ * Stop watching fd, for reading and writing.
+ */
+void
+unwatchFd(int fd)
+{
+	removeWatch(fd, 0);
+	removeWatch(fd, 1);
+}
+
+void
+unwatchFdWrite(int fd)
+{
+	removeWatch(fd, 1);
+}
+
+static void
+addWatch(int fd, int writing, fdFunc_t func, void *data)
+{
+	removeWatch(fd, writing);
+	if (numWatches >= watchesSize) {
+		watchesSize += 4;
+		watches = (fdWatch_t *)myRealloc(watches, watchesSize * sizeof(fdWatch_t));
+	}
+	watches[numWatches].fd = fd;
+	watches[numWatches].writing = writing;
+	watches[numWatches].func = func;
+	watches[numWatches].data = data;
+	++numWatches;
+}
+
+static void
+removeWatch(int fd, int writing)
+{
+	int i;
+
+	for (i = 0; i < numWatches; ++i) {
+		if (watches[i].fd == fd && watches[i].writing == writing) {
+			watches[i] = watches[--numWatches];
+			return;
+		}
+	}
+}
+
+/*
+ * Wait for watched file descriptors (and background requests) and call
+ * the functions of those that are ready.
+ */
+static void
+runWatchesWait(long timeout)
+{
+	int *fds = (int *)myMalloc(numWatches * 3 * sizeof(int));
+	int *writing = fds + numWatches;
+	int *ready = writing + numWatches;
+	int i, n = numWatches;
+
+	for (i = 0; i < n; ++i) {
+		fds[i] = watches[i].fd;
+		writing[i] = watches[i].writing;
+	}
+	(void)httpWaitFds(timeout, fds, writing, ready, n);
+
+	/* functions may watch and unwatch, look each one up again */
+	for (i = 0; i < n; ++i) {
+		int j;
+
+		if (!ready[i])
+			continue;
+		for (j = 0; j < numWatches; ++j) {
+			if (watches[j].fd == fds[i] && watches[j].writing == writing[i]) {
+				(*watches[j].func)(fds[i], watches[j].data);
+				break;
+			}
+		}
+	}
+	free(fds);
+}
+
+void
+runEvents(void)
+{
+	while (numEvents > 0 || httpPending() || numWatches > 0) {
+		event_t *ep = numEvents > 0 ? heap[0] : NULL;
+		usec_t now = usecTime();
+		eventFunc_t func;
+		void *data;
+
+		checkSignals();
+		if (!ep || ep->when > now) {
+			/* wait until the event is due */
+			usec_t wait = ep ? ep->when - now : 1000000;
+
+			if (wait < 0)
+				wait = 0;
+			if (numWatches > 0)
+				runWatchesWait((long)((wait + 999) / 1000));
+			else if (httpPending())
+				/* background requests finish while waiting */
+				(void)httpWait((long)((wait + 999) / 1000));
+			else
+				(void)sleepUntil(usecNow() + wait, 0);
+			continue;
+		}
+		func = ep->func;
+		data = ep->data;
+		removeEvent(ep);
+		free(ep);
+		log(("runEvents(): %d event(s) left\n", (int)numEvents));
+		(*func)(data);
+	}
+	free(heap);
+	heap = NULL;
+	heapSize = 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHEDULE_H_INCLUDED
+#define SCHEDULE_H_INCLUDED
+
+#include "auctioninfo.h"
+#include <time.h>
+
+/*
+ * Event queue, ordered by the time each event is due.
+ *
+ * Events with the same due time are run in the order they were scheduled.
+ * An event function may schedule or cancel other events, including new
+ * events for its own data.
+ */
+typedef void (*eventFunc_t)(void *data);
+typedef struct event event_t;
+
+extern event_t *scheduleEvent(time_t when, eventFunc_t func, void *data);
+extern event_t *scheduleEventUsec(usec_t when, eventFunc_t func, void *data);
+extern void cancelEvent(event_t *ep);
+extern void cancelEvents(const void *data);
+extern void clearEvents(void);
+extern int countEvents(void);
+extern time_t nextEventTime(void);
+
+/*
+ * File descriptors to watch while waiting for events.
+ */
+typedef void (*fdFunc_t)(int fd, void *data);
+
+extern void watchFd(int fd, fdFunc_t func, void *data);
+extern void watchFdWrite(int fd, fdFunc_t func, void *data);
+extern void unwatchFd(int fd);
+extern void unwatchFdWrite(int fd);
+
+/*
+ * Run events until the queue is empty, no background HTTP requests are
+ * left and no file descriptors are watched, waiting for HTTP requests and
+ * file descriptors until the next event is due.
+ */
+extern void runEvents(void);
+
+#endif /* SCHEDULE_H_INCLUDED */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decrypted session file:
+ *
+ *	user <escaped username>
+ *	time <login time>
+ *	<cookies, see httpGetCookies()>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cipher.h"
+#include "esniper.h"
+#include "http.h"
+#include "session.h"
+#include "util.h"
+
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static char *sessionPath(void);
+static char *readSession(const char *path, size_t *len);
+static int writeSession(const char *path, const unsigned char *data, size_t len);
+
+static const char SESSION_FILE[] = ".esniper.session.";
+static const char LOCK_SUFFIX[] = ".lock";
+static const char TMP_SUFFIX[] = ".tmp";
+
+static int lockFd = -1;
+
+/*
+ * Path of session file, NULL if session cache is disabled.
+ */
+static char *
+sessionPath(void)
+{
+	const char *homedir;
+
+	if (!options.session || !options.usernameEscape)
+		return NULL;
+	if (options.sessionFile && *options.sessionFile)
+		return myStrdup(options.sessionFile);
+#if defined(WIN32)
+	homedir = getenv("USERPROFILE");
+#else
+	homedir = getenv("HOME");
+#endif
+	if (!homedir || !*homedir)
+		return NULL;
+	return myStrdup4(homedir, "/", SESSION_FILE, options.usernameEscape);
+}
+
+/*
+ * Lock session cache, waiting for other processes.  Locking is only
+ * advisory and not available on Windows.
+ *
+ * returns 0 on success, non-0 otherwise.
+ */
+int
+lockSession(void)
+{
+#if defined(WIN32)
+	return 0;
+#else
+	char *path = sessionPath(), *lockPath;
+	struct flock fl;
+
+	if (!path)
+		return 0;
+	lockPath = myStrdup2(path, LOCK_SUFFIX);
+	free(path);
+	lockFd = open(lockPath, O_RDWR | O_CREAT, 0600);
+	free(lockPath);
+	if (lockFd < 0) {
+		log(("lockSession(): cannot open lock file: %s", strerror(errno)));
+		return 1;
+	}
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(lockFd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) {
+			log(("lockSession(): cannot lock: %s", strerror(errno)));
+			close(lockFd);
+			lockFd = -1;
+			return 1;
+		}
+	}
+	return 0;
+#endif
+}
+
+void
+unlockSession(void)
+{
+#if !defined(WIN32)
+	/* closing the file releases the lock */
+	if (lockFd >= 0) {
+		close(lockFd);
+		lockFd = -1;
+	}
+#endif
+}
+
+/*
+ * Restore cached session if it belongs to this user, started after
+ * after and is at most maxAge seconds old.
+ *
+ * returns 0 if the session was restored, non-0 otherwise.
+ */
+int
+loadSession(time_t after, time_t maxAge, time_t *loginTime)
+{
+	char *path = sessionPath(), *password, *text, *s;
+	unsigned char *data;
+	size_t len;
+	time_t t;
+	int ret = 1;
+
+	if (!path)
+		return 1;
+	data = (unsigned char *)readSession(path, &len);
+	free(path);
+	if (!data)
+		return 1;
+
+	password = getPassword();
+	text = openData(password, data, len, NULL);
+	freePassword(password);
+	free(data);
+	if (!text) {
+		log(("loadSession(): cannot decrypt session, wrong password?"));
+		return 1;
+	}
+
+	s = text;
+	if (strncmp(s, "user ", 5) ||
+	    strncmp(s + 5, options.usernameEscape, strlen(options.usernameEscape)) ||
+	    s[5 + strlen(options.usernameEscape)] != '\n') {
+		log(("loadSession(): session of other user"));
+	} else if (!(s = strchr(s, '\n')) || strncmp(++s, "time ", 5)) {
+		log(("loadSession(): bad session file"));
+	} else if ((t = (time_t)strtol(s + 5, &s, 10)) <= after ||
+		   time(NULL) - t > maxAge) {
+		log(("loadSession(): session of %ld is outdated", (long)t));
+	} else if (*s == '\n' && !resetCurlSession() && !httpSetCookies(s + 1)) {
+		log(("loadSession(): using session of %ld", (long)t));
+		*loginTime = t;
+		ret = 0;
+	}
+	memset(text, 0, strlen(text));
+	free(text);
+	return ret;
+}
+
+/*
+ * Save current session.
+ *
+ * returns 0 on success, non-0 otherwise.
+ */
+int
+saveSession(time_t loginTime)
+{
+	char *path = sessionPath(), *cookies, *text, *password;
+	char buf[32];
+	unsigned char *data;
+	size_t len;
+	int ret;
+
+	if (!path)
+		return 0;
+	if (!(cookies = httpGetCookies())) {
+		free(path);
+		return 1;
+	}
+	sprintf(buf, "\ntime %ld\n", (long)loginTime);
+	text = myStrdup4("user ", options.usernameEscape, buf, cookies);
+	memset(cookies, 0, strlen(cookies));
+	free(cookies);
+
+	password = getPassword();
+	data = sealData(password, text, strlen(text), &len);
+	freePassword(password);
+	memset(text, 0, strlen(text));
+	free(text);
+
+	ret = writeSession(path, data, len);
+	free(data);
+	free(path);
+	return ret;
+}
+
+static char *
+readSession(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "rb");
+	char *data = NULL;
+	size_t size = 0;
+
+	*len = 0;
+	if (!fp)
+		return NULL;
+	for (;;) {
+		size_t n;
+
+		data = (char *)myRealloc(data, size += 4096);
+		n = fread(data + *len, 1, size - *len, fp);
+		*len += n;
+		if (n == 0)
+			break;
+	}
+	fclose(fp);
+	return data;
+}
+
+/*
+ * Write to a temporary file first, so readers never see half a session.
+ */
+static int
+writeSession(const char *path, const unsigned char *data, size_t len)
+{
+	char *tmpPath = myStrdup2(path, TMP_SUFFIX);
+	FILE *fp;
+	int ret = 0;
+
+#if defined(WIN32)
+	fp = fopen(tmpPath, "wb");
+#else
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	fp = fd < 0 ? NULL : fdopen(fd, "wb");
+#endif
+	if (!fp) {
+		printLog(stderr, "Cannot write session file %s: %s\n", tmpPath, strerror(errno));
+		free(tmpPath);
+		return 1;
+	}
+	if (fwrite(data, 1, len, fp) != len)
+		ret = 1;
+	if (fclose(fp))
+		ret = 1;
+#if defined(WIN32)
+	(void)remove(path);
+#endif
+	if (!ret && rename(tmpPath, path))
+		ret = 1;
+	if (ret) {
+		printLog(stderr, "Cannot write session file %s: %s\n", path, strerror(errno));
+		(void)remove(tmpPath);
+	}
+	free(tmpPath);
+	return ret;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "trace.h"
+#include "esniper.h"
+#include "util.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * A trace file starts with TRACE_MAGIC, followed by one entry per
+ * transfer:
+ *
+ *	request <start usec> <method> <url>
+ *	response <rc> <code> <date> <dns> <connect> <ssl> <request> <first byte> <total> <size>
+ *	etag <value>
+ *	last-modified <value>
+ *	<body, size bytes>
+ *
+ * The body is followed by a newline.  Times are microseconds after the
+ * start of the request, see httpTiming_t.
+ */
+#define TRACE_MAGIC "esniper trace 1"
+
+static FILE *recordFile = NULL;
+static int recordFailed = 0;
+
+static traceEntry_t *entries = NULL;
+static int numEntries = 0;
+static int replayLoaded = 0;
+static usec_t replayShift = 0;	/* replay time - recording time */
+static unsigned long seed = 1;	/* fixed, so synthetic latencies repeat */
+
+static int openRecord(void);
+static void loadReplay(void);
+static int readEntry(FILE *fp, traceEntry_t *tp, char **line, size_t *size);
+static char *readLine(FILE *fp, char **line, size_t *size);
+static const char *lineValue(const char *line, const char *name);
+static int samePath(const char *a, const char *b);
+static int parseLatency(const char *latency, long *min, long *max);
+
+/*
+ * Append transfer to the trace file given by options.record.
+ */
+void
+traceRecord(const traceEntry_t *tp)
+{
+	if (!recordFile && openRecord())
+		return;
+	fprintf(recordFile, "request %.0f %s %s\n", (double)tp->started, tp->method, tp->url);
+	fprintf(recordFile, "response %d %ld %ld %.0f %.0f %.0f %.0f %.0f %.0f %lu\n",
+		tp->rc, tp->code, (long)tp->date,
+		(double)tp->timing.dns, (double)tp->timing.connect,
+		(double)tp->timing.ssl, (double)tp->timing.request,
+		(double)tp->timing.firstByte, (double)tp->timing.total,
+		(unsigned long)tp->size);
+	fprintf(recordFile, "etag %s\n", tp->validator.etag);
+	fprintf(recordFile, "last-modified %s\n", tp->validator.lastModified);
+	if (tp->size)
+		fwrite(tp->body, 1, tp->size, recordFile);
+	putc('\n', recordFile);
+	/* keep what we have if esniper dies */
+	fflush(recordFile);
+}
+
+/*
+ * The trace has pages with bid tokens, so only the user may read it,
+ * like the session file.
+ *
+ * returns 0 on success, 1 on error.
+ */
+static int
+openRecord(void)
+{
+#if !defined(WIN32)
+	int fd;
+#endif
+
+	if (recordFailed)
+		return 1;
+#if defined(WIN32)
+	recordFile = fopen(options.record, "wb");
+#else
+	if ((fd = open(options.record, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+		/* an old trace may have been readable */
+		(void)fchmod(fd, 0600);
+		if (!(recordFile = fdopen(fd, "wb")))
+			close(fd);
+	}
+#endif
+	if (!recordFile) {
+		printLog(stderr, "Cannot open trace file %s: %s\n", options.record, strerror(errno));
+		recordFailed = 1;
+		return 1;
+	}
+	fprintf(recordFile, "%s\n", TRACE_MAGIC);
+	return 0;
+}
+
+/*
+ * Find recorded answer to a request in the trace file given by
+ * options.replay.  Answers are used in the order they were recorded.
+ * Requests with the same URL, or else with the same URL up to the query,
+ * match.  When all matching answers have been used, the last one is used
+ * again.
+ *
+ * returns answer, NULL if there is none.
+ */
+const traceEntry_t *
+traceFind(const char *method, const char *url)
+{
+	traceEntry_t *unusedSame = NULL, *unusedPath = NULL;
+	traceEntry_t *lastSame = NULL, *lastPath = NULL, *tp;
+	int i;
+
+	if (!replayLoaded)
+		loadReplay();
+	for (i = 0; i < numEntries; ++i) {
+		tp = &entries[i];
+		if (strcmp(tp->method, method) || !samePath(tp->url, url))
+			continue;
+		if (!strcmp(tp->url, url)) {
+			if (!tp->used && !unusedSame)
+				unusedSame = tp;
+			lastSame = tp;
+		} else {
+			if (!tp->used && !unusedPath)
+				unusedPath = tp;
+			lastPath = tp;
+		}
+	}
+	tp = unusedSame ? unusedSame : unusedPath ? unusedPath :
+	     lastSame ? lastSame : lastPath;
+	if (tp) {
+		log(("replay: %s %s answered by entry %d", method, url, (int)(tp - entries) + 1));
+		tp->used = 1;
+	} else
+		log(("replay: %s %s not in trace", method, url));
+	return tp;
+}
+
+/*
+ * Latency of replayed answer, and its timing.  The recorded timing is
+ * scaled to a synthetic latency.
+ *
+ * returns latency in microseconds.
+ */
+usec_t
+traceLatency(const traceEntry_t *tp, httpTiming_t *timing)
+{
+	long min, max;
+	usec_t latency, recorded;
+
+	memset(timing, 0, sizeof(*timing));
+	if (!tp)
+		return 0;
+	*timing = tp->timing;
+	recorded = tp->timing.total;
+	if (parseLatency(options.replayLatency, &min, &max) || min < 0)
+		return recorded;
+
+	/* linear congruential generator, same numbers on every run */
+	seed = seed * 1103515245 + 12345;
+	latency = (usec_t)(min + (long)((seed >> 16) % (unsigned long)(max - min + 1))) * 1000;
+	if (recorded > 0) {
+		timing->dns = timing->dns * latency / recorded;
+		timing->connect = timing->connect * latency / recorded;
+		timing->ssl = timing->ssl * latency / recorded;
+		timing->request = timing->request * latency / recorded;
+		timing->firstByte = timing->firstByte * latency / recorded;
+	} else
+		timing->firstByte = latency;
+	timing->total = latency;
+	return latency;
+}
+
+/*
+ * Date header of replayed answer, moved by the time between recording
+ * and replay, so eBay's clock offset is as recorded.
+ */
+time_t
+traceDate(const traceEntry_t *tp)
+{
+	if (!tp || !tp->date)
+		return 0;
+	return tp->date + (time_t)(replayShift / 1000000);
+}
+
+/*
+ * Check options.replayLatency: "recorded", "<ms>" or "<min>-<max>" (ms).
+ *
+ * returns 1 if valid, 0 if not.
+ */
+int
+traceLatencyValid(const char *latency)
+{
+	long min, max;
+
+	return !parseLatency(latency, &min, &max);
+}
+
+/*
+ * min and max are set to -1 for recorded latencies.
+ *
+ * returns 0 on success, 1 on error.
+ */
+static int
+parseLatency(const char *latency, long *min, long *max)
+{
+	char *end;
+
+	*min = *max = -1;
+	if (!latency || !strcmp(latency, "recorded"))
+		return 0;
+	*min = strtol(latency, &end, 10);
+	if (end == latency || *min < 0)
+		return 1;
+	if (*end == '-') {
+		const char *s = end + 1;
+
+		*max = strtol(s, &end, 10);
+		if (end == s || *max < *min)
+			return 1;
+	} else
+		*max = *min;
+	return *end != '\0';
+}
+
+static void
+loadReplay(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+
+	replayLoaded = 1;
+	if (!(fp = fopen(options.replay, "rb"))) {
+		printLog(stderr, "Cannot open trace file %s: %s\n", options.replay, strerror(errno));
+		return;
+	}
+	if (!readLine(fp, &line, &size) || strcmp(line, TRACE_MAGIC)) {
+		printLog(stderr, "%s is not a trace file\n", options.replay);
+		fclose(fp);
+		free(line);
+		return;
+	}
+	for (;;) {
+		traceEntry_t entry;
+		int ret = readEntry(fp, &entry, &line, &size);
+
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			printLog(stderr, "Trace file %s: entry %d is damaged, rest is ignored\n", options.replay, numEntries + 1);
+			break;
+		}
+		entries = (traceEntry_t *)myRealloc(entries, (numEntries + 1) * sizeof(traceEntry_t));
+		entries[numEntries++] = entry;
+	}
+	fclose(fp);
+	free(line);
+	if (numEntries > 0)
+		replayShift = usecTime() - entries[0].started;
+	log(("replay: %d entries from %s", numEntries, options.replay));
+}
+
+/*
+ * returns 0 on success, -1 at end of file, 1 on error.
+ */
+static int
+readEntry(FILE *fp, traceEntry_t *tp, char **line, size_t *size)
+{
+	double t[7];
+	long date;
+	unsigned long bodySize;
+	const char *value;
+	char *s, *method;
+
+	memset(tp, 0, sizeof(*tp));
+	if (!readLine(fp, line, size))
+		return -1;
+
+	/* request <start> <method> <url> */
+	if (!(value = lineValue(*line, "request")))
+		return 1;
+	t[0] = strtod(value, &s);
+	if (s == value || *s++ != ' ')
+		return 1;
+	method = s;
+	if (!(s = strchr(s, ' ')))
+		return 1;
+	*s++ = '\0';
+	tp->started = (usec_t)t[0];
+	tp->method = myStrdup(method);
+	tp->url = myStrdup(s);
+
+	if (!readLine(fp, line, size) || !(value = lineValue(*line, "response")) ||
+	    sscanf(value, "%d %ld %ld %lf %lf %lf %lf %lf %lf %lu",
+		   &tp->rc, &tp->code, &date, &t[1], &t[2], &t[3], &t[4],
+		   &t[5], &t[6], &bodySize) != 10)
+		goto damaged;
+	tp->date = (time_t)date;
+	tp->timing.dns = (usec_t)t[1];
+	tp->timing.connect = (usec_t)t[2];
+	tp->timing.ssl = (usec_t)t[3];
+	tp->timing.request = (usec_t)t[4];
+	tp->timing.firstByte = (usec_t)t[5];
+	tp->timing.total = (usec_t)t[6];
+
+	if (!readLine(fp, line, size) || !(value = lineValue(*line, "etag")) ||
+	    strlen(value) >= sizeof(tp->validator.etag))
+		goto damaged;
+	strcpy(tp->validator.etag, value);
+	if (!readLine(fp, line, size) || !(value = lineValue(*line, "last-modified")) ||
+	    strlen(value) >= sizeof(tp->validator.lastModified))
+		goto damaged;
+	strcpy(tp->validator.lastModified, value);
+
+	tp->size = (size_t)bodySize;
+	tp->body = (char *)myMalloc(tp->size + 1);
+	if (fread(tp->body, 1, tp->size, fp) != tp->size || getc(fp) != '\n')
+		goto damaged;
+	tp->body[tp->size] = '\0';
+	return 0;
+
+damaged:
+	free(tp->method);
+	free(tp->url);
+	free(tp->body);
+	return 1;
+}
+
+/*
+ * Read line without newline into *line, which grows as needed.
+ *
+ * returns line, NULL at end of file.
+ */
+static char *
+readLine(FILE *fp, char **line, size_t *size)
+{
+	size_t len = 0;
+
+	for (;;) {
+		if (*size - len < 2) {
+			*size = *size ? *size * 2 : 1024;
+			*line = (char *)myRealloc(*line, *size);
+		}
+		if (!fgets(*line + len, (int)(*size - len), fp))
+			return len ? *line : NULL;
+		len += strlen(*line + len);
+		if (len > 0 && (*line)[len - 1] == '\n') {
+			(*line)[len - 1] = '\0';
+			return *line;
+		}
+	}
+}
+
+/*
+ * returns value of "<name> <value>" line, NULL if line has another name.
+ */
+static const char *
+lineValue(const char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(line, name, len) || line[len] != ' ')
+		return NULL;
+	return line + len + 1;
+}
+
+/* URLs are the same up to the query */
+static int
+samePath(const char *a, const char *b)
+{
+	size_t len = strcspn(a, "?");
+
+	return len == strcspn(b, "?") && !strncmp(a, b, len);
+}
+
+void
+traceClose(void)
+{
+	int i;
+
+	if (recordFile) {
+		fclose(recordFile);
+		recordFile = NULL;
+	}
+	for (i = 0; i < numEntries; ++i) {
+		free(entries[i].method);
+		free(entries[i].url);
+		free(entries[i].body);
+	}
+	free(entries);
+	entries = NULL;
+	numEntries = 0;
+}
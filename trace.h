@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2002, 2007, Scott Nicol <esniper@users.sf.net>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include "http.h"
+#include <time.h>
+
+/*
+ * HTTP traces.  With options.record every transfer is appended to a trace
+ * file.  With options.replay no network is used, requests are answered
+ * from a trace file instead, after the recorded or a synthetic latency
+ * (options.replayLatency).
+ *
+ * Trace files contain the pages of the recorded account, but neither
+ * cookies nor POST data.
+ */
+typedef struct {
+	usec_t started;		/* wall clock time request was started */
+	char *method;		/* GET, POST or HEAD */
+	char *url;
+	int rc;			/* CURLcode of transfer */
+	long code;		/* HTTP response code */
+	time_t date;		/* Date header, 0 if none */
+	httpTiming_t timing;
+	httpValidator_t validator;
+	char *body;
+	size_t size;
+	int used;		/* replayed at least once */
+} traceEntry_t;
+
+extern void traceRecord(const traceEntry_t *tp);
+extern const traceEntry_t *traceFind(const char *method, const char *url);
+extern usec_t traceLatency(const traceEntry_t *tp, httpTiming_t *timing);
+extern time_t traceDate(const traceEntry_t *tp);
+extern int traceLatencyValid(const char *latency);
+extern void traceClose(void);
+
+#endif /* TRACE_H_INCLUDED */
@@ -61,11 +61,15 @@ static void cryptPassword(char *password);
  * Replacement malloc/realloc/strdup, with error checking
  */
 
+static unsigned long numAllocs = 0;	/* see allocCount() */
+
 void *
 myMalloc(size_t size)
 {
 	void *ret = malloc(size);
 
+	++numAllocs;
+
 	if (!ret) {
 		printLog(stderr, "Cannot allocate memory: %s\n", strerror(errno));
 		exit(1);
@@ -78,6 +82,8 @@ myRealloc(void *buf, size_t size)
 {
 	void *ret = buf ? realloc(buf, size) : malloc(size);
 
+	++numAllocs;
+
 	if (!ret) {
 		printLog(stderr, "Cannot reallocate memory: %s\n", strerror(errno));
 		exit(1);
@@ -85,6 +91,15 @@ myRealloc(void *buf, size_t size)
 	return ret;
 }
 
+/*
+ * Number of allocations by myMalloc() and myRealloc() so far.
+ */
+unsigned long
+allocCount(void)
+{
+	return numAllocs;
+}
+
 char *
 myStrdup(const char *s)
 {
@@ -144,15 +159,75 @@ myStrdup4(const char *s1, const char *s2, const char *s3, const char *s4)
  * Debugging functions.
  */
 
-static FILE *logfile = NULL;
+/*
+ * Log messages are formatted by the caller, but written to the log file
+ * by a background thread.  The caller puts records into a ring buffer
+ * (single producer, single consumer, no locks) and never waits for the
+ * disk, unless the ring is full.  Opening and closing the log file are
+ * records too, so they stay in order with the messages.
+ *
+ * Without threads (Windows, or compilers without atomic builtins) the log
+ * is written directly.
+ */
+#if !defined(WIN32) && defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define LOG_THREAD 1
+#include <pthread.h>
+#define atomicLoad(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define atomicStore(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define LOG_THREAD 0
+#endif
+
+enum logRecordType { lr_text, lr_open, lr_close };
+
+typedef struct {
+	int type;
+	size_t len;		/* bytes following the record */
+} logRecord_t;
+
+#define LOG_RING (1024 * 1024)		/* bytes, power of 2 */
+#define LOG_IDLE 5000000		/* ns, consumer sleeps when idle */
+
+static FILE *logfile = NULL;		/* consumer only */
+static char *logName = NULL;		/* name of log file, producer */
+static int logActive = 0;		/* log file open, producer */
+
+#if LOG_THREAD
+static char logRing[LOG_RING];
+static size_t logHead = 0;		/* bytes written, producer */
+static size_t logTail = 0;		/* bytes read, consumer */
+static int logStop = 0;
+static int logRunning = 0;
+static pthread_t logThreadId;
+static char *logRecordBuf = NULL;	/* consumer */
+static size_t logRecordSize = 0;
+
+static void *logThread(void *arg);
+static void ringCopyIn(size_t pos, const void *data, size_t len);
+static void ringCopyOut(size_t pos, void *data, size_t len);
+static void logStartThread(void);
+static void logStopThread(void);
+#endif
+static void logPut(int type, const char *data, size_t len);
+static void logProcess(int type, const char *data, size_t len);
+
+static char *logLine = NULL;		/* formatted message, producer */
+static size_t logLineSize = 0;
+static char logChars[256];		/* see logChar() */
+static size_t numLogChars = 0;
 
 void
 logClose()
 {
-	if (logfile) {
-		fclose(logfile);
-		logfile = NULL;
-	}
+	if (!logActive)
+		return;
+	logPut(lr_close, NULL, 0);
+	logActive = 0;
+	free(logName);
+	logName = NULL;
+#if LOG_THREAD
+	logStopThread();
+#endif
 }
 
 void
@@ -211,15 +286,179 @@ logOpen(const auctionInfo *aip, const char *logdir)
 #endif
 		free(tmp);
 	}
-	logClose();
-	if (!(logfile = fopen(logfilename, "a"))) {
-		/* non-fatal error! */
-		fprintf(stderr, "Unable to open log file %s: %s\n",
-			logfilename, strerror(errno));
-	} else
-		dlog("### %s version %s ###\n", getProgname(), getVersion());
-	free(logfilename);
+	/* same file, nothing to do */
+	if (logActive && !strcmp(logName, logfilename)) {
+		free(logfilename);
+		return;
+	}
+#if LOG_THREAD
+	logStartThread();
+#endif
+	logPut(lr_open, logfilename, strlen(logfilename) + 1);
+	free(logName);
+	logName = logfilename;
+	logActive = 1;
+	dlog("### %s version %s ###\n", getProgname(), getVersion());
+}
+
+/*
+ * Put a record into the ring, or process it right away without a log
+ * thread.
+ */
+static void
+logPut(int type, const char *data, size_t len)
+{
+#if LOG_THREAD
+	logRecord_t rec;
+	size_t need;
+
+	if (!logRunning) {
+		logProcess(type, data, len);
+		if (logfile)
+			fflush(logfile);
+		return;
+	}
+	/* don't let one huge message fill the ring */
+	if (len > LOG_RING / 4)
+		len = LOG_RING / 4;
+	rec.type = type;
+	rec.len = len;
+	need = sizeof(rec) + len;
+	/* full: wait for the log thread */
+	while (LOG_RING - (logHead - atomicLoad(logTail)) < need) {
+		struct timespec ts;
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = 100000;
+		nanosleep(&ts, NULL);
+	}
+	ringCopyIn(logHead, &rec, sizeof(rec));
+	ringCopyIn(logHead + sizeof(rec), data, len);
+	atomicStore(logHead, logHead + need);
+#else
+	logProcess(type, data, len);
+	if (logfile)
+		fflush(logfile);
+#endif
+}
+
+/*
+ * Write a record to the log file.
+ */
+static void
+logProcess(int type, const char *data, size_t len)
+{
+	switch (type) {
+	case lr_text:
+		if (logfile)
+			fwrite(data, 1, len, logfile);
+		break;
+	case lr_open:
+		if (logfile)
+			fclose(logfile);
+		if (!(logfile = fopen(data, "a")))
+			/* non-fatal error! */
+			fprintf(stderr, "Unable to open log file %s: %s\n",
+				data, strerror(errno));
+		break;
+	case lr_close:
+		if (logfile) {
+			fclose(logfile);
+			logfile = NULL;
+		}
+		break;
+	}
+}
+
+#if LOG_THREAD
+static void
+ringCopyIn(size_t pos, const void *data, size_t len)
+{
+	size_t off = pos & (LOG_RING - 1);
+	size_t first = len < LOG_RING - off ? len : LOG_RING - off;
+
+	memcpy(logRing + off, data, first);
+	memcpy(logRing, (const char *)data + first, len - first);
+}
+
+static void
+ringCopyOut(size_t pos, void *data, size_t len)
+{
+	size_t off = pos & (LOG_RING - 1);
+	size_t first = len < LOG_RING - off ? len : LOG_RING - off;
+
+	memcpy(data, logRing + off, first);
+	memcpy((char *)data + first, logRing, len - first);
+}
+
+/*
+ * Log thread: write records until stopped and the ring is empty.  The
+ * file is flushed whenever the ring runs empty.
+ */
+static void *
+logThread(void *arg)
+{
+	for (;;) {
+		size_t tail = logTail;
+		logRecord_t rec;
+
+		if (tail == atomicLoad(logHead)) {
+			struct timespec ts;
+
+			if (logfile)
+				fflush(logfile);
+			if (atomicLoad(logStop))
+				break;
+			ts.tv_sec = 0;
+			ts.tv_nsec = LOG_IDLE;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		ringCopyOut(tail, &rec, sizeof(rec));
+		if (rec.len + 1 > logRecordSize) {
+			logRecordSize = rec.len + 1;
+			logRecordBuf = (char *)myRealloc(logRecordBuf, logRecordSize);
+		}
+		ringCopyOut(tail + sizeof(rec), logRecordBuf, rec.len);
+		logRecordBuf[rec.len] = '\0';
+		logProcess(rec.type, logRecordBuf, rec.len);
+		atomicStore(logTail, tail + sizeof(rec) + rec.len);
+	}
+	return NULL;
+}
+
+static void
+logStartThread(void)
+{
+	int rc;
+
+	if (logRunning)
+		return;
+	logStop = 0;
+	if ((rc = pthread_create(&logThreadId, NULL, logThread, NULL))) {
+		/* log synchronously */
+		fprintf(stderr, "Cannot start log thread: %s\n", strerror(rc));
+		return;
+	}
+	logRunning = 1;
+}
+
+/*
+ * Wait until everything is written, then stop the log thread.
+ */
+static void
+logStopThread(void)
+{
+	if (!logRunning)
+		return;
+	atomicStore(logStop, 1);
+	pthread_join(logThreadId, NULL);
+	logRunning = 0;
+	free(logRecordBuf);
+	logRecordBuf = NULL;
+	logRecordSize = 0;
 }
+#endif
 
 /*
  * va_list version of log
@@ -227,30 +466,60 @@ logOpen(const auctionInfo *aip, const char *logdir)
 static void
 vlog(const char *fmt, va_list arglist)
 {
+	/* timestamp up to the seconds is formatted once per second */
+	static time_t prefixTime = -1;
+	static char prefix[40];
+	static size_t prefixLen = 0;
 #if defined(WIN32)
 	struct timeb tb;
+	long frac;
 #else
 	struct timeval tv;
+	long frac;
 #endif
-	char timebuf[80];	/* more than big enough */
 	time_t t;
+	size_t len;
+	int n;
+	va_list args;
 
-	if (!logfile)
+	if (!logActive)
 		return;
 
 #if defined(WIN32)
 	ftime(&tb);
 	t = (time_t)(tb.time);
-	strftime(timebuf, sizeof(timebuf), "\n*** %Y-%m-%d %H:%M:%S", localtime(&t));
-	fprintf(logfile, "%s.%03d ", timebuf, tb.millitm);
+	frac = tb.millitm;
 #else
 	gettimeofday(&tv, NULL);
 	t = (time_t)(tv.tv_sec);
-	strftime(timebuf, sizeof(timebuf), "\n*** %Y-%m-%d %H:%M:%S", localtime(&t));
-	fprintf(logfile, "%s.%06ld ", timebuf, (long)tv.tv_usec);
+	frac = (long)tv.tv_usec;
 #endif
-	vfprintf(logfile, fmt, arglist);
-	fflush(logfile);
+	if (t != prefixTime) {
+		prefixLen = strftime(prefix, sizeof(prefix), "\n*** %Y-%m-%d %H:%M:%S", localtime(&t));
+		prefixTime = t;
+	}
+	if (logLineSize < 4096) {
+		logLineSize = 4096;
+		logLine = (char *)myRealloc(logLine, logLineSize);
+	}
+	memcpy(logLine, prefix, prefixLen);
+#if defined(WIN32)
+	len = prefixLen + (size_t)sprintf(logLine + prefixLen, ".%03ld ", frac);
+#else
+	len = prefixLen + (size_t)sprintf(logLine + prefixLen, ".%06ld ", frac);
+#endif
+
+	va_copy(args, arglist);
+	n = vsnprintf(logLine + len, logLineSize - len, fmt, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	if ((size_t)n >= logLineSize - len) {
+		logLineSize = len + (size_t)n + 1;
+		logLine = (char *)myRealloc(logLine, logLineSize);
+		(void)vsnprintf(logLine + len, logLineSize - len, fmt, arglist);
+	}
+	logPut(lr_text, logLine, len + (size_t)n);
 }
 
 /*
@@ -275,7 +544,7 @@ printLog(FILE *fp, const char *fmt, ...)
 {
 	va_list arglist;
 
-	if (options.debug && logfile) {
+	if (options.debug && logActive) {
 		va_start(arglist, fmt);
 		vlog(fmt, arglist);
 		va_end(arglist);
@@ -305,15 +574,12 @@ checkVersion(void)
 		/* not available */
 		if (mp == NULL)
 			return NULL;
-		newVersion = mp->memory;
-		for (i = 0; newVersion[i] && newVersion[i] != '\n'; ++i)
+		for (i = 0; mp->memory[i] && mp->memory[i] != '\n'; ++i)
 			;
-		newVersion[i] = '\0';
+		mp->memory[i] = '\0';
+		newVersion = myStrdup(mp->memory);
 		result = !strcmp(getVersion(), newVersion);
-		/* Don't use freeMembuf(), it will also free
-		 * mp->memory, which we are using.
-		 */
-		free(mp);
+		freeMembuf(mp);
 	}
 	return result ? NULL : newVersion;
 }
@@ -354,9 +620,9 @@ bugReport(const char *func, const char *file, int line, auctionInfo *aip, memBuf
 	if (aip) {
 		printLog(stdout,
 			"\tauction = %s, price = %s, remain = %d\n"
-			"\tlatency = %d, result = %d, error = %d\n",
+			"\tlatency = %ld ms, result = %d, error = %d\n",
 			nullStr(aip->auction), nullStr(aip->bidPriceStr),
-			aip->remain, aip->latency, aip->bidResult,
+			aip->remain, (long)(aip->latency / 1000), aip->bidResult,
 			aip->auctionError);
 	}
 
@@ -382,7 +648,7 @@ bugReport(const char *func, const char *file, int line, auctionInfo *aip, memBuf
 		free(optionlog);
 	}
 	printf("\t");
-	if (options.debug && logfile) {
+	if (options.debug && logActive) {
 		va_start(arglist, fmt);
 		vlog(fmt, arglist);
 		va_end(arglist);
@@ -419,21 +685,26 @@ bugReport(const char *func, const char *file, int line, auctionInfo *aip, memBuf
 void
 logChar(int c)
 {
-	if (!logfile)
+	if (!logActive)
 		return;
 
-	if (c == EOF)
-		fflush(logfile);
-	else
-		putc(c, logfile);
+	if (c != EOF)
+		logChars[numLogChars++] = (char)c;
+	if ((c == EOF || numLogChars == sizeof(logChars)) && numLogChars > 0) {
+		logPut(lr_text, logChars, numLogChars);
+		numLogChars = 0;
+	}
 }
 
-/* read from file until you see the given character. */
+/*
+ * Read from file until you see the given character.  Result shares the
+ * text buffer of the memBuf (see getNonTag()), it is valid until the next
+ * call for this memBuf.
+ */
 char *
 getUntil(memBuf_t *mp, int until)
 {
-	static char *buf = NULL;
-	static size_t bufsize = 0;
+	memScratch_t *sp = &mp->textBuf;
 	size_t count = 0;
 	int c;
 
@@ -443,12 +714,12 @@ getUntil(memBuf_t *mp, int until)
 		if (options.debug)
 			logChar(c);
 		if ((char)c == until) {
-			term(buf, bufsize, count);
+			term(sp->buf, sp->size, count);
 			if (options.debug)
 				logChar(EOF);
-			return buf;
+			return sp->buf;
 		}
-		addchar(buf, bufsize, count, (char)c);
+		addchar(sp->buf, sp->size, count, (char)c);
 	}
 	if (options.debug)
 		logChar(EOF);
@@ -492,6 +763,129 @@ timestamp()
 	return buf;
 }
 
+/*
+ * Monotonic clock in microseconds, for measuring time intervals.  Not
+ * affected by changes of the system time.
+ */
+usec_t
+usecNow(void)
+{
+#if defined(WIN32)
+	return (usec_t)GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (usec_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (usec_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * Sleep until deadline (monotonic clock, see usecNow()).  Sleep may
+ * overshoot, so the last spin microseconds are spent polling the clock.
+ *
+ * returns wake-up time - deadline, in microseconds.
+ */
+usec_t
+sleepUntil(usec_t deadline, usec_t spin)
+{
+	usec_t now;
+	usec_t wake = deadline - spin;
+
+#if defined(WIN32)
+	if ((now = usecNow()) < wake)
+		Sleep((DWORD)((wake - now) / 1000));
+#elif defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME) && !defined(__APPLE__)
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(wake / 1000000);
+	ts.tv_nsec = (long)(wake % 1000000) * 1000;
+	/* absolute deadline, so interruption by signals doesn't matter */
+	while (usecNow() < wake) {
+		int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		if (err && err != EINTR) {
+			log(("sleepUntil(): clock_nanosleep failed: %s", strerror(err)));
+			break;
+		}
+		checkSignals();
+	}
+#else
+	while ((now = usecNow()) < wake) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)((wake - now) / 1000000);
+		ts.tv_nsec = (long)((wake - now) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		checkSignals();
+	}
+#endif
+	while ((now = usecNow()) < deadline)
+		;
+	return now - deadline;
+}
+
+/*
+ * Token bucket rate limiter.  Tokens arrive at rate per second, up to
+ * burst tokens are saved up.  A rate <= 0 means no limit.
+ */
+void
+initTokenBucket(tokenBucket_t *tbp, double rate, int burst)
+{
+	tbp->rate = rate;
+	tbp->burst = burst > 1 ? burst : 1;
+	tbp->tokens = tbp->burst;
+	tbp->last = usecNow();
+}
+
+/*
+ * Take a token.
+ *
+ * returns 0 if a token was taken, otherwise microseconds until the next
+ * token is available.
+ */
+usec_t
+takeToken(tokenBucket_t *tbp)
+{
+	usec_t now = usecNow();
+
+	if (tbp->rate <= 0)
+		return 0;
+	tbp->tokens += (double)(now - tbp->last) * tbp->rate / 1000000;
+	if (tbp->tokens > tbp->burst)
+		tbp->tokens = tbp->burst;
+	tbp->last = now;
+	if (tbp->tokens >= 1) {
+		tbp->tokens -= 1;
+		return 0;
+	}
+	return (usec_t)((1 - tbp->tokens) * 1000000 / tbp->rate) + 1;
+}
+
+/*
+ * Wall clock in microseconds since the epoch.
+ */
+usec_t
+usecTime(void)
+{
+#if defined(WIN32)
+	struct timeb tb;
+
+	ftime(&tb);
+	return (usec_t)tb.time * 1000000 + (usec_t)tb.millitm * 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (usec_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 /*
  * skip rest of line, up to newline.  Useful for handling comments.
  */
@@ -624,7 +1018,8 @@ priceFixup(char *price, auctionInfo *aip)
 			;
 		tmp = price[start];
 		price[start] = '\0';
-		aip->currency = myStrdup(price);
+		aip->currency = internString(price);
+		aip->currencyCode = lookupCurrency(aip->currency);
 		price[start] = tmp;
 	}
 	for (; start < len && !isdigit((int)price[start]) && price[start] != ',' && price[start] != '.'; ++start)
@@ -757,6 +1152,26 @@ freePassword(char *password)
 	free(password);
 }
 
+/*
+ * Save or restore the password set by setPassword(), with its pad, when
+ * switching accounts (see account.c).
+ */
+void
+savePassword(savedPassword_t *sp)
+{
+	sp->password = options.password;
+	sp->pad = passwordPad;
+	sp->len = passwordLen;
+}
+
+void
+restorePassword(const savedPassword_t *sp)
+{
+	options.password = sp->password;
+	passwordPad = sp->pad;
+	passwordLen = sp->len;
+}
+
 /*
  * Cygwin doesn't provide basename and dirname?
  *
@@ -40,6 +40,7 @@ extern char *myStrndup(const char *, size_t len);
 extern char *myStrdup2(const char *, const char *);
 extern char *myStrdup3(const char *, const char *, const char *);
 extern char *myStrdup4(const char *, const char *, const char *, const char *);
+extern unsigned long allocCount(void);
 
 extern void logClose(void);
 extern void logOpen(const auctionInfo *aip, const char *logdir);
@@ -54,6 +55,19 @@ extern char *getUntil(memBuf_t *mp, int until);
 extern const char *nullStr(const char *);
 extern const char * nullEmptyStr(const char *s);
 extern char *timestamp(void);
+extern usec_t usecNow(void);
+extern usec_t usecTime(void);
+extern usec_t sleepUntil(usec_t deadline, usec_t spin);
+
+typedef struct {
+	double rate;		/* tokens per second */
+	double burst;		/* max. tokens saved up */
+	double tokens;
+	usec_t last;		/* time of last update, see usecNow() */
+} tokenBucket_t;
+
+extern void initTokenBucket(tokenBucket_t *tbp, double rate, int burst);
+extern usec_t takeToken(tokenBucket_t *tbp);
 extern int skipline(FILE *fp);
 extern char *prompt(const char *p, int noecho);
 extern int boolValue(const char *value);
@@ -65,6 +79,15 @@ extern void setPassword(char *password);
 extern char *getPassword(void);
 extern void freePassword(char *password);
 
+typedef struct {
+	char *password;		/* encrypted */
+	char *pad;
+	size_t len;
+} savedPassword_t;
+
+extern void savePassword(savedPassword_t *sp);
+extern void restorePassword(const savedPassword_t *sp);
+
 #if defined(__CYGWIN__) || defined(WIN32)
 extern char *basename(char *);
 extern char *dirname(char *);